@@ -0,0 +1,327 @@
+#ifndef KALEIDOSCOPE_AST_H
+#define KALEIDOSCOPE_AST_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//=========================
+// AST Context
+//=========================
+
+// A read-only view of an array that lives in an ASTContext.
+template <typename T>
+class ArenaArray {
+  const T *Data = nullptr;
+  size_t Length = 0;
+
+public:
+  ArenaArray() = default;
+  ArenaArray(const T *Data, size_t Length) : Data(Data), Length(Length) {}
+
+  const T *begin() const { return Data; }
+  const T *end() const { return Data + Length; }
+  size_t size() const { return Length; }
+  bool empty() const { return Length == 0; }
+  const T &operator[](size_t Index) const { return Data[Index]; }
+};
+
+// An interned identifier. Each distinct spelling gets one Symbol per symbol table, so names are
+// stored once and compared as integers. Symbols are dense, which lets later passes index tables
+// by them directly.
+using Symbol = uint32_t;
+
+// The empty name, used for anonymous top-level functions.
+constexpr Symbol EmptySymbol = 0;
+
+// A bump allocator that owns every node of a translation unit. Nodes never run destructors, so
+// allocating one is a pointer bump and tearing down a whole module just releases the slabs. The
+// context also owns the symbol table for the names those nodes refer to.
+//
+// To build ASTs on several threads, give each thread a child context. A child allocates on its
+// own but interns into its root's symbol table, so Symbols mean the same thing in every context
+// of the family. Once a thread is done, the root can adopt the child's slabs, after which its
+// nodes live as long as the root does.
+class ASTContext {
+  std::vector<std::unique_ptr<char[]>> Slabs;
+  char *CurPtr = nullptr;
+  char *SlabEnd = nullptr;
+  size_t BytesAllocated = 0;
+  size_t BytesReserved = 0; // The size of all of Slabs
+
+  // How many bytes the slabs of every context in the process add up to, and the most they have
+  // added up to at any one time.
+  static inline std::atomic<size_t> LiveSlabBytes{0};
+  static inline std::atomic<size_t> PeakSlabBytes{0};
+
+  // Spellings are copied into the arena, so the map keys and Spellings entries share storage. A
+  // child keeps only a cache of the lookups it has made; Spellings live in the root alone.
+  std::unordered_map<std::string_view, Symbol> SymbolLookup;
+  std::vector<std::string_view> Spellings;
+
+  ASTContext *Root = nullptr; // Set for a child
+  std::atomic<bool> HasChildren{false}; // Once set, the root's symbol table is always locked
+  mutable std::mutex SymbolMutex;
+
+  // Slabs start small so that a short REPL session stays cheap, and double up to a cap as a
+  // module grows.
+  static constexpr size_t InitialSlabSize = 4096;
+  static constexpr size_t MaxSlabSize = 1 << 20;
+
+  void *allocateSlow(size_t Size, size_t Alignment) {
+    size_t slab_size = InitialSlabSize;
+    if (!Slabs.empty()) {
+      slab_size = std::min(MaxSlabSize, 2 * static_cast<size_t>(SlabEnd - Slabs.back().get()));
+    }
+    // Oversized requests get a slab of their own.
+    slab_size = std::max(slab_size, Size + Alignment);
+
+    Slabs.emplace_back(new char[slab_size]);
+    BytesReserved += slab_size;
+    size_t live = LiveSlabBytes.fetch_add(slab_size, std::memory_order_relaxed) + slab_size;
+    size_t peak = PeakSlabBytes.load(std::memory_order_relaxed);
+    while (live > peak &&
+           !PeakSlabBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {}
+    CurPtr = Slabs.back().get();
+    SlabEnd = CurPtr + slab_size;
+    return allocate(Size, Alignment);
+  }
+
+  Symbol internInRoot(std::string_view Name) {
+    std::unique_lock<std::mutex> lock(SymbolMutex, std::defer_lock);
+    if (HasChildren) { lock.lock(); }
+
+    auto it = SymbolLookup.find(Name);
+    if (it != SymbolLookup.end()) { return it->second; }
+
+    Symbol symbol = static_cast<Symbol>(Spellings.size());
+    std::string_view spelling = copyString(Name);
+    Spellings.push_back(spelling);
+    SymbolLookup.emplace(spelling, symbol);
+    return symbol;
+  }
+
+public:
+  ASTContext() { intern(std::string_view()); }
+
+  /// A child of Parent, sharing its root's symbol table. The root must outlive it, and while
+  /// children are in use on other threads the root itself may only intern and look up symbols:
+  /// it adds the spellings of new names to its own arena.
+  explicit ASTContext(ASTContext &Parent) : Root(Parent.Root ? Parent.Root : &Parent) {
+    Root->HasChildren = true;
+  }
+
+  ~ASTContext() { LiveSlabBytes.fetch_sub(BytesReserved, std::memory_order_relaxed); }
+
+  ASTContext(const ASTContext &) = delete;
+  ASTContext &operator=(const ASTContext &) = delete;
+
+  void *allocate(size_t Size, size_t Alignment) {
+    uintptr_t aligned =
+        (reinterpret_cast<uintptr_t>(CurPtr) + Alignment - 1) & ~static_cast<uintptr_t>(Alignment - 1);
+    if (!CurPtr || aligned + Size > reinterpret_cast<uintptr_t>(SlabEnd)) {
+      return allocateSlow(Size, Alignment);
+    }
+    CurPtr = reinterpret_cast<char *>(aligned + Size);
+    BytesAllocated += Size;
+    return reinterpret_cast<void *>(aligned);
+  }
+
+  /// Construct a T in the arena. T must not need its destructor run.
+  template <typename T, typename... ArgTs>
+  T *create(ArgTs &&...Args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "ASTContext never runs destructors");
+    return new (allocate(sizeof(T), alignof(T))) T(std::forward<ArgTs>(Args)...);
+  }
+
+  /// Copy Length elements starting at Data into the arena.
+  template <typename T>
+  ArenaArray<T> copyArray(const T *Data, size_t Length) {
+    static_assert(std::is_trivially_copyable<T>::value, "arena arrays are copied bytewise");
+    if (Length == 0) { return ArenaArray<T>(); }
+    T *copy = static_cast<T *>(allocate(sizeof(T) * Length, alignof(T)));
+    memcpy(copy, Data, sizeof(T) * Length);
+    return ArenaArray<T>(copy, Length);
+  }
+
+  /// Copy a string (e.g. a token payload that is about to be invalidated) into the arena.
+  std::string_view copyString(std::string_view Str) {
+    if (Str.empty()) { return std::string_view(); }
+    char *copy = static_cast<char *>(allocate(Str.size(), 1));
+    memcpy(copy, Str.data(), Str.size());
+    return std::string_view(copy, Str.size());
+  }
+
+  size_t getBytesAllocated() const { return BytesAllocated; }
+  size_t getBytesReserved() const { return BytesReserved; }
+
+  /// The bytes held in slabs by every context in the process, now and at most so far.
+  static size_t getLiveSlabBytes() { return LiveSlabBytes.load(std::memory_order_relaxed); }
+  static size_t getPeakSlabBytes() { return PeakSlabBytes.load(std::memory_order_relaxed); }
+
+  /// Return the symbol for Name, adding it to the table the first time it is seen.
+  Symbol intern(std::string_view Name) {
+    if (!Root) { return internInRoot(Name); }
+
+    // Only names new to this child take the root's lock.
+    auto it = SymbolLookup.find(Name);
+    if (it != SymbolLookup.end()) { return it->second; }
+    Symbol symbol = Root->internInRoot(Name);
+    SymbolLookup.emplace(copyString(Name), symbol);
+    return symbol;
+  }
+
+  std::string_view getSpelling(Symbol S) const {
+    if (Root) { return Root->getSpelling(S); }
+    std::unique_lock<std::mutex> lock(SymbolMutex, std::defer_lock);
+    if (HasChildren) { lock.lock(); }
+    return Spellings[S];
+  }
+
+  size_t getNumSymbols() const {
+    if (Root) { return Root->getNumSymbols(); }
+    std::unique_lock<std::mutex> lock(SymbolMutex, std::defer_lock);
+    if (HasChildren) { lock.lock(); }
+    return Spellings.size();
+  }
+
+  /// Take ownership of everything Child has allocated. Child must no longer be in use by any
+  /// other thread, and must not allocate again.
+  void adopt(ASTContext &Child) {
+    // Keep the current slab last, since allocation continues in it.
+    auto at = Slabs.empty() ? Slabs.end() : Slabs.end() - 1;
+    Slabs.insert(at, std::make_move_iterator(Child.Slabs.begin()),
+                 std::make_move_iterator(Child.Slabs.end()));
+    BytesAllocated += Child.BytesAllocated;
+    BytesReserved += Child.BytesReserved;
+    Child.Slabs.clear();
+    Child.CurPtr = Child.SlabEnd = nullptr;
+    Child.BytesAllocated = 0;
+    Child.BytesReserved = 0;
+    Child.SymbolLookup.clear();
+  }
+};
+
+
+//=========================
+// Abstract Syntax Tree
+//=========================
+
+// Base class for all expression nodes. Nodes live in an ASTContext and are told apart by their
+// kind rather than through virtual functions.
+class ExprAST {
+public:
+  enum ExprASTKind {
+    Expr_Number,
+    Expr_Variable,
+    Expr_Binary,
+    Expr_Call,
+  };
+
+  ExprAST(ExprASTKind Kind) : Kind(Kind) {}
+
+  ExprASTKind getKind() const { return Kind; }
+
+private:
+  const ExprASTKind Kind;
+};
+
+// Expression class for numeric literals like "1.0".
+class NumberExprAST : public ExprAST {
+  double Val;
+
+public:
+  NumberExprAST(double Val) : ExprAST(Expr_Number), Val(Val) {}
+
+  double getVal() const { return Val; }
+
+  static bool classof(const ExprAST *E) { return E->getKind() == Expr_Number; }
+};
+
+// Expression class for referencing a variable, like "a".
+class VariableExprAST : public ExprAST {
+  Symbol Name;
+
+public:
+  VariableExprAST(Symbol Name) : ExprAST(Expr_Variable), Name(Name) {}
+
+  Symbol getName() const { return Name; }
+
+  static bool classof(const ExprAST *E) { return E->getKind() == Expr_Variable; }
+};
+
+// Expression class for a binary operator.
+class BinaryExprAST : public ExprAST {
+  char Op; // A character representing the operator, e.g. '+'.
+  ExprAST *LHS, *RHS;
+
+public:
+  BinaryExprAST(char Op, ExprAST *LHS, ExprAST *RHS)
+    : ExprAST(Expr_Binary), Op(Op), LHS(LHS), RHS(RHS) {}
+
+  char getOp() const { return Op; }
+  ExprAST *getLHS() const { return LHS; }
+  ExprAST *getRHS() const { return RHS; }
+
+  static bool classof(const ExprAST *E) { return E->getKind() == Expr_Binary; }
+};
+
+// Expression class for function calls.
+class CallExprAST : public ExprAST {
+  Symbol Callee;
+  ArenaArray<ExprAST *> Args;
+
+public:
+  CallExprAST(Symbol Callee, ArenaArray<ExprAST *> Args)
+    : ExprAST(Expr_Call), Callee(Callee), Args(Args) {}
+
+  Symbol getCallee() const { return Callee; }
+  ArenaArray<ExprAST *> getArgs() const { return Args; }
+
+  static bool classof(const ExprAST *E) { return E->getKind() == Expr_Call; }
+};
+
+// This class represents the "prototype" for a function, which captures its name,
+// and its argument names (thus implicitly the number of arguments the function takes).
+class PrototypeAST {
+  Symbol Name;
+  ArenaArray<Symbol> Args;
+
+public:
+  PrototypeAST(Symbol Name, ArenaArray<Symbol> Args)
+    : Name(Name), Args(Args) {}
+
+  Symbol getName() const { return Name; }
+  ArenaArray<Symbol> getArgs() const { return Args; }
+};
+
+struct FlatExpr;
+
+/// This class represents a function definition itself.
+class FunctionAST {
+  PrototypeAST *Prototype;
+  ExprAST *Body;
+  FlatExpr *FlatBody = nullptr; // Only built when the parser is asked for flat expressions
+
+public:
+  FunctionAST(PrototypeAST *Prototype, ExprAST *Body)
+    : Prototype(Prototype), Body(Body) {}
+
+  PrototypeAST *getPrototype() const { return Prototype; }
+  ExprAST *getBody() const { return Body; }
+  FlatExpr *getFlatBody() const { return FlatBody; }
+  void setFlatBody(FlatExpr *E) { FlatBody = E; }
+};
+
+#endif // KALEIDOSCOPE_AST_H
@@ -0,0 +1,411 @@
+#ifndef KALEIDOSCOPE_ARRAYRUNTIME_H
+#define KALEIDOSCOPE_ARRAYRUNTIME_H
+
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Interpreter.h"
+#include "ThreadPool.h"
+#include "VectorKernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//=========================
+// Array Runtime
+//=========================
+
+// Built-in functions over arrays of doubles held by the host, so that a script hands bulk work to
+// native loops instead of making a call per element. Kaleidoscope only has numbers, so an array
+// is passed around as its handle: the index it was added at. Once installed in an interpreter,
+// scripts may call (or declare as externs):
+//
+//   len(a)         how many elements a holds
+//   at(a i)        a's element i
+//   sum(a)         the sum of a's elements
+//   dot(a b)       the sum of the products of a's and b's elements, which must be as many
+//   map(f a)       a new array of f(x) for every element x of a
+//   reduce(f a x)  x and then every element of a, in order, combined by f, which is assumed to be
+//                  associative, as + and * are
+//
+// map and reduce take a function's name, as in `sum(map(square, 0))`, and call it through the
+// batch evaluator, a block of rows at a time. Long arrays are cut into ChunkElements chunks that
+// run on a thread pool; within a chunk, sum and dot add in vector lanes. Chunks and lanes are the
+// same however many threads there are, so results do not depend on the thread count, though
+// they may differ in the last bits from adding one element at a time. reduce combines
+// neighbours pairwise, level by level, so its result only equals the fold's if f is
+// associative.
+//
+// Arrays never change once added. Those made by map live as long as the runtime, unless they are
+// made inside a Scope, which frees them when it ends; a long-lived host such as the server opens
+// one around each evaluation, so that what scripts map does not pile up. A handle whose array
+// has been freed may name another array later.
+class ArrayRuntime {
+public:
+  class Scope;
+
+private:
+  struct Builtin {
+    PrototypeAST *Prototype;
+    Interpreter::NativeFn Fn;
+    uint32_t FunctionParams;
+  };
+
+  ASTContext &Ctx;
+  // A child of Ctx for the interpreters that call back into scripts, made up front so that Ctx
+  // locks its symbol table before any of them runs. They only look up spellings through it.
+  ASTContext Names;
+  unsigned NumThreads;
+  std::unique_ptr<ThreadPool> Pool; // Started the first time an array is long enough to split
+  std::once_flag PoolStarted;
+  std::mutex Lock; // Guards Arrays, FreeHandles, the open scopes' arrays and Idle
+  // Shared with the built-ins reading them, so that freeing one never pulls it out from under
+  // a call that still holds it.
+  std::deque<std::shared_ptr<const std::vector<double>>> Arrays;
+  std::vector<size_t> FreeHandles; // Of arrays that scopes have freed
+  std::vector<std::unique_ptr<Interpreter>> Idle; // For calling back, one chunk at a time
+  std::vector<Builtin> Builtins;
+
+  static constexpr size_t ChunkElements = 1 << 16;
+
+  // Built-ins may call functions that call built-ins in turn, and with no conditionals that
+  // recursion never ends; stop it before the native stack overflows.
+  static constexpr unsigned MaxNesting = 64;
+
+  static unsigned &getNesting() {
+    static thread_local unsigned Nesting = 0;
+    return Nesting;
+  }
+
+  // Whether this thread is running a chunk, in which case nested built-ins run on it serially
+  // rather than waiting on the pool they are part of.
+  static bool &getInChunk() {
+    static thread_local bool InChunk = false;
+    return InChunk;
+  }
+
+  // The innermost scope open on this thread, which chunks run on the pool take on from the
+  // thread that queued them.
+  static Scope *&getScope() {
+    static thread_local Scope *Current = nullptr;
+    return Current;
+  }
+
+  bool error(const char *Str, Symbol Name) {
+    std::string message(Str);
+    message.append(" '").append(Ctx.getSpelling(Name)).append("'");
+    reportError(message);
+    return false;
+  }
+
+  bool getArray(double Handle, Symbol Callee, std::shared_ptr<const std::vector<double>> &Array) {
+    std::lock_guard<std::mutex> lock(Lock);
+    if (!(Handle >= 0 && Handle < Arrays.size() && std::floor(Handle) == Handle) ||
+        !Arrays[static_cast<size_t>(Handle)]) {
+      return error("Unknown array passed to", Callee);
+    }
+    Array = Arrays[static_cast<size_t>(Handle)];
+    return true;
+  }
+
+  // An interpreter over the same function table as Caller's, for calling back into it.
+  std::unique_ptr<Interpreter> checkOut(Interpreter &Caller) {
+    {
+      std::lock_guard<std::mutex> lock(Lock);
+      auto it = std::find_if(Idle.begin(), Idle.end(), [&](const auto &I) {
+        return I->getRegistry() == Caller.getRegistry();
+      });
+      if (it != Idle.end()) {
+        auto evaluator = std::move(*it);
+        Idle.erase(it);
+        return evaluator;
+      }
+    }
+    return std::make_unique<Interpreter>(Names, Caller.getRegistry());
+  }
+
+  void checkIn(std::unique_ptr<Interpreter> E) {
+    std::lock_guard<std::mutex> lock(Lock);
+    Idle.push_back(std::move(E));
+  }
+
+  // Call F over column Args[0..NumArgs-1], from Begin up to End, into Out, on an interpreter
+  // sharing Caller's function table.
+  bool callBatch(Interpreter &Caller, Symbol F, const double *const *Args, size_t NumArgs,
+                 size_t Begin, size_t End, double *Out) {
+    std::unique_ptr<Interpreter> evaluator = checkOut(Caller);
+    const double *columns[2];
+    for (size_t i = 0; i < NumArgs; ++i) { columns[i] = Args[i] + Begin; }
+    bool ok = evaluator->callBatch(F, columns, NumArgs, End - Begin, Out + Begin);
+    checkIn(std::move(evaluator));
+    return ok;
+  }
+
+  // Run Task(Begin, End) over every chunk of NumElements elements (one empty chunk if there are
+  // none), on the pool if there are several. Returns whether every chunk succeeded; if not, the
+  // errors of the first chunk that failed are reported, as running them in order would have.
+  template <typename TaskFn> bool forEachChunk(size_t NumElements, TaskFn Task) {
+    size_t num_chunks = std::max<size_t>(1, (NumElements + ChunkElements - 1) / ChunkElements);
+    auto run = [&](size_t Chunk) {
+      return Task(Chunk * ChunkElements, std::min(NumElements, (Chunk + 1) * ChunkElements));
+    };
+    if (num_chunks > 1 && !getInChunk()) {
+      std::call_once(PoolStarted, [this] { Pool = std::make_unique<ThreadPool>(NumThreads); });
+    }
+    if (num_chunks == 1 || getInChunk() || Pool->getNumThreads() == 1) {
+      for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+        if (!run(chunk)) { return false; }
+      }
+      return true;
+    }
+
+    std::vector<char> succeeded(num_chunks);
+    std::vector<std::vector<Diagnostic>> diagnostics(num_chunks);
+    std::mutex done_lock;
+    std::condition_variable done;
+    size_t remaining = num_chunks;
+    Scope *scope = getScope();
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+      Pool->submit([&, chunk] {
+        getInChunk() = true;
+        getScope() = scope;
+        {
+          DiagnosticCapture capture;
+          succeeded[chunk] = run(chunk);
+          diagnostics[chunk] = capture.getDiagnostics();
+        }
+        getScope() = nullptr;
+        getInChunk() = false;
+        std::lock_guard<std::mutex> lock(done_lock);
+        if (--remaining == 0) { done.notify_all(); }
+      });
+    }
+    std::unique_lock<std::mutex> lock(done_lock);
+    done.wait(lock, [&] { return remaining == 0; });
+
+    for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+      if (succeeded[chunk]) { continue; }
+      for (const Diagnostic &diagnostic : diagnostics[chunk]) {
+        reportError(diagnostic.Loc, diagnostic.Message);
+      }
+      return false;
+    }
+    return true;
+  }
+
+  // The sum of A's elements, or with B, of their products, adding up each chunk's in turn.
+  bool sumChunks(const double *A, const double *B, size_t N, double &Result) {
+    size_t num_chunks = std::max<size_t>(1, (N + ChunkElements - 1) / ChunkElements);
+    std::vector<double> partial(num_chunks);
+    forEachChunk(N, [&](size_t Begin, size_t End) {
+      size_t chunk = Begin / ChunkElements;
+      partial[chunk] = B ? dotColumns(A + Begin, B + Begin, End - Begin)
+                         : sumColumn(A + Begin, End - Begin);
+      return true;
+    });
+    Result = 0.0;
+    for (double sum : partial) { Result += sum; }
+    return true;
+  }
+
+  bool map(Interpreter &Caller, Symbol F, const std::vector<double> &A, double &Result) {
+    std::vector<double> out(A.size());
+    const double *args[1] = {A.data()};
+    if (!forEachChunk(A.size(), [&](size_t Begin, size_t End) {
+          return callBatch(Caller, F, args, 1, Begin, End, out.data());
+        })) {
+      return false;
+    }
+    Result = addArray(std::move(out));
+    return true;
+  }
+
+  bool reduce(Interpreter &Caller, Symbol F, const std::vector<double> &A, double Initial,
+              double &Result) {
+    // Each level combines the neighbours of the one before, carrying an odd one out along.
+    std::vector<double> level(A), lhs, rhs, next;
+    while (level.size() > 1) {
+      size_t pairs = level.size() / 2;
+      lhs.resize(pairs);
+      rhs.resize(pairs);
+      next.resize(pairs + level.size() % 2);
+      for (size_t i = 0; i < pairs; ++i) {
+        lhs[i] = level[2 * i];
+        rhs[i] = level[2 * i + 1];
+      }
+      if (level.size() % 2) { next.back() = level.back(); }
+      const double *args[2] = {lhs.data(), rhs.data()};
+      if (!forEachChunk(pairs, [&](size_t Begin, size_t End) {
+            return callBatch(Caller, F, args, 2, Begin, End, next.data());
+          })) {
+        return false;
+      }
+      level.swap(next);
+    }
+
+    // Then the initial value goes in front of the rest.
+    double args[2] = {Initial, level.empty() ? 0.0 : level[0]};
+    const double *columns[2] = {&args[0], &args[1]};
+    if (level.empty()) {
+      // Nothing to combine it with, but f must still be callable.
+      if (!callBatch(Caller, F, columns, 2, 0, 0, &Result)) { return false; }
+      Result = Initial;
+      return true;
+    }
+    return callBatch(Caller, F, columns, 2, 0, 1, &Result);
+  }
+
+  void addBuiltin(const char *Name, std::initializer_list<const char *> Params,
+                  Interpreter::NativeFn Fn, uint32_t FunctionParams = 0) {
+    std::vector<Symbol> params;
+    for (const char *param : Params) { params.push_back(Ctx.intern(param)); }
+    auto Proto = Ctx.create<PrototypeAST>(Ctx.intern(Name),
+                                          Ctx.copyArray(params.data(), params.size()));
+    Builtins.push_back(Builtin{Proto, std::move(Fn), FunctionParams});
+  }
+
+  // Wrap Body, which takes this built-in's name and the call's arguments, so that it counts
+  // towards MaxNesting.
+  template <typename BodyFn> Interpreter::NativeFn nested(Symbol Name, BodyFn Body) {
+    return [this, Name, Body](Interpreter &Caller, const double *Args, double &Result) {
+      unsigned &nesting = getNesting();
+      if (nesting >= MaxNesting) { return error("Maximum call depth exceeded in", Name); }
+      ++nesting;
+      bool ok = Body(Caller, Args, Result);
+      --nesting;
+      return ok;
+    };
+  }
+
+public:
+  /// A runtime whose built-ins are declared in Ctx, running chunks of long arrays on NumThreads
+  /// threads (0 for one per hardware thread). The interpreters it is installed in must share
+  /// Ctx's symbol table.
+  ArrayRuntime(ASTContext &Ctx, unsigned NumThreads)
+    : Ctx(Ctx), Names(Ctx), NumThreads(NumThreads) {
+    Symbol len = Ctx.intern("len"), at = Ctx.intern("at"), sum = Ctx.intern("sum"),
+           dot = Ctx.intern("dot"), map = Ctx.intern("map"), reduce = Ctx.intern("reduce");
+    addBuiltin("len", {"a"}, [this, len](Interpreter &, const double *Args, double &Result) {
+      std::shared_ptr<const std::vector<double>> a;
+      if (!getArray(Args[0], len, a)) { return false; }
+      Result = static_cast<double>(a->size());
+      return true;
+    });
+    addBuiltin("at", {"a", "i"}, [this, at](Interpreter &, const double *Args, double &Result) {
+      std::shared_ptr<const std::vector<double>> a;
+      if (!getArray(Args[0], at, a)) { return false; }
+      double index = Args[1];
+      if (!(index >= 0 && index < a->size() && std::floor(index) == index)) {
+        return error("Index out of range in", at);
+      }
+      Result = (*a)[static_cast<size_t>(index)];
+      return true;
+    });
+    addBuiltin("sum", {"a"}, [this, sum](Interpreter &, const double *Args, double &Result) {
+      std::shared_ptr<const std::vector<double>> a;
+      if (!getArray(Args[0], sum, a)) { return false; }
+      return sumChunks(a->data(), nullptr, a->size(), Result);
+    });
+    addBuiltin("dot", {"a", "b"}, [this, dot](Interpreter &, const double *Args, double &Result) {
+      std::shared_ptr<const std::vector<double>> a, b;
+      if (!getArray(Args[0], dot, a) || !getArray(Args[1], dot, b)) { return false; }
+      if (a->size() != b->size()) { return error("Arrays of different lengths passed to", dot); }
+      return sumChunks(a->data(), b->data(), a->size(), Result);
+    });
+    addBuiltin("map", {"f", "a"},
+               nested(map, [this, map](Interpreter &Caller, const double *Args, double &Result) {
+                 std::shared_ptr<const std::vector<double>> a;
+                 if (!getArray(Args[1], map, a)) { return false; }
+                 return this->map(Caller, static_cast<Symbol>(Args[0]), *a, Result);
+               }),
+               /*FunctionParams=*/1);
+    addBuiltin(
+        "reduce", {"f", "a", "x"},
+        nested(reduce, [this, reduce](Interpreter &Caller, const double *Args, double &Result) {
+          std::shared_ptr<const std::vector<double>> a;
+          if (!getArray(Args[1], reduce, a)) { return false; }
+          return this->reduce(Caller, static_cast<Symbol>(Args[0]), *a, Args[2], Result);
+        }),
+        /*FunctionParams=*/1);
+  }
+
+  ArrayRuntime(const ArrayRuntime &) = delete;
+  ArrayRuntime &operator=(const ArrayRuntime &) = delete;
+
+  /// Publish the built-ins in Interp's function table. Definitions of the same names made
+  /// later replace them.
+  void install(Interpreter &Interp) {
+    for (const Builtin &builtin : Builtins) {
+      Interp.addNative(builtin.Prototype, builtin.Fn, builtin.FunctionParams);
+    }
+  }
+
+  /// The prototype of the built-in named Name, or null if there is none.
+  const PrototypeAST *getBuiltin(Symbol Name) const {
+    for (const Builtin &builtin : Builtins) {
+      if (builtin.Prototype->getName() == Name) { return builtin.Prototype; }
+    }
+    return nullptr;
+  }
+
+  /// Hand Values to scripts, returning the handle they refer to it by. Inside a Scope, the array
+  /// is freed when the scope ends.
+  double addArray(std::vector<double> Values) {
+    auto array = std::make_shared<const std::vector<double>>(std::move(Values));
+    std::lock_guard<std::mutex> lock(Lock);
+    size_t handle = Arrays.size();
+    if (FreeHandles.empty()) {
+      Arrays.push_back(std::move(array));
+    } else {
+      handle = FreeHandles.back();
+      FreeHandles.pop_back();
+      Arrays[handle] = std::move(array);
+    }
+    Scope *scope = getScope();
+    if (scope && &scope->Runtime == this) { scope->Made.push_back(handle); }
+    return static_cast<double>(handle);
+  }
+
+  /// The array with handle Handle, which must have been returned by addArray() or map and not
+  /// freed since.
+  std::shared_ptr<const std::vector<double>> getArray(double Handle) {
+    std::lock_guard<std::mutex> lock(Lock);
+    return Arrays[static_cast<size_t>(Handle)];
+  }
+
+  /// Frees the arrays added while it is the innermost scope open on its thread, including those
+  /// that map makes in chunks run for it on other threads, once it ends.
+  class Scope {
+    friend class ArrayRuntime;
+    ArrayRuntime &Runtime;
+    Scope *Outer;
+    std::vector<size_t> Made; // Guarded by Runtime.Lock
+
+  public:
+    explicit Scope(ArrayRuntime &Runtime) : Runtime(Runtime), Outer(getScope()) {
+      getScope() = this;
+    }
+
+    ~Scope() {
+      getScope() = Outer;
+      // Let go of the arrays after unlocking, unless a call still holds them.
+      std::vector<std::shared_ptr<const std::vector<double>>> freed;
+      std::lock_guard<std::mutex> lock(Runtime.Lock);
+      for (size_t handle : Made) {
+        freed.push_back(std::move(Runtime.Arrays[handle]));
+        Runtime.FreeHandles.push_back(handle);
+      }
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+  };
+};
+
+#endif // KALEIDOSCOPE_ARRAYRUNTIME_H
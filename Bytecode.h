@@ -0,0 +1,29 @@
+#ifndef KALEIDOSCOPE_BYTECODE_H
+#define KALEIDOSCOPE_BYTECODE_H
+
+#include <cstdint>
+
+//=========================
+// Bytecode
+//=========================
+
+// Every function body is lowered once to a small register bytecode. A function's parameters are
+// its registers 0..N-1, so variable references need no instructions at all; temporaries are
+// allocated above them in stack order.
+enum BytecodeOpcode : uint8_t {
+  op_const, // Dst = Constants[A]
+  op_move,  // Dst = A
+  op_add,   // Dst = A + B
+  op_sub,   // Dst = A - B
+  op_mul,   // Dst = A * B
+  op_less,  // Dst = A < B ? 1.0 : 0.0
+  op_call,  // Dst = Functions[A](Dst, Dst+1, ... Dst+B-1)
+  op_ret,   // return A
+};
+
+struct Instruction {
+  BytecodeOpcode Opcode;
+  uint32_t Dst, A, B;
+};
+
+#endif // KALEIDOSCOPE_BYTECODE_H
@@ -0,0 +1,205 @@
+#ifndef KALEIDOSCOPE_CALLGRAPH_H
+#define KALEIDOSCOPE_CALLGRAPH_H
+
+#include "AST.h"
+#include "TopLevelItems.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+//=========================
+// Call Graph
+//=========================
+
+// Which functions a module's definitions call, by name. Every definition of a name contributes its
+// calls, so a name that is defined more than once calls whatever any of its definitions calls;
+// that is what a call by name may reach, whichever definition is current when it runs. Calls are
+// read from each CallExprAST's callee and kept as edges between Symbols, so the graph is indexed
+// like the interpreter's function table.
+class CallGraph {
+  std::vector<std::vector<Symbol>> Callees; // Indexed by Symbol; sorted, without repeats
+  std::vector<bool> Defined;
+  std::vector<bool> Recursive;
+
+  void grow(Symbol Name) {
+    if (Name >= Callees.size()) {
+      Callees.resize(Name + 1);
+      Defined.resize(Name + 1);
+      Recursive.resize(Name + 1);
+    }
+  }
+
+  // Mark every name that can reach itself: those with a call to themselves, and the members of
+  // every strongly connected component of more than one. This is Tarjan's algorithm, with an
+  // explicit stack so that long call chains cannot overflow the native one.
+  void findRecursion() {
+    constexpr unsigned Unvisited = ~0u;
+    size_t num_names = Callees.size();
+    std::vector<unsigned> index(num_names, Unvisited), low(num_names);
+    std::vector<bool> on_stack(num_names);
+    std::vector<Symbol> component;
+    std::vector<std::pair<Symbol, size_t>> path; // A name, and the next of its callees to visit
+    unsigned next_index = 0;
+
+    for (Symbol root = 0; root < num_names; ++root) {
+      if (!Defined[root] || index[root] != Unvisited) { continue; }
+      path.emplace_back(root, 0);
+      index[root] = low[root] = next_index++;
+      component.push_back(root);
+      on_stack[root] = true;
+
+      while (!path.empty()) {
+        auto &[name, next] = path.back();
+        if (next < Callees[name].size()) {
+          Symbol callee = Callees[name][next++];
+          if (callee == name) { Recursive[name] = true; }
+          if (!Defined[callee]) { continue; }
+          if (index[callee] == Unvisited) {
+            index[callee] = low[callee] = next_index++;
+            component.push_back(callee);
+            on_stack[callee] = true;
+            path.emplace_back(callee, 0);
+          } else if (on_stack[callee]) {
+            low[name] = std::min(low[name], index[callee]);
+          }
+          continue;
+        }
+
+        Symbol done = name;
+        path.pop_back();
+        if (!path.empty()) {
+          Symbol caller = path.back().first;
+          low[caller] = std::min(low[caller], low[done]);
+        }
+        if (low[done] != index[done]) { continue; }
+
+        // Done is the root of a component: everything above it on the stack.
+        auto first = std::find(component.begin(), component.end(), done);
+        bool cycle = component.end() - first > 1;
+        for (auto it = first; it != component.end(); ++it) {
+          on_stack[*it] = false;
+          if (cycle) { Recursive[*it] = true; }
+        }
+        component.erase(first, component.end());
+      }
+    }
+  }
+
+public:
+  /// Build the graph of every definition among Items.
+  explicit CallGraph(const std::vector<TopLevelItem> &Items) {
+    std::vector<Symbol> callees;
+    for (const TopLevelItem &item : Items) {
+      if (item.Kind != TopLevelItem::Item_Definition) { continue; }
+      Symbol name = item.Function->getPrototype()->getName();
+      callees.clear();
+      collectCallees(item.Function->getBody(), callees);
+      grow(name);
+      for (Symbol callee : callees) { grow(callee); }
+      Defined[name] = true;
+      std::vector<Symbol> &edges = Callees[name];
+      edges.insert(edges.end(), callees.begin(), callees.end());
+      std::sort(edges.begin(), edges.end());
+      edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    }
+    findRecursion();
+  }
+
+  /// Append the name of every function E calls to Names, once each. A variable passed straight
+  /// to a call counts as a call to the function of that name, which a built-in such as map may
+  /// make. Shared subexpressions are only visited once, so this stays linear in the size of a
+  /// folded DAG.
+  static void collectCallees(const ExprAST *E, std::vector<Symbol> &Names) {
+    std::unordered_set<const ExprAST *> visited;
+    std::unordered_set<Symbol> seen;
+    std::vector<const ExprAST *> worklist{E};
+    while (!worklist.empty()) {
+      const ExprAST *node = worklist.back();
+      worklist.pop_back();
+      if (!visited.insert(node).second) { continue; }
+      if (node->getKind() == ExprAST::Expr_Binary) {
+        auto B = static_cast<const BinaryExprAST *>(node);
+        worklist.push_back(B->getLHS());
+        worklist.push_back(B->getRHS());
+      } else if (node->getKind() == ExprAST::Expr_Call) {
+        auto C = static_cast<const CallExprAST *>(node);
+        if (seen.insert(C->getCallee()).second) { Names.push_back(C->getCallee()); }
+        for (const ExprAST *Arg : C->getArgs()) {
+          if (Arg->getKind() == ExprAST::Expr_Variable) {
+            Symbol name = static_cast<const VariableExprAST *>(Arg)->getName();
+            if (seen.insert(name).second) { Names.push_back(name); }
+          }
+          worklist.push_back(Arg);
+        }
+      }
+    }
+  }
+
+  /// Whether a call to Name can lead back to Name.
+  bool isRecursive(Symbol Name) const { return Name < Recursive.size() && Recursive[Name]; }
+
+  /// The names Name's definitions call directly.
+  const std::vector<Symbol> &getCallees(Symbol Name) const {
+    static const std::vector<Symbol> None;
+    return Name < Callees.size() ? Callees[Name] : None;
+  }
+
+  /// Every name that can reach itself.
+  std::vector<Symbol> getRecursiveNames() const {
+    std::vector<Symbol> names;
+    for (Symbol name = 0; name < Recursive.size(); ++name) {
+      if (Recursive[name]) { names.push_back(name); }
+    }
+    return names;
+  }
+
+  /// Which names a call to any of Roots can reach, Roots included, indexed by Symbol over
+  /// NumSymbols names.
+  std::vector<bool> findReachable(const std::vector<Symbol> &Roots, size_t NumSymbols) const {
+    std::vector<bool> reached(std::max(NumSymbols, Callees.size()));
+    std::vector<Symbol> worklist;
+    auto reach = [&](Symbol Name) {
+      if (!reached[Name]) {
+        reached[Name] = true;
+        worklist.push_back(Name);
+      }
+    };
+    for (Symbol root : Roots) { reach(root); }
+    while (!worklist.empty()) {
+      Symbol name = worklist.back();
+      worklist.pop_back();
+      for (Symbol callee : getCallees(name)) { reach(callee); }
+    }
+    return reached;
+  }
+
+  /// Which names can reach any of Targets through calls, Targets included, indexed by Symbol over
+  /// NumSymbols names.
+  std::vector<bool> findReaching(const std::vector<Symbol> &Targets, size_t NumSymbols) const {
+    std::vector<std::vector<Symbol>> callers(Callees.size());
+    for (Symbol name = 0; name < Callees.size(); ++name) {
+      for (Symbol callee : Callees[name]) { callers[callee].push_back(name); }
+    }
+    std::vector<bool> reaching(std::max(NumSymbols, Callees.size()));
+    std::vector<Symbol> worklist;
+    auto reach = [&](Symbol Name) {
+      if (!reaching[Name]) {
+        reaching[Name] = true;
+        worklist.push_back(Name);
+      }
+    };
+    for (Symbol target : Targets) { reach(target); }
+    while (!worklist.empty()) {
+      Symbol name = worklist.back();
+      worklist.pop_back();
+      if (name < callers.size()) {
+        for (Symbol caller : callers[name]) { reach(caller); }
+      }
+    }
+    return reaching;
+  }
+};
+
+#endif // KALEIDOSCOPE_CALLGRAPH_H
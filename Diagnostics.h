@@ -0,0 +1,95 @@
+#ifndef KALEIDOSCOPE_DIAGNOSTICS_H
+#define KALEIDOSCOPE_DIAGNOSTICS_H
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+//=========================
+// Diagnostics
+//=========================
+
+// A position in the source: 1-based line, and 1-based byte column within it. Line 0 means no
+// position, for errors that are not about any one place in the source.
+struct SourceLocation {
+  unsigned Line = 0;
+  unsigned Column = 0;
+
+  bool isValid() const { return Line != 0; }
+};
+
+struct Diagnostic {
+  SourceLocation Loc;
+  std::string Message;
+
+  /// Append this as a line of text: "Error: [File:]Line:Column: Message", or just "Error: Message"
+  /// without a location.
+  void render(std::string &Out, std::string_view File = std::string_view()) const {
+    Out.append("Error: ");
+    if (Loc.isValid()) {
+      if (!File.empty()) { Out.append(File).append(":"); }
+      Out.append(std::to_string(Loc.Line)).append(":").append(std::to_string(Loc.Column));
+      Out.append(": ");
+    }
+    Out.append(Message).append("\n");
+  }
+};
+
+// Errors are printed to stderr as soon as they are found, unless the current thread is
+// collecting them in a DiagnosticCapture. Workers that parse or lower in parallel collect theirs,
+// so that they can be printed later in the order a serial run would have produced them, and the
+// serial loop collects each item's so that they are written out together.
+class DiagnosticCapture {
+  std::vector<Diagnostic> Diagnostics;
+  DiagnosticCapture *Previous;
+
+  static DiagnosticCapture *&getActive() {
+    static thread_local DiagnosticCapture *Active = nullptr;
+    return Active;
+  }
+
+public:
+  DiagnosticCapture() : Previous(getActive()) { getActive() = this; }
+  ~DiagnosticCapture() { getActive() = Previous; }
+  DiagnosticCapture(const DiagnosticCapture &) = delete;
+  DiagnosticCapture &operator=(const DiagnosticCapture &) = delete;
+
+  /// Everything reported since construction or the last take() or print().
+  const std::vector<Diagnostic> &getDiagnostics() const { return Diagnostics; }
+
+  /// Everything reported since construction or the last call, rendered as it would have been
+  /// printed, with File (if any) naming the source the locations are in.
+  std::string take(std::string_view File = std::string_view()) {
+    std::string text;
+    for (const Diagnostic &diagnostic : Diagnostics) { diagnostic.render(text, File); }
+    Diagnostics.clear();
+    return text;
+  }
+
+  /// Print and forget everything reported so far, in one write.
+  void print(FILE *Out) {
+    if (Diagnostics.empty()) { return; }
+    std::string text = take();
+    fwrite(text.data(), 1, text.size(), Out);
+  }
+
+  friend void reportError(SourceLocation Loc, std::string_view Message);
+};
+
+/// Report "Error: <Line>:<Column>: <Message>" on the current thread.
+inline void reportError(SourceLocation Loc, std::string_view Message) {
+  if (DiagnosticCapture *capture = DiagnosticCapture::getActive()) {
+    capture->Diagnostics.push_back(Diagnostic{Loc, std::string(Message)});
+    return;
+  }
+  std::string text;
+  Diagnostic{Loc, std::string(Message)}.render(text);
+  fwrite(text.data(), 1, text.size(), stderr);
+}
+
+/// Report "Error: <Message>", about no position in particular, on the current thread.
+inline void reportError(std::string_view Message) { reportError(SourceLocation(), Message); }
+
+#endif // KALEIDOSCOPE_DIAGNOSTICS_H
@@ -0,0 +1,212 @@
+#ifndef KALEIDOSCOPE_DOCUMENT_H
+#define KALEIDOSCOPE_DOCUMENT_H
+
+#include "Diagnostics.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "TopLevelItems.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+//=========================
+// Documents
+//=========================
+
+// A source buffer that is edited in place, as in an editor, together with its parsed top-level
+// items. Each item records the span of source it was parsed from: from the end of the item before
+// it up to the first token of the item after it, since whether an item ends depends on that token.
+// An edit re-parses from the item before the first whose span it touches, since the edit may run
+// into the token after that item, and stops as soon as an item ends
+// on an old item boundary past the edit; every item from there on is kept as it was, nodes
+// included, with its span shifted.
+//
+// The items parsed by one parse share a child context of the caller's context, which is freed once
+// edits have replaced all of them. An item keeps the errors reported while parsing it relative to
+// where its span starts, so that they move with it when an edit before it shifts it, and renders
+// them on demand (see getDiagnostics()); its Parsed.Diagnostics is left empty.
+class Document {
+public:
+  struct Item {
+    TopLevelItem Parsed;
+    size_t Begin;         // Offset of the span's first byte
+    size_t End;           // One past its last byte: where the next item's span begins
+    SourceLocation Start; // Where Begin is in the text
+    // The errors reported while parsing it. Their lines count from Start's, as line 1, and
+    // columns on that first line count from Start's column, as column 1.
+    std::vector<Diagnostic> Errors;
+  };
+
+  /// What an edit changed: items [First, First + NumRemoved) were replaced by the NumAdded items
+  /// now starting at First.
+  struct EditResult {
+    size_t First = 0;
+    size_t NumRemoved = 0;
+    size_t NumAdded = 0;
+  };
+
+private:
+  ASTContext &Ctx;
+  bool Simplify;
+  unsigned MaxExpressionDepth = DefaultMaxExpressionDepth;
+  std::string Text;
+  std::vector<Item> Items;
+  std::vector<std::shared_ptr<ASTContext>> Owners; // Parallel to Items
+
+  static constexpr size_t NoResync = ~size_t(0);
+
+  // Loc relative to Start, as Item::Errors holds it, and back.
+  static SourceLocation getRelative(SourceLocation Loc, SourceLocation Start) {
+    if (!Loc.isValid()) { return Loc; }
+    if (Loc.Line != Start.Line) { return SourceLocation{Loc.Line - Start.Line + 1, Loc.Column}; }
+    return SourceLocation{1, Loc.Column - Start.Column + 1};
+  }
+
+  static SourceLocation getAbsolute(SourceLocation Loc, SourceLocation Start) {
+    if (!Loc.isValid()) { return Loc; }
+    if (Loc.Line != 1) { return SourceLocation{Start.Line + Loc.Line - 1, Loc.Column}; }
+    return SourceLocation{Start.Line, Start.Column + Loc.Column - 1};
+  }
+
+  // Parse from Begin, appending items to NewItems until Resync accepts where one ends (returning
+  // the index in Items of the old item that ended there too), or the input ends (returning
+  // NoResync).
+  template <typename ResyncFn>
+  size_t parseFrom(size_t Begin, std::vector<Item> &NewItems,
+                   std::vector<std::shared_ptr<ASTContext>> &NewOwners, ResyncFn Resync) {
+    auto context = std::make_shared<ASTContext>(Ctx);
+    std::string_view text(Text);
+    auto source = SourceBuffer::getMemory(text.substr(Begin));
+    SourceLocation item_start = getLocationAfter(SourceLocation{1, 1}, text.substr(0, Begin));
+    Lexer lexer(*source, item_start);
+    Parser parser(lexer, *context);
+    ExprSimplifier simplifier(*context);
+    if (Simplify) { parser.setSimplifier(&simplifier); }
+    parser.setMaxExpressionDepth(MaxExpressionDepth);
+    DiagnosticCapture capture;
+
+    parser.getNextToken();
+    TopLevelItem parsed;
+    size_t item_begin = Begin;
+    while (parseTopLevelItem(parser, parsed)) {
+      size_t item_end = Begin + (lexer.getTokenStart() - source->begin());
+      Item item{parsed, item_begin, item_end, item_start, {}};
+      for (const Diagnostic &error : capture.getDiagnostics()) {
+        item.Errors.push_back(Diagnostic{getRelative(error.Loc, item_start), error.Message});
+      }
+      capture.take();
+      NewItems.push_back(std::move(item));
+      NewOwners.push_back(context);
+      size_t resync = Resync(item_end);
+      if (resync != NoResync) { return resync; }
+      parsed = TopLevelItem();
+      item_begin = item_end;
+      item_start = lexer.getTokenLoc();
+    }
+    return NoResync;
+  }
+
+public:
+  /// Parse into children of Ctx. With Simplify, expressions are folded and shared as they are
+  /// parsed.
+  explicit Document(ASTContext &Ctx, bool Simplify = true) : Ctx(Ctx), Simplify(Simplify) {}
+
+  /// Reject expressions nested deeper than Depth, or 0 for no limit, from the next parse on.
+  void setMaxExpressionDepth(unsigned Depth) { MaxExpressionDepth = Depth; }
+
+  /// Replace the whole text, and parse all of it.
+  void setText(std::string NewText) {
+    Text = std::move(NewText);
+    Items.clear();
+    Owners.clear();
+    parseFrom(0, Items, Owners, [](size_t) { return NoResync; });
+  }
+
+  /// Replace Length bytes at Offset with Replacement, and re-parse the items that may have
+  /// changed.
+  EditResult edit(size_t Offset, size_t Length, std::string_view Replacement) {
+    Offset = std::min(Offset, Text.size());
+    Length = std::min(Length, Text.size() - Offset);
+    // Where the replaced text ends, before and after the edit, for moving the items after it.
+    SourceLocation edit_start = getLocationAfter(SourceLocation{1, 1},
+                                                 std::string_view(Text).substr(0, Offset));
+    SourceLocation old_end =
+        getLocationAfter(edit_start, std::string_view(Text).substr(Offset, Length));
+    SourceLocation new_end = getLocationAfter(edit_start, Replacement);
+    Text.replace(Offset, Length, Replacement.data(), Replacement.size());
+    ptrdiff_t delta = static_cast<ptrdiff_t>(Replacement.size()) - static_cast<ptrdiff_t>(Length);
+
+    // The first item that may change is the first whose span, or the token after it, the edit
+    // touches. That token starts where the item ends but may run on into the edit, so the last
+    // item to end before the edit is parsed again as well.
+    auto first_it = std::lower_bound(Items.begin(), Items.end(), Offset,
+                                     [](const Item &I, size_t At) { return I.End < At; });
+    if (first_it != Items.begin()) { --first_it; }
+    EditResult result;
+    result.First = first_it - Items.begin();
+    size_t begin = first_it == Items.begin() ? 0 : std::prev(first_it)->End;
+
+    // Stop at the first item that ends where an old item did, past the end of the edit: the
+    // parse is back at the top level at a point with the same text after it as before.
+    size_t candidate = result.First;
+    auto resync = [&](size_t NewEnd) -> size_t {
+      if (NewEnd < Offset + Replacement.size()) { return NoResync; }
+      size_t old_end = NewEnd - delta;
+      while (candidate < Items.size() && Items[candidate].End < old_end) { ++candidate; }
+      if (candidate < Items.size() && Items[candidate].End == old_end) { return candidate; }
+      return NoResync;
+    };
+
+    std::vector<Item> new_items;
+    std::vector<std::shared_ptr<ASTContext>> new_owners;
+    size_t last = parseFrom(begin, new_items, new_owners, resync);
+    size_t kept_from = last == NoResync ? Items.size() : last + 1;
+
+    for (size_t i = kept_from; i < Items.size(); ++i) {
+      Items[i].Begin += delta;
+      Items[i].End += delta;
+      // Kept items start past the replaced text; only one that starts on its last line moves
+      // along that line.
+      SourceLocation &start = Items[i].Start;
+      if (start.Line == old_end.Line) {
+        start = SourceLocation{new_end.Line, new_end.Column + (start.Column - old_end.Column)};
+      } else {
+        start.Line = start.Line - old_end.Line + new_end.Line;
+      }
+    }
+    result.NumRemoved = kept_from - result.First;
+    result.NumAdded = new_items.size();
+    Items.erase(Items.begin() + result.First, Items.begin() + kept_from);
+    Items.insert(Items.begin() + result.First, new_items.begin(), new_items.end());
+    Owners.erase(Owners.begin() + result.First, Owners.begin() + kept_from);
+    Owners.insert(Owners.begin() + result.First, new_owners.begin(), new_owners.end());
+    return result;
+  }
+
+  const std::string &getText() const { return Text; }
+  const std::vector<Item> &getItems() const { return Items; }
+
+  /// The errors reported while parsing I, rendered as they would have been printed, at the lines
+  /// and columns they are at in the text as it is now.
+  static std::string getDiagnostics(const Item &I, std::string_view File = std::string_view()) {
+    std::string text;
+    for (const Diagnostic &error : I.Errors) {
+      Diagnostic{getAbsolute(error.Loc, I.Start), error.Message}.render(text, File);
+    }
+    return text;
+  }
+
+  /// The item whose span holds Offset, or nullptr past the end of the text.
+  const Item *findItem(size_t Offset) const {
+    auto it = std::upper_bound(Items.begin(), Items.end(), Offset,
+                               [](size_t At, const Item &I) { return At < I.End; });
+    return it == Items.end() ? nullptr : &*it;
+  }
+};
+
+#endif // KALEIDOSCOPE_DOCUMENT_H
@@ -0,0 +1,433 @@
+#ifndef KALEIDOSCOPE_DRIVER_H
+#define KALEIDOSCOPE_DRIVER_H
+
+#include "ArrayRuntime.h"
+#include "Diagnostics.h"
+#include "Inliner.h"
+#include "Interpreter.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "SerializedAST.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include "TopLevelItems.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//=========================
+// Multi-File Driver
+//=========================
+
+// Compiles many files at once. Each file is read and parsed on a thread pool, in a context of its
+// own that shares one symbol table with the others; once all are parsed, each has its calls
+// inlined and is lowered to bytecode, again on the pool. A link step then
+// resolves every file's externs against the definitions of all the files, merges the lowered
+// definitions into one interpreter, and evaluates the files' top-level expressions. Nothing is
+// defined after the link, so the expressions are independent of each other: they are evaluated
+// on the pool too, by interpreters sharing the linked function table, and what each prints is
+// written out in order.
+class MultiFileDriver {
+  struct FileUnit {
+    std::string Path;
+    std::unique_ptr<ASTContext> Ctx;
+    std::unique_ptr<Interpreter> Interp;
+    std::vector<TopLevelItem> Items;
+    unsigned NumErrors = 0;
+    bool Opened = false;
+    double ParseSeconds = 0.0;
+    double LowerSeconds = 0.0;
+    bool Loaded = false; // Read from a serialized AST rather than parsed
+    FrontEndCounts Counts;
+    std::string Diagnostics; // Printed in file order once every file is compiled
+  };
+
+  ASTContext &Ctx;
+  std::vector<std::unique_ptr<FileUnit>> Files;
+  unsigned NumThreads;
+  bool Simplify;
+  RunStats *Stats = nullptr;
+  unsigned MaxExpressionDepth = DefaultMaxExpressionDepth;
+  unsigned InlineThreshold = DefaultInlineThreshold;
+  uint32_t MemoCapacity = 0;
+  size_t MaxArenaBytes = 0;
+  ArrayRuntime *Arrays = nullptr;
+  TierCompiler *Tiers = nullptr;
+
+  using Clock = std::chrono::steady_clock;
+
+  static double secondsSince(Clock::time_point Start) {
+    return std::chrono::duration<double>(Clock::now() - Start).count();
+  }
+
+  void parse(FileUnit &File) {
+    DiagnosticCapture capture;
+    parseCaptured(File);
+    File.Diagnostics = capture.take(File.Path);
+  }
+
+  void parseCaptured(FileUnit &File) {
+    auto start = Clock::now();
+    auto source = SourceBuffer::getFile(File.Path.c_str());
+    if (!source) {
+      reportError("could not open '" + File.Path + "'");
+      ++File.NumErrors;
+      return;
+    }
+    File.Opened = true;
+
+    if (SerializedAST::isSerialized(*source)) {
+      // Written by -emit-ast; its items only need rebuilding, not parsing.
+      auto module = SerializedAST::load(std::move(source));
+      if (!module) {
+        ++File.NumErrors;
+        return;
+      }
+      module->importInto(*File.Ctx, File.Items);
+      File.Loaded = true;
+    } else {
+      Lexer lexer(*source);
+      Parser parser(lexer, *File.Ctx);
+      ExprSimplifier simplifier(*File.Ctx);
+      if (Simplify) { parser.setSimplifier(&simplifier); }
+      if (Stats) { parser.setCounts(&File.Counts); }
+      parser.setMaxExpressionDepth(MaxExpressionDepth);
+      parser.setMaxArenaBytes(MaxArenaBytes);
+      parser.getNextToken();
+      File.NumErrors += parseTopLevelItems(parser, File.Items);
+      File.Counts.Folded = simplifier.getNumFolded();
+      File.Counts.Shared = simplifier.getNumShared();
+    }
+    File.ParseSeconds = secondsSince(start);
+    if (Stats) {
+      Stats->record(File.Loaded ? RunStats::Phase_Load : RunStats::Phase_Parse, start,
+                    Clock::now(), File.Path);
+    }
+  }
+
+  void lower(FileUnit &File, const std::vector<Symbol> &LinkedNames) {
+    DiagnosticCapture capture;
+    lowerCaptured(File, LinkedNames);
+    File.Diagnostics += capture.take(File.Path);
+  }
+
+  void lowerCaptured(FileUnit &File, const std::vector<Symbol> &LinkedNames) {
+    // Calls are only inlined within the file, and never to names the link may change. Top-level
+    // expressions run once every file is linked, so only callees that the file does not define
+    // again later can be inlined into them.
+    if (InlineThreshold) {
+      auto start = Clock::now();
+      ModuleInliner inliner(*File.Ctx, Simplify);
+      inliner.setThreshold(InlineThreshold);
+      inliner.setExpressionsRunLast(true);
+      for (Symbol name : LinkedNames) { inliner.keepCallsTo(name); }
+      inliner.run(File.Items);
+      if (Stats) {
+        Stats->record(RunStats::Phase_Inline, start, Clock::now(), File.Path);
+        Stats->addInlined(inliner.getNumInlined(), 0);
+      }
+    }
+
+    // Lower each definition against this file's own declarations; calls into other files go
+    // through externs, which the link step resolves.
+    auto start = Clock::now();
+    if (Arrays) { Arrays->install(*File.Interp); }
+    for (const TopLevelItem &item : File.Items) {
+      if (item.Kind == TopLevelItem::Item_Extern) {
+        File.Interp->addExtern(item.Prototype);
+      } else if (item.Kind == TopLevelItem::Item_Definition) {
+        if (!File.Interp->addFunction(item.Function)) { ++File.NumErrors; }
+      }
+    }
+    File.LowerSeconds = secondsSince(start);
+    if (Stats) { Stats->record(RunStats::Phase_Lower, start, Clock::now(), File.Path); }
+  }
+
+  // The names whose definition the link may change from what one file sees on its own: those
+  // that more than one file defines, or that files declare with different numbers of arguments.
+  std::vector<Symbol> findLinkedNames() const {
+    struct Declaration {
+      const FileUnit *Definer = nullptr;
+      size_t Arity;
+      bool Listed = false;
+    };
+    std::unordered_map<Symbol, Declaration> declarations;
+    std::vector<Symbol> names;
+    for (auto &File : Files) {
+      for (const TopLevelItem &item : File->Items) {
+        bool definition = item.Kind == TopLevelItem::Item_Definition;
+        if (!definition && item.Kind != TopLevelItem::Item_Extern) { continue; }
+        PrototypeAST *Proto = definition ? item.Function->getPrototype() : item.Prototype;
+        auto [it, inserted] =
+            declarations.emplace(Proto->getName(), Declaration{nullptr, Proto->getArgs().size()});
+        Declaration &declaration = it->second;
+        bool changed = !inserted && declaration.Arity != Proto->getArgs().size();
+        if (definition) {
+          changed |= declaration.Definer && declaration.Definer != File.get();
+          declaration.Definer = File.get();
+        }
+        if (changed && !declaration.Listed) {
+          names.push_back(Proto->getName());
+          declaration.Listed = true;
+        }
+      }
+    }
+    return names;
+  }
+
+  unsigned link(Interpreter &Interp) {
+    unsigned num_errors = 0;
+    auto spelling = [&](Symbol S) { return std::string(Ctx.getSpelling(S)); };
+
+    // Which file defines each name, and with how many parameters.
+    struct DefinitionSite {
+      const FileUnit *File;
+      size_t Arity;
+    };
+    std::unordered_map<Symbol, DefinitionSite> definitions;
+    for (auto &File : Files) {
+      for (const TopLevelItem &item : File->Items) {
+        if (item.Kind != TopLevelItem::Item_Definition) { continue; }
+        PrototypeAST *Proto = item.Function->getPrototype();
+        auto [it, inserted] = definitions.emplace(
+            Proto->getName(), DefinitionSite{File.get(), Proto->getArgs().size()});
+        if (!inserted && it->second.File != File.get()) {
+          fprintf(stderr, "Error: '%s' is defined in both '%s' and '%s'\n",
+                  spelling(Proto->getName()).c_str(), it->second.File->Path.c_str(),
+                  File->Path.c_str());
+          ++num_errors;
+        }
+        it->second = DefinitionSite{File.get(), Proto->getArgs().size()};
+      }
+    }
+
+    for (auto &File : Files) {
+      for (const TopLevelItem &item : File->Items) {
+        if (item.Kind != TopLevelItem::Item_Extern) { continue; }
+        Symbol name = item.Prototype->getName();
+        auto it = definitions.find(name);
+        const PrototypeAST *builtin = Arrays ? Arrays->getBuiltin(name) : nullptr;
+        if (it == definitions.end() && builtin) {
+          if (builtin->getArgs().size() != item.Prototype->getArgs().size()) {
+            fprintf(stderr, "Error: extern '%s' in '%s' takes %zu arguments, but the built-in "
+                            "takes %zu\n",
+                    spelling(name).c_str(), File->Path.c_str(), item.Prototype->getArgs().size(),
+                    builtin->getArgs().size());
+            ++num_errors;
+          }
+        } else if (it == definitions.end()) {
+          fprintf(stderr, "Error: unresolved extern '%s' in '%s'\n", spelling(name).c_str(),
+                  File->Path.c_str());
+          ++num_errors;
+        } else if (it->second.Arity != item.Prototype->getArgs().size()) {
+          fprintf(stderr, "Error: extern '%s' in '%s' takes %zu arguments, but '%s' defines it "
+                          "with %zu\n",
+                  spelling(name).c_str(), File->Path.c_str(), item.Prototype->getArgs().size(),
+                  it->second.File->Path.c_str(), it->second.Arity);
+          ++num_errors;
+        }
+        Interp.addExtern(item.Prototype);
+      }
+      Interp.takeDefinitions(*File->Interp);
+    }
+    return num_errors;
+  }
+
+  // Evaluate every file's top-level expressions against Interp's definitions, printing each
+  // result or error in order. Returns the number of errors.
+  unsigned evaluate(Interpreter &Interp, ThreadPool &Pool) {
+    PhaseTimer timer(Stats, RunStats::Phase_Evaluate);
+    std::vector<FunctionAST *> expressions;
+    for (auto &File : Files) {
+      for (const TopLevelItem &item : File->Items) {
+        if (item.Kind == TopLevelItem::Item_Expression) { expressions.push_back(item.Function); }
+      }
+    }
+
+    MemoCounts memo = Interp.getMemoCounts();
+    unsigned num_errors = 0;
+    if (Pool.getNumThreads() == 1 || expressions.size() < 2) {
+      for (FunctionAST *expression : expressions) {
+        double result;
+        if (Interp.evaluate(expression, result)) {
+          fprintf(stderr, "Evaluated to %f\n", result);
+        } else {
+          ++num_errors;
+        }
+      }
+      memo = Interp.getMemoCounts();
+    } else {
+      // A few chunks per thread even out expressions of different costs.
+      size_t num_chunks = std::min(expressions.size(), 4 * Pool.getNumThreads());
+      std::vector<std::string> outputs(expressions.size());
+      std::vector<unsigned> chunk_errors(num_chunks);
+      std::vector<MemoCounts> chunk_memo(num_chunks);
+      for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+        Pool.submit([&, chunk] {
+          ASTContext context(Ctx);
+          Interpreter interp(context, Interp.getRegistry());
+          interp.setMemoCapacity(MemoCapacity);
+          interp.setTierCompiler(Tiers);
+          DiagnosticCapture capture;
+          size_t begin = expressions.size() * chunk / num_chunks;
+          size_t end = expressions.size() * (chunk + 1) / num_chunks;
+          for (size_t i = begin; i < end; ++i) {
+            double result;
+            bool ok = interp.evaluate(expressions[i], result);
+            outputs[i] = capture.take();
+            if (ok) {
+              char line[64];
+              snprintf(line, sizeof(line), "Evaluated to %f\n", result);
+              outputs[i] += line;
+            } else {
+              ++chunk_errors[chunk];
+            }
+          }
+          chunk_memo[chunk] = interp.getMemoCounts();
+        });
+      }
+      Pool.wait();
+      for (const std::string &output : outputs) { fputs(output.c_str(), stderr); }
+      for (size_t chunk = 0; chunk < num_chunks; ++chunk) {
+        num_errors += chunk_errors[chunk];
+        memo.add(chunk_memo[chunk]);
+      }
+    }
+    if (Stats) { Stats->addMemo(memo.Hits, memo.Misses, memo.Evictions); }
+    return num_errors;
+  }
+
+public:
+  /// Compile into children of Ctx, using NumThreads threads (0 for one per hardware thread).
+  MultiFileDriver(ASTContext &Ctx, unsigned NumThreads, bool Simplify)
+    : Ctx(Ctx), NumThreads(NumThreads), Simplify(Simplify) {}
+
+  /// Reject expressions nested deeper than Depth, or 0 for no limit.
+  void setMaxExpressionDepth(unsigned Depth) { MaxExpressionDepth = Depth; }
+
+  /// Stop parsing a file once its items take more than Bytes of arena, or never for 0; see
+  /// Parser::setMaxArenaBytes(). Each file has a limit of its own, so which files stop does not
+  /// depend on the order they were parsed in.
+  void setMaxArenaBytes(size_t Bytes) { MaxArenaBytes = Bytes; }
+
+  /// Inline calls to functions of at most Size nodes within each file, or none for 0.
+  void setInlineThreshold(unsigned Size) { InlineThreshold = Size; }
+
+  /// Memoize up to Capacity results of each function while evaluating, or none for 0.
+  void setMemoCapacity(uint32_t Capacity) { MemoCapacity = Capacity; }
+
+  /// Compile hot functions through Compiler while evaluating, or never with null.
+  void setTierCompiler(TierCompiler *Compiler) { Tiers = Compiler; }
+
+  /// Record each file's parse and lowering, the link and the evaluation in Stats, and count what
+  /// parsing the files consumed and built.
+  void setStats(RunStats *Recorder) { Stats = Recorder; }
+
+  /// Give every file the built-ins of Runtime, which externs may also name.
+  void setArrayRuntime(ArrayRuntime *Runtime) { Arrays = Runtime; }
+
+  void addFile(std::string Path) {
+    auto File = std::make_unique<FileUnit>();
+    File->Path = std::move(Path);
+    File->Ctx = std::make_unique<ASTContext>(Ctx);
+    File->Interp = std::make_unique<Interpreter>(*File->Ctx);
+    Files.push_back(std::move(File));
+  }
+
+  /// Add every path listed in the manifest at Path, one per line. Relative paths are taken from
+  /// the manifest's directory. Blank lines and lines starting with '#' are skipped. Returns false
+  /// if the manifest cannot be read.
+  bool addManifest(const char *Path) {
+    auto source = SourceBuffer::getFile(Path);
+    if (!source) { return false; }
+
+    std::string directory(Path);
+    size_t slash = directory.find_last_of("/\\");
+    directory.resize(slash == std::string::npos ? 0 : slash + 1);
+
+    std::string line;
+    auto flush = [&] {
+      while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) { line.pop_back(); }
+      if (!line.empty() && line[0] != '#') {
+        bool absolute = line[0] == '/' || line[0] == '\\' || (line.size() > 1 && line[1] == ':');
+        addFile(absolute ? line : directory + line);
+      }
+      line.clear();
+    };
+    const char *cursor = source->begin(), *keep = cursor;
+    while (true) {
+      for (; cursor != source->end(); ++cursor) {
+        if (*cursor == '\n') {
+          flush();
+        } else {
+          line.push_back(*cursor);
+        }
+      }
+      keep = cursor;
+      if (!source->refill(keep, cursor)) { break; }
+    }
+    flush();
+    return true;
+  }
+
+  /// Compile and link every file, print a summary line for each, and evaluate the top-level
+  /// expressions. Returns the number of errors.
+  unsigned run() {
+    auto start = Clock::now();
+    ThreadPool pool(NumThreads);
+    size_t num_threads = pool.getNumThreads();
+    for (auto &File : Files) {
+      FileUnit *unit = File.get();
+      pool.submit([this, unit] { parse(*unit); });
+    }
+    pool.wait();
+
+    std::vector<Symbol> linked_names;
+    if (InlineThreshold) { linked_names = findLinkedNames(); }
+    for (auto &File : Files) {
+      FileUnit *unit = File.get();
+      pool.submit([this, unit, &linked_names] { lower(*unit, linked_names); });
+    }
+    pool.wait();
+    double compile_seconds = secondsSince(start);
+
+    unsigned num_errors = 0;
+    for (auto &File : Files) {
+      num_errors += File->NumErrors;
+      if (Stats) { Stats->addCounts(File->Counts); }
+      fputs(File->Diagnostics.c_str(), stderr);
+      if (!File->Opened) { continue; }
+      unsigned counts[3] = {0, 0, 0};
+      for (const TopLevelItem &item : File->Items) {
+        if (item.Kind <= TopLevelItem::Item_Expression) { ++counts[item.Kind]; }
+      }
+      fprintf(stderr, "%s: %u definitions, %u externs, %u expressions; parsed in %.3f ms, "
+                      "lowered in %.3f ms\n",
+              File->Path.c_str(), counts[TopLevelItem::Item_Definition],
+              counts[TopLevelItem::Item_Extern], counts[TopLevelItem::Item_Expression],
+              File->ParseSeconds * 1e3, File->LowerSeconds * 1e3);
+    }
+
+    start = Clock::now();
+    Interpreter interp(Ctx);
+    interp.setMemoCapacity(MemoCapacity);
+    interp.setTierCompiler(Tiers);
+    if (Arrays) { Arrays->install(interp); }
+    num_errors += link(interp);
+    double link_seconds = secondsSince(start);
+    if (Stats) { Stats->record(RunStats::Phase_Link, start, Clock::now()); }
+
+    num_errors += evaluate(interp, pool);
+
+    fprintf(stderr, "%zu files compiled in %.3f ms on %zu threads, linked in %.3f ms\n",
+            Files.size(), compile_seconds * 1e3, num_threads, link_seconds * 1e3);
+    return num_errors;
+  }
+};
+
+#endif // KALEIDOSCOPE_DRIVER_H
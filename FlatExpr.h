@@ -0,0 +1,187 @@
+#ifndef KALEIDOSCOPE_FLATEXPR_H
+#define KALEIDOSCOPE_FLATEXPR_H
+
+#include "AST.h"
+
+#include <cstdint>
+#include <vector>
+
+//=========================
+// Flat Expressions
+//=========================
+
+// A compact encoding of an expression tree for passes that want to walk it linearly rather than
+// chase LHS/RHS pointers around the heap. Nodes are stored in postorder across parallel arrays,
+// so every operand precedes its user and the root is the last node.
+//
+// Like tokens, binary operators are encoded as their ASCII character, and everything else is one
+// of these negative opcodes.
+enum FlatOpcode : int8_t {
+  flat_number = -1,   // Operand0: index into Literals
+  flat_variable = -2, // Operand0: the variable's Symbol
+  flat_call = -3,     // Operand0: the callee's Symbol, Operand1: index into CallArgs, which holds
+                      // the argument count followed by the argument node indices
+};
+// For a binary operator, Operand0 and Operand1 are the node indices of the LHS and RHS.
+
+// A finished flat expression. The arrays live in the ASTContext it was built in.
+struct FlatExpr {
+  ArenaArray<int8_t> Opcodes;
+  ArenaArray<uint32_t> Operand0;
+  ArenaArray<uint32_t> Operand1;
+  ArenaArray<double> Literals;
+  ArenaArray<uint32_t> CallArgs;
+
+  uint32_t size() const { return static_cast<uint32_t>(Opcodes.size()); }
+  uint32_t getRoot() const { return size() - 1; }
+
+  /// The argument node indices of the flat_call node at Index.
+  ArenaArray<uint32_t> getCallArgs(uint32_t Index) const {
+    uint32_t at = Operand1[Index];
+    return ArenaArray<uint32_t>(CallArgs.begin() + at + 1, CallArgs[at]);
+  }
+};
+
+// Accumulates a flat expression while the parser builds the matching tree. Appending a node
+// returns its index; the parser relies on the most recently appended node being the root of the
+// subexpression it has just finished.
+class FlatExprBuilder {
+  std::vector<int8_t> Opcodes;
+  std::vector<uint32_t> Operand0;
+  std::vector<uint32_t> Operand1;
+  std::vector<double> Literals;
+  std::vector<uint32_t> CallArgs;
+
+  // The nodes addTree() has reached, and whether their operands have been appended yet; and the
+  // indices of the operands appended that no node has used yet.
+  struct PendingNode {
+    const ExprAST *E;
+    bool OperandsDone;
+  };
+  std::vector<PendingNode> Pending;
+  std::vector<uint32_t> Operands;
+
+  uint32_t append(int8_t Opcode, uint32_t Op0, uint32_t Op1) {
+    Opcodes.push_back(Opcode);
+    Operand0.push_back(Op0);
+    Operand1.push_back(Op1);
+    return getLastIndex();
+  }
+
+public:
+  uint32_t getLastIndex() const { return static_cast<uint32_t>(Opcodes.size()) - 1; }
+
+  uint32_t addNumber(double Val) {
+    Literals.push_back(Val);
+    return append(flat_number, static_cast<uint32_t>(Literals.size()) - 1, 0);
+  }
+
+  uint32_t addVariable(Symbol Name) { return append(flat_variable, Name, 0); }
+
+  uint32_t addBinary(char Op, uint32_t LHS, uint32_t RHS) { return append(Op, LHS, RHS); }
+
+  uint32_t addCall(Symbol Callee, const uint32_t *Args, size_t NumArgs) {
+    uint32_t at = static_cast<uint32_t>(CallArgs.size());
+    CallArgs.push_back(static_cast<uint32_t>(NumArgs));
+    CallArgs.insert(CallArgs.end(), Args, Args + NumArgs);
+    return append(flat_call, Callee, at);
+  }
+
+  /// Append the whole of E in postorder and return the index of its root. Shared subtrees are
+  /// appended once per use, as they would be if the parser had built them incrementally.
+  uint32_t addTree(const ExprAST *E) {
+    // Trees may be far deeper than the native stack, so walk them on a worklist.
+    Pending.push_back({E, false});
+    while (!Pending.empty()) {
+      PendingNode node = Pending.back();
+      Pending.pop_back();
+      switch (node.E->getKind()) {
+      case ExprAST::Expr_Number:
+        Operands.push_back(addNumber(static_cast<const NumberExprAST *>(node.E)->getVal()));
+        break;
+      case ExprAST::Expr_Variable:
+        Operands.push_back(addVariable(static_cast<const VariableExprAST *>(node.E)->getName()));
+        break;
+      case ExprAST::Expr_Binary: {
+        auto B = static_cast<const BinaryExprAST *>(node.E);
+        if (!node.OperandsDone) {
+          Pending.push_back({B, true});
+          Pending.push_back({B->getRHS(), false});
+          Pending.push_back({B->getLHS(), false});
+          break;
+        }
+        uint32_t rhs = Operands.back();
+        Operands.pop_back();
+        Operands.back() = addBinary(B->getOp(), Operands.back(), rhs);
+        break;
+      }
+      case ExprAST::Expr_Call: {
+        auto C = static_cast<const CallExprAST *>(node.E);
+        ArenaArray<ExprAST *> args = C->getArgs();
+        if (!node.OperandsDone) {
+          Pending.push_back({C, true});
+          for (size_t i = args.size(); i > 0; --i) { Pending.push_back({args[i - 1], false}); }
+          break;
+        }
+        size_t args_begin = Operands.size() - args.size();
+        uint32_t call = addCall(C->getCallee(), Operands.data() + args_begin, args.size());
+        Operands.resize(args_begin);
+        Operands.push_back(call);
+        break;
+      }
+      }
+    }
+    uint32_t root = Operands.back();
+    Operands.clear();
+    return root;
+  }
+
+  /// Drop any partially built expression, e.g. one abandoned by a parse error.
+  void clear() {
+    Opcodes.clear();
+    Operand0.clear();
+    Operand1.clear();
+    Literals.clear();
+    CallArgs.clear();
+  }
+
+  /// Copy the expression built so far into Ctx and start a new one.
+  FlatExpr *finish(ASTContext &Ctx) {
+    auto E = Ctx.create<FlatExpr>();
+    E->Opcodes = Ctx.copyArray(Opcodes.data(), Opcodes.size());
+    E->Operand0 = Ctx.copyArray(Operand0.data(), Operand0.size());
+    E->Operand1 = Ctx.copyArray(Operand1.data(), Operand1.size());
+    E->Literals = Ctx.copyArray(Literals.data(), Literals.size());
+    E->CallArgs = Ctx.copyArray(CallArgs.data(), CallArgs.size());
+    clear();
+    return E;
+  }
+};
+
+/// Visit every node of E in storage order, which is postorder, so a visitor always sees a node's
+/// operands before the node itself. VisitorT provides:
+///   visitNumber(uint32_t Index, double Val)
+///   visitVariable(uint32_t Index, Symbol Name)
+///   visitBinary(uint32_t Index, char Op, uint32_t LHS, uint32_t RHS)
+///   visitCall(uint32_t Index, Symbol Callee, ArenaArray<uint32_t> Args)
+template <typename VisitorT>
+void walkFlatExpr(const FlatExpr &E, VisitorT &V) {
+  for (uint32_t i = 0, e = E.size(); i != e; ++i) {
+    switch (E.Opcodes[i]) {
+    case flat_number:
+      V.visitNumber(i, E.Literals[E.Operand0[i]]);
+      break;
+    case flat_variable:
+      V.visitVariable(i, E.Operand0[i]);
+      break;
+    case flat_call:
+      V.visitCall(i, E.Operand0[i], E.getCallArgs(i));
+      break;
+    default:
+      V.visitBinary(i, static_cast<char>(E.Opcodes[i]), E.Operand0[i], E.Operand1[i]);
+      break;
+    }
+  }
+}
+
+#endif // KALEIDOSCOPE_FLATEXPR_H
@@ -0,0 +1,214 @@
+#ifndef KALEIDOSCOPE_FUNCTIONREGISTRY_H
+#define KALEIDOSCOPE_FUNCTIONREGISTRY_H
+
+#include "AST.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//=========================
+// Function Registry
+//=========================
+
+// A table of immutable EntryT, indexed by Symbol, that any number of threads read while others
+// replace entries. Reads take no lock and never wait: an entry is published by storing a pointer
+// to it, and a reader loads that pointer. Writers are serialized among themselves.
+//
+// What a writer replaces is reclaimed in the manner of RCU. Each reader announces, while it is
+// inside a read section, the epoch it entered at; a replaced entry is tagged with the epoch of
+// its replacement, and is only deleted once no reader is left in a section it entered by then. A
+// reader therefore finds each entry it loaded alive until it leaves its section, however many
+// updates happen meanwhile.
+template <typename EntryT> class FunctionRegistry {
+  // The published slots. A full array is replaced by a larger copy rather than grown in place,
+  // so a reader may keep indexing the one it loaded.
+  struct Table {
+    size_t Size;
+    std::unique_ptr<std::atomic<const EntryT *>[]> Slots;
+
+    explicit Table(size_t Size) : Size(Size), Slots(new std::atomic<const EntryT *>[Size]) {
+      for (size_t i = 0; i < Size; ++i) { Slots[i].store(nullptr, std::memory_order_relaxed); }
+    }
+  };
+
+  struct ReaderState {
+    std::atomic<uint64_t> Epoch{0}; // The epoch its section started at, or 0 outside one
+    unsigned Nesting = 0;           // Only touched by the reader's own thread
+  };
+
+  // Something replaced at Epoch, waiting for the readers that may still hold it.
+  struct Retired {
+    uint64_t Epoch;
+    const EntryT *Entry;
+    Table *Slots;
+  };
+
+  std::atomic<Table *> Current;
+  std::atomic<uint64_t> Epoch{1};
+  std::atomic<uint64_t> Generation{0};
+  std::mutex WriterMutex; // Held by writers and by readers (un)registering, never by a read
+  std::vector<std::unique_ptr<ReaderState>> Readers;
+  std::vector<Retired> RetiredList;
+
+  static constexpr size_t InitialSize = 64;
+
+  // Set aside what was replaced, and delete whatever no reader can still hold.
+  void retire(const EntryT *Entry, Table *Slots) {
+    RetiredList.push_back(Retired{Epoch.fetch_add(1), Entry, Slots});
+
+    uint64_t oldest = UINT64_MAX;
+    for (const auto &reader : Readers) {
+      uint64_t epoch = reader->Epoch.load();
+      if (epoch) { oldest = std::min(oldest, epoch); }
+    }
+    auto held = std::partition(RetiredList.begin(), RetiredList.end(),
+                               [oldest](const Retired &R) { return R.Epoch >= oldest; });
+    for (auto it = held; it != RetiredList.end(); ++it) {
+      delete it->Entry;
+      delete it->Slots;
+    }
+    RetiredList.erase(held, RetiredList.end());
+  }
+
+  // Store Entry as Name's, growing the table to hold it if need be, and count a new generation
+  // if it may compute something else than what it replaces. WriterMutex must be held.
+  void publish(Symbol Name, const EntryT *Entry, bool Changed = true) {
+    Table *table = Current.load(std::memory_order_relaxed);
+    if (Name >= table->Size) {
+      auto grown = new Table(std::max<size_t>(2 * table->Size, Name + 1));
+      for (size_t i = 0; i < table->Size; ++i) {
+        grown->Slots[i].store(table->Slots[i].load(std::memory_order_relaxed),
+                              std::memory_order_relaxed);
+      }
+      Current.store(grown);
+      retire(nullptr, table);
+      table = grown;
+    }
+    const EntryT *old = table->Slots[Name].exchange(Entry);
+    if (Changed) { Generation.fetch_add(1, std::memory_order_release); }
+    if (old) { retire(old, nullptr); }
+  }
+
+public:
+  /// A thread's handle for reading the registry, which it must enter a section of (see
+  /// ReadSection) around every read. Each thread needs its own.
+  class Reader {
+    FunctionRegistry &Registry;
+    ReaderState *State;
+
+  public:
+    explicit Reader(FunctionRegistry &Registry) : Registry(Registry) {
+      std::lock_guard<std::mutex> lock(Registry.WriterMutex);
+      Registry.Readers.push_back(std::make_unique<ReaderState>());
+      State = Registry.Readers.back().get();
+    }
+
+    ~Reader() {
+      std::lock_guard<std::mutex> lock(Registry.WriterMutex);
+      auto &readers = Registry.Readers;
+      readers.erase(std::find_if(readers.begin(), readers.end(),
+                                 [this](const auto &R) { return R.get() == State; }));
+    }
+
+    Reader(const Reader &) = delete;
+    Reader &operator=(const Reader &) = delete;
+
+    void enter() {
+      if (State->Nesting++ == 0) {
+        State->Epoch.store(Registry.Epoch.load());
+        // The loads in the section are only acquires, which may otherwise be satisfied before
+        // the store above is visible (store-load reordering); a writer could then replace and
+        // retire an entry, find no reader in a section, and free it under one. With the fence,
+        // either the writer's exchange comes first, and the section loads the replacement, or
+        // the fence does, and the writer's seq_cst scan of the readers sees this epoch.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+
+    void leave() {
+      if (--State->Nesting == 0) { State->Epoch.store(0, std::memory_order_release); }
+    }
+  };
+
+  /// Keeps what Reader loads from the registry alive until the end of the scope. Sections may
+  /// nest.
+  class ReadSection {
+    Reader &R;
+
+  public:
+    explicit ReadSection(Reader &R) : R(R) { R.enter(); }
+    ~ReadSection() { R.leave(); }
+
+    ReadSection(const ReadSection &) = delete;
+    ReadSection &operator=(const ReadSection &) = delete;
+  };
+
+  FunctionRegistry() : Current(new Table(InitialSize)) {}
+
+  /// Every Reader must be gone by now.
+  ~FunctionRegistry() {
+    Table *table = Current.load();
+    for (size_t i = 0; i < table->Size; ++i) { delete table->Slots[i].load(); }
+    delete table;
+    for (const Retired &R : RetiredList) {
+      delete R.Entry;
+      delete R.Slots;
+    }
+  }
+
+  FunctionRegistry(const FunctionRegistry &) = delete;
+  FunctionRegistry &operator=(const FunctionRegistry &) = delete;
+
+  /// The entry for Name, or null if there is none. Only valid inside a read section, until it
+  /// ends.
+  const EntryT *get(Symbol Name) const {
+    const Table *table = Current.load(std::memory_order_acquire);
+    if (Name >= table->Size) { return nullptr; }
+    return table->Slots[Name].load(std::memory_order_acquire);
+  }
+
+  /// One past the highest Symbol that may have an entry.
+  size_t size() const { return Current.load(std::memory_order_acquire)->Size; }
+
+  /// A count that changes whenever an entry is published, for caches of anything derived from
+  /// the entries.
+  uint64_t getGeneration() const { return Generation.load(std::memory_order_acquire); }
+
+  /// Replace the entry for Name with the one Make returns, given the current one (or null), or
+  /// leave it if Make returns null. Make runs while other writers wait, so that it can decide
+  /// from the entry it is replacing. Returns whether the entry was replaced.
+  template <typename MakeFn> bool update(Symbol Name, MakeFn Make) {
+    std::lock_guard<std::mutex> lock(WriterMutex);
+    Table *table = Current.load(std::memory_order_relaxed);
+    const EntryT *old = Name < table->Size ? table->Slots[Name].load() : nullptr;
+    std::unique_ptr<EntryT> replacement = Make(old);
+    if (!replacement) { return false; }
+    publish(Name, replacement.release());
+    return true;
+  }
+
+  /// The same for a replacement that computes exactly what the entry it replaces does, only
+  /// faster: the generation stays as it is, so nothing derived from the old entry is dropped.
+  template <typename MakeFn> bool refine(Symbol Name, MakeFn Make) {
+    std::lock_guard<std::mutex> lock(WriterMutex);
+    Table *table = Current.load(std::memory_order_relaxed);
+    const EntryT *old = Name < table->Size ? table->Slots[Name].load() : nullptr;
+    std::unique_ptr<EntryT> replacement = Make(old);
+    if (!replacement) { return false; }
+    publish(Name, replacement.release(), /*Changed=*/false);
+    return true;
+  }
+
+  /// Replace the entry for Name with Entry (which may be null), whatever it was.
+  void set(Symbol Name, std::unique_ptr<EntryT> Entry) {
+    std::lock_guard<std::mutex> lock(WriterMutex);
+    publish(Name, Entry.release());
+  }
+};
+
+#endif // KALEIDOSCOPE_FUNCTIONREGISTRY_H
@@ -0,0 +1,548 @@
+#ifndef KALEIDOSCOPE_INLINER_H
+#define KALEIDOSCOPE_INLINER_H
+
+#include "AST.h"
+#include "CallGraph.h"
+#include "Simplify.h"
+#include "TopLevelItems.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+//=========================
+// Inlining
+//=========================
+
+// How large a function body may be, in nodes, for calls to it to be inlined by default; see
+// ModuleInliner::setThreshold().
+constexpr unsigned DefaultInlineThreshold = 40;
+
+// Substitutes the bodies of small functions for the calls to them throughout a module that was
+// parsed ahead of time, before it is interpreted or compiled, and can then drop the definitions
+// that nothing is left calling. Items are rewritten in place and in order, so a callee is inlined
+// as already rewritten itself, and a chain of small helpers collapses into its callers.
+//
+// The module must run exactly as it would have: every item keeps its place and its output, and
+// everything evaluates to the same value, to the bit, or fails with the same error. The pass
+// follows the definitions the interpreter would hold at each item, and only inlines a call when
+// the callee it would reach is known:
+//   - the callee's current definition is one the interpreter accepts, and no later one replaces
+//     it before the caller can run (a top-level expression runs at once; a definition may run at
+//     any later point);
+//   - every call left in the callee's body is to a name that the module only ever declares with
+//     one number of arguments;
+//   - the caller itself is accepted, so that no error it would report can be removed.
+// Without conditionals any recursion is unbounded, and ends at the interpreter's call depth
+// limit. Which call reaches the limit depends on how deep every frame on the way is, so nothing
+// is inlined into a function a recursive one can call, nor is a function that can lead to
+// recursion inlined anywhere (see CallGraph).
+//
+// Arguments are evaluated before a call, and an inlined body evaluates them where it uses them
+// instead. That is the same for arguments that make no call, since nothing else can fail. An
+// argument that makes a call must be used exactly once, in order with the other such arguments,
+// and before the body makes any call of its own.
+//
+// Inlining is worthwhile when the body is small (see setThreshold), and when the arguments the
+// body uses more than once are cheap to evaluate again: together those repeats may cost no more
+// than the call they replace.
+class ModuleInliner {
+  // What a call to a name reaches at the current item, as the interpreter's function table would
+  // hold it.
+  struct Slot {
+    PrototypeAST *Prototype = nullptr;
+    FunctionAST *Definition = nullptr; // As rewritten
+    bool Inlinable = false;
+  };
+
+  // A rewritten expression, with its size as a tree (shared nodes count every time they are
+  // reached) and whether it makes a call.
+  struct Rewritten {
+    ExprAST *E;
+    uint32_t Size;
+    bool HasCall;
+  };
+
+  // Evaluating a repeated argument again costs about one node of work per node. A call costs
+  // about as much as this many nodes: the call instruction and its checks, and a new frame.
+  static constexpr uint32_t CallCost = 8;
+
+  ASTContext &Ctx;
+  bool Simplify;
+  ExprSimplifier Simplifier;
+  unsigned Threshold = DefaultInlineThreshold;
+  bool ExpressionsRunLast = false;
+  bool EliminateDead = false;
+  size_t NumInlined = 0;
+  size_t NumEliminated = 0;
+
+  std::vector<Slot> Slots;              // Indexed by Symbol, and sized by run()
+  std::vector<size_t> LastDefinedAt;    // The last item that defines each name, or NotDefined
+  std::vector<uint32_t> Arity;          // The number of arguments each name is declared with
+  std::vector<bool> ArityChanges;       // Set for names declared with more than one
+  std::vector<bool> MayRecurse;         // Names whose calls can reach a recursive function
+  std::vector<bool> RunsInRecursion;    // Names a recursive function can call
+  std::vector<Symbol> KeptCalls;        // Names never inlined
+  std::unordered_map<ExprAST *, Rewritten> Memo; // For the body being rewritten
+  size_t Position = 0;                  // The item being rewritten
+  bool InExpression = false;            // Whether it is a top-level expression
+
+  static constexpr size_t NotDefined = ~size_t(0);
+  static constexpr uint32_t Unknown = ~uint32_t(0);
+
+  static uint32_t addSizes(uint32_t A, uint32_t B) { return A + B < A ? ~uint32_t(0) : A + B; }
+
+  // Which parameter of Params a reference to Name is: later parameters shadow earlier ones with
+  // the same name, as in the interpreter.
+  static size_t findParam(ArenaArray<Symbol> Params, Symbol Name) {
+    for (size_t i = Params.size(); i-- > 0;) {
+      if (Params[i] == Name) { return i; }
+    }
+    return Params.size();
+  }
+
+  void declare(PrototypeAST *Proto) {
+    Symbol name = Proto->getName();
+    uint32_t arity = static_cast<uint32_t>(Proto->getArgs().size());
+    if (Arity[name] == Unknown) {
+      Arity[name] = arity;
+    } else if (Arity[name] != arity) {
+      ArityChanges[name] = true;
+    }
+  }
+
+  // Whether the interpreter would accept Body: every variable is a parameter of Proto, every
+  // operator is one it evaluates, and every call is to a function it knows, with the right number
+  // of arguments.
+  bool isAccepted(const ExprAST *Body, const PrototypeAST *Proto) {
+    std::unordered_set<const ExprAST *> visited;
+    std::vector<const ExprAST *> worklist{Body};
+    while (!worklist.empty()) {
+      const ExprAST *E = worklist.back();
+      worklist.pop_back();
+      if (!visited.insert(E).second) { continue; }
+      switch (E->getKind()) {
+      case ExprAST::Expr_Number:
+        break;
+      case ExprAST::Expr_Variable: {
+        auto Params = Proto->getArgs();
+        if (findParam(Params, static_cast<const VariableExprAST *>(E)->getName()) ==
+            Params.size()) {
+          return false;
+        }
+        break;
+      }
+      case ExprAST::Expr_Binary: {
+        auto B = static_cast<const BinaryExprAST *>(E);
+        char op = B->getOp();
+        if (op != '+' && op != '-' && op != '*' && op != '<') { return false; }
+        worklist.push_back(B->getLHS());
+        worklist.push_back(B->getRHS());
+        break;
+      }
+      case ExprAST::Expr_Call: {
+        auto C = static_cast<const CallExprAST *>(E);
+        const Slot &callee = Slots[C->getCallee()];
+        if (!callee.Prototype || callee.Prototype->getArgs().size() != C->getArgs().size()) {
+          return false;
+        }
+        for (const ExprAST *Arg : C->getArgs()) { worklist.push_back(Arg); }
+        break;
+      }
+      }
+    }
+    return true;
+  }
+
+  // Walk E as a tree, for at most Budget nodes, counting the nodes into Size and the uses of each
+  // of Params into Uses (if given). Returns false if E calls a name whose arity may change.
+  //
+  // This and the walks below keep their pending nodes on a worklist rather than the call stack,
+  // as CallGraph does, since nothing bounds how deep a body is.
+  bool measure(const ExprAST *E, ArenaArray<Symbol> Params, uint32_t *Uses, uint32_t &Size,
+               uint32_t Budget) {
+    std::vector<const ExprAST *> worklist{E};
+    while (!worklist.empty()) {
+      if (++Size > Budget) { return true; }
+      const ExprAST *node = worklist.back();
+      worklist.pop_back();
+      switch (node->getKind()) {
+      case ExprAST::Expr_Number:
+        break;
+      case ExprAST::Expr_Variable: {
+        size_t param = findParam(Params, static_cast<const VariableExprAST *>(node)->getName());
+        if (Uses && param < Params.size()) { ++Uses[param]; }
+        break;
+      }
+      case ExprAST::Expr_Binary: {
+        auto B = static_cast<const BinaryExprAST *>(node);
+        worklist.push_back(B->getRHS());
+        worklist.push_back(B->getLHS());
+        break;
+      }
+      case ExprAST::Expr_Call: {
+        auto C = static_cast<const CallExprAST *>(node);
+        if (ArityChanges[C->getCallee()]) { return false; }
+        auto args = C->getArgs();
+        for (size_t i = args.size(); i-- > 0;) { worklist.push_back(args[i]); }
+        break;
+      }
+      }
+    }
+    return true;
+  }
+
+  // Whether E, the body of a callee with parameters Params, evaluates the arguments among Args
+  // that make calls in order, and before it makes any call itself.
+  static bool keepsCallOrder(const ExprAST *E, ArenaArray<Symbol> Params,
+                             const std::vector<Rewritten> &Args) {
+    size_t last = Params.size(); // The last such argument evaluated so far
+    bool called = false;         // Whether the body has made a call
+    // A null entry is a call, made once the arguments pushed above it are evaluated.
+    std::vector<const ExprAST *> worklist{E};
+    while (!worklist.empty()) {
+      const ExprAST *node = worklist.back();
+      worklist.pop_back();
+      if (!node) {
+        called = true;
+        continue;
+      }
+      switch (node->getKind()) {
+      case ExprAST::Expr_Number:
+        break;
+      case ExprAST::Expr_Variable: {
+        size_t param = findParam(Params, static_cast<const VariableExprAST *>(node)->getName());
+        if (!Args[param].HasCall) { break; }
+        if (called || (last != Params.size() && param <= last)) { return false; }
+        last = param;
+        break;
+      }
+      case ExprAST::Expr_Binary: {
+        auto B = static_cast<const BinaryExprAST *>(node);
+        worklist.push_back(B->getRHS());
+        worklist.push_back(B->getLHS());
+        break;
+      }
+      case ExprAST::Expr_Call: {
+        auto args = static_cast<const CallExprAST *>(node)->getArgs();
+        worklist.push_back(nullptr);
+        for (size_t i = args.size(); i-- > 0;) { worklist.push_back(args[i]); }
+        break;
+      }
+      }
+    }
+    return true;
+  }
+
+  Rewritten makeBinary(char Op, const Rewritten &LHS, const Rewritten &RHS) {
+    ExprAST *E = Simplify ? Simplifier.getBinary(Op, LHS.E, RHS.E)
+                          : Ctx.create<BinaryExprAST>(Op, LHS.E, RHS.E);
+    // Folding may have reduced it to a literal or to one of its operands.
+    if (E == LHS.E) { return LHS; }
+    if (E == RHS.E) { return RHS; }
+    if (E->getKind() == ExprAST::Expr_Number) { return Rewritten{E, 1, false}; }
+    return Rewritten{E, addSizes(1, addSizes(LHS.Size, RHS.Size)), LHS.HasCall || RHS.HasCall};
+  }
+
+  Rewritten makeCall(Symbol Callee, const std::vector<Rewritten> &Args) {
+    std::vector<ExprAST *> args;
+    uint32_t size = 1;
+    for (const Rewritten &Arg : Args) {
+      args.push_back(Arg.E);
+      size = addSizes(size, Arg.Size);
+    }
+    ArenaArray<ExprAST *> arena_args = Ctx.copyArray(args.data(), args.size());
+    ExprAST *E = Simplify ? Simplifier.getCall(Callee, arena_args)
+                          : Ctx.create<CallExprAST>(Callee, arena_args);
+    return Rewritten{E, size, true};
+  }
+
+  // A node whose operands are being rewritten, or whose turn it is once they are.
+  struct PendingNode {
+    ExprAST *E;
+    bool OperandsDone;
+  };
+
+  // Push the operands of the binary or call node E to be rewritten, leftmost on top, after E
+  // itself to be rebuilt from them.
+  static void pushOperands(ExprAST *E, std::vector<PendingNode> &Worklist) {
+    Worklist.push_back(PendingNode{E, true});
+    if (E->getKind() == ExprAST::Expr_Binary) {
+      auto B = static_cast<BinaryExprAST *>(E);
+      Worklist.push_back(PendingNode{B->getRHS(), false});
+      Worklist.push_back(PendingNode{B->getLHS(), false});
+      return;
+    }
+    auto args = static_cast<CallExprAST *>(E)->getArgs();
+    for (size_t i = args.size(); i-- > 0;) { Worklist.push_back(PendingNode{args[i], false}); }
+  }
+
+  // Pop the NumOperands values on top of Values, in order.
+  static std::vector<Rewritten> popOperands(std::vector<Rewritten> &Values, size_t NumOperands) {
+    std::vector<Rewritten> operands(Values.end() - NumOperands, Values.end());
+    Values.resize(Values.size() - NumOperands);
+    return operands;
+  }
+
+  // E, from the body of a callee with parameters Params, with the arguments Args in place of the
+  // parameters.
+  Rewritten substitute(ExprAST *E, ArenaArray<Symbol> Params, const std::vector<Rewritten> &Args) {
+    std::vector<PendingNode> worklist{PendingNode{E, false}};
+    std::vector<Rewritten> values; // The substituted operands of the nodes on the worklist
+    while (!worklist.empty()) {
+      PendingNode node = worklist.back();
+      worklist.pop_back();
+      switch (node.E->getKind()) {
+      case ExprAST::Expr_Number:
+        values.push_back(Rewritten{node.E, 1, false});
+        continue;
+      case ExprAST::Expr_Variable: {
+        Symbol name = static_cast<VariableExprAST *>(node.E)->getName();
+        values.push_back(Args[findParam(Params, name)]);
+        continue;
+      }
+      case ExprAST::Expr_Binary:
+      case ExprAST::Expr_Call:
+        break;
+      }
+      if (!node.OperandsDone) {
+        pushOperands(node.E, worklist);
+        continue;
+      }
+      if (node.E->getKind() == ExprAST::Expr_Binary) {
+        std::vector<Rewritten> operands = popOperands(values, 2);
+        values.push_back(
+            makeBinary(static_cast<BinaryExprAST *>(node.E)->getOp(), operands[0], operands[1]));
+      } else {
+        auto C = static_cast<CallExprAST *>(node.E);
+        values.push_back(makeCall(C->getCallee(), popOperands(values, C->getArgs().size())));
+      }
+    }
+    return values.back();
+  }
+
+  // Inline the call of Callee with Args into Result, if the rules above allow it and the cost
+  // model finds it worthwhile.
+  bool tryInline(Symbol Callee, const std::vector<Rewritten> &Args, Rewritten &Result) {
+    const Slot &slot = Slots[Callee];
+    if (!slot.Inlinable) { return false; }
+    if ((!InExpression || ExpressionsRunLast) && LastDefinedAt[Callee] > Position) {
+      return false;
+    }
+
+    FunctionAST *F = slot.Definition;
+    auto Params = F->getPrototype()->getArgs();
+    std::vector<uint32_t> uses(Params.size());
+    uint32_t size = 0;
+    measure(F->getBody(), Params, uses.data(), size, Threshold);
+
+    uint64_t repeated = 0;
+    for (size_t i = 0; i < Params.size(); ++i) {
+      if (uses[i] != 1 && Args[i].HasCall) { return false; } // It would be dropped or repeated
+      if (uses[i] > 1) { repeated += uint64_t(uses[i] - 1) * Args[i].Size; }
+    }
+    if (repeated > CallCost) { return false; }
+    if (!keepsCallOrder(F->getBody(), Params, Args)) { return false; }
+
+    Result = substitute(F->getBody(), Params, Args);
+    ++NumInlined;
+    return true;
+  }
+
+  Rewritten rewrite(ExprAST *E) {
+    std::vector<PendingNode> worklist{PendingNode{E, false}};
+    std::vector<Rewritten> values; // The rewritten operands of the nodes on the worklist
+    while (!worklist.empty()) {
+      PendingNode node = worklist.back();
+      worklist.pop_back();
+      switch (node.E->getKind()) {
+      case ExprAST::Expr_Number:
+      case ExprAST::Expr_Variable:
+        values.push_back(Rewritten{node.E, 1, false});
+        continue;
+      case ExprAST::Expr_Binary:
+      case ExprAST::Expr_Call:
+        break;
+      }
+      if (!node.OperandsDone) {
+        auto it = Memo.find(node.E);
+        if (it != Memo.end()) {
+          values.push_back(it->second);
+        } else {
+          pushOperands(node.E, worklist);
+        }
+        continue;
+      }
+
+      Rewritten result;
+      if (node.E->getKind() == ExprAST::Expr_Binary) {
+        auto B = static_cast<BinaryExprAST *>(node.E);
+        std::vector<Rewritten> operands = popOperands(values, 2);
+        const Rewritten &lhs = operands[0], &rhs = operands[1];
+        if (lhs.E == B->getLHS() && rhs.E == B->getRHS()) {
+          uint32_t size = addSizes(1, addSizes(lhs.Size, rhs.Size));
+          result = Rewritten{node.E, size, lhs.HasCall || rhs.HasCall};
+        } else {
+          result = makeBinary(B->getOp(), lhs, rhs);
+        }
+      } else {
+        auto C = static_cast<CallExprAST *>(node.E);
+        std::vector<Rewritten> args = popOperands(values, C->getArgs().size());
+        bool changed = false;
+        for (size_t i = 0; i < args.size(); ++i) { changed |= args[i].E != C->getArgs()[i]; }
+        if (!tryInline(C->getCallee(), args, result)) {
+          if (changed) {
+            result = makeCall(C->getCallee(), args);
+          } else {
+            uint32_t size = 1;
+            for (const Rewritten &Arg : args) { size = addSizes(size, Arg.Size); }
+            result = Rewritten{node.E, size, true};
+          }
+        }
+      }
+      Memo.emplace(node.E, result);
+      values.push_back(result);
+    }
+    return values.back();
+  }
+
+  // F with its calls inlined, or F itself if none could be.
+  FunctionAST *rewriteFunction(FunctionAST *F) {
+    Memo.clear();
+    ExprAST *body = rewrite(F->getBody()).E;
+    if (body == F->getBody()) { return F; }
+    return Ctx.create<FunctionAST>(F->getPrototype(), body);
+  }
+
+  // Drop every accepted definition that no call from a top-level expression or a rejected
+  // definition can reach. Rejected definitions are kept, for the errors they report, and so are
+  // the definitions they call, since those decide which error that is.
+  void eliminateDead(std::vector<TopLevelItem> &Items, const std::vector<bool> &Accepted) {
+    CallGraph graph(Items);
+    std::vector<Symbol> roots;
+    for (size_t i = 0; i < Items.size(); ++i) {
+      const TopLevelItem &item = Items[i];
+      if (item.Kind == TopLevelItem::Item_Expression ||
+          (item.Kind == TopLevelItem::Item_Definition && !Accepted[i])) {
+        CallGraph::collectCallees(item.Function->getBody(), roots);
+      }
+    }
+    std::vector<bool> reached = graph.findReachable(roots, Ctx.getNumSymbols());
+
+    size_t kept = 0;
+    for (size_t i = 0; i < Items.size(); ++i) {
+      const TopLevelItem &item = Items[i];
+      if (item.Kind == TopLevelItem::Item_Definition && Accepted[i] &&
+          !reached[item.Function->getPrototype()->getName()]) {
+        ++NumEliminated;
+        continue;
+      }
+      Items[kept++] = item;
+    }
+    Items.resize(kept);
+  }
+
+public:
+  /// Build rewritten expressions in Ctx, which must own Items' nodes or be of the same family
+  /// and outlive them. With Simplify, they are folded and shared as the parser would have.
+  ModuleInliner(ASTContext &Ctx, bool Simplify) : Ctx(Ctx), Simplify(Simplify), Simplifier(Ctx) {}
+
+  /// Only inline functions whose bodies have at most Size nodes; 0 inlines nothing.
+  void setThreshold(unsigned Size) { Threshold = Size; }
+
+  /// Treat top-level expressions as running after every definition, as the multi-file driver
+  /// runs them, rather than where they appear.
+  void setExpressionsRunLast(bool Last) { ExpressionsRunLast = Last; }
+
+  /// Never inline calls to Name, nor functions that call it, since something outside the module
+  /// may replace it, even with a different number of arguments.
+  void keepCallsTo(Symbol Name) { KeptCalls.push_back(Name); }
+
+  /// After inlining, drop the definitions that nothing calls. The module's output then no longer
+  /// reports them as parsed, so this is for modules that are compiled or saved rather than run
+  /// as a session.
+  void setEliminateDead(bool Eliminate) { EliminateDead = Eliminate; }
+
+  /// Rewrite the functions of Items in place.
+  void run(std::vector<TopLevelItem> &Items) {
+    size_t num_symbols = Ctx.getNumSymbols();
+    Slots.assign(num_symbols, Slot());
+    LastDefinedAt.assign(num_symbols, NotDefined);
+    Arity.assign(num_symbols, Unknown);
+    ArityChanges.assign(num_symbols, false);
+
+    // Find which items the interpreter accepts, and the last definition of each name.
+    std::vector<bool> accepted(Items.size());
+    for (size_t i = 0; i < Items.size(); ++i) {
+      TopLevelItem &item = Items[i];
+      if (item.Kind == TopLevelItem::Item_Extern) {
+        Slot &slot = Slots[item.Prototype->getName()];
+        if (!slot.Definition) { slot.Prototype = item.Prototype; }
+        declare(item.Prototype);
+      } else if (item.Kind == TopLevelItem::Item_Definition) {
+        PrototypeAST *Proto = item.Function->getPrototype();
+        Slot &slot = Slots[Proto->getName()];
+        PrototypeAST *previous = slot.Prototype;
+        slot.Prototype = Proto; // The body may call the function itself
+        accepted[i] = isAccepted(item.Function->getBody(), Proto);
+        if (accepted[i]) {
+          slot.Definition = item.Function;
+          LastDefinedAt[Proto->getName()] = i;
+          declare(Proto);
+        } else {
+          slot.Prototype = previous;
+        }
+      } else if (item.Kind == TopLevelItem::Item_Expression) {
+        accepted[i] = isAccepted(item.Function->getBody(), item.Function->getPrototype());
+      }
+    }
+
+    // Rewrite the accepted functions in order, against the definitions current at each.
+    CallGraph graph(Items);
+    std::vector<Symbol> recursive = graph.getRecursiveNames();
+    MayRecurse = graph.findReaching(recursive, num_symbols);
+    RunsInRecursion = graph.findReachable(recursive, num_symbols);
+    std::vector<bool> kept_calls(num_symbols);
+    for (Symbol name : KeptCalls) {
+      kept_calls[name] = true;
+      ArityChanges[name] = true;
+    }
+    Slots.assign(num_symbols, Slot());
+    for (size_t i = 0; i < Items.size(); ++i) {
+      TopLevelItem &item = Items[i];
+      Position = i;
+      InExpression = item.Kind == TopLevelItem::Item_Expression;
+      if (item.Kind == TopLevelItem::Item_Extern) {
+        Slot &slot = Slots[item.Prototype->getName()];
+        if (!slot.Definition) { slot.Prototype = item.Prototype; }
+      } else if (accepted[i] && InExpression) {
+        item.Function = rewriteFunction(item.Function);
+      } else if (accepted[i]) {
+        PrototypeAST *Proto = item.Function->getPrototype();
+        Symbol name = Proto->getName();
+        Slot &slot = Slots[name];
+        slot.Prototype = Proto;
+        slot.Inlinable = false;
+        if (!RunsInRecursion[name]) { item.Function = rewriteFunction(item.Function); }
+        slot.Definition = item.Function;
+
+        uint32_t size = 0;
+        slot.Inlinable =
+            !MayRecurse[name] && !kept_calls[name] &&
+            measure(item.Function->getBody(), Proto->getArgs(), nullptr, size, Threshold) &&
+            size <= Threshold;
+      }
+    }
+    Memo.clear();
+
+    if (EliminateDead) { eliminateDead(Items, accepted); }
+  }
+
+  /// How many calls have been replaced by the callee's body, and how many definitions dropped.
+  size_t getNumInlined() const { return NumInlined; }
+  size_t getNumEliminated() const { return NumEliminated; }
+};
+
+#endif // KALEIDOSCOPE_INLINER_H
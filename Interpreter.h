@@ -0,0 +1,932 @@
+#ifndef KALEIDOSCOPE_INTERPRETER_H
+#define KALEIDOSCOPE_INTERPRETER_H
+
+#include "AST.h"
+#include "Bytecode.h"
+#include "Diagnostics.h"
+#include "FunctionRegistry.h"
+#include "MemoTable.h"
+#include "NativeCode.h"
+#include "Tiering.h"
+#include "VectorKernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+//=========================
+// Interpreter
+//=========================
+
+// Evaluates parsed functions. Definitions are entered into a function table indexed by the
+// Symbol of their prototype's name and lowered to bytecode as they arrive, so calling a function
+// repeatedly never re-walks its tree. A tree-walking evaluator over the same table is kept as a
+// reference, and is what runs one-off top-level expressions.
+//
+// The same bytecode also runs over many rows at once (see callBatch). Each register then holds a
+// column of BatchRows values instead of one, and every instruction is a vector kernel over it.
+// Columns may be float or int64_t rather than double, for the narrower arithmetic callers ask for
+// by passing such columns; the element type is fixed for the whole call, so no instruction ever
+// checks it. Only functions whose constants are all integers (see Function::Integral) run over
+// int64_t, and they compute exactly what they would over doubles as long as no value exceeds
+// 2^53 in magnitude.
+//
+// Function bodies only do arithmetic on their arguments and call other functions, so a call's
+// result depends on nothing but its arguments and the definitions in the table. With
+// setMemoCapacity, each function remembers its results in a MemoTable, which is forgotten as soon
+// as any definition is added or replaced. A remembered result is only used where making the call
+// again would not have run into MaxCallDepth, so memoizing never changes what a program prints.
+//
+// The function table is a FunctionRegistry, which several interpreters may share: each runs on
+// its own thread with its own stacks and memo tables, and looks callees up without locking while
+// any of them adds definitions. A definition is lowered before it is published, and a published
+// function never changes, so each call runs one definition from start to end; the next call finds
+// whichever definition is current by then.
+//
+// With setTierCompiler, calls also count how often each definition's bytecode runs, and one that
+// reaches the compiler's threshold is compiled to native code in the background (see NativeCode).
+// The compiled function then replaces the bytecode one in the function table without counting as
+// a redefinition, since it computes exactly the same, so memo tables are kept; calls already
+// running carry on in bytecode. Batch and tree calls never run compiled code.
+class Interpreter {
+public:
+  /// A built-in function: compute Result from the arguments of a call made by Caller, or report
+  /// why not and return false.
+  using NativeFn = std::function<bool(Interpreter &Caller, const double *Args, double &Result)>;
+
+private:
+  struct Function {
+    PrototypeAST *Prototype = nullptr;
+    FunctionAST *Definition = nullptr; // Null for externs and built-ins
+    std::vector<Instruction> Code;
+    std::vector<double> Constants;
+    uint32_t NumRegisters = 0;
+    bool Integral = true; // Whether every constant is an integer that an int64_t holds
+    NativeFn Native;              // Set for built-ins
+    uint32_t FunctionParams = 0;  // For built-ins, bit i is set if argument i names a function
+    // Calls that ran this lowering's bytecode, shared by the copies of it, and its native code
+    // once it has been compiled.
+    std::shared_ptr<std::atomic<uint64_t>> Calls;
+    std::shared_ptr<const NativeCode> Compiled;
+    std::shared_ptr<const void> Owner; // What Prototype and Definition were allocated in
+  };
+
+public:
+  using Registry = FunctionRegistry<Function>;
+
+private:
+
+  // A function's memo table, and the generation of the function table its results belong to.
+  struct MemoSlot {
+    std::unique_ptr<MemoTable> Table;
+    uint64_t Generation = 0;
+  };
+
+  ASTContext &Ctx;
+  std::shared_ptr<Registry> Functions;
+  Registry::Reader Reading;
+  std::vector<MemoSlot> Memos;     // Indexed by Symbol; empty unless memoizing
+  uint32_t MemoCapacity = 0;       // Results kept per function, or 0 not to memoize
+  MemoCounts RetiredCounts;        // Counts of tables that were replaced
+  unsigned DeepestFrame = 0;       // While memoizing, the deepest frame run since a call began
+  TierCompiler *Tiers = nullptr;   // Where hot functions go to be compiled, if anywhere
+  std::shared_ptr<const void> DefinitionOwner; // Held by every function this publishes
+  std::vector<double> Stack;       // Register frames of active bytecode calls
+  std::vector<double> BatchStack;  // The same for batch calls, BatchRows doubles per register
+  std::vector<float> FloatBatchStack; // The same for batch calls over floats
+  std::vector<int64_t> IntBatchStack; // The same for batch calls over int64_t
+
+  // The operators and calls that evaluateTree() has reached, waiting for their operands. Calls
+  // that walk their callee's tree push its frames above their caller's, and pop back to them
+  // before returning, so one stack serves every depth.
+  struct TreeFrame {
+    ExprAST *E;
+    bool HasLHS = false;         // For a binary operator, whether LHS holds its left operand
+    double LHS = 0;
+    uint32_t FunctionParams = 0; // For a call, which arguments name functions
+    size_t ArgsBegin = 0;        // For a call, where its arguments start among the operands
+    bool Waiting = false;        // For a call, whether its next argument is being evaluated
+  };
+  std::vector<TreeFrame> TreeStack;
+
+  // Rows evaluated per pass of a batch call: enough to amortize dispatch, few enough that a
+  // frame's columns stay in cache.
+  static constexpr size_t BatchRows = 256;
+
+  // Kaleidoscope has no conditionals yet, so any recursion is unbounded; stop it cleanly rather
+  // than overflowing the native stack.
+  static constexpr unsigned MaxCallDepth = 10000;
+
+  // Register allocation state while lowering a body, and the prototype of the function being
+  // lowered, which its body may call before it is published.
+  uint32_t NextRegister = 0;
+  uint32_t MaxRegister = 0;
+  const PrototypeAST *Lowering = nullptr;
+
+  bool error(const char *Str) {
+    reportError(Str);
+    return false;
+  }
+
+  bool error(const char *Str, Symbol Name) {
+    std::string message(Str);
+    message.append(" '").append(Ctx.getSpelling(Name)).append("'");
+    reportError(message);
+    return false;
+  }
+
+  // Make sure a call to Callee, declared by Proto (or nobody), with NumArgs arguments can be
+  // resolved, reporting why not.
+  bool checkCallee(const PrototypeAST *Proto, Symbol Callee, size_t NumArgs) {
+    if (!Proto) { return error("Unknown function referenced", Callee); }
+    if (Proto->getArgs().size() != NumArgs) {
+      return error("Incorrect # arguments passed to", Callee);
+    }
+    return true;
+  }
+
+  // Which arguments of a call to Callee name functions rather than values.
+  uint32_t getFunctionParams(Symbol Callee) const {
+    if (Lowering && Lowering->getName() == Callee) { return 0; }
+    const Function *F = Functions->get(Callee);
+    return F ? F->FunctionParams : 0;
+  }
+
+  static bool isFunctionParam(uint32_t FunctionParams, size_t Index) {
+    return Index < 32 && (FunctionParams >> Index & 1);
+  }
+
+  // The value passed for E as an argument of Callee that names a function: its Symbol.
+  bool getFunctionName(ExprAST *E, Symbol Callee, double &Value) {
+    if (E->getKind() != ExprAST::Expr_Variable) {
+      return error("Expected a function name in call to", Callee);
+    }
+    Value = static_cast<VariableExprAST *>(E)->getName();
+    return true;
+  }
+
+  bool checkCallee(Symbol Callee, size_t NumArgs) {
+    if (Lowering && Lowering->getName() == Callee) {
+      return checkCallee(Lowering, Callee, NumArgs);
+    }
+    const Function *F = Functions->get(Callee);
+    return checkCallee(F ? F->Prototype : nullptr, Callee, NumArgs);
+  }
+
+  // The table of Name's results as of the current definitions, for Arity arguments, and the
+  // generation of the function table it is for.
+  MemoTable &getMemo(Symbol Name, size_t Arity, uint64_t &Generation) {
+    if (Name >= Memos.size()) { Memos.resize(Functions->size()); }
+    MemoSlot &slot = Memos[Name];
+    uint64_t generation = Generation = Functions->getGeneration();
+    if (!slot.Table || slot.Generation != generation) {
+      if (slot.Table && slot.Table->getArity() == Arity) {
+        slot.Table->clear();
+      } else {
+        if (slot.Table) { RetiredCounts.add(slot.Table->getCounts()); }
+        slot.Table = std::make_unique<MemoTable>(Arity, MemoCapacity);
+      }
+      slot.Generation = generation;
+    }
+    return *slot.Table;
+  }
+
+  // Answer a call that would run its body in frame Frame from Memo, if Memo holds the result of
+  // one whose calls stayed within MaxCallDepth from there. Found is where Memo holds the
+  // arguments, if it does, for storeMemo() to replace.
+  bool lookupMemo(MemoTable &Memo, const double *Args, unsigned Frame, double &Result,
+                  MemoTable::Slot &Found) {
+    uint32_t below;
+    if (!Memo.lookup(Args, MaxCallDepth - Frame, Result, below, Found)) { return false; }
+    DeepestFrame = std::max(DeepestFrame, Frame + below);
+    return true;
+  }
+
+  // Remember a result in Memo, unless a definition was published while it was computed: part of
+  // it may then come from a definition that has since been replaced.
+  void storeMemo(MemoTable &Memo, uint64_t Generation, const double *Args, double Result,
+                 uint32_t Depth, MemoTable::Slot Found) {
+    if (Functions->getGeneration() == Generation) { Memo.insert(Args, Result, Depth, Found); }
+  }
+
+  template <typename T> std::vector<T> &getBatchStack() {
+    if constexpr (std::is_same_v<T, double>) {
+      return BatchStack;
+    } else if constexpr (std::is_same_v<T, float>) {
+      return FloatBatchStack;
+    } else {
+      static_assert(std::is_same_v<T, int64_t>, "unsupported column type");
+      return IntBatchStack;
+    }
+  }
+
+  bool notIntegral(const Function &F, Symbol Name) {
+    return error(F.Native ? "No integer version of built-in" : "Non-integer constants in", Name);
+  }
+
+  // Make sure F, and every function it calls as of now, can run over int64_t columns.
+  bool checkIntegral(const Function &F, std::vector<bool> &Visited) {
+    if (!F.Integral) { return notIntegral(F, F.Prototype->getName()); }
+    for (const Instruction &I : F.Code) {
+      if (I.Opcode != op_call) { continue; }
+      if (I.A >= Visited.size()) { Visited.resize(I.A + 1); }
+      if (Visited[I.A]) { continue; }
+      Visited[I.A] = true;
+      const Function *callee = Functions->get(I.A);
+      if (callee && !checkIntegral(*callee, Visited)) { return false; }
+    }
+    return true;
+  }
+
+  uint32_t allocateRegister() {
+    uint32_t reg = NextRegister++;
+    if (NextRegister > MaxRegister) { MaxRegister = NextRegister; }
+    return reg;
+  }
+
+  // An operator or call that lower() has reached, waiting for its operands to be lowered.
+  struct LowerFrame {
+    ExprAST *E;
+    uint32_t Base;                  // The first register free for it to use
+    BytecodeOpcode Opcode = op_add; // For a binary operator, what it lowers to
+    int64_t LHS = -1;               // For a binary operator, the register of its LHS once lowered
+    uint32_t FunctionParams = 0;    // For a call, which arguments name functions
+    size_t NextArg = 0;             // For a call, the argument to place next
+    bool Waiting = false;           // For a call, whether that argument is being lowered
+  };
+
+  // Lower E into F, returning the register that holds its value or -1 on error. Registers at or
+  // above NextRegister on entry are free for E to use. Operators and calls are lowered after
+  // their operands, which are kept on an explicit stack rather than the call stack, as the
+  // parser keeps them, so that how deep E is cannot overflow it.
+  int64_t lower(Function &F, ExprAST *E) {
+    std::vector<LowerFrame> frames;
+    int64_t value = -1; // The register holding the value of the expression lowered last
+    while (true) {
+      // Reach E: leaves are lowered at once, operators and calls wait for their operands.
+      switch (E->getKind()) {
+      case ExprAST::Expr_Number: {
+        uint32_t dst = allocateRegister();
+        double val = static_cast<NumberExprAST *>(E)->getVal();
+        if (!(std::floor(val) == val && std::fabs(val) < 0x1p63)) { F.Integral = false; }
+        F.Constants.push_back(val);
+        F.Code.push_back({op_const, dst, static_cast<uint32_t>(F.Constants.size() - 1), 0});
+        value = dst;
+        break;
+      }
+      case ExprAST::Expr_Variable: {
+        Symbol name = static_cast<VariableExprAST *>(E)->getName();
+        auto Args = F.Prototype->getArgs();
+        // Later parameters shadow earlier ones with the same name.
+        size_t i = Args.size();
+        while (i > 0 && Args[i - 1] != name) { --i; }
+        if (i == 0) {
+          error("Unknown variable name", name);
+          return -1;
+        }
+        value = static_cast<int64_t>(i - 1);
+        break;
+      }
+      case ExprAST::Expr_Binary: {
+        auto B = static_cast<BinaryExprAST *>(E);
+        LowerFrame frame{E, NextRegister};
+        switch (B->getOp()) {
+        case '+': frame.Opcode = op_add; break;
+        case '-': frame.Opcode = op_sub; break;
+        case '*': frame.Opcode = op_mul; break;
+        case '<': frame.Opcode = op_less; break;
+        default:
+          error("invalid binary operator");
+          return -1;
+        }
+        frames.push_back(frame);
+        E = B->getLHS();
+        continue;
+      }
+      case ExprAST::Expr_Call: {
+        auto C = static_cast<CallExprAST *>(E);
+        if (!checkCallee(C->getCallee(), C->getArgs().size())) { return -1; }
+        LowerFrame frame{E, NextRegister};
+        frame.FunctionParams = getFunctionParams(C->getCallee());
+        frames.push_back(frame);
+        break;
+      }
+      }
+
+      // Hand value to the frames waiting for it, popping every one it completes, until one needs
+      // another operand lowered.
+      E = nullptr;
+      while (!E) {
+        if (frames.empty()) { return value; }
+        LowerFrame &top = frames.back();
+        if (top.E->getKind() == ExprAST::Expr_Binary) {
+          if (top.LHS < 0) {
+            top.LHS = value;
+            E = static_cast<BinaryExprAST *>(top.E)->getRHS();
+            break;
+          }
+          // Both operands are dead after this instruction, so the result can reuse their space.
+          NextRegister = top.Base;
+          uint32_t dst = allocateRegister();
+          F.Code.push_back({top.Opcode, dst, static_cast<uint32_t>(top.LHS),
+                            static_cast<uint32_t>(value)});
+          value = dst;
+          frames.pop_back();
+          continue;
+        }
+
+        // Arguments go in consecutive registers, which become the callee's parameter registers.
+        auto C = static_cast<CallExprAST *>(top.E);
+        auto Args = C->getArgs();
+        while (top.NextArg < Args.size()) {
+          uint32_t slot = top.Base + static_cast<uint32_t>(top.NextArg);
+          if (!top.Waiting) {
+            NextRegister = slot;
+            if (!isFunctionParam(top.FunctionParams, top.NextArg)) {
+              top.Waiting = true;
+              E = Args[top.NextArg];
+              break;
+            }
+            double name;
+            if (!getFunctionName(Args[top.NextArg], C->getCallee(), name)) { return -1; }
+            uint32_t dst = allocateRegister();
+            F.Constants.push_back(name);
+            F.Code.push_back({op_const, dst, static_cast<uint32_t>(F.Constants.size() - 1), 0});
+            value = dst;
+          }
+          if (value != slot) { F.Code.push_back({op_move, slot, static_cast<uint32_t>(value), 0}); }
+          NextRegister = slot;
+          allocateRegister();
+          top.Waiting = false;
+          ++top.NextArg;
+        }
+        if (E) { break; }
+
+        NextRegister = top.Base;
+        allocateRegister();
+        F.Code.push_back({op_call, top.Base, C->getCallee(), static_cast<uint32_t>(Args.size())});
+        value = top.Base;
+        frames.pop_back();
+      }
+    }
+  }
+
+  // Count a call that is about to run F's bytecode, and queue F to be compiled once it is hot.
+  void countCall(const Function &F, Symbol Name) {
+    if (F.Calls->fetch_add(1, std::memory_order_relaxed) + 1 == Tiers->getThreshold()) {
+      tierUp(F, Name);
+    }
+  }
+
+  // Queue a copy of F to be compiled, and then published in place of F, unless Name has been
+  // redefined by then. Copies of one lowering share their call count, so that is what tells
+  // whether the definition is still the same. A backend is handed F's definition here, where
+  // its names can be looked up, if F makes no calls.
+  void tierUp(const Function &F, Symbol Name) {
+    auto snapshot = std::make_shared<const Function>(F);
+    std::shared_ptr<Registry> functions = Functions;
+    bool use_backend = static_cast<bool>(Tiers->getBackend());
+    TierCompiler::CodeFn backend_code;
+    if (use_backend && std::none_of(F.Code.begin(), F.Code.end(), [](const Instruction &I) {
+          return I.Opcode == op_call;
+        })) {
+      backend_code = Tiers->getBackend()(Ctx, F.Definition);
+    }
+    Tiers->submit(std::string(Ctx.getSpelling(Name)), Tiers->getThreshold(),
+                  [functions, snapshot, Name, use_backend,
+                   backend_code = std::move(backend_code)](size_t &CodeBytes) {
+      std::shared_ptr<const NativeCode> code;
+      if (!use_backend) {
+        code = NativeCode::compile(snapshot->Code, snapshot->Constants, snapshot->NumRegisters,
+                                   &callFromNative);
+      } else if (backend_code) {
+        code = backend_code();
+      }
+      if (!code) { return TierDecision::Tier_Bytecode; }
+      CodeBytes = code->size();
+      bool swapped = functions->refine(Name, [&](const Function *Old) {
+        std::unique_ptr<Function> compiled;
+        if (Old && Old->Calls == snapshot->Calls && !Old->Compiled) {
+          compiled = std::make_unique<Function>(*Old);
+          compiled->Compiled = code;
+        }
+        return compiled;
+      });
+      return swapped ? TierDecision::Tier_Native : TierDecision::Tier_Superseded;
+    });
+  }
+
+  // How compiled code makes its calls (see NativeCode::CallFn). Nothing may unwind into compiled
+  // code, which has no unwind tables, so whatever the call throws (std::bad_alloc when the stack
+  // cannot grow for the callee, say) is reported as an error here instead, and the compiled
+  // caller fails as it would on any other.
+  static double *callFromNative(void *Self, size_t Base, const Instruction *I, unsigned Depth) {
+    auto interp = static_cast<Interpreter *>(Self);
+    try {
+      if (!interp->callAt(Base, *I, Depth)) { return nullptr; }
+    } catch (const std::bad_alloc &) {
+      interp->error("Out of memory in call to", I->A);
+      return nullptr;
+    } catch (...) {
+      interp->error("Unexpected failure in call to", I->A);
+      return nullptr;
+    }
+    return interp->Stack.data() + Base;
+  }
+
+  // Run F with its registers starting at Stack[Base], through its native code if it has been
+  // compiled.
+  bool execute(const Function &F, size_t Base, double &Result, unsigned Depth) {
+    if (F.Compiled) { return F.Compiled->run(this, Stack.data() + Base, Base, Depth, Result); }
+    return run(F, Base, Result, Depth);
+  }
+
+  // Make the call I from the frame at Stack[Base], of a function running Depth calls deep,
+  // leaving the result in I's destination register. Calls to built-ins and memoized calls take
+  // the longer ways round below.
+  bool callAt(size_t Base, const Instruction &I, unsigned Depth) {
+    // The callee may have been redefined since this call was lowered.
+    const Function *callee = Functions->get(I.A);
+    if (!callee || callee->Prototype->getArgs().size() != I.B) {
+      return error("Incorrect # arguments passed to", I.A);
+    }
+    if (!callee->Definition) { return callBuiltin(*callee, Base + I.Dst, I.A); }
+    if (Depth >= MaxCallDepth) { return error("Maximum call depth exceeded in", I.A); }
+    if (MemoCapacity) { return callMemoized(*callee, Base + I.Dst, I, Depth + 1); }
+
+    // The callee's frame starts at the argument registers, so arguments are never copied.
+    double value;
+    if (!enter(*callee, Base + I.Dst, I.A, value, Depth + 1)) { return false; }
+    Stack[Base + I.Dst] = value;
+    return true;
+  }
+
+  // Run F, named Name, in a frame at Stack[Base] Depth calls deep, counting the call towards
+  // compiling it.
+  bool enter(const Function &F, size_t Base, Symbol Name, double &Result, unsigned Depth) {
+    if (Tiers && !F.Compiled) { countCall(F, Name); }
+    if (Stack.size() < Base + F.NumRegisters) { Stack.resize(2 * (Base + F.NumRegisters)); }
+    return execute(F, Base, Result, Depth);
+  }
+
+  bool callBuiltin(const Function &F, size_t Base, Symbol Name) {
+    if (!F.Native) { return error("No definition for extern", Name); }
+    // Built-ins take their arguments where they are, and are never memoized.
+    double value;
+    if (!F.Native(*this, Stack.data() + Base, value)) { return false; }
+    Stack[Base] = value;
+    return true;
+  }
+
+  // callAt() for F when memoizing, with F's frame at Stack[Base] running in frame Frame.
+  bool callMemoized(const Function &F, size_t Base, const Instruction &I, unsigned Frame) {
+    uint64_t generation = 0;
+    MemoTable &memo = getMemo(I.A, I.B, generation);
+    MemoTable::Slot found;
+    double value;
+    if (lookupMemo(memo, Stack.data() + Base, Frame, value, found)) {
+      Stack[Base] = value;
+      return true;
+    }
+    unsigned outer_deepest = std::max(DeepestFrame, Frame);
+    DeepestFrame = Frame;
+    if (!enter(F, Base, I.A, value, Frame)) { return false; }
+
+    // The callee never writes its parameter registers, so they still hold the arguments.
+    storeMemo(memo, generation, Stack.data() + Base, value, DeepestFrame - Frame, found);
+    DeepestFrame = std::max(outer_deepest, DeepestFrame);
+    Stack[Base] = value;
+    return true;
+  }
+
+  // Run the bytecode of F with its registers starting at Stack[Base].
+  bool run(const Function &F, size_t Base, double &Result, unsigned Depth) {
+    double *regs = Stack.data() + Base;
+    for (const Instruction *ip = F.Code.data();; ++ip) {
+      switch (ip->Opcode) {
+      case op_const: regs[ip->Dst] = F.Constants[ip->A]; break;
+      case op_move: regs[ip->Dst] = regs[ip->A]; break;
+      case op_add: regs[ip->Dst] = regs[ip->A] + regs[ip->B]; break;
+      case op_sub: regs[ip->Dst] = regs[ip->A] - regs[ip->B]; break;
+      case op_mul: regs[ip->Dst] = regs[ip->A] * regs[ip->B]; break;
+      case op_less: regs[ip->Dst] = regs[ip->A] < regs[ip->B] ? 1.0 : 0.0; break;
+      case op_call:
+        if (!callAt(Base, *ip, Depth)) { return false; }
+        // The stack may have grown during the call.
+        regs = Stack.data() + Base;
+        break;
+      case op_ret:
+        Result = regs[ip->A];
+        return true;
+      }
+    }
+  }
+
+  // Call the built-in F once for each of the first Rows rows of the NumArgs columns starting at
+  // Columns, leaving the results in the first.
+  template <typename T>
+  bool callNativeRows(const Function &F, T *Columns, size_t NumArgs, size_t Rows) {
+    std::vector<double> args(NumArgs);
+    for (size_t row = 0; row < Rows; ++row) {
+      for (size_t i = 0; i < NumArgs; ++i) {
+        args[i] = static_cast<double>(Columns[i * BatchRows + row]);
+      }
+      double value;
+      if (!F.Native(*this, args.data(), value)) { return false; }
+      Columns[row] = static_cast<T>(value);
+    }
+    return true;
+  }
+
+  // Run the bytecode of F over the first Rows rows of the columns of T starting at Base in their
+  // batch stack, leaving the result in its register 0.
+  template <typename T> bool runBatch(const Function &F, size_t Base, size_t Rows, unsigned Depth) {
+    std::vector<T> &stack = getBatchStack<T>();
+    for (const Instruction *ip = F.Code.data();; ++ip) {
+      // The stack may grow during a call, so find the frame again for every instruction.
+      T *regs = stack.data() + Base;
+      auto column = [regs](uint32_t Reg) { return regs + Reg * BatchRows; };
+      switch (ip->Opcode) {
+      case op_const:
+        fillColumn(column(ip->Dst), static_cast<T>(F.Constants[ip->A]), Rows);
+        break;
+      case op_move: std::copy_n(column(ip->A), Rows, column(ip->Dst)); break;
+      case op_add: applyColumns<'+'>(column(ip->Dst), column(ip->A), column(ip->B), Rows); break;
+      case op_sub: applyColumns<'-'>(column(ip->Dst), column(ip->A), column(ip->B), Rows); break;
+      case op_mul: applyColumns<'*'>(column(ip->Dst), column(ip->A), column(ip->B), Rows); break;
+      case op_less: applyColumns<'<'>(column(ip->Dst), column(ip->A), column(ip->B), Rows); break;
+      case op_call: {
+        const Function *callee = Functions->get(ip->A);
+        if (!callee || callee->Prototype->getArgs().size() != ip->B) {
+          return error("Incorrect # arguments passed to", ip->A);
+        }
+        // It may have been redefined since the call began.
+        if (std::is_integral_v<T> && !callee->Integral) { return notIntegral(*callee, ip->A); }
+        if (!callee->Definition) {
+          if (!callee->Native) { return error("No definition for extern", ip->A); }
+          if (!callNativeRows(*callee, column(ip->Dst), ip->B, Rows)) { return false; }
+          break;
+        }
+        if (Depth >= MaxCallDepth) { return error("Maximum call depth exceeded in", ip->A); }
+
+        // As in run(), the callee's frame starts at the argument columns, and its register 0 is
+        // the caller's destination.
+        size_t callee_base = Base + ip->Dst * BatchRows;
+        if (stack.size() < callee_base + callee->NumRegisters * BatchRows) {
+          stack.resize(2 * (callee_base + callee->NumRegisters * BatchRows));
+        }
+        if (!runBatch<T>(*callee, callee_base, Rows, Depth + 1)) { return false; }
+        break;
+      }
+      case op_ret:
+        if (ip->A != 0) { std::copy_n(column(ip->A), Rows, regs); }
+        return true;
+      }
+    }
+  }
+
+  // Evaluate E directly from the tree, with Args bound to the parameters of Proto. Calls go
+  // through the tree as well when TreeCalls is set, and through bytecode otherwise. The nodes
+  // waiting for their operands are kept on TreeStack, as lower() keeps them.
+  bool evaluateTree(ExprAST *E, const PrototypeAST *Proto, const double *Args, bool TreeCalls,
+                    double &Result, unsigned Depth) {
+    size_t frames_begin = TreeStack.size();
+    auto fail = [&] {
+      TreeStack.erase(TreeStack.begin() + frames_begin, TreeStack.end());
+      return false;
+    };
+    std::vector<double> operands; // The arguments evaluated so far of the calls on TreeStack
+    double value = 0;             // The value of the expression evaluated last
+    while (true) {
+      // Reach E: leaves are evaluated at once, operators and calls wait for their operands.
+      switch (E->getKind()) {
+      case ExprAST::Expr_Number:
+        value = static_cast<NumberExprAST *>(E)->getVal();
+        break;
+      case ExprAST::Expr_Variable: {
+        Symbol name = static_cast<VariableExprAST *>(E)->getName();
+        auto Params = Proto->getArgs();
+        // Later parameters shadow earlier ones with the same name.
+        size_t i = Params.size();
+        while (i > 0 && Params[i - 1] != name) { --i; }
+        if (i == 0) {
+          error("Unknown variable name", name);
+          return fail();
+        }
+        value = Args[i - 1];
+        break;
+      }
+      case ExprAST::Expr_Binary:
+        TreeStack.push_back(TreeFrame{E});
+        E = static_cast<BinaryExprAST *>(E)->getLHS();
+        continue;
+      case ExprAST::Expr_Call: {
+        auto C = static_cast<CallExprAST *>(E);
+        if (!checkCallee(C->getCallee(), C->getArgs().size())) { return fail(); }
+        TreeFrame frame{E};
+        frame.FunctionParams = getFunctionParams(C->getCallee());
+        frame.ArgsBegin = operands.size();
+        if (operands.empty()) { operands.reserve(8); }
+        TreeStack.push_back(frame);
+        break;
+      }
+      }
+
+      // Hand value to the frames waiting for it, popping every one it completes, until one needs
+      // another operand evaluated.
+      E = nullptr;
+      while (!E) {
+        if (TreeStack.size() == frames_begin) {
+          Result = value;
+          return true;
+        }
+        TreeFrame &top = TreeStack.back();
+        if (top.E->getKind() == ExprAST::Expr_Binary) {
+          auto B = static_cast<BinaryExprAST *>(top.E);
+          if (!top.HasLHS) {
+            top.HasLHS = true;
+            top.LHS = value;
+            E = B->getRHS();
+            break;
+          }
+          double lhs = top.LHS;
+          TreeStack.pop_back();
+          switch (B->getOp()) {
+          case '+': value = lhs + value; break;
+          case '-': value = lhs - value; break;
+          case '*': value = lhs * value; break;
+          case '<': value = lhs < value ? 1.0 : 0.0; break;
+          default:
+            error("invalid binary operator");
+            return fail();
+          }
+          continue;
+        }
+
+        auto C = static_cast<CallExprAST *>(top.E);
+        auto CallArgs = C->getArgs();
+        if (top.Waiting) {
+          operands.push_back(value);
+          top.Waiting = false;
+        }
+        while (operands.size() - top.ArgsBegin < CallArgs.size()) {
+          size_t i = operands.size() - top.ArgsBegin;
+          if (!isFunctionParam(top.FunctionParams, i)) {
+            top.Waiting = true;
+            E = CallArgs[i];
+            break;
+          }
+          double name;
+          if (!getFunctionName(CallArgs[i], C->getCallee(), name)) { return fail(); }
+          operands.push_back(name);
+        }
+        if (E) { break; }
+
+        size_t args_begin = top.ArgsBegin;
+        TreeStack.pop_back();
+        if (!callImpl(C->getCallee(), operands.data() + args_begin, CallArgs.size(), TreeCalls,
+                      value, Depth + 1)) {
+          return fail();
+        }
+        operands.resize(args_begin);
+      }
+    }
+  }
+
+  template <typename T>
+  bool callBatchImpl(Symbol Name, const T *const *Args, size_t NumArgs, size_t NumRows, T *Out) {
+    Registry::ReadSection section(Reading);
+    const Function *callee = Functions->get(Name);
+    if (!checkCallee(callee ? callee->Prototype : nullptr, Name, NumArgs)) { return false; }
+    const Function &F = *callee;
+    if (!F.Definition && !F.Native) { return error("No definition for extern", Name); }
+    if constexpr (std::is_integral_v<T>) {
+      std::vector<bool> visited;
+      if (!checkIntegral(F, visited)) { return false; }
+    }
+
+    std::vector<T> &stack = getBatchStack<T>();
+    if (stack.size() < F.NumRegisters * BatchRows) { stack.resize(F.NumRegisters * BatchRows); }
+    for (size_t row = 0; row < NumRows; row += BatchRows) {
+      size_t rows = std::min(BatchRows, NumRows - row);
+      for (size_t i = 0; i < NumArgs; ++i) {
+        std::copy_n(Args[i] + row, rows, stack.data() + i * BatchRows);
+      }
+      bool ok = F.Native ? callNativeRows(F, stack.data(), NumArgs, rows)
+                         : runBatch<T>(F, 0, rows, 0);
+      if (!ok) { return false; }
+      std::copy_n(stack.data(), rows, Out + row);
+    }
+    return true;
+  }
+
+  // Call Name with NumArgs arguments. The callee is looked up again here, since it may have been
+  // redefined, by another thread, while its arguments were evaluated.
+  bool callImpl(Symbol Name, const double *Args, size_t NumArgs, bool TreeCalls, double &Result,
+                unsigned Depth) {
+    const Function *callee = Functions->get(Name);
+    if (!checkCallee(callee ? callee->Prototype : nullptr, Name, NumArgs)) { return false; }
+    const Function &F = *callee;
+    if (!F.Definition) {
+      if (F.Native) { return F.Native(*this, Args, Result); }
+      return error("No definition for extern", Name);
+    }
+    if (Depth >= MaxCallDepth) { return error("Maximum call depth exceeded in", Name); }
+
+    if (TreeCalls) {
+      return evaluateTree(F.Definition->getBody(), F.Prototype, Args, true, Result, Depth);
+    }
+
+    uint64_t generation = 0;
+    MemoTable *memo = MemoCapacity ? &getMemo(Name, NumArgs, generation) : nullptr;
+    MemoTable::Slot found = MemoTable::NoSlot;
+    if (memo) {
+      if (lookupMemo(*memo, Args, Depth, Result, found)) { return true; }
+      DeepestFrame = Depth;
+    }
+
+    if (Tiers && !F.Compiled) { countCall(F, Name); }
+
+    // Top-level calls start their frame at the bottom of the stack.
+    if (Stack.size() < F.NumRegisters) { Stack.resize(F.NumRegisters); }
+    std::copy(Args, Args + NumArgs, Stack.begin());
+    if (!execute(F, 0, Result, Depth)) { return false; }
+    if (memo) { storeMemo(*memo, generation, Args, Result, DeepestFrame - Depth, found); }
+    return true;
+  }
+
+public:
+  explicit Interpreter(ASTContext &Ctx) : Interpreter(Ctx, std::make_shared<Registry>()) {}
+
+  /// An interpreter whose function table is Functions, which interpreters on other threads may
+  /// share. Ctx must share its symbol table with their contexts.
+  Interpreter(ASTContext &Ctx, std::shared_ptr<Registry> Functions)
+    : Ctx(Ctx), Functions(std::move(Functions)), Reading(*this->Functions), Stack(1024) {}
+
+  /// The function table, to share with interpreters on other threads.
+  const std::shared_ptr<Registry> &getRegistry() const { return Functions; }
+
+  /// Keep Owner alive for as long as the function table holds any definition or extern that this
+  /// interpreter publishes from now on, e.g. the context they were parsed into; or hold nothing
+  /// with null.
+  void setDefinitionOwner(std::shared_ptr<const void> Owner) {
+    DefinitionOwner = std::move(Owner);
+  }
+
+  /// Lower a definition to bytecode and publish it in the function table, replacing any earlier
+  /// one of the same name. Returns false (leaving the table unchanged) on error.
+  bool addFunction(FunctionAST *Definition) {
+    PrototypeAST *Proto = Definition->getPrototype();
+    auto lowered = std::make_unique<Function>();
+    lowered->Prototype = Proto;
+    lowered->Definition = Definition;
+    lowered->Calls = std::make_shared<std::atomic<uint64_t>>(0);
+    lowered->Owner = DefinitionOwner;
+
+    {
+      // The body may call the function itself, which is only published once it is lowered.
+      Registry::ReadSection section(Reading);
+      Lowering = Proto;
+      NextRegister = MaxRegister = static_cast<uint32_t>(Proto->getArgs().size());
+      int64_t result = lower(*lowered, Definition->getBody());
+      Lowering = nullptr;
+      if (result < 0) { return false; }
+      lowered->Code.push_back({op_ret, 0, static_cast<uint32_t>(result), 0});
+      lowered->NumRegisters = MaxRegister;
+    }
+
+    Functions->set(Proto->getName(), std::move(lowered));
+    return true;
+  }
+
+  /// Declare a function that has no body here. An existing definition or built-in of the same
+  /// name is kept.
+  void addExtern(PrototypeAST *Proto) {
+    Functions->update(Proto->getName(), [this, Proto](const Function *Old) {
+      std::unique_ptr<Function> declared;
+      if (!Old || (!Old->Definition && !Old->Native)) {
+        declared = std::make_unique<Function>();
+        declared->Prototype = Proto;
+        declared->Owner = DefinitionOwner;
+      }
+      return declared;
+    });
+  }
+
+  /// Publish a built-in function with the name and parameters of Proto, which Fn computes. Bit i
+  /// of FunctionParams marks argument i as naming a function rather than being a value; calls
+  /// pass that function's Symbol for it. A definition of the same name replaces it, as it would
+  /// any other.
+  void addNative(PrototypeAST *Proto, NativeFn Fn, uint32_t FunctionParams = 0) {
+    auto native = std::make_unique<Function>();
+    native->Prototype = Proto;
+    native->NumRegisters = std::max<uint32_t>(1, static_cast<uint32_t>(Proto->getArgs().size()));
+    native->Integral = false;
+    native->Native = std::move(Fn);
+    native->FunctionParams = FunctionParams;
+    Functions->set(Proto->getName(), std::move(native));
+  }
+
+  /// Move every definition out of Other into this interpreter, replacing any of the same name,
+  /// without lowering them again. Both interpreters' contexts must share one symbol table, and
+  /// they must not share a function table.
+  void takeDefinitions(Interpreter &Other) {
+    Registry::ReadSection section(Other.Reading);
+    for (Symbol name = 0; name < Other.Functions->size(); ++name) {
+      const Function *F = Other.Functions->get(name);
+      if (!F || !F->Definition) { continue; }
+      Functions->set(name, std::make_unique<Function>(*F));
+      Other.Functions->set(name, nullptr);
+    }
+  }
+
+  /// Remember up to Capacity results of each function, and answer calls with arguments it has
+  /// seen from them, or stop memoizing with 0. Only calls that succeed are remembered, so an error
+  /// is reported again each time. Calls through bytecode are memoized; tree and batch calls are
+  /// not.
+  void setMemoCapacity(uint32_t Capacity) {
+    MemoCapacity = Capacity;
+    for (MemoSlot &slot : Memos) {
+      if (slot.Table) { RetiredCounts.add(slot.Table->getCounts()); }
+    }
+    Memos.clear();
+  }
+
+  /// Count the calls that run each function's bytecode, and hand functions to Compiler to be
+  /// compiled once they reach its threshold; or with null, stop. Compiler must outlive this
+  /// interpreter's calls.
+  void setTierCompiler(TierCompiler *Compiler) { Tiers = Compiler; }
+
+  /// Whether the function named Name runs native code, now that the tier compiler has compiled
+  /// it.
+  bool isCompiled(Symbol Name) {
+    Registry::ReadSection section(Reading);
+    const Function *F = Functions->get(Name);
+    return F && F->Compiled;
+  }
+
+  /// The hits, misses and evictions of every memo table so far.
+  MemoCounts getMemoCounts() const {
+    MemoCounts counts = RetiredCounts;
+    for (const MemoSlot &slot : Memos) {
+      if (slot.Table) { counts.add(slot.Table->getCounts()); }
+    }
+    return counts;
+  }
+
+  /// Call the function named Name through its bytecode.
+  bool call(Symbol Name, const double *Args, size_t NumArgs, double &Result) {
+    Registry::ReadSection section(Reading);
+    return callImpl(Name, Args, NumArgs, /*TreeCalls=*/false, Result, 0);
+  }
+
+  /// Call the function named Name once per row: row i takes its arguments from Args[0][i] ...
+  /// Args[NumArgs-1][i] and stores its result in Out[i]. Rows are evaluated in blocks with
+  /// vector kernels, which is far faster than calling it row by row. Returns false on the first
+  /// error, in which case Out is only partly written.
+  bool callBatch(Symbol Name, const double *const *Args, size_t NumArgs, size_t NumRows,
+                 double *Out) {
+    return callBatchImpl(Name, Args, NumArgs, NumRows, Out);
+  }
+
+  /// The same over columns of float, computing in single precision throughout, with twice as
+  /// many rows per vector instruction.
+  bool callBatch(Symbol Name, const float *const *Args, size_t NumArgs, size_t NumRows,
+                 float *Out) {
+    return callBatchImpl(Name, Args, NumArgs, NumRows, Out);
+  }
+
+  /// The same over columns of int64_t, for functions whose constants, and the constants of
+  /// everything they call, are all integers; anything else is rejected before any row runs.
+  /// Rows give the results they would over doubles while every value stays within 2^53 in
+  /// magnitude; beyond that, integers are exact where doubles round, and wrap around past 2^63.
+  bool callBatch(Symbol Name, const int64_t *const *Args, size_t NumArgs, size_t NumRows,
+                 int64_t *Out) {
+    return callBatchImpl(Name, Args, NumArgs, NumRows, Out);
+  }
+
+  /// Call the function named Name by walking its tree, and the trees of everything it calls.
+  bool callTree(Symbol Name, const double *Args, size_t NumArgs, double &Result) {
+    Registry::ReadSection section(Reading);
+    return callImpl(Name, Args, NumArgs, /*TreeCalls=*/true, Result, 0);
+  }
+
+  /// Evaluate an anonymous top-level expression once. Its body is walked directly rather than
+  /// lowered, since it will never run again; the functions it calls run as bytecode.
+  bool evaluate(FunctionAST *TopLevel, double &Result) {
+    Registry::ReadSection section(Reading);
+    return evaluateTree(TopLevel->getBody(), TopLevel->getPrototype(), nullptr,
+                        /*TreeCalls=*/false, Result, 0);
+  }
+};
+
+#endif // KALEIDOSCOPE_INTERPRETER_H
@@ -0,0 +1,349 @@
+#ifndef KALEIDOSCOPE_LEXER_H
+#define KALEIDOSCOPE_LEXER_H
+
+#include "Diagnostics.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//=========================
+// Source Input
+//=========================
+
+// A contiguous range of source text that the lexer scans with a cursor. Files are memory-mapped
+// whole; streams such as stdin are read in large blocks, and whatever the lexer still needs is
+// moved to the front of the buffer before the next block is appended.
+class SourceBuffer {
+  const char *Start = nullptr;
+  const char *End = nullptr;
+  size_t Offset = 0; // Of Start in the input as a whole
+
+  // Backing memory when the source is a mapped file.
+  void *MappedBase = nullptr;
+  size_t MappedSize = 0;
+#ifdef _WIN32
+  HANDLE MappingHandle = nullptr;
+#endif
+
+  // Backing memory when the source is a stream. FD is -1 once the stream is exhausted.
+  int FD = -1;
+  bool OwnsFD = false;
+  std::vector<char> Storage;
+
+  static constexpr size_t BlockSize = 1 << 16;
+
+public:
+  SourceBuffer() = default;
+  SourceBuffer(const SourceBuffer &) = delete;
+  SourceBuffer &operator=(const SourceBuffer &) = delete;
+  ~SourceBuffer();
+
+  /// Map the file at Path into memory. Returns nullptr if it cannot be opened.
+  static std::unique_ptr<SourceBuffer> getFile(const char *Path);
+  /// Read from an already open descriptor (e.g. 0 for stdin) block by block.
+  static std::unique_ptr<SourceBuffer> getStream(int FD, bool OwnsFD = false);
+  /// Lex text that is already in memory. The buffer does not copy Text, which must outlive it.
+  static std::unique_ptr<SourceBuffer> getMemory(std::string_view Text);
+
+  const char *begin() const { return Start; }
+  const char *end() const { return End; }
+  /// How far into the input begin() is: nonzero once a stream has dropped the blocks before it.
+  size_t getOffset() const { return Offset; }
+
+  /// Whether [begin(), end()) is the entire input, rather than the current block of a stream.
+  bool holdsWholeInput() const { return FD < 0 && Storage.empty(); }
+
+  /// Append the next block of a streamed source. Everything from Keep onwards is preserved, and
+  /// Keep and Cursor (which must lie in [Keep, end()]) are moved to the refilled buffer. Returns
+  /// false once there is no more input.
+  bool refill(const char *&Keep, const char *&Cursor);
+};
+
+inline SourceBuffer::~SourceBuffer() {
+#ifdef _WIN32
+  if (MappedBase) { UnmapViewOfFile(MappedBase); }
+  if (MappingHandle) { CloseHandle(MappingHandle); }
+  if (FD >= 0 && OwnsFD) { _close(FD); }
+#else
+  if (MappedBase) { munmap(MappedBase, MappedSize); }
+  if (FD >= 0 && OwnsFD) { close(FD); }
+#endif
+}
+
+inline std::unique_ptr<SourceBuffer> SourceBuffer::getFile(const char *Path) {
+  auto buffer = std::make_unique<SourceBuffer>();
+#ifdef _WIN32
+  HANDLE file = CreateFileA(Path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) { return nullptr; }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    return nullptr;
+  }
+
+  // Empty files cannot be mapped, and there is nothing to lex anyway.
+  if (size.QuadPart > 0) {
+    buffer->MappingHandle = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (buffer->MappingHandle) {
+      buffer->MappedBase = MapViewOfFile(buffer->MappingHandle, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (!buffer->MappedBase) {
+      CloseHandle(file);
+      return nullptr;
+    }
+    buffer->MappedSize = static_cast<size_t>(size.QuadPart);
+  }
+  CloseHandle(file);
+#else
+  int fd = open(Path, O_RDONLY);
+  if (fd < 0) { return nullptr; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return nullptr;
+  }
+
+  // Pipes and character devices report no useful size, so read those as a stream.
+  if (!S_ISREG(st.st_mode)) { return getStream(fd, /*OwnsFD=*/true); }
+
+  // Empty files cannot be mapped, and there is nothing to lex anyway.
+  if (st.st_size > 0) {
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+      close(fd);
+      return nullptr;
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+    buffer->MappedBase = base;
+    buffer->MappedSize = st.st_size;
+  }
+  close(fd);
+#endif
+
+  buffer->Start = static_cast<const char *>(buffer->MappedBase);
+  buffer->End = buffer->Start + buffer->MappedSize;
+  return buffer;
+}
+
+inline std::unique_ptr<SourceBuffer> SourceBuffer::getStream(int FD, bool OwnsFD) {
+  auto buffer = std::make_unique<SourceBuffer>();
+  buffer->FD = FD;
+  buffer->OwnsFD = OwnsFD;
+  return buffer;
+}
+
+inline std::unique_ptr<SourceBuffer> SourceBuffer::getMemory(std::string_view Text) {
+  auto buffer = std::make_unique<SourceBuffer>();
+  buffer->Start = Text.data();
+  buffer->End = Text.data() + Text.size();
+  return buffer;
+}
+
+inline bool SourceBuffer::refill(const char *&Keep, const char *&Cursor) {
+  if (FD < 0) { return false; }
+
+  // Slide the part of the buffer the lexer still needs to the front, then append a block.
+  Offset += Keep - Start;
+  size_t kept = End - Keep;
+  size_t cursor_offset = Cursor - Keep;
+  if (kept > 0 && Keep != Storage.data()) { memmove(Storage.data(), Keep, kept); }
+  if (Storage.size() < kept + BlockSize) { Storage.resize(kept + BlockSize); }
+
+  long bytes_read;
+  do {
+#ifdef _WIN32
+    bytes_read = _read(FD, Storage.data() + kept, static_cast<unsigned>(BlockSize));
+#else
+    bytes_read = read(FD, Storage.data() + kept, BlockSize);
+#endif
+  } while (bytes_read < 0 && errno == EINTR);
+
+  if (bytes_read <= 0) {
+    // End of input (or a read error, which we treat the same way).
+    if (OwnsFD) {
+#ifdef _WIN32
+      _close(FD);
+#else
+      close(FD);
+#endif
+    }
+    FD = -1;
+    bytes_read = 0;
+  }
+
+  Start = Storage.data();
+  End = Start + kept + bytes_read;
+  Keep = Start;
+  Cursor = Start + cursor_offset;
+  return bytes_read > 0;
+}
+
+
+//=========================
+// Lexer
+//=========================
+
+// The lexer returns tokens [0-255] if it is an unknown character, otherwise one
+// of these for known things.
+enum Token {
+  token_eof = -1,        // End of file
+  token_def = -2,        // Define
+  token_extern = -3,     // External function
+  token_identifier = -4, // Keyword
+  token_number = -5,     // Numeric data
+};
+
+/// The location just past Text, which starts at Start.
+inline SourceLocation getLocationAfter(SourceLocation Start, std::string_view Text) {
+  size_t last_newline = Text.rfind('\n');
+  if (last_newline == std::string_view::npos) {
+    Start.Column += static_cast<unsigned>(Text.size());
+    return Start;
+  }
+  Start.Line += static_cast<unsigned>(std::count(Text.begin(), Text.end(), '\n'));
+  Start.Column = static_cast<unsigned>(Text.size() - last_newline);
+  return Start;
+}
+
+// Turns a SourceBuffer into tokens. All lexing state lives in the object, so independent
+// lexers can run on different threads.
+class Lexer {
+  SourceBuffer &Source;
+  const char *Cursor;     // Next character to be lexed
+  const char *TokenStart; // First character of the token being lexed
+
+  // Where the token starts. No token spans a line break, so the line only moves on while
+  // skipping whitespace. Offsets are the source buffer's, and lexing starts at offset 0; when that
+  // is part way along a line, the line's first column is at a negative offset.
+  unsigned Line;
+  ptrdiff_t LineOffset; // Offset in the input of the current line's first column
+
+  ptrdiff_t getOffset(const char *P) const {
+    return static_cast<ptrdiff_t>(Source.getOffset() + (P - Source.begin()));
+  }
+
+  // Token payloads point straight into the source buffer, so they are only valid until the next
+  // call to gettok().
+  std::string_view IdentifierStr; // Filled in if token_identifier
+  double NumVal = 0.0;            // Filled in if token_number
+
+  /// Move the cursor past the run of characters Accept takes, pulling in more input when the
+  /// current block runs out, and return the character after the run without consuming it (EOF at
+  /// the end of the input). Each block is scanned with the position kept in a local, rather than
+  /// stored back for every character. With Drop, TokenStart follows the cursor, so that a stream
+  /// need not keep the run.
+  template <bool Drop, typename AcceptFn> int skipWhile(AcceptFn Accept) {
+    while (true) {
+      const char *p = Cursor, *end = Source.end();
+      while (p != end && Accept(p)) { ++p; }
+      Cursor = p;
+      if (Drop) { TokenStart = p; }
+      if (p != end) { return static_cast<unsigned char>(*p); }
+      if (!Source.refill(TokenStart, Cursor)) { return EOF; }
+    }
+  }
+
+public:
+  /// Lex Source, whose first byte is at Start in the input as a whole.
+  explicit Lexer(SourceBuffer &Source, SourceLocation Start = SourceLocation{1, 1})
+    : Source(Source), Cursor(Source.begin()), TokenStart(Source.begin()), Line(Start.Line),
+      LineOffset(1 - static_cast<ptrdiff_t>(Start.Column)) {}
+
+  std::string_view getIdentifierStr() const { return IdentifierStr; }
+  /// Where the token gettok() last returned starts in the source buffer (its end, for token_eof).
+  const char *getTokenStart() const { return TokenStart; }
+  double getNumVal() const { return NumVal; }
+
+  /// Where the token gettok() last returned starts, as a line and column.
+  SourceLocation getTokenLoc() const {
+    return SourceLocation{Line, static_cast<unsigned>(getOffset(TokenStart) - LineOffset + 1)};
+  }
+
+  /// gettok - Return the next token from the source buffer.
+  int gettok() {
+    // Skip any whitespace, counting the lines it ends.
+    TokenStart = Cursor;
+    int this_char = skipWhile</*Drop=*/true>([this](const char *P) {
+      if (*P == '\n') {
+        ++Line;
+        LineOffset = getOffset(P + 1);
+      }
+      return isspace(static_cast<unsigned char>(*P));
+    });
+
+    if (isalpha(this_char)) { // Regular expression: [a-zA-Z][a-zA-Z0-9]*
+      ++Cursor;
+      skipWhile</*Drop=*/false>(
+          [](const char *P) { return isalnum(static_cast<unsigned char>(*P)); });
+      IdentifierStr = std::string_view(TokenStart, Cursor - TokenStart);
+
+      if (IdentifierStr == "def") {
+        return token_def;
+      } else if (IdentifierStr == "extern") {
+        return token_extern;
+      }
+      // If the identifier is not a keyword, it is a generic identifier.
+      return token_identifier;
+    } else if (isdigit(this_char) || this_char == '.') {   // Regular expression: [0-9.]+
+      ++Cursor;
+      skipWhile</*Drop=*/false>([](const char *P) {
+        return isdigit(static_cast<unsigned char>(*P)) || *P == '.';
+      });
+
+      // Like strtod, take the longest prefix that forms a number ("1.2.3" is 1.2) and treat a
+      // lone "." as zero. Literals that overflow or underflow a double are rare enough to hand
+      // back to strtod, which already knows how to round them.
+      auto result = std::from_chars(TokenStart, Cursor, NumVal);
+      if (result.ec == std::errc::invalid_argument) {
+        NumVal = 0.0;
+      } else if (result.ec == std::errc::result_out_of_range) {
+        NumVal = strtod(std::string(TokenStart, Cursor).c_str(), nullptr);
+      }
+      return token_number;
+    } else if (this_char == '#') {
+      // Comment until end of line.
+      TokenStart = ++Cursor;
+      this_char = skipWhile</*Drop=*/true>([](const char *P) { return *P != '\n' && *P != '\r'; });
+
+      if (this_char != EOF) {
+        return gettok();
+      }
+      // The comment ran to the end of the input; don't step past it.
+      return token_eof;
+    } else if (this_char == EOF) {
+      // Check for end of file.  Don't eat the EOF.
+      return token_eof;
+    }
+
+    // Otherwise, just return the character as its ASCII value.
+    ++Cursor;
+    return this_char;
+  }
+};
+
+#endif // KALEIDOSCOPE_LEXER_H
@@ -0,0 +1,202 @@
+#ifndef KALEIDOSCOPE_MEMOTABLE_H
+#define KALEIDOSCOPE_MEMOTABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+//=========================
+// Memo Tables
+//=========================
+
+// What memo tables found: calls answered from a table, calls that had to run, and results
+// evicted to make room for newer ones.
+struct MemoCounts {
+  uint64_t Hits = 0;
+  uint64_t Misses = 0;
+  uint64_t Evictions = 0;
+
+  void add(const MemoCounts &Other) {
+    Hits += Other.Hits;
+    Misses += Other.Misses;
+    Evictions += Other.Evictions;
+  }
+};
+
+// The results of one function's calls, keyed by the bit patterns of its arguments, so that 0.0
+// and -0.0 are different keys and a NaN argument matches the same NaN. At most Capacity results
+// are kept; once it is full, the least recently used one makes room for the next. Each result
+// also keeps how many levels of calls its call made below itself, so that a caller near a call
+// depth limit can tell whether making the call again would have run into it.
+//
+// Entries live in flat arrays, chained into hash buckets and into a recency list by index, so a
+// lookup allocates nothing and a full table evicts in constant time.
+class MemoTable {
+  static constexpr uint32_t None = ~uint32_t(0);
+
+  size_t Arity;
+  uint32_t Capacity;
+  uint32_t Size = 0;
+  uint32_t Head = None; // Most recently used
+  uint32_t Tail = None; // Least recently used
+  std::vector<uint32_t> Buckets;
+  std::vector<uint64_t> Keys; // Arity bit patterns per entry
+  std::vector<double> Results;
+  std::vector<uint32_t> Depths;
+  std::vector<uint64_t> Hashes;
+  std::vector<uint32_t> ChainNext, Prev, Next;
+  MemoCounts Counts;
+
+  static uint64_t getBits(double Val) {
+    uint64_t bits;
+    memcpy(&bits, &Val, sizeof(bits));
+    return bits;
+  }
+
+  // Arguments that differ only in their high bits, as small integers and simple fractions do,
+  // must still land in different buckets, which are taken from the low bits; so the result is
+  // mixed all the way through at the end.
+  uint64_t hash(const double *Args) const {
+    uint64_t hash = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < Arity; ++i) { hash = (hash ^ getBits(Args[i])) * 0xff51afd7ed558ccdull; }
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+  }
+
+  bool matches(uint32_t Entry, const double *Args) const {
+    const uint64_t *key = Keys.data() + Entry * Arity;
+    for (size_t i = 0; i < Arity; ++i) {
+      if (key[i] != getBits(Args[i])) { return false; }
+    }
+    return true;
+  }
+
+  void unlink(uint32_t Entry) {
+    (Prev[Entry] == None ? Head : Next[Prev[Entry]]) = Next[Entry];
+    (Next[Entry] == None ? Tail : Prev[Next[Entry]]) = Prev[Entry];
+  }
+
+  void pushFront(uint32_t Entry) {
+    Prev[Entry] = None;
+    Next[Entry] = Head;
+    (Head == None ? Tail : Prev[Head]) = Entry;
+    Head = Entry;
+  }
+
+  uint32_t &getBucket(uint64_t Hash) { return Buckets[Hash & (Buckets.size() - 1)]; }
+
+  // The entry holding Args, whose hash is Hash, or None.
+  uint32_t find(uint64_t Hash, const double *Args) const {
+    uint32_t entry = Buckets[Hash & (Buckets.size() - 1)];
+    while (entry != None && (Hashes[entry] != Hash || !matches(entry, Args))) {
+      entry = ChainNext[entry];
+    }
+    return entry;
+  }
+
+public:
+  /// Where a table holds the result for some arguments, as lookup() finds it, or NoSlot.
+  using Slot = uint32_t;
+  static constexpr Slot NoSlot = None;
+
+  /// A table for a function of Arity parameters holding at most Capacity results (at least one).
+  MemoTable(size_t Arity, uint32_t Capacity)
+    : Arity(Arity), Capacity(Capacity ? Capacity : 1) {
+    size_t buckets = 1;
+    while (buckets < 2 * static_cast<size_t>(this->Capacity)) { buckets *= 2; }
+    Buckets.assign(buckets, None);
+  }
+
+  /// Find the result of a call with Args (Arity of them) that went at most MaxDepth levels deep,
+  /// and how deep it went, counting a hit or a miss. Found is set to the slot holding Args even
+  /// when its call went too deep to answer this one, so that insert() can replace that result.
+  bool lookup(const double *Args, uint32_t MaxDepth, double &Result, uint32_t &Depth,
+              Slot &Found) {
+    uint32_t entry = Found = find(hash(Args), Args);
+    if (entry == None || Depths[entry] > MaxDepth) {
+      ++Counts.Misses;
+      return false;
+    }
+    if (entry != Head) {
+      unlink(entry);
+      pushFront(entry);
+    }
+    ++Counts.Hits;
+    Result = Results[entry];
+    Depth = Depths[entry];
+    return true;
+  }
+
+  /// Remember that a call with Args returned Result, making calls Depth levels deep below itself.
+  /// Found is what lookup() found for Args before the call; if the table holds Args, there or
+  /// wherever calls made since have put them, that result is replaced in place. Otherwise the
+  /// least recently used result is evicted if the table is full.
+  void insert(const double *Args, double Result, uint32_t Depth, Slot Found = NoSlot) {
+    uint64_t hash = this->hash(Args);
+    uint32_t held = Found < Size && Hashes[Found] == hash && matches(Found, Args)
+                        ? Found
+                        : find(hash, Args);
+    if (held != None) {
+      Results[held] = Result;
+      Depths[held] = Depth;
+      if (held != Head) {
+        unlink(held);
+        pushFront(held);
+      }
+      return;
+    }
+
+    uint32_t entry;
+    if (Size < Capacity) {
+      entry = Size++;
+      Keys.resize(Keys.size() + Arity);
+      Results.push_back(0.0);
+      Depths.push_back(0);
+      Hashes.push_back(0);
+      ChainNext.push_back(None);
+      Prev.push_back(None);
+      Next.push_back(None);
+    } else {
+      entry = Tail;
+      unlink(entry);
+      uint32_t *link = &getBucket(Hashes[entry]);
+      while (*link != entry) { link = &ChainNext[*link]; }
+      *link = ChainNext[entry];
+      ++Counts.Evictions;
+    }
+
+    uint64_t *key = Keys.data() + entry * Arity;
+    for (size_t i = 0; i < Arity; ++i) { key[i] = getBits(Args[i]); }
+    Results[entry] = Result;
+    Depths[entry] = Depth;
+    Hashes[entry] = hash;
+    uint32_t &bucket = getBucket(hash);
+    ChainNext[entry] = bucket;
+    bucket = entry;
+    pushFront(entry);
+  }
+
+  /// Forget every result, keeping the counts. This takes time in the number of results held, not
+  /// in the capacity.
+  void clear() {
+    for (uint32_t entry = 0; entry < Size; ++entry) { getBucket(Hashes[entry]) = None; }
+    Keys.clear();
+    Results.clear();
+    Depths.clear();
+    Hashes.clear();
+    ChainNext.clear();
+    Prev.clear();
+    Next.clear();
+    Size = 0;
+    Head = Tail = None;
+  }
+
+  size_t getArity() const { return Arity; }
+  size_t size() const { return Size; }
+  const MemoCounts &getCounts() const { return Counts; }
+};
+
+#endif // KALEIDOSCOPE_MEMOTABLE_H
@@ -0,0 +1,262 @@
+#ifndef KALEIDOSCOPE_NATIVECODE_H
+#define KALEIDOSCOPE_NATIVECODE_H
+
+#include "Bytecode.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define KALEIDOSCOPE_NATIVE_TIER 1
+#include <sys/mman.h>
+#endif
+
+//=========================
+// Native Code
+//=========================
+
+// One function's bytecode translated to x86-64 machine code: a short run of SSE2 instructions
+// per bytecode instruction, which computes bit for bit what the bytecode does, without the
+// dispatch. Registers stay in the interpreter's stack, where callees expect their arguments;
+// compiled code only keeps the address of its frame in a machine register.
+//
+// Calls are handed back to the interpreter through a CallFn, which finds and runs the callee as
+// bytecode would (compiled or not), and returns where the caller's frame is afterwards, since the
+// stack may have moved, or null on an error. The instruction it is given is the code's own copy,
+// so it lives as long as the code does. Compiled code has no unwind tables, so nothing may unwind
+// through it: a CallFn must catch whatever its call throws, e.g. std::bad_alloc from growing the
+// interpreter's stack, and report it as an error instead.
+//
+// The code follows the System V calling convention, so it is only generated for x86-64 targets
+// other than Windows; elsewhere compile() always fails, and functions stay in bytecode. Its pages
+// are written first and only then made executable, never both at once.
+//
+// Code compiled by something else, e.g. LLVM (see TierCompiler::setBackend), is wrapped as a
+// NativeCode too. It is a plain function of the arguments, which makes no calls.
+class NativeCode {
+public:
+  /// Make the call I, in the frame at Base of the interpreter Self's stack, from a function
+  /// running Depth calls deep. Returns the frame's address afterwards, or null on an error.
+  using CallFn = double *(*)(void *Self, size_t Base, const Instruction *I, unsigned Depth);
+
+  /// The most arguments that code compiled elsewhere may take.
+  static constexpr unsigned MaxForeignArgs = 6;
+
+private:
+  using EntryFn = bool (*)(void *Self, double *Frame, size_t Base, unsigned Depth,
+                           double *Result);
+
+  // Register operands are addressed as a 32-bit displacement from the frame.
+  static constexpr uint32_t MaxRegister = (1u << 28) - 1;
+
+  std::vector<Instruction> Code;
+  void *Memory = nullptr;
+  size_t Size = 0;
+  void *Foreign = nullptr; // A function of NumForeignArgs doubles, if compiled elsewhere
+  unsigned NumForeignArgs = 0;
+  std::shared_ptr<const void> ForeignOwner;
+
+  explicit NativeCode(const std::vector<Instruction> &Code) : Code(Code) {}
+
+  double runForeign(const double *Args) const {
+    switch (NumForeignArgs) {
+    case 0: return reinterpret_cast<double (*)()>(Foreign)();
+    case 1: return reinterpret_cast<double (*)(double)>(Foreign)(Args[0]);
+    case 2: return reinterpret_cast<double (*)(double, double)>(Foreign)(Args[0], Args[1]);
+    case 3:
+      return reinterpret_cast<double (*)(double, double, double)>(Foreign)(Args[0], Args[1],
+                                                                          Args[2]);
+    case 4:
+      return reinterpret_cast<double (*)(double, double, double, double)>(Foreign)(
+          Args[0], Args[1], Args[2], Args[3]);
+    case 5:
+      return reinterpret_cast<double (*)(double, double, double, double, double)>(Foreign)(
+          Args[0], Args[1], Args[2], Args[3], Args[4]);
+    default:
+      return reinterpret_cast<double (*)(double, double, double, double, double, double)>(
+          Foreign)(Args[0], Args[1], Args[2], Args[3], Args[4], Args[5]);
+    }
+  }
+
+  class Emitter {
+    std::vector<uint8_t> Bytes;
+    std::vector<size_t> Failures; // Where the rel32 of each jump to the failure exit goes
+
+  public:
+    void emit(std::initializer_list<uint8_t> Code) { Bytes.insert(Bytes.end(), Code); }
+
+    void emit32(uint32_t Value) {
+      for (int i = 0; i < 4; ++i) { Bytes.push_back(static_cast<uint8_t>(Value >> 8 * i)); }
+    }
+
+    void emit64(uint64_t Value) {
+      for (int i = 0; i < 8; ++i) { Bytes.push_back(static_cast<uint8_t>(Value >> 8 * i)); }
+    }
+
+    // The scalar double instruction Op between xmm0 and register Reg of the frame at r12: 0x10
+    // loads it, 0x11 stores it, and 0x58, 0x5C and 0x59 add, subtract and multiply by it.
+    void emitFrame(uint8_t Op, uint32_t Reg) {
+      emit({0xF2, 0x41, 0x0F, Op, 0x84, 0x24});
+      emit32(Reg * 8);
+    }
+
+    void emitLoad(uint32_t Reg) { emitFrame(0x10, Reg); }
+    void emitStore(uint32_t Reg) { emitFrame(0x11, Reg); }
+
+    void emitEpilogue() {
+      emit({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3});
+    }
+
+    // jz to the failure exit, which finish() places.
+    void emitJumpIfNull() {
+      emit({0x48, 0x85, 0xC0, 0x0F, 0x84}); // test rax, rax; jz rel32
+      Failures.push_back(Bytes.size());
+      emit32(0);
+    }
+
+    // Emit the failure exit, and resolve the jumps to it.
+    std::vector<uint8_t> finish() {
+      size_t exit = Bytes.size();
+      for (size_t at : Failures) {
+        uint32_t offset = static_cast<uint32_t>(exit - (at + 4));
+        memcpy(&Bytes[at], &offset, sizeof(offset));
+      }
+      emit({0x31, 0xC0}); // xor eax, eax
+      emitEpilogue();
+      return std::move(Bytes);
+    }
+  };
+
+public:
+  /// Translate Code, with Constants, using NumRegisters registers and making its calls through
+  /// Call; or return null if it cannot be, on this target or for this code.
+  static std::unique_ptr<NativeCode> compile(const std::vector<Instruction> &Code,
+                                             const std::vector<double> &Constants,
+                                             uint32_t NumRegisters, CallFn Call) {
+#ifdef KALEIDOSCOPE_NATIVE_TIER
+    if (NumRegisters > MaxRegister) { return nullptr; }
+
+    std::unique_ptr<NativeCode> native(new NativeCode(Code));
+    Emitter out;
+    // Keep the arguments in callee-saved registers: Self in rbx, the frame in r12, its base in
+    // r13, the depth in r14d and where the result goes in r15. Five pushes also leave the stack
+    // aligned for calls.
+    out.emit({0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57});
+    out.emit({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0x49, 0x89, 0xD5, 0x41, 0x89, 0xCE});
+    out.emit({0x4D, 0x89, 0xC7});
+
+    for (const Instruction &I : native->Code) {
+      switch (I.Opcode) {
+      case op_const: {
+        uint64_t bits;
+        memcpy(&bits, &Constants[I.A], sizeof(bits));
+        out.emit({0x48, 0xB8}); // mov rax, imm64
+        out.emit64(bits);
+        out.emit({0x49, 0x89, 0x84, 0x24}); // mov [r12 + disp32], rax
+        out.emit32(I.Dst * 8);
+        break;
+      }
+      case op_move:
+        out.emitLoad(I.A);
+        out.emitStore(I.Dst);
+        break;
+      case op_add:
+      case op_sub:
+      case op_mul:
+        out.emitLoad(I.A);
+        out.emitFrame(I.Opcode == op_add ? 0x58 : I.Opcode == op_sub ? 0x5C : 0x59, I.B);
+        out.emitStore(I.Dst);
+        break;
+      case op_less:
+        // cmpltsd leaves all ones or all zeros, and false for NaN as '<' does; masking 1.0 with
+        // it gives the 1.0 or 0.0 the bytecode stores.
+        out.emitLoad(I.A);
+        out.emit({0xF2, 0x41, 0x0F, 0xC2, 0x84, 0x24});
+        out.emit32(I.B * 8);
+        out.emit({0x01});
+        out.emit({0x48, 0xB8});
+        out.emit64(0x3FF0000000000000ull);
+        out.emit({0x66, 0x48, 0x0F, 0x6E, 0xC8, 0x66, 0x0F, 0x54, 0xC1}); // movq; andpd
+        out.emitStore(I.Dst);
+        break;
+      case op_call:
+        // Call(Self, Base, &I, Depth), then pick up the frame wherever it is now.
+        out.emit({0x48, 0x89, 0xDF, 0x4C, 0x89, 0xEE, 0x48, 0xBA});
+        out.emit64(reinterpret_cast<uintptr_t>(&I));
+        out.emit({0x44, 0x89, 0xF1, 0x48, 0xB8});
+        out.emit64(reinterpret_cast<uintptr_t>(Call));
+        out.emit({0xFF, 0xD0});
+        out.emitJumpIfNull();
+        out.emit({0x49, 0x89, 0xC4}); // mov r12, rax
+        break;
+      case op_ret:
+        out.emitLoad(I.A);
+        out.emit({0xF2, 0x41, 0x0F, 0x11, 0x07}); // movsd [r15], xmm0
+        out.emit({0xB8, 0x01, 0x00, 0x00, 0x00}); // mov eax, 1
+        out.emitEpilogue();
+        break;
+      }
+    }
+
+    std::vector<uint8_t> bytes = out.finish();
+    void *memory = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) { return nullptr; }
+    memcpy(memory, bytes.data(), bytes.size());
+    if (mprotect(memory, bytes.size(), PROT_READ | PROT_EXEC)) {
+      munmap(memory, bytes.size());
+      return nullptr;
+    }
+    native->Memory = memory;
+    native->Size = bytes.size();
+    return native;
+#else
+    (void)Code;
+    (void)Constants;
+    (void)NumRegisters;
+    (void)Call;
+    return nullptr;
+#endif
+  }
+
+  /// Wrap Entry, a function compiled elsewhere that takes NumArgs doubles and returns one
+  /// without making any calls, as long as Owner keeps it alive; or return null if it takes more
+  /// than MaxForeignArgs.
+  static std::unique_ptr<NativeCode> wrap(void *Entry, unsigned NumArgs,
+                                          std::shared_ptr<const void> Owner) {
+    if (NumArgs > MaxForeignArgs) { return nullptr; }
+    std::unique_ptr<NativeCode> native(new NativeCode(std::vector<Instruction>()));
+    native->Foreign = Entry;
+    native->NumForeignArgs = NumArgs;
+    native->ForeignOwner = std::move(Owner);
+    return native;
+  }
+
+  ~NativeCode() {
+#ifdef KALEIDOSCOPE_NATIVE_TIER
+    if (Memory) { munmap(Memory, Size); }
+#endif
+  }
+
+  NativeCode(const NativeCode &) = delete;
+  NativeCode &operator=(const NativeCode &) = delete;
+
+  /// Run the code with its registers at Frame, which is Base in Self's stack, Depth calls deep.
+  /// Returns false if a call failed, having reported why.
+  bool run(void *Self, double *Frame, size_t Base, unsigned Depth, double &Result) const {
+    if (Foreign) {
+      Result = runForeign(Frame);
+      return true;
+    }
+    return reinterpret_cast<EntryFn>(Memory)(Self, Frame, Base, Depth, &Result);
+  }
+
+  /// The size of the machine code in bytes, or 0 if it was compiled elsewhere.
+  size_t size() const { return Size; }
+};
+
+#endif // KALEIDOSCOPE_NATIVECODE_H
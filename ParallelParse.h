@@ -0,0 +1,220 @@
+#ifndef KALEIDOSCOPE_PARALLELPARSE_H
+#define KALEIDOSCOPE_PARALLELPARSE_H
+
+#include "Diagnostics.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include "TopLevelItems.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+//=========================
+// Parallel Parsing
+//=========================
+
+// Parses one large file on several threads. A quick scan picks split points just before a def,
+// extern or top-level ';' near evenly spaced offsets, and each chunk between them is lexed and
+// parsed on a thread pool, into a child context of its own that is adopted by the caller's
+// context afterwards. Errors are captured per item rather than printed, so that the items can be
+// handed back in source order exactly as the serial top-level loop would have produced them. If
+// parsing goes over its memory limit, the items end with the one a serial parse would have
+// stopped in: the chunks are charged in source order, and the one that goes over is parsed again
+// with what the chunks before it took.
+class ParallelParser {
+  struct Chunk {
+    const char *Begin;
+    const char *End;
+    SourceLocation Loc; // Of Begin
+    std::unique_ptr<ASTContext> Ctx;
+    std::vector<TopLevelItem> Items;
+    FrontEndCounts Counts;
+    size_t ArenaBytes = 0; // Taken by its items
+    bool Stopped = false;  // At the memory limit, after its last item
+  };
+
+  ASTContext &Ctx;
+  unsigned NumThreads;
+  bool Simplify;
+  size_t MinChunkBytes;
+  size_t NumChunks = 0;
+  size_t NumReparsed = 0;
+  RunStats *Stats = nullptr;
+  unsigned MaxExpressionDepth = DefaultMaxExpressionDepth;
+  size_t MaxArenaBytes = 0;
+  bool FlatBodies = false;
+  bool Stopped = false;
+
+  /// The start of the first def, extern or ';' token at or after the line following From, or End
+  /// if there is none. No token or comment spans a line break, so lexing can start at any line and
+  /// agree with a lexer that started at the beginning of the input.
+  static const char *findSplit(const char *From, const char *End) {
+    const char *p = From;
+    while (p != End && *p != '\n' && *p != '\r') { ++p; }
+    while (p != End) {
+      unsigned char c = static_cast<unsigned char>(*p);
+      if (isspace(c)) {
+        ++p;
+      } else if (c == '#') {
+        while (p != End && *p != '\n' && *p != '\r') { ++p; }
+      } else if (isalpha(c)) {
+        const char *start = p;
+        do {
+          ++p;
+        } while (p != End && isalnum(static_cast<unsigned char>(*p)));
+        std::string_view word(start, p - start);
+        if (word == "def" || word == "extern") { return start; }
+      } else if (isdigit(c) || c == '.') {
+        do {
+          ++p;
+        } while (p != End && (isdigit(static_cast<unsigned char>(*p)) || *p == '.'));
+      } else if (c == ';') {
+        return p;
+      } else {
+        ++p;
+      }
+    }
+    return End;
+  }
+
+  std::unique_ptr<Chunk> makeChunk(const char *Begin, const char *End, SourceLocation Loc) {
+    auto chunk = std::make_unique<Chunk>();
+    chunk->Begin = Begin;
+    chunk->End = End;
+    chunk->Loc = Loc;
+    chunk->Ctx = std::make_unique<ASTContext>(Ctx);
+    return chunk;
+  }
+
+  // Parse C, as if the chunks before it had taken Used bytes of the memory limit.
+  void parseChunk(Chunk &C, size_t Used = 0) {
+    PhaseTimer timer(Stats, RunStats::Phase_Parse);
+    auto source = SourceBuffer::getMemory(std::string_view(C.Begin, C.End - C.Begin));
+    Lexer lexer(*source, C.Loc);
+    Parser parser(lexer, *C.Ctx);
+    ExprSimplifier simplifier(*C.Ctx);
+    if (Simplify) { parser.setSimplifier(&simplifier); }
+    FlatExprBuilder flat;
+    if (FlatBodies) { parser.setFlatExprBuilder(&flat); }
+    parser.setMaxExpressionDepth(MaxExpressionDepth);
+    parser.setMaxArenaBytes(MaxArenaBytes, Used);
+    DiagnosticCapture capture;
+    if (Stats) { parser.setCounts(&C.Counts); }
+    parser.getNextToken();
+    parseTopLevelItems(parser, C.Items, &capture);
+    C.ArenaBytes = parser.getArenaBytesUsed() - Used;
+    C.Stopped = parser.exceededMaxArenaBytes();
+    C.Counts.Folded = simplifier.getNumFolded();
+    C.Counts.Shared = simplifier.getNumShared();
+  }
+
+  // An item that fails at the end of a chunk may only have failed because the split cut it
+  // short, and a serial parse would have reported the error at the token after the split instead.
+  // Any other chunk ends just where the serial loop would be back at the top level.
+  static bool endsInError(const Chunk &C) {
+    return !C.Items.empty() && C.Items.back().Kind == TopLevelItem::Item_Error;
+  }
+
+public:
+  /// Parse into children of Ctx on NumThreads threads (0 for one per hardware thread), splitting
+  /// the input into chunks of at least MinChunkBytes.
+  ParallelParser(ASTContext &Ctx, unsigned NumThreads, bool Simplify,
+                 size_t MinChunkBytes = 1 << 20)
+    : Ctx(Ctx), NumThreads(NumThreads), Simplify(Simplify),
+      MinChunkBytes(std::max<size_t>(MinChunkBytes, 1)) {}
+
+  /// Parse the whole of Source, which must hold the entire input, and append one item per step of
+  /// the top-level loop to Items, with its errors in Diagnostics. Everything parsed is owned by Ctx
+  /// when this returns.
+  void parse(const SourceBuffer &Source, std::vector<TopLevelItem> &Items) {
+    const char *begin = Source.begin(), *end = Source.end();
+    size_t size = end - begin;
+
+    size_t num_threads = NumThreads;
+    if (num_threads == 0) { num_threads = std::max(1u, std::thread::hardware_concurrency()); }
+    size_t wanted = num_threads > 1 ? std::min(num_threads * 4, size / MinChunkBytes) : 1;
+
+    std::vector<std::unique_ptr<Chunk>> chunks;
+    const char *chunk_begin = begin;
+    SourceLocation chunk_loc{1, 1};
+    for (size_t i = 1; i < wanted; ++i) {
+      const char *target = std::max(begin + size / wanted * i, chunk_begin);
+      const char *split = findSplit(target, end);
+      if (split == end) { break; }
+      if (split == chunk_begin) { continue; }
+      chunks.push_back(makeChunk(chunk_begin, split, chunk_loc));
+      chunk_loc = getLocationAfter(chunk_loc, std::string_view(chunk_begin, split - chunk_begin));
+      chunk_begin = split;
+    }
+    chunks.push_back(makeChunk(chunk_begin, end, chunk_loc));
+    NumChunks += chunks.size();
+
+    if (chunks.size() == 1) {
+      parseChunk(*chunks[0]);
+    } else {
+      ThreadPool pool(static_cast<unsigned>(num_threads));
+      for (auto &chunk : chunks) {
+        Chunk *c = chunk.get();
+        pool.submit([this, c] { parseChunk(*c); });
+      }
+      pool.wait();
+    }
+
+    size_t used = 0; // Of the memory limit, by the chunks kept so far
+    for (size_t i = 0; i < chunks.size(); ++i) {
+      // Parse a chunk that may have been cut short again together with the next one.
+      while (endsInError(*chunks[i]) && !chunks[i]->Stopped && i + 1 < chunks.size()) {
+        auto merged = makeChunk(chunks[i]->Begin, chunks[i + 1]->End, chunks[i]->Loc);
+        parseChunk(*merged);
+        chunks[++i] = std::move(merged);
+        ++NumReparsed;
+      }
+      // A chunk that takes the input over the limit only on top of the chunks before it stops
+      // where a serial parse would once it is parsed counting them.
+      if (MaxArenaBytes && used > 0 && used + chunks[i]->ArenaBytes > MaxArenaBytes) {
+        auto charged = makeChunk(chunks[i]->Begin, chunks[i]->End, chunks[i]->Loc);
+        parseChunk(*charged, used);
+        chunks[i] = std::move(charged);
+      }
+      used += chunks[i]->ArenaBytes;
+      Items.insert(Items.end(), chunks[i]->Items.begin(), chunks[i]->Items.end());
+      Ctx.adopt(*chunks[i]->Ctx);
+      if (Stats) { Stats->addCounts(chunks[i]->Counts); }
+      if (chunks[i]->Stopped) {
+        Stopped = true;
+        break;
+      }
+    }
+  }
+
+  /// Reject expressions nested deeper than Depth, or 0 for no limit.
+  void setMaxExpressionDepth(unsigned Depth) { MaxExpressionDepth = Depth; }
+
+  /// Stop parsing once the items of the input take more than Bytes of arena, or never for 0; see
+  /// Parser::setMaxArenaBytes(). Where it stops does not depend on how the chunks were scheduled.
+  void setMaxArenaBytes(size_t Bytes) { MaxArenaBytes = Bytes; }
+
+  /// Whether parsing stopped at that limit.
+  bool exceededMaxArenaBytes() const { return Stopped; }
+
+  /// Also encode every function body as a FlatExpr; see Parser::setFlatExprBuilder().
+  void setFlatBodies(bool Enable) { FlatBodies = Enable; }
+
+  /// Time each chunk's parse as a span of the parse phase in Stats, on whichever thread parsed
+  /// it, and count what the chunks that were kept consumed and built.
+  void setStats(RunStats *Recorder) { Stats = Recorder; }
+
+  /// How many chunks have been parsed, and how many of those had to be parsed again merged with
+  /// the chunk after them.
+  size_t getNumChunks() const { return NumChunks; }
+  size_t getNumReparsed() const { return NumReparsed; }
+};
+
+#endif // KALEIDOSCOPE_PARALLELPARSE_H
@@ -0,0 +1,529 @@
+#ifndef KALEIDOSCOPE_PARSER_H
+#define KALEIDOSCOPE_PARSER_H
+
+#include "AST.h"
+#include "Diagnostics.h"
+#include "FlatExpr.h"
+#include "Lexer.h"
+#include "Simplify.h"
+#include "Stats.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//=========================
+// Operator Precedence
+//=========================
+
+enum Associativity : uint8_t { Assoc_Left, Assoc_Right };
+
+// The precedence and associativity of every single-character binary operator, indexed directly by
+// token. Higher precedence binds tighter (i.e. like BEDMAS); characters that are not operators
+// have precedence -1, as do the lexer's own negative tokens. The table starts out as the
+// constant StandardOperators and can be extended at runtime, e.g. for user-defined operators.
+class OperatorTable {
+  struct Entry {
+    int16_t Precedence;
+    Associativity Assoc;
+  };
+  std::array<Entry, 256> Entries{};
+
+public:
+  constexpr OperatorTable() {
+    for (Entry &entry : Entries) { entry = Entry{-1, Assoc_Left}; }
+  }
+
+  /// Declare Op a binary operator (or change how it binds). Precedence must be positive.
+  constexpr void define(unsigned char Op, int Precedence, Associativity Assoc = Assoc_Left) {
+    Entries[Op].Precedence = static_cast<int16_t>(Precedence);
+    Entries[Op].Assoc = Assoc;
+  }
+
+  /// The precedence of Token as a binary operator, or -1 if it is not one.
+  constexpr int getPrecedence(int Token) const {
+    return static_cast<unsigned>(Token) < Entries.size() ? Entries[Token].Precedence : -1;
+  }
+
+  constexpr bool isRightAssociative(int Token) const {
+    return static_cast<unsigned>(Token) < Entries.size() && Entries[Token].Assoc == Assoc_Right;
+  }
+};
+
+inline constexpr OperatorTable StandardOperators = [] {
+  OperatorTable table;
+  table.define('<', 100);
+  table.define('+', 200);
+  table.define('-', 200);
+  table.define('*', 300);
+  return table;
+}();
+
+static_assert(StandardOperators.getPrecedence('*') == 300 &&
+                  StandardOperators.getPrecedence('x') == -1 &&
+                  StandardOperators.getPrecedence(token_eof) == -1,
+              "the standard operators are resolved at compile time");
+
+
+//=========================
+// Parser
+//=========================
+
+// How deeply expressions may nest by default; see Parser::setMaxExpressionDepth().
+constexpr unsigned DefaultMaxExpressionDepth = 10000;
+
+// A recursive descent parser over the tokens of one Lexer. Expressions, which machine-generated
+// input can nest arbitrarily deeply, are parsed on an explicit stack instead, so that their depth
+// is bounded by a limit rather than by the thread's stack. Each parser owns its current token and
+// operator table, so separate parsers can run on separate threads. Nodes are allocated in an
+// ASTContext and stay valid for as long as it does.
+class Parser {
+  Lexer &Lex;
+  ASTContext &Ctx;
+  int curr_token = 0;
+
+  // Scratch stacks for call arguments and prototype argument names. Nested calls push above
+  // their callers' entries and pop back before returning, so one stack serves every depth.
+  std::vector<ExprAST *> ArgStack;
+  std::vector<uint32_t> FlatArgStack;
+  std::vector<Symbol> ArgNameStack;
+
+  // When set, every function body is also encoded as a FlatExpr alongside its tree. The parse
+  // functions append to Flat as they build nodes; while folding, it is null, since what folding
+  // leaves is only known once the body is done, and the tree is encoded then instead.
+  FlatExprBuilder *FlatBuilder = nullptr;
+  FlatExprBuilder *Flat = nullptr;
+
+  // When set, expression nodes are built through it, folding and sharing them as they are parsed.
+  ExprSimplifier *Simplify = nullptr;
+
+  // The binary operators this parser knows, starting with the standard ones.
+  OperatorTable Operators = StandardOperators;
+
+  // Expression parsing keeps its pending work here rather than on the call stack, one frame per
+  // bracket, argument list, or operand waiting on operators that bind tighter.
+  struct ExprFrame {
+    enum FrameKind : uint8_t {
+      Frame_Operand, // Parsing operators of at least MinPrecedence onto LHS
+      Frame_Paren,   // Inside '(', waiting for the expression and ')'
+      Frame_Call,    // Inside a call's argument list, waiting for the next argument
+    };
+    FrameKind Kind;
+    int MinPrecedence;
+    bool Nested = false;     // The RHS of Op is being extended by an operand frame above
+    char Op = 0;             // The operator whose RHS is being parsed, once LHS is set
+    int OpPrecedence = 0;
+    uint32_t FlatLHS = 0;    // The flat form's index of LHS
+    ExprAST *LHS = nullptr;
+    unsigned Height = 0;     // How high LHS is as a tree, or the highest argument of a call
+    Symbol Callee = EmptySymbol;
+    size_t ArgsBegin = 0;
+
+    ExprFrame(FrameKind Kind, int MinPrecedence) : Kind(Kind), MinPrecedence(MinPrecedence) {}
+  };
+  std::vector<ExprFrame> ExprStack;
+  unsigned MaxExpressionDepth = DefaultMaxExpressionDepth;
+
+  // When set, every token lexed and node built is counted in it.
+  FrontEndCounts *Counts = nullptr;
+
+  // Parsing stops once the items parsed take more than this, unless it is 0. ArenaBytesUsed is
+  // what the items before the current one took, which ItemStart marks the start of. The names
+  // an item interns are not charged to it: how many of them a context copies depends on which
+  // it has seen before, not on the item.
+  size_t MaxArenaBytes = 0;
+  size_t ArenaBytesUsed = 0;
+  size_t ItemStart = 0;
+  size_t ItemNameBytes = 0;
+  bool InItem = false;
+  bool Stopped = false; // Past MaxArenaBytes: every token from here on is the end of the input
+
+  // Count a node of Kind, which took the arena bytes allocated since Before.
+  void count(FrontEndCounts::NodeKind Kind, size_t Before) {
+    if (Counts) {
+      ++Counts->Nodes[Kind];
+      Counts->NodeBytes[Kind] += Ctx.getBytesAllocated() - Before;
+    }
+  }
+
+  Symbol intern(std::string_view Name) {
+    size_t before = Ctx.getBytesAllocated();
+    Symbol symbol = Ctx.intern(Name);
+    size_t bytes = Ctx.getBytesAllocated() - before;
+    ItemNameBytes += bytes;
+    if (Counts) { Counts->NameBytes += bytes; }
+    return symbol;
+  }
+
+  // Parse one top-level item with Parse, counting the arena bytes it took. An item that parsing
+  // stopped in fails, as the rest of it was never read.
+  template <typename ParseFn> auto parseItem(ParseFn Parse) -> decltype(Parse()) {
+    ItemStart = Ctx.getBytesAllocated();
+    ItemNameBytes = 0;
+    InItem = true;
+    SourceLocation loc = Lex.getTokenLoc();
+    auto result = Parse();
+    size_t bytes = Ctx.getBytesAllocated() - ItemStart;
+    ArenaBytesUsed += bytes - ItemNameBytes;
+    InItem = false;
+    if (Counts) { Counts->addItem(bytes, loc); }
+    return Stopped ? nullptr : result;
+  }
+
+public:
+  Parser(Lexer &Lex, ASTContext &Ctx) : Lex(Lex), Ctx(Ctx) {}
+
+  ASTContext &getContext() const { return Ctx; }
+  int getCurrToken() const { return curr_token; }
+  int getNextToken() {
+    if (MaxArenaBytes && InItem && !Stopped && getArenaBytesUsed() > MaxArenaBytes) {
+      reportError(Lex.getTokenLoc(), "parsing stopped: the AST is over the memory limit of " +
+                                         std::to_string(MaxArenaBytes) + " bytes");
+      Stopped = true;
+    }
+    if (Stopped) { return curr_token = token_eof; }
+    curr_token = Lex.gettok();
+    if (Counts && curr_token != token_eof) {
+      ++Counts->Tokens[FrontEndCounts::getTokenSlot(curr_token)];
+    }
+    return curr_token;
+  }
+
+  /// Also build a FlatExpr for each function body parsed from now on, using Builder as scratch
+  /// space. Pass nullptr to go back to building trees only.
+  void setFlatExprBuilder(FlatExprBuilder *Builder) {
+    FlatBuilder = Builder;
+    Flat = Simplify ? nullptr : FlatBuilder;
+  }
+
+  /// Fold and share expression nodes through Simplifier as they are parsed, which must allocate
+  /// in this parser's context. Pass nullptr to build nodes exactly as written.
+  void setSimplifier(ExprSimplifier *Simplifier) {
+    Simplify = Simplifier;
+    Flat = Simplify ? nullptr : FlatBuilder;
+  }
+
+  /// Parse Op as a binary operator from now on. The parser builds BinaryExprAST nodes for it;
+  /// giving them a meaning is up to whoever consumes the tree.
+  void defineBinaryOperator(char Op, int Precedence, Associativity Assoc = Assoc_Left) {
+    Operators.define(static_cast<unsigned char>(Op), Precedence, Assoc);
+  }
+
+  const OperatorTable &getOperators() const { return Operators; }
+
+  /// How deeply expressions may nest, or 0 for no limit: brackets, argument lists and operands of
+  /// operators that bind tighter than the one before them each take a level. Deeper expressions
+  /// are rejected, and so are expressions whose trees would be higher than that, counting the
+  /// edges from the root to the deepest leaf, as a long chain of operators is.
+  void setMaxExpressionDepth(unsigned Depth) { MaxExpressionDepth = Depth ? Depth : ~0u; }
+
+  /// Count the tokens lexed and the nodes built from now on into Counter, or stop counting with
+  /// nullptr. The simplifier's counts are up to whoever owns it.
+  void setCounts(FrontEndCounts *Counter) { Counts = Counter; }
+
+  /// Stop parsing once the items parsed from now on take more than Bytes of arena for their
+  /// nodes, less Used that earlier parsers of the same input have taken, or never for 0. The item being parsed
+  /// then fails with an error, and the input ends there, so that a runaway input is cut off
+  /// before it takes the process down. Only what the items themselves allocate counts, not what
+  /// the context already held or what others allocate in it between items, so the item parsing
+  /// stops in does not depend on anything but the input.
+  void setMaxArenaBytes(size_t Bytes, size_t Used = 0) {
+    MaxArenaBytes = Bytes;
+    ArenaBytesUsed = Used;
+  }
+
+  /// The arena bytes the items parsed so far have taken, including the one being parsed and the
+  /// bytes passed to setMaxArenaBytes() as used already.
+  size_t getArenaBytesUsed() const {
+    return ArenaBytesUsed + (InItem ? Ctx.getBytesAllocated() - ItemStart - ItemNameBytes : 0);
+  }
+
+  /// Whether parsing stopped at the limit set by setMaxArenaBytes().
+  bool exceededMaxArenaBytes() const { return Stopped; }
+
+  // Wrap a parsed body into a function, attaching its flat form if one was built.
+  FunctionAST *createFunction(PrototypeAST *Prototype, ExprAST *Body) {
+    size_t before = Ctx.getBytesAllocated();
+    auto F = Ctx.create<FunctionAST>(Prototype, Body);
+    if (FlatBuilder) {
+      if (!Flat) { FlatBuilder->addTree(Body); }
+      F->setFlatBody(FlatBuilder->finish(Ctx));
+    }
+    count(FrontEndCounts::Node_Function, before);
+    return F;
+  }
+
+  ExprAST *ParseNumberExpr() {
+    double val = Lex.getNumVal();
+    size_t before = Ctx.getBytesAllocated();
+    auto result = Simplify ? Simplify->getNumber(val) : Ctx.create<NumberExprAST>(val);
+    if (Flat) { Flat->addNumber(val); }
+    count(FrontEndCounts::Node_Number, before);
+    getNextToken(); // Eat the number
+    return result;
+  }
+
+  ExprAST *createVariable(Symbol Name) {
+    if (Flat) { Flat->addVariable(Name); }
+    size_t before = Ctx.getBytesAllocated();
+    auto result = Simplify ? Simplify->getVariable(Name) : Ctx.create<VariableExprAST>(Name);
+    count(FrontEndCounts::Node_Variable, before);
+    return result;
+  }
+
+  // Build a call of Callee on the arguments pushed since ArgsBegin, and pop them.
+  ExprAST *createCall(Symbol Callee, size_t ArgsBegin) {
+    size_t before = Ctx.getBytesAllocated();
+    auto Args = Ctx.copyArray(ArgStack.data() + ArgsBegin, ArgStack.size() - ArgsBegin);
+    ArgStack.resize(ArgsBegin);
+    if (Flat) {
+      Flat->addCall(Callee, FlatArgStack.data() + ArgsBegin, Args.size());
+      FlatArgStack.resize(ArgsBegin);
+    }
+    ExprAST *result = Simplify ? Simplify->getCall(Callee, Args)
+                               : Ctx.create<CallExprAST>(Callee, Args);
+    count(FrontEndCounts::Node_Call, before);
+    return result;
+  }
+
+  // Merge an operand frame's LHS with RHS, the operand of its pending operator, which is
+  // RHSHeight high as a tree. Returns false, building nothing, if the result would be higher
+  // than MaxExpressionDepth.
+  bool mergeOperand(ExprFrame &F, ExprAST *RHS, unsigned RHSHeight) {
+    unsigned height = std::max(F.Height, RHSHeight) + 1;
+    if (height > MaxExpressionDepth) { return false; }
+    if (Flat) { Flat->addBinary(F.Op, F.FlatLHS, Flat->getLastIndex()); }
+    size_t before = Ctx.getBytesAllocated();
+    F.LHS = Simplify ? Simplify->getBinary(F.Op, F.LHS, RHS)
+                     : Ctx.create<BinaryExprAST>(F.Op, F.LHS, RHS);
+    F.Height = height;
+    count(FrontEndCounts::Node_Binary, before);
+    return true;
+  }
+
+  // Report an error at the current token.
+  ExprAST *LogError(const char *Str) {
+    if (Stopped) { return nullptr; } // Only the limit that stopped it is reported
+    reportError(Lex.getTokenLoc(), Str);
+    return nullptr;
+  }
+
+  PrototypeAST *LogErrorP(const char *Str) {
+    LogError(Str);
+    return nullptr;
+  }
+
+  /// Recover from an item that failed to parse: skip to the next ';', def or extern, where the
+  /// next item may start, or the end of the input. A def, extern or ';' cannot appear inside an
+  /// item, so this makes progress whenever the item does not start with one, and one mistake
+  /// costs one error rather than one for every token after it.
+  void skipToNextItem() {
+    while (curr_token != token_eof && curr_token != ';' && curr_token != token_def &&
+           curr_token != token_extern) {
+      getNextToken();
+    }
+  }
+
+  /// Get the precedence of the pending binary operator token.
+  int GetTokenPrecedence() const { return Operators.getPrecedence(curr_token); }
+
+  // Parse function header.
+  PrototypeAST *ParsePrototype() {
+    if (curr_token != token_identifier) { return LogErrorP("Expected function name in prototype"); }
+
+    Symbol func_name = intern(Lex.getIdentifierStr());
+    getNextToken();
+
+    if (curr_token != '(') { return LogErrorP("Expected '(' in prototype"); }
+
+    // Read the list of argument names.
+    ArgNameStack.clear();
+    while (getNextToken() == token_identifier) {
+      ArgNameStack.push_back(intern(Lex.getIdentifierStr()));
+    }
+    if (curr_token != ')') { return LogErrorP("Expected ')' in prototype"); }
+
+    getNextToken();  // Eat ')'
+
+    size_t before = Ctx.getBytesAllocated();
+    auto ArgNames = Ctx.copyArray(ArgNameStack.data(), ArgNameStack.size());
+    auto Proto = Ctx.create<PrototypeAST>(func_name, ArgNames);
+    count(FrontEndCounts::Node_Prototype, before);
+    return Proto;
+  }
+
+  /// Parse an expression: primaries, i.e. numbers, variables, calls and bracketed expressions,
+  /// joined by binary operators.
+  ExprAST *ParseExpression() {
+    size_t frames_begin = ExprStack.size();
+    size_t args_begin = ArgStack.size();
+    unsigned depth = 0;
+    auto fail = [&](const char *Message) {
+      ExprStack.erase(ExprStack.begin() + frames_begin, ExprStack.end());
+      ArgStack.resize(args_begin);
+      if (Flat) { FlatArgStack.resize(args_begin); }
+      return LogError(Message);
+    };
+    auto nest = [&] { return ++depth <= MaxExpressionDepth; };
+    auto too_deep = [&] { return fail("expression is nested too deeply"); };
+
+    ExprStack.push_back(ExprFrame{ExprFrame::Frame_Operand, 0});
+    while (true) {
+      // Parse a primary, unless it opens a nested expression.
+      ExprAST *value;
+      unsigned height = 0; // How high value is as a tree
+      switch (curr_token) {
+      case token_number:
+        value = ParseNumberExpr();
+        break;
+      case token_identifier: {
+        Symbol id_name = intern(Lex.getIdentifierStr());
+        getNextToken(); // Eat identifier
+        if (curr_token != '(') {
+          value = createVariable(id_name);
+          break;
+        }
+        getNextToken(); // Eat '('
+        if (curr_token == ')') {
+          getNextToken(); // Eat ')'
+          value = createCall(id_name, ArgStack.size());
+          break;
+        }
+        if (!nest()) { return too_deep(); }
+        ExprFrame call{ExprFrame::Frame_Call, 0};
+        call.Callee = id_name;
+        call.ArgsBegin = ArgStack.size();
+        ExprStack.push_back(call);
+        ExprStack.push_back(ExprFrame{ExprFrame::Frame_Operand, 0});
+        continue;
+      }
+      case '(':
+        getNextToken(); // Eat '('
+        if (!nest()) { return too_deep(); }
+        ExprStack.push_back(ExprFrame{ExprFrame::Frame_Paren, 0});
+        ExprStack.push_back(ExprFrame{ExprFrame::Frame_Operand, 0});
+        continue;
+      default:
+        return fail("Unknown token when expecting an expression");
+      }
+
+      // Hand the value to the frames waiting for it, popping every frame it completes, until one
+      // needs another primary.
+      while (true) {
+        ExprFrame &F = ExprStack.back();
+        if (F.Kind == ExprFrame::Frame_Paren) {
+          if (curr_token != ')') { return fail("expected ')'"); }
+          getNextToken(); // Eat ')'
+          ExprStack.pop_back();
+          --depth;
+          continue;
+        }
+        if (F.Kind == ExprFrame::Frame_Call) {
+          ArgStack.push_back(value);
+          if (Flat) { FlatArgStack.push_back(Flat->getLastIndex()); }
+          F.Height = std::max(F.Height, height);
+          if (curr_token == ')') {
+            height = F.Height + 1;
+            if (height > MaxExpressionDepth) { return too_deep(); }
+            getNextToken(); // Eat ')'
+            value = createCall(F.Callee, F.ArgsBegin);
+            ExprStack.pop_back();
+            --depth;
+            continue;
+          }
+          if (curr_token != ',') { return fail("Expected ')' or ',' in argument list"); }
+          getNextToken(); // Eat ','
+          ExprStack.push_back(ExprFrame{ExprFrame::Frame_Operand, 0});
+          break;
+        }
+
+        // An operand frame: value is its LHS, the RHS of its operator, or that RHS extended by
+        // the operators after it that bind tighter.
+        if (!F.LHS) {
+          F.LHS = value;
+          F.Height = height;
+        } else if (!F.Nested) {
+          // If the next operator binds tighter, let it take RHS as its LHS. A right associative
+          // operator also hands RHS on to another operator of the same precedence.
+          int next_precedence = GetTokenPrecedence();
+          bool right_assoc = Operators.isRightAssociative(F.Op);
+          if (F.OpPrecedence < next_precedence ||
+              (right_assoc && F.OpPrecedence == next_precedence)) {
+            if (!nest()) { return too_deep(); }
+            F.Nested = true;
+            ExprFrame inner{ExprFrame::Frame_Operand,
+                            right_assoc ? F.OpPrecedence : F.OpPrecedence + 1};
+            inner.LHS = value;
+            inner.Height = height;
+            ExprStack.push_back(inner);
+          } else if (!mergeOperand(F, value, height)) {
+            return too_deep();
+          }
+        } else {
+          F.Nested = false;
+          --depth;
+          if (!mergeOperand(F, value, height)) { return too_deep(); }
+        }
+
+        // Take the next operator if it binds at least as tightly as this frame's operators,
+        // otherwise LHS is all this frame parses.
+        ExprFrame &top = ExprStack.back();
+        int token_precedence = GetTokenPrecedence();
+        if (token_precedence < top.MinPrecedence) {
+          value = top.LHS;
+          height = top.Height;
+          ExprStack.pop_back();
+          if (ExprStack.size() == frames_begin) { return value; }
+          continue;
+        }
+        top.Op = static_cast<char>(curr_token);
+        top.OpPrecedence = token_precedence;
+        getNextToken(); // Eat binary operator
+        // The flat form's most recent node is the root of LHS until RHS is parsed.
+        top.FlatLHS = Flat ? Flat->getLastIndex() : 0;
+        break;
+      }
+    }
+  }
+
+  // Parse function definition.
+  FunctionAST *ParseDefinition() {
+    return parseItem([this]() -> FunctionAST * {
+      getNextToken();  // Eat 'def'
+      auto Prototype = ParsePrototype();
+      if (!Prototype) { return nullptr; }
+
+      if (Flat) { Flat->clear(); }
+      if (auto E = ParseExpression())
+        return createFunction(Prototype, E);
+      return nullptr;
+    });
+  }
+
+  PrototypeAST *ParseExtern() {
+    return parseItem([this] {
+      getNextToken();  // Eat 'extern'
+      return ParsePrototype();
+    });
+  }
+
+  FunctionAST *ParseTopLevelExpr() {
+    return parseItem([this]() -> FunctionAST * {
+      if (Flat) { Flat->clear(); }
+      if (auto E = ParseExpression()) {
+        // Make an anonymous prototype.
+        size_t before = Ctx.getBytesAllocated();
+        auto Prototype = Ctx.create<PrototypeAST>(EmptySymbol, ArenaArray<Symbol>());
+        count(FrontEndCounts::Node_Prototype, before);
+        return createFunction(Prototype, E);
+      }
+      return nullptr;
+    });
+  }
+};
+
+#endif // KALEIDOSCOPE_PARSER_H
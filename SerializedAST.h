@@ -0,0 +1,414 @@
+#ifndef KALEIDOSCOPE_SERIALIZEDAST_H
+#define KALEIDOSCOPE_SERIALIZEDAST_H
+
+#include "AST.h"
+#include "Diagnostics.h"
+#include "FlatExpr.h"
+#include "Lexer.h"
+#include "StructuralHash.h"
+#include "TopLevelItems.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+//=========================
+// Serialized ASTs
+//=========================
+
+// A binary encoding of a module's top-level items that is read in place from a mapped file. Each
+// function body is stored as its FlatExpr arrays, so a loaded module hands out FlatExprs that
+// point straight into the mapping, and names are indices into a string table rather than Symbols
+// of some ASTContext. Every reference is an offset from the start of the file, and every array is
+// aligned for its element type.
+//
+// The layout is the host's: a file written on a machine of the other byte order is rejected
+// rather than converted.
+//
+// A ';' step of the top-level loop is kept as an item with no name, arguments or body, so that a
+// loaded module replays exactly like the source it was written from.
+//
+//   SerializedASTHeader
+//   for each item: uint32_t Args[NumArgs], padding, then its body:
+//     double Literals[NumLiterals]
+//     uint32_t Operand0[NumNodes], Operand1[NumNodes], CallArgs[NumCallArgs]
+//     int8_t Opcodes[NumNodes]
+//   SerializedASTItem Items[NumItems]
+//   uint32_t StringOffsets[NumStrings + 1], then the string bytes
+
+constexpr char SerializedASTMagic[8] = {'K', 'A', 'L', 'A', 'S', 'T', '\r', '\n'};
+constexpr uint32_t SerializedASTVersion = 1;
+constexpr uint32_t SerializedASTByteOrder = 0x01020304;
+
+struct SerializedASTHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t ByteOrder;
+  uint64_t FileSize;
+  uint64_t Checksum; // hashBytes() of everything after the header
+  uint32_t NumStrings;
+  uint32_t NumItems;
+  uint64_t ItemsAt;
+  uint64_t StringOffsetsAt;
+  uint64_t StringDataAt; // StringOffsets are relative to this
+};
+
+struct SerializedASTItem {
+  uint32_t Kind; // A TopLevelItem::ItemKind: a definition, extern, expression or ';'
+  uint32_t Name; // String index; 0 is the empty name of a top-level expression
+  uint32_t NumArgs;
+  uint32_t NumNodes; // 0 for an extern
+  uint32_t NumLiterals;
+  uint32_t NumCallArgs;
+  uint64_t ArgsAt;
+  uint64_t BodyAt;
+};
+
+static_assert(sizeof(SerializedASTHeader) == 64 && sizeof(SerializedASTItem) == 40,
+              "the on-disk layout must not depend on the compiler's padding");
+
+/// Encode every item but the errors among Items, which were parsed into
+/// Ctx (or one of its family), as a serialized AST in Out.
+inline void serializeAST(const ASTContext &Ctx, const std::vector<TopLevelItem> &Items,
+                         std::string &Out) {
+  std::unordered_map<Symbol, uint32_t> string_indices;
+  std::vector<std::string_view> strings;
+  auto getString = [&](Symbol S) {
+    auto [it, inserted] = string_indices.emplace(S, static_cast<uint32_t>(strings.size()));
+    if (inserted) { strings.push_back(Ctx.getSpelling(S)); }
+    return it->second;
+  };
+  getString(EmptySymbol);
+
+  auto align = [&] { Out.resize((Out.size() + 7) & ~size_t(7), '\0'); };
+  auto append = [&](const void *Data, size_t Size) {
+    Out.append(static_cast<const char *>(Data), Size);
+  };
+
+  Out.assign(sizeof(SerializedASTHeader), '\0');
+  std::vector<SerializedASTItem> table;
+  std::vector<uint32_t> scratch;
+  FlatExprBuilder builder;
+  ASTContext flat_context;
+  for (const TopLevelItem &item : Items) {
+    if (item.Kind == TopLevelItem::Item_Error) { continue; }
+    SerializedASTItem entry = {};
+    entry.Kind = item.Kind;
+    if (item.Kind == TopLevelItem::Item_Semicolon) {
+      table.push_back(entry);
+      continue;
+    }
+
+    PrototypeAST *Proto = item.Function ? item.Function->getPrototype() : item.Prototype;
+
+    entry.Name = getString(Proto->getName());
+    entry.NumArgs = static_cast<uint32_t>(Proto->getArgs().size());
+    scratch.clear();
+    for (Symbol Arg : Proto->getArgs()) { scratch.push_back(getString(Arg)); }
+    align();
+    entry.ArgsAt = Out.size();
+    append(scratch.data(), scratch.size() * sizeof(uint32_t));
+
+    if (item.Function) {
+      const FlatExpr *body = item.Function->getFlatBody();
+      if (!body) {
+        builder.clear();
+        builder.addTree(item.Function->getBody());
+        body = builder.finish(flat_context);
+      }
+      entry.NumNodes = body->size();
+      entry.NumLiterals = static_cast<uint32_t>(body->Literals.size());
+      entry.NumCallArgs = static_cast<uint32_t>(body->CallArgs.size());
+
+      // Names in the body become string indices too.
+      scratch.assign(body->Operand0.begin(), body->Operand0.end());
+      for (uint32_t i = 0; i < entry.NumNodes; ++i) {
+        if (body->Opcodes[i] == flat_variable || body->Opcodes[i] == flat_call) {
+          scratch[i] = getString(scratch[i]);
+        }
+      }
+
+      align();
+      entry.BodyAt = Out.size();
+      append(body->Literals.begin(), entry.NumLiterals * sizeof(double));
+      append(scratch.data(), entry.NumNodes * sizeof(uint32_t));
+      append(body->Operand1.begin(), entry.NumNodes * sizeof(uint32_t));
+      append(body->CallArgs.begin(), entry.NumCallArgs * sizeof(uint32_t));
+      append(body->Opcodes.begin(), entry.NumNodes);
+    }
+    table.push_back(entry);
+  }
+
+  SerializedASTHeader header = {};
+  memcpy(header.Magic, SerializedASTMagic, sizeof(header.Magic));
+  header.Version = SerializedASTVersion;
+  header.ByteOrder = SerializedASTByteOrder;
+  header.NumItems = static_cast<uint32_t>(table.size());
+  header.NumStrings = static_cast<uint32_t>(strings.size());
+
+  align();
+  header.ItemsAt = Out.size();
+  append(table.data(), table.size() * sizeof(SerializedASTItem));
+
+  header.StringOffsetsAt = Out.size();
+  uint32_t offset = 0;
+  for (std::string_view S : strings) {
+    append(&offset, sizeof(offset));
+    offset += static_cast<uint32_t>(S.size());
+  }
+  append(&offset, sizeof(offset));
+  header.StringDataAt = Out.size();
+  for (std::string_view S : strings) { Out.append(S.data(), S.size()); }
+
+  header.FileSize = Out.size();
+  header.Checksum = hashBytes(std::string_view(Out).substr(sizeof(SerializedASTHeader)));
+  memcpy(&Out[0], &header, sizeof(header));
+}
+
+// A serialized AST mapped into memory. Loading checks the header, which takes constant time, and
+// by default also the checksum and every offset and index in the file, which takes time linear in
+// its size. Skip that only for files written by a trusted, matching writer.
+class SerializedAST {
+  std::unique_ptr<SourceBuffer> Buffer;
+  const SerializedASTHeader *Header = nullptr;
+  const SerializedASTItem *Items = nullptr;
+  const uint32_t *StringOffsets = nullptr;
+
+  template <typename T>
+  const T *at(uint64_t Offset) const {
+    return reinterpret_cast<const T *>(Buffer->begin() + Offset);
+  }
+
+  // Whether Count elements of type T at Offset lie within the file, suitably aligned.
+  template <typename T>
+  bool holds(uint64_t Offset, uint64_t Count) const {
+    uint64_t size = Buffer->end() - Buffer->begin();
+    return Offset % alignof(T) == 0 && Offset <= size && Count <= (size - Offset) / sizeof(T);
+  }
+
+  static std::unique_ptr<SerializedAST> fail(const char *Message) {
+    reportError(Message);
+    return nullptr;
+  }
+
+  bool verifyItem(const SerializedASTItem &Item) const {
+    uint32_t num_strings = Header->NumStrings;
+    if (Item.Kind > TopLevelItem::Item_Semicolon || Item.Name >= num_strings) { return false; }
+    if (Item.Kind == TopLevelItem::Item_Semicolon &&
+        (Item.Name != 0 || Item.NumArgs != 0 || Item.NumNodes != 0)) {
+      return false;
+    }
+    if (!holds<uint32_t>(Item.ArgsAt, Item.NumArgs)) { return false; }
+    for (uint32_t Arg : getArgs(Item)) {
+      if (Arg >= num_strings) { return false; }
+    }
+    bool has_body =
+        Item.Kind == TopLevelItem::Item_Definition || Item.Kind == TopLevelItem::Item_Expression;
+    if (has_body != (Item.NumNodes != 0)) { return false; }
+    if (Item.NumNodes == 0) { return true; }
+
+    uint64_t body_size = Item.NumLiterals * uint64_t(8) + Item.NumNodes * uint64_t(9) +
+                         Item.NumCallArgs * uint64_t(4);
+    if (!holds<double>(Item.BodyAt, 0) || !holds<char>(Item.BodyAt, body_size)) { return false; }
+
+    // Every operand must refer to an earlier node, as a postorder encoding does.
+    FlatExpr body = getBody(Item);
+    for (uint32_t i = 0; i < body.size(); ++i) {
+      uint32_t op0 = body.Operand0[i], op1 = body.Operand1[i];
+      switch (body.Opcodes[i]) {
+      case flat_number:
+        if (op0 >= body.Literals.size()) { return false; }
+        break;
+      case flat_variable:
+        if (op0 >= num_strings) { return false; }
+        break;
+      case flat_call:
+        if (op0 >= num_strings || op1 >= body.CallArgs.size() ||
+            body.CallArgs[op1] > body.CallArgs.size() - op1 - 1) {
+          return false;
+        }
+        for (uint32_t Arg : body.getCallArgs(i)) {
+          if (Arg >= i) { return false; }
+        }
+        break;
+      default:
+        if (body.Opcodes[i] < 0 || op0 >= i || op1 >= i) { return false; }
+        break;
+      }
+    }
+    return true;
+  }
+
+  ArenaArray<uint32_t> getArgs(const SerializedASTItem &Item) const {
+    return ArenaArray<uint32_t>(at<uint32_t>(Item.ArgsAt), Item.NumArgs);
+  }
+
+  // Rebuilds a body's tree from its flat form in postorder, for walkFlatExpr(): the node at each
+  // index is built once the nodes of its operands are.
+  struct TreeBuilder {
+    ASTContext &Ctx;
+    const std::vector<Symbol> &Symbols; // By string index
+    std::vector<ExprAST *> Nodes;       // By node index
+    std::vector<ExprAST *> Args;
+
+    void visitNumber(uint32_t Index, double Val) {
+      Nodes[Index] = Ctx.create<NumberExprAST>(Val);
+    }
+
+    void visitVariable(uint32_t Index, uint32_t Name) {
+      Nodes[Index] = Ctx.create<VariableExprAST>(Symbols[Name]);
+    }
+
+    void visitBinary(uint32_t Index, char Op, uint32_t LHS, uint32_t RHS) {
+      Nodes[Index] = Ctx.create<BinaryExprAST>(Op, Nodes[LHS], Nodes[RHS]);
+    }
+
+    void visitCall(uint32_t Index, uint32_t Callee, ArenaArray<uint32_t> CallArgs) {
+      Args.clear();
+      for (uint32_t Arg : CallArgs) { Args.push_back(Nodes[Arg]); }
+      Nodes[Index] =
+          Ctx.create<CallExprAST>(Symbols[Callee], Ctx.copyArray(Args.data(), Args.size()));
+    }
+  };
+
+  FlatExpr getBody(const SerializedASTItem &Item) const {
+    FlatExpr body;
+    uint64_t offset = Item.BodyAt;
+    body.Literals = ArenaArray<double>(at<double>(offset), Item.NumLiterals);
+    offset += Item.NumLiterals * uint64_t(sizeof(double));
+    body.Operand0 = ArenaArray<uint32_t>(at<uint32_t>(offset), Item.NumNodes);
+    offset += Item.NumNodes * uint64_t(sizeof(uint32_t));
+    body.Operand1 = ArenaArray<uint32_t>(at<uint32_t>(offset), Item.NumNodes);
+    offset += Item.NumNodes * uint64_t(sizeof(uint32_t));
+    body.CallArgs = ArenaArray<uint32_t>(at<uint32_t>(offset), Item.NumCallArgs);
+    offset += Item.NumCallArgs * uint64_t(sizeof(uint32_t));
+    body.Opcodes = ArenaArray<int8_t>(at<int8_t>(offset), Item.NumNodes);
+    return body;
+  }
+
+public:
+  /// Whether Source starts like a serialized AST rather than Kaleidoscope source.
+  static bool isSerialized(const SourceBuffer &Source) {
+    return Source.end() - Source.begin() >= static_cast<ptrdiff_t>(sizeof(SerializedASTMagic)) &&
+           !memcmp(Source.begin(), SerializedASTMagic, sizeof(SerializedASTMagic));
+  }
+
+  /// Take over Source, which must hold a whole file, and check that it is a serialized AST this
+  /// build can read. Returns nullptr, having reported why, if it is not.
+  static std::unique_ptr<SerializedAST> load(std::unique_ptr<SourceBuffer> Source,
+                                             bool Verify = true) {
+    auto module = std::make_unique<SerializedAST>();
+    module->Buffer = std::move(Source);
+    if (!isSerialized(*module->Buffer)) { return fail("not a serialized AST"); }
+    if (!module->holds<SerializedASTHeader>(0, 1)) { return fail("serialized AST is truncated"); }
+    const SerializedASTHeader &header = *module->at<SerializedASTHeader>(0);
+    module->Header = &header;
+    if (header.Version != SerializedASTVersion) {
+      return fail("serialized AST is from an unsupported version");
+    }
+    if (header.ByteOrder != SerializedASTByteOrder) {
+      return fail("serialized AST was written with the other byte order");
+    }
+    std::string_view contents(module->Buffer->begin(),
+                              module->Buffer->end() - module->Buffer->begin());
+    if (header.FileSize != contents.size() ||
+        !module->holds<SerializedASTItem>(header.ItemsAt, header.NumItems) ||
+        !module->holds<uint32_t>(header.StringOffsetsAt, uint64_t(header.NumStrings) + 1) ||
+        header.NumStrings == 0) {
+      return fail("serialized AST is truncated");
+    }
+    module->Items = module->at<SerializedASTItem>(header.ItemsAt);
+    module->StringOffsets = module->at<uint32_t>(header.StringOffsetsAt);
+    if (!Verify) { return module; }
+
+    if (hashBytes(contents.substr(sizeof(SerializedASTHeader))) != header.Checksum) {
+      return fail("serialized AST is corrupt (checksum mismatch)");
+    }
+    for (uint32_t i = 0; i < header.NumStrings; ++i) {
+      if (module->StringOffsets[i] > module->StringOffsets[i + 1]) {
+        return fail("serialized AST is corrupt (bad string table)");
+      }
+    }
+    if (!module->holds<char>(header.StringDataAt, module->StringOffsets[header.NumStrings])) {
+      return fail("serialized AST is corrupt (bad string table)");
+    }
+    for (uint32_t i = 0; i < header.NumItems; ++i) {
+      if (!module->verifyItem(module->Items[i])) {
+        return fail("serialized AST is corrupt (bad item)");
+      }
+    }
+    return module;
+  }
+
+  size_t getNumItems() const { return Header->NumItems; }
+  size_t getNumStrings() const { return Header->NumStrings; }
+
+  std::string_view getString(uint32_t Index) const {
+    const char *data = at<char>(Header->StringDataAt);
+    return std::string_view(data + StringOffsets[Index],
+                            StringOffsets[Index + 1] - StringOffsets[Index]);
+  }
+
+  TopLevelItem::ItemKind getKind(size_t Index) const {
+    return static_cast<TopLevelItem::ItemKind>(Items[Index].Kind);
+  }
+
+  /// The item's name and parameter names, as string indices.
+  uint32_t getName(size_t Index) const { return Items[Index].Name; }
+  ArenaArray<uint32_t> getArgs(size_t Index) const { return getArgs(Items[Index]); }
+
+  /// The body of a definition or expression, read in place. Its variable and callee names are
+  /// string indices rather than Symbols.
+  FlatExpr getBody(size_t Index) const { return getBody(Items[Index]); }
+
+  /// Rebuild every item as a tree in Ctx, interning its names there, and append them to Items.
+  void importInto(ASTContext &Ctx, std::vector<TopLevelItem> &Out) const {
+    std::vector<Symbol> symbols(Header->NumStrings);
+    for (uint32_t i = 0; i < Header->NumStrings; ++i) { symbols[i] = Ctx.intern(getString(i)); }
+
+    TreeBuilder builder{Ctx, symbols, {}, {}};
+    std::vector<Symbol> arg_names;
+    for (size_t i = 0; i < getNumItems(); ++i) {
+      TopLevelItem item;
+      item.Kind = getKind(i);
+      if (item.Kind == TopLevelItem::Item_Semicolon) {
+        Out.push_back(item);
+        continue;
+      }
+
+      arg_names.clear();
+      for (uint32_t Arg : getArgs(i)) { arg_names.push_back(symbols[Arg]); }
+      auto Proto = Ctx.create<PrototypeAST>(symbols[getName(i)],
+                                            Ctx.copyArray(arg_names.data(), arg_names.size()));
+
+      if (item.Kind == TopLevelItem::Item_Extern) {
+        item.Prototype = Proto;
+        Out.push_back(item);
+        continue;
+      }
+
+      FlatExpr body = getBody(i);
+      builder.Nodes.resize(body.size());
+      walkFlatExpr(body, builder);
+      item.Function = Ctx.create<FunctionAST>(Proto, builder.Nodes[body.getRoot()]);
+      Out.push_back(item);
+    }
+  }
+};
+
+/// Write Bytes to the file at Path, replacing it. Returns false, having reported why, if it
+/// cannot.
+inline bool writeFile(const char *Path, std::string_view Bytes) {
+  FILE *file = fopen(Path, "wb");
+  bool written = file && fwrite(Bytes.data(), 1, Bytes.size(), file) == Bytes.size();
+  if (file && fclose(file) != 0) { written = false; }
+  if (!written) { reportError("could not write '" + std::string(Path) + "'"); }
+  return written;
+}
+
+#endif // KALEIDOSCOPE_SERIALIZEDAST_H
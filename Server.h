@@ -0,0 +1,439 @@
+#ifndef KALEIDOSCOPE_SERVER_H
+#define KALEIDOSCOPE_SERVER_H
+
+#include "ArrayRuntime.h"
+#include "Diagnostics.h"
+#include "Interpreter.h"
+#include "Stats.h"
+#include "StreamingParse.h"
+#include "ThreadPool.h"
+#include "TopLevelItems.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//=========================
+// Evaluation Server
+//=========================
+
+constexpr size_t DefaultMaxInFlight = 1024;
+
+// A long-lived process that keeps definitions resident and evaluates what clients send it over
+// sockets, so that a job costs neither a process start nor parsing its definitions again. Each
+// connection is a stream of Kaleidoscope source, parsed as it arrives; every complete item in it
+// is one request, answered with what the REPL would print for it, less the prompts. Items may be
+// sent in batches of any size and pipelined without waiting for answers, which come back in the
+// order the items were sent.
+//
+// Definitions and externs go into one function table for every connection, so that what one
+// client defines, the others can call from their next request. Expressions are evaluated on a
+// thread pool, by interpreters that share that table; a definition or extern first waits for its
+// own connection's earlier expressions, so each connection sees its items take effect in order.
+// A connection has at most MaxInFlight items that are still being evaluated or are waiting to be
+// written back; past that, the server stops reading from it until the client reads its answers,
+// so a client that sends more than that without reading will wait forever.
+class EvaluationServer {
+  // The answer to one item, in the order the items were sent.
+  struct Answer {
+    bool Ready = false;
+    std::string Text;
+  };
+
+  struct Connection {
+    int FD; // Closed, and set to -1, under Lock
+    // Everything parsed from this connection, also held by what it publishes to the function table
+    std::shared_ptr<ASTContext> Ctx;
+    std::thread Reader;
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::deque<Answer> Answers;
+    size_t NumEvaluating = 0;
+    bool DoneReading = false;
+    std::atomic<bool> Finished{false};
+  };
+
+  ASTContext &Ctx;
+  bool Simplify;
+  ThreadPool Pool;
+  std::shared_ptr<Interpreter::Registry> Functions = std::make_shared<Interpreter::Registry>();
+  RunStats *Stats = nullptr;
+  unsigned MaxExpressionDepth = DefaultMaxExpressionDepth;
+  uint32_t MemoCapacity = 0;
+  TierCompiler *Tiers = nullptr;
+  ArrayRuntime *Arrays = nullptr;
+  size_t MaxArenaBytes = 0;
+  size_t MaxInFlight = DefaultMaxInFlight;
+  int ListenFD = -1;
+  std::string SocketPath; // Set for a Unix socket, to remove it again
+
+  // Interpreters for evaluating on the pool, each used by one task at a time.
+  struct Evaluator {
+    std::unique_ptr<ASTContext> Ctx;
+    std::unique_ptr<Interpreter> Interp;
+  };
+  std::mutex EvaluatorLock;
+  std::vector<std::unique_ptr<Evaluator>> Idle;
+  size_t NumConnections = 0;
+  std::atomic<size_t> NumItems{0};
+
+  static std::atomic<bool> &getStopFlag() {
+    static std::atomic<bool> Stop{false};
+    return Stop;
+  }
+
+  static bool error(const std::string &Message) {
+    reportError(Message);
+    return false;
+  }
+
+  std::unique_ptr<Evaluator> checkOut() {
+    {
+      std::lock_guard<std::mutex> lock(EvaluatorLock);
+      if (!Idle.empty()) {
+        auto evaluator = std::move(Idle.back());
+        Idle.pop_back();
+        return evaluator;
+      }
+    }
+    auto evaluator = std::make_unique<Evaluator>();
+    evaluator->Ctx = std::make_unique<ASTContext>(Ctx);
+    evaluator->Interp = std::make_unique<Interpreter>(*evaluator->Ctx, Functions);
+    evaluator->Interp->setMemoCapacity(MemoCapacity);
+    evaluator->Interp->setTierCompiler(Tiers);
+    return evaluator;
+  }
+
+  void checkIn(std::unique_ptr<Evaluator> E) {
+    std::lock_guard<std::mutex> lock(EvaluatorLock);
+    Idle.push_back(std::move(E));
+  }
+
+  static bool writeAll(int FD, std::string_view Bytes) {
+    while (!Bytes.empty()) {
+      ssize_t written = send(FD, Bytes.data(), Bytes.size(), MSG_NOSIGNAL);
+      if (written < 0 && errno == EINTR) { continue; }
+      if (written <= 0) { return false; }
+      Bytes.remove_prefix(static_cast<size_t>(written));
+    }
+    return true;
+  }
+
+  // Write C's answers back as they become ready, in order, until reading has stopped and every
+  // answer is out. Once the client stops reading, the rest are dropped.
+  void writeAnswers(Connection &C) {
+    bool broken = false;
+    std::unique_lock<std::mutex> lock(C.Lock);
+    while (true) {
+      C.Changed.wait(lock, [&] {
+        return (!C.Answers.empty() && C.Answers.front().Ready) ||
+               (C.DoneReading && C.Answers.empty());
+      });
+      if (C.Answers.empty()) { return; }
+      std::string text;
+      while (!C.Answers.empty() && C.Answers.front().Ready) {
+        text += C.Answers.front().Text;
+        C.Answers.pop_front();
+      }
+      C.Changed.notify_all(); // Room for more items
+      lock.unlock();
+      if (!broken) { broken = !writeAll(C.FD, text); }
+      lock.lock();
+    }
+  }
+
+  // Queue an answer for the next item, once there is room, and return it. Answers are only
+  // popped from the front, so the reference stays valid.
+  Answer &addAnswer(Connection &C, std::unique_lock<std::mutex> &Lock) {
+    C.Changed.wait(Lock, [&] { return C.Answers.size() < MaxInFlight; });
+    C.Answers.emplace_back();
+    return C.Answers.back();
+  }
+
+  // Answer one item from C, evaluating it on the pool if it is an expression.
+  void handleItem(Connection &C, Interpreter &Definer, const TopLevelItem &Item) {
+    if (Item.Kind == TopLevelItem::Item_Semicolon) { return; }
+    NumItems.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(C.Lock);
+    Answer &answer = addAnswer(C, lock);
+    answer.Text.assign(Item.Diagnostics.data(), Item.Diagnostics.size());
+
+    if (Item.Kind == TopLevelItem::Item_Expression) {
+      ++C.NumEvaluating;
+      FunctionAST *F = Item.Function;
+      Pool.submit([this, &C, &answer, F] {
+        std::unique_ptr<Evaluator> evaluator = checkOut();
+        DiagnosticCapture capture;
+        double result;
+        std::optional<ArrayRuntime::Scope> scope;
+        if (Arrays) { scope.emplace(*Arrays); }
+        bool ok = timePhase(Stats, RunStats::Phase_Evaluate,
+                            [&] { return evaluator->Interp->evaluate(F, result); });
+        scope.reset();
+        std::string text = capture.take();
+        if (ok) {
+          char line[64];
+          snprintf(line, sizeof(line), "Evaluated to %f\n", result);
+          text += line;
+        }
+        checkIn(std::move(evaluator));
+
+        std::lock_guard<std::mutex> lock(C.Lock);
+        answer.Text += text;
+        answer.Ready = true;
+        --C.NumEvaluating;
+        C.Changed.notify_all();
+      });
+      return;
+    }
+
+    if (Item.Kind == TopLevelItem::Item_Definition || Item.Kind == TopLevelItem::Item_Extern) {
+      // Earlier expressions must not see what this changes.
+      C.Changed.wait(lock, [&] { return C.NumEvaluating == 0; });
+      lock.unlock();
+      DiagnosticCapture capture;
+      std::string text;
+      if (Item.Kind == TopLevelItem::Item_Extern) {
+        Definer.addExtern(Item.Prototype);
+        text = "Parsed an extern\n";
+      } else if (timePhase(Stats, RunStats::Phase_Lower,
+                           [&] { return Definer.addFunction(Item.Function); })) {
+        text = "Parsed a function definition.\n";
+      }
+      text.insert(0, capture.take());
+      lock.lock();
+      answer.Text += text;
+    }
+    answer.Ready = true;
+    C.Changed.notify_all();
+  }
+
+  // Read and answer everything sent on C until the client closes its end, or the server stops.
+  void serveConnection(Connection &C) {
+    std::thread writer([this, &C] { writeAnswers(C); });
+    ASTContext definer_context(Ctx);
+    Interpreter definer(definer_context, Functions);
+    definer.setDefinitionOwner(C.Ctx);
+    StreamingParser stream(*C.Ctx, Simplify);
+    stream.setMaxExpressionDepth(MaxExpressionDepth);
+    stream.setMaxArenaBytes(MaxArenaBytes);
+    stream.setStats(Stats);
+
+    std::vector<TopLevelItem> items;
+    auto handle = [&] {
+      for (const TopLevelItem &item : items) { handleItem(C, definer, item); }
+      items.clear();
+    };
+    char buffer[65536];
+    while (true) {
+      ssize_t received = recv(C.FD, buffer, sizeof(buffer), 0);
+      if (received < 0 && errno == EINTR) { continue; }
+      if (received <= 0) { break; }
+      stream.feed(std::string_view(buffer, static_cast<size_t>(received)), items);
+      handle();
+      if (stream.exceededMaxArenaBytes()) { break; }
+    }
+    stream.finish(items);
+    handle();
+
+    {
+      std::unique_lock<std::mutex> lock(C.Lock);
+      C.Changed.wait(lock, [&] { return C.NumEvaluating == 0; });
+      C.DoneReading = true;
+      C.Changed.notify_all();
+    }
+    writer.join();
+    {
+      std::lock_guard<std::mutex> lock(C.Lock);
+      close(C.FD);
+      C.FD = -1;
+    }
+
+    // Definitions from this connection may still be called from others, so what they were parsed
+    // into lives on until the function table holds none of them.
+    C.Ctx.reset();
+    C.Finished = true;
+  }
+
+  bool listenUnix(const std::string &Path) {
+    sockaddr_un address{};
+    if (Path.size() >= sizeof(address.sun_path)) {
+      return error("Socket path is too long: '" + Path + "'");
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, Path.data(), Path.size());
+    ListenFD = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ListenFD < 0) { return error(std::string("socket: ") + strerror(errno)); }
+    unlink(Path.c_str()); // A socket left behind by an earlier server
+    if (bind(ListenFD, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+      return error("Could not bind '" + Path + "': " + strerror(errno));
+    }
+    SocketPath = Path;
+    return true;
+  }
+
+  bool listenTCP(const std::string &Host, const std::string &Port) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *found = nullptr;
+    int status = getaddrinfo(Host.empty() ? nullptr : Host.c_str(), Port.c_str(), &hints, &found);
+    if (status != 0) {
+      return error("Could not resolve '" + Host + ":" + Port + "': " + gai_strerror(status));
+    }
+    std::string failure = "no addresses";
+    for (addrinfo *info = found; info; info = info->ai_next) {
+      int fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+      if (fd < 0) { continue; }
+      int reuse = 1;
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+      if (bind(fd, info->ai_addr, info->ai_addrlen) == 0) {
+        ListenFD = fd;
+        break;
+      }
+      failure = strerror(errno);
+      close(fd);
+    }
+    freeaddrinfo(found);
+    if (ListenFD < 0) { return error("Could not bind '" + Host + ":" + Port + "': " + failure); }
+    return true;
+  }
+
+public:
+  /// Parse into children of Ctx, and evaluate on NumThreads threads (0 for one per hardware
+  /// thread). With Simplify, expressions are folded and shared as they are parsed.
+  EvaluationServer(ASTContext &Ctx, unsigned NumThreads, bool Simplify)
+    : Ctx(Ctx), Simplify(Simplify), Pool(NumThreads) {}
+
+  ~EvaluationServer() {
+    if (ListenFD >= 0) { close(ListenFD); }
+    if (!SocketPath.empty()) { unlink(SocketPath.c_str()); }
+  }
+
+  EvaluationServer(const EvaluationServer &) = delete;
+  EvaluationServer &operator=(const EvaluationServer &) = delete;
+
+  /// Reject expressions nested deeper than Depth, or 0 for no limit.
+  void setMaxExpressionDepth(unsigned Depth) { MaxExpressionDepth = Depth; }
+
+  /// Memoize up to Capacity results of each function while evaluating, or none for 0.
+  void setMemoCapacity(uint32_t Capacity) { MemoCapacity = Capacity; }
+
+  /// Compile hot functions through Compiler while evaluating, or never with null. Compiled code
+  /// is shared by every connection, like the definitions it was compiled from.
+  void setTierCompiler(TierCompiler *Compiler) { Tiers = Compiler; }
+
+  /// Free what each expression maps with Runtime's built-ins, which must be in the function
+  /// table, once it has been evaluated; so an array made by one item cannot be used by another.
+  void setArrayRuntime(ArrayRuntime *Runtime) { Arrays = Runtime; }
+
+  /// Stop parsing a connection once the items sent on it take more than Bytes of arena, or never
+  /// for 0; see Parser::setMaxArenaBytes(). A connection that parsing stops in is answered up to
+  /// the item it stopped in, with the error, and then closed. Each connection has a limit of its
+  /// own, which neither what other connections sent nor what stays resident after it counts
+  /// towards.
+  void setMaxArenaBytes(size_t Bytes) { MaxArenaBytes = Bytes; }
+
+  /// Stop reading from a connection with Count items unanswered.
+  void setMaxInFlight(size_t Count) { MaxInFlight = Count ? Count : 1; }
+
+  /// Record parsing, lowering and evaluation in Stats, and count what parsing consumed and built.
+  void setStats(RunStats *Recorder) { Stats = Recorder; }
+
+  /// Listen on Address: "unix:<path>" for a Unix socket, or "[<host>:]<port>" for TCP (on every
+  /// interface when there is no host). Returns false, having reported why, if that fails.
+  bool listen(const std::string &Address) {
+    bool bound;
+    if (Address.compare(0, 5, "unix:") == 0) {
+      bound = listenUnix(Address.substr(5));
+    } else {
+      size_t colon = Address.rfind(':');
+      std::string host = colon == std::string::npos ? std::string() : Address.substr(0, colon);
+      if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2); // [::1]:port
+      }
+      bound = listenTCP(host, colon == std::string::npos ? Address : Address.substr(colon + 1));
+    }
+    if (!bound) { return false; }
+    if (::listen(ListenFD, SOMAXCONN) < 0) {
+      return error(std::string("listen: ") + strerror(errno));
+    }
+    return true;
+  }
+
+  /// Ask every server in the process to stop. Safe to call from a signal handler.
+  static void requestStop() { getStopFlag().store(true); }
+
+  /// Accept and serve connections until requestStop(). Connections still open then stop being
+  /// read from, and are closed once their answers are written.
+  void serve() {
+    std::vector<std::unique_ptr<Connection>> connections;
+    while (!getStopFlag().load()) {
+      pollfd listening{ListenFD, POLLIN, 0};
+      if (poll(&listening, 1, 100) <= 0) { continue; }
+      int fd = accept(ListenFD, nullptr, nullptr);
+      if (fd < 0) { continue; }
+
+      // Reap the connections that have closed.
+      for (auto &connection : connections) {
+        if (connection->Finished) { connection->Reader.join(); }
+      }
+      connections.erase(std::remove_if(connections.begin(), connections.end(),
+                                       [](const auto &C) { return !C->Reader.joinable(); }),
+                        connections.end());
+
+      auto connection = std::make_unique<Connection>();
+      connection->FD = fd;
+      connection->Ctx = std::make_shared<ASTContext>(Ctx);
+      Connection *raw = connection.get();
+      connection->Reader = std::thread([this, raw] { serveConnection(*raw); });
+      connections.push_back(std::move(connection));
+      ++NumConnections;
+    }
+
+    // A connection's reader closes its socket once it is done, so the lock keeps it from being
+    // closed, and the number reused, between the check and the shutdown.
+    for (auto &connection : connections) {
+      std::lock_guard<std::mutex> lock(connection->Lock);
+      if (connection->FD >= 0) { shutdown(connection->FD, SHUT_RD); }
+    }
+    for (auto &connection : connections) { connection->Reader.join(); }
+    Pool.wait();
+  }
+
+  /// The function table every connection defines into, for publishing built-ins in before
+  /// serving.
+  const std::shared_ptr<Interpreter::Registry> &getRegistry() const { return Functions; }
+
+  size_t getNumConnections() const { return NumConnections; }
+  size_t getNumItems() const { return NumItems.load(); }
+
+  /// The hits, misses and evictions of every evaluating interpreter's memo tables.
+  MemoCounts getMemoCounts() {
+    std::lock_guard<std::mutex> lock(EvaluatorLock);
+    MemoCounts counts;
+    for (const auto &evaluator : Idle) { counts.add(evaluator->Interp->getMemoCounts()); }
+    return counts;
+  }
+};
+
+#endif // KALEIDOSCOPE_SERVER_H
@@ -0,0 +1,197 @@
+#ifndef KALEIDOSCOPE_SIMPLIFY_H
+#define KALEIDOSCOPE_SIMPLIFY_H
+
+#include "AST.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+//=========================
+// Simplification
+//=========================
+
+// Builds expression nodes through a folding, hash-consing factory. Binary operators on two
+// literals are evaluated, identities that hold for every double are applied, and structurally
+// equal subtrees are shared, so the result is a DAG in which a repeated subexpression is one node.
+// Walkers that treat it as a tree still see the same expression; they just revisit shared nodes.
+//
+// Only rewrites that give bit-identical results are made: x*1, 1*x, x-0, x+(-0) and (-0)+x become
+// x, but x+0 does not (it turns -0 into +0), nor does x*0 (x may be NaN, infinite or negative).
+//
+// The parser can build through one as it goes (see Parser::setSimplifier), or simplify() can be
+// run over a finished tree. Nodes are allocated in the ASTContext given at construction, and
+// simplified trees must only mix nodes from that context.
+class ExprSimplifier {
+  ASTContext &Ctx;
+
+  struct BinaryKey {
+    char Op;
+    ExprAST *LHS, *RHS;
+    bool operator==(const BinaryKey &Other) const {
+      return Op == Other.Op && LHS == Other.LHS && RHS == Other.RHS;
+    }
+  };
+  struct BinaryKeyHash {
+    size_t operator()(const BinaryKey &K) const {
+      size_t hash = std::hash<ExprAST *>()(K.LHS);
+      hash = hash * 31 + std::hash<ExprAST *>()(K.RHS);
+      return hash * 31 + static_cast<unsigned char>(K.Op);
+    }
+  };
+
+  // Literals are keyed by bit pattern, so 0.0 and -0.0 stay distinct and NaNs are shared.
+  std::unordered_map<uint64_t, NumberExprAST *> Numbers;
+  std::unordered_map<Symbol, VariableExprAST *> Variables;
+  std::unordered_map<BinaryKey, BinaryExprAST *, BinaryKeyHash> Binaries;
+  std::unordered_multimap<size_t, CallExprAST *> Calls;
+
+  unsigned NumFolded = 0;
+  unsigned NumShared = 0;
+
+  static uint64_t getBits(double Val) {
+    uint64_t bits;
+    memcpy(&bits, &Val, sizeof(bits));
+    return bits;
+  }
+
+  static NumberExprAST *asLiteral(ExprAST *E) {
+    return NumberExprAST::classof(E) ? static_cast<NumberExprAST *>(E) : nullptr;
+  }
+
+  static bool isLiteral(ExprAST *E, double Val) {
+    auto N = asLiteral(E);
+    return N && getBits(N->getVal()) == getBits(Val);
+  }
+
+  // The value of LHS Op RHS for two literals, as the interpreter would compute it.
+  static bool fold(char Op, double LHS, double RHS, double &Result) {
+    switch (Op) {
+    case '+': Result = LHS + RHS; return true;
+    case '-': Result = LHS - RHS; return true;
+    case '*': Result = LHS * RHS; return true;
+    case '<': Result = LHS < RHS ? 1.0 : 0.0; return true;
+    default: return false;
+    }
+  }
+
+  // An operand equal to the whole of LHS Op RHS, or nullptr if there is none.
+  static ExprAST *applyIdentity(char Op, ExprAST *LHS, ExprAST *RHS) {
+    switch (Op) {
+    case '*':
+      if (isLiteral(RHS, 1.0)) { return LHS; }
+      if (isLiteral(LHS, 1.0)) { return RHS; }
+      return nullptr;
+    case '+':
+      if (isLiteral(RHS, -0.0)) { return LHS; }
+      if (isLiteral(LHS, -0.0)) { return RHS; }
+      return nullptr;
+    case '-':
+      if (isLiteral(RHS, 0.0)) { return LHS; }
+      return nullptr;
+    default:
+      return nullptr;
+    }
+  }
+
+public:
+  explicit ExprSimplifier(ASTContext &Ctx) : Ctx(Ctx) {}
+
+  ExprAST *getNumber(double Val) {
+    auto &slot = Numbers[getBits(Val)];
+    if (slot) {
+      ++NumShared;
+    } else {
+      slot = Ctx.create<NumberExprAST>(Val);
+    }
+    return slot;
+  }
+
+  ExprAST *getVariable(Symbol Name) {
+    auto &slot = Variables[Name];
+    if (slot) {
+      ++NumShared;
+    } else {
+      slot = Ctx.create<VariableExprAST>(Name);
+    }
+    return slot;
+  }
+
+  ExprAST *getBinary(char Op, ExprAST *LHS, ExprAST *RHS) {
+    auto L = asLiteral(LHS), R = asLiteral(RHS);
+    double folded;
+    if (L && R && fold(Op, L->getVal(), R->getVal(), folded)) {
+      ++NumFolded;
+      return getNumber(folded);
+    }
+    if (auto E = applyIdentity(Op, LHS, RHS)) {
+      ++NumFolded;
+      return E;
+    }
+
+    auto &slot = Binaries[BinaryKey{Op, LHS, RHS}];
+    if (slot) {
+      ++NumShared;
+    } else {
+      slot = Ctx.create<BinaryExprAST>(Op, LHS, RHS);
+    }
+    return slot;
+  }
+
+  /// Args must already live in the simplifier's context.
+  ExprAST *getCall(Symbol Callee, ArenaArray<ExprAST *> Args) {
+    size_t hash = std::hash<Symbol>()(Callee);
+    for (ExprAST *Arg : Args) { hash = hash * 31 + std::hash<ExprAST *>()(Arg); }
+
+    auto range = Calls.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      CallExprAST *C = it->second;
+      if (C->getCallee() != Callee || C->getArgs().size() != Args.size()) { continue; }
+      bool same = true;
+      for (size_t i = 0, e = Args.size(); i != e && same; ++i) {
+        same = C->getArgs()[i] == Args[i];
+      }
+      if (same) {
+        ++NumShared;
+        return C;
+      }
+    }
+
+    auto C = Ctx.create<CallExprAST>(Callee, Args);
+    Calls.emplace(hash, C);
+    return C;
+  }
+
+  /// Rebuild E bottom-up through the factory, returning the simplified expression.
+  ExprAST *simplify(ExprAST *E) {
+    switch (E->getKind()) {
+    case ExprAST::Expr_Number:
+      return getNumber(static_cast<NumberExprAST *>(E)->getVal());
+    case ExprAST::Expr_Variable:
+      return getVariable(static_cast<VariableExprAST *>(E)->getName());
+    case ExprAST::Expr_Binary: {
+      auto B = static_cast<BinaryExprAST *>(E);
+      ExprAST *lhs = simplify(B->getLHS());
+      return getBinary(B->getOp(), lhs, simplify(B->getRHS()));
+    }
+    case ExprAST::Expr_Call: {
+      auto C = static_cast<CallExprAST *>(E);
+      auto Args = C->getArgs();
+      ExprAST **args = static_cast<ExprAST **>(
+          Ctx.allocate(sizeof(ExprAST *) * Args.size(), alignof(ExprAST *)));
+      for (size_t i = 0, e = Args.size(); i != e; ++i) { args[i] = simplify(Args[i]); }
+      return getCall(C->getCallee(), ArenaArray<ExprAST *>(args, Args.size()));
+    }
+    }
+    return E;
+  }
+
+  /// How many operators were folded away or reduced to an operand.
+  unsigned getNumFolded() const { return NumFolded; }
+
+  /// How many requested nodes were already present and shared.
+  unsigned getNumShared() const { return NumShared; }
+};
+
+#endif // KALEIDOSCOPE_SIMPLIFY_H
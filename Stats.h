@@ -0,0 +1,481 @@
+#ifndef KALEIDOSCOPE_STATS_H
+#define KALEIDOSCOPE_STATS_H
+
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Lexer.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+//=========================
+// Front-End Counters
+//=========================
+
+// What parsing consumed and built: tokens by kind, nodes by kind as the parser built them (before
+// folding and sharing), and how many of those the simplifier folded away or shared. Memory is
+// counted too, as the arena bytes each kind of node took (with the arrays of arguments and
+// parameters it refers to, and a function's flat form); nodes the simplifier shared take none of
+// their own. Identifiers are not kept as tokens, only as the names they intern, which are counted
+// apart. A parser counts into one of these as it goes; the counts of parsers on other threads are
+// added together once they are done.
+struct FrontEndCounts {
+  enum NodeKind {
+    Node_Number,
+    Node_Variable,
+    Node_Binary,
+    Node_Call,
+    Node_Prototype,
+    Node_Function,
+    NumNodeKinds
+  };
+
+  // Characters are counted at their own value, and the lexer's negative tokens after them.
+  static constexpr int NumTokenSlots = 256 + 5;
+  static constexpr int getTokenSlot(int Token) { return Token >= 0 ? Token : 255 - Token; }
+
+  uint64_t Tokens[NumTokenSlots] = {};
+  uint64_t Nodes[NumNodeKinds] = {};
+  uint64_t NodeBytes[NumNodeKinds] = {};
+  uint64_t NameBytes = 0; // Spellings of names seen for the first time
+  uint64_t Folded = 0;
+  uint64_t Shared = 0;
+  uint64_t LargestItemBytes = 0; // What the top-level item that took the most took
+  SourceLocation LargestItemLoc; // Where that item starts, in whichever input it came from
+
+  void add(const FrontEndCounts &Other) {
+    for (int i = 0; i < NumTokenSlots; ++i) { Tokens[i] += Other.Tokens[i]; }
+    for (int i = 0; i < NumNodeKinds; ++i) {
+      Nodes[i] += Other.Nodes[i];
+      NodeBytes[i] += Other.NodeBytes[i];
+    }
+    NameBytes += Other.NameBytes;
+    Folded += Other.Folded;
+    Shared += Other.Shared;
+    addItem(Other.LargestItemBytes, Other.LargestItemLoc);
+  }
+
+  /// Count a top-level item starting at Loc that took Bytes of arena.
+  void addItem(uint64_t Bytes, SourceLocation Loc) {
+    if (Bytes > LargestItemBytes) {
+      LargestItemBytes = Bytes;
+      LargestItemLoc = Loc;
+    }
+  }
+
+  uint64_t getNumTokens() const {
+    uint64_t total = 0;
+    for (uint64_t count : Tokens) { total += count; }
+    return total;
+  }
+
+  uint64_t getNumNodes() const {
+    uint64_t total = 0;
+    for (uint64_t count : Nodes) { total += count; }
+    return total;
+  }
+
+  uint64_t getNumNodeBytes() const {
+    uint64_t total = 0;
+    for (uint64_t bytes : NodeBytes) { total += bytes; }
+    return total;
+  }
+
+  static const char *getNodeKindName(int Kind) {
+    static const char *const Names[NumNodeKinds] = {"number",    "variable", "binary",
+                                                     "call",      "prototype", "function"};
+    return Names[Kind];
+  }
+
+  /// A printable name for the token counted in Slot, e.g. "identifier" or "'+'".
+  static std::string getTokenSlotName(int Slot) {
+    switch (Slot) {
+    case getTokenSlot(token_def):
+      return "def";
+    case getTokenSlot(token_extern):
+      return "extern";
+    case getTokenSlot(token_identifier):
+      return "identifier";
+    case getTokenSlot(token_number):
+      return "number";
+    }
+    char name[8];
+    if (Slot > ' ' && Slot < 127 && Slot != '\'' && Slot != '"' && Slot != '\\') {
+      snprintf(name, sizeof(name), "'%c'", Slot);
+    } else {
+      snprintf(name, sizeof(name), "0x%02x", Slot);
+    }
+    return name;
+  }
+};
+
+
+//=========================
+// Tier Decisions
+//=========================
+
+// What became of a function that was called often enough to be compiled to native code.
+struct TierDecision {
+  enum Outcome {
+    Tier_Native,     // Compiled; its calls run the machine code from then on
+    Tier_Superseded, // Redefined before its code was ready, so the code was dropped
+    Tier_Bytecode,   // Not compiled, by this target or this backend; it stays in bytecode
+    NumOutcomes
+  };
+
+  std::string Name;
+  uint64_t Calls = 0; // Calls that had run its body when it was queued
+  double CompileSeconds = 0.0;
+  size_t CodeBytes = 0;
+  Outcome Result = Tier_Bytecode;
+
+  static const char *getOutcomeName(int O) {
+    static const char *const Names[NumOutcomes] = {"native", "superseded", "bytecode"};
+    return Names[O];
+  }
+};
+
+//=========================
+// Run Statistics
+//=========================
+
+// Where one run of the compiler spent its time, and what it parsed. Work is timed in phases;
+// every timed span also becomes a trace event when tracing, for viewing a run in a Chrome trace
+// viewer (chrome://tracing or Perfetto). Spans may be recorded from any thread, and a phase's time
+// is the sum over every thread that spent time in it.
+//
+// Lexing, parsing and folding run interleaved, the parser pulling each token from the lexer and
+// handing each node to the simplifier, so they are timed together as one phase.
+class RunStats {
+public:
+  enum Phase {
+    Phase_Parse,    // Lexing, parsing and folding
+    Phase_Load,     // Loading serialized ASTs
+    Phase_Inline,   // Inlining calls and dropping dead definitions
+    Phase_Lower,    // Lowering definitions to bytecode
+    Phase_Evaluate, // Lowering and running top-level expressions
+    Phase_Link,     // Resolving externs across files
+    Phase_Codegen,  // Generating MLIR
+    Phase_JIT,      // Compiling and running through ORC, or compiling hot functions natively
+    NumPhases
+  };
+
+  using Clock = std::chrono::steady_clock;
+
+private:
+  struct Event {
+    Phase P;
+    unsigned Thread;
+    double Start; // Microseconds since the run started
+    double Duration;
+    std::string Detail;
+  };
+
+  Clock::time_point Epoch = Clock::now();
+  bool Tracing;
+
+  mutable std::mutex Mutex;
+  double Seconds[NumPhases] = {};
+  uint64_t Spans[NumPhases] = {};
+  std::vector<Event> Events;
+  std::vector<std::thread::id> Threads; // Trace thread ids are indices into this
+  FrontEndCounts Counts;
+  uint64_t NumInlined = 0;    // Calls replaced by the callee's body
+  uint64_t NumEliminated = 0; // Definitions that nothing called
+  uint64_t MemoHits = 0;      // Calls answered from a memo table
+  uint64_t MemoMisses = 0;    // Memoized calls that had to run
+  uint64_t MemoEvictions = 0; // Results dropped from full memo tables
+  std::vector<TierDecision> Tiers;
+
+  double getMicroseconds(Clock::time_point T) const {
+    return std::chrono::duration<double, std::micro>(T - Epoch).count();
+  }
+
+  unsigned getThreadIndex() {
+    std::thread::id id = std::this_thread::get_id();
+    for (size_t i = 0; i < Threads.size(); ++i) {
+      if (Threads[i] == id) { return static_cast<unsigned>(i); }
+    }
+    Threads.push_back(id);
+    return static_cast<unsigned>(Threads.size() - 1);
+  }
+
+  static void appendJSONString(std::string &Out, std::string_view Str) {
+    Out += '"';
+    for (char c : Str) {
+      if (c == '"' || c == '\\') {
+        Out += '\\';
+        Out += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char escape[8];
+        snprintf(escape, sizeof(escape), "\\u%04x", c);
+        Out += escape;
+      } else {
+        Out += c;
+      }
+    }
+    Out += '"';
+  }
+
+  static void appendNumber(std::string &Out, double Value) {
+    char number[32];
+    snprintf(number, sizeof(number), "%.3f", Value);
+    Out += number;
+  }
+
+public:
+  /// With Tracing, keep every timed span as a trace event as well as adding it to its phase.
+  explicit RunStats(bool Tracing = false) : Tracing(Tracing) {}
+
+  static const char *getPhaseName(int P) {
+    static const char *const Names[NumPhases] = {"parse",    "load", "inline",  "lower",
+                                                 "evaluate", "link", "codegen", "jit"};
+    return Names[P];
+  }
+
+  /// Add the span from Start to End to phase P. Detail, e.g. a file name, is kept with its trace
+  /// event.
+  void record(Phase P, Clock::time_point Start, Clock::time_point End,
+              std::string_view Detail = std::string_view()) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Seconds[P] += std::chrono::duration<double>(End - Start).count();
+    ++Spans[P];
+    if (Tracing) {
+      double start = getMicroseconds(Start);
+      Events.push_back(
+          Event{P, getThreadIndex(), start, getMicroseconds(End) - start, std::string(Detail)});
+    }
+  }
+
+  void addCounts(const FrontEndCounts &C) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Counts.add(C);
+  }
+
+  void addInlined(uint64_t Calls, uint64_t Definitions) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    NumInlined += Calls;
+    NumEliminated += Definitions;
+  }
+
+  void addMemo(uint64_t Hits, uint64_t Misses, uint64_t Evictions) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    MemoHits += Hits;
+    MemoMisses += Misses;
+    MemoEvictions += Evictions;
+  }
+
+  void addTierDecision(TierDecision Decision) {
+    std::lock_guard<std::mutex> lock(Mutex);
+    Tiers.push_back(std::move(Decision));
+  }
+
+  /// Print a table of the phases and counters to Out. Ctx is the context the run kept its ASTs
+  /// in.
+  void printReport(FILE *Out, const ASTContext &Ctx) const {
+    std::lock_guard<std::mutex> lock(Mutex);
+    double wall = std::chrono::duration<double>(Clock::now() - Epoch).count();
+    fprintf(Out, "===--- Time report ---===\n");
+    fprintf(Out, "  %-10s %10s %7s %10s\n", "phase", "seconds", "%wall", "spans");
+    for (int p = 0; p < NumPhases; ++p) {
+      if (!Spans[p]) { continue; }
+      fprintf(Out, "  %-10s %10.6f %6.1f%% %10llu\n", getPhaseName(p), Seconds[p],
+              wall > 0 ? 100.0 * Seconds[p] / wall : 0.0,
+              static_cast<unsigned long long>(Spans[p]));
+    }
+    fprintf(Out, "  %-10s %10.6f\n", "wall", wall);
+
+    fprintf(Out, "===--- Counters ---===\n");
+    fprintf(Out, "  %-22s%12llu\n", "tokens",
+            static_cast<unsigned long long>(Counts.getNumTokens()));
+    for (int slot = 0; slot < FrontEndCounts::NumTokenSlots; ++slot) {
+      if (!Counts.Tokens[slot]) { continue; }
+      fprintf(Out, "    %-20s%12llu\n", FrontEndCounts::getTokenSlotName(slot).c_str(),
+              static_cast<unsigned long long>(Counts.Tokens[slot]));
+    }
+    fprintf(Out, "  %-22s%12llu\n", "nodes",
+            static_cast<unsigned long long>(Counts.getNumNodes()));
+    for (int kind = 0; kind < FrontEndCounts::NumNodeKinds; ++kind) {
+      fprintf(Out, "    %-20s%12llu\n", FrontEndCounts::getNodeKindName(kind),
+              static_cast<unsigned long long>(Counts.Nodes[kind]));
+    }
+    fprintf(Out, "  %-22s%12llu\n", "folded", static_cast<unsigned long long>(Counts.Folded));
+    fprintf(Out, "  %-22s%12llu\n", "shared", static_cast<unsigned long long>(Counts.Shared));
+    fprintf(Out, "  %-22s%12llu\n", "calls inlined", static_cast<unsigned long long>(NumInlined));
+    fprintf(Out, "  %-22s%12llu\n", "functions eliminated",
+            static_cast<unsigned long long>(NumEliminated));
+    fprintf(Out, "  %-22s%12llu\n", "memo hits", static_cast<unsigned long long>(MemoHits));
+    fprintf(Out, "  %-22s%12llu\n", "memo misses", static_cast<unsigned long long>(MemoMisses));
+    fprintf(Out, "  %-22s%12llu\n", "memo evictions",
+            static_cast<unsigned long long>(MemoEvictions));
+    fprintf(Out, "  %-22s%12zu\n", "symbols", Ctx.getNumSymbols());
+    fprintf(Out, "  %-22s%12zu\n", "arena bytes allocated", Ctx.getBytesAllocated());
+    fprintf(Out, "  %-22s%12zu\n", "arena bytes reserved", Ctx.getBytesReserved());
+    fprintf(Out, "  %-22s%12zu\n", "arena high-water mark", ASTContext::getPeakSlabBytes());
+
+    fprintf(Out, "===--- Parsed memory ---===\n");
+    fprintf(Out, "  %-20s%12s%12s%12s\n", "kind", "nodes", "bytes", "bytes/node");
+    for (int kind = 0; kind < FrontEndCounts::NumNodeKinds; ++kind) {
+      uint64_t nodes = Counts.Nodes[kind], bytes = Counts.NodeBytes[kind];
+      fprintf(Out, "  %-20s%12llu%12llu%12.1f\n", FrontEndCounts::getNodeKindName(kind),
+              static_cast<unsigned long long>(nodes), static_cast<unsigned long long>(bytes),
+              nodes ? static_cast<double>(bytes) / nodes : 0.0);
+    }
+    fprintf(Out, "  %-20s%12s%12llu\n", "names", "",
+            static_cast<unsigned long long>(Counts.NameBytes));
+    fprintf(Out, "  %-20s%12llu%12llu\n", "total",
+            static_cast<unsigned long long>(Counts.getNumNodes()),
+            static_cast<unsigned long long>(Counts.getNumNodeBytes() + Counts.NameBytes));
+    if (Counts.LargestItemBytes) {
+      fprintf(Out, "  %-20s%24llu  at %u:%u\n", "largest item",
+              static_cast<unsigned long long>(Counts.LargestItemBytes),
+              Counts.LargestItemLoc.Line, Counts.LargestItemLoc.Column);
+    }
+
+    if (!Tiers.empty()) {
+      fprintf(Out, "===--- Tiers ---===\n");
+      fprintf(Out, "  %-20s%12s%12s%12s  %s\n", "function", "calls", "compile us", "bytes",
+              "tier");
+      for (const TierDecision &tier : Tiers) {
+        fprintf(Out, "  %-20s%12llu%12.1f%12zu  %s\n", tier.Name.c_str(),
+                static_cast<unsigned long long>(tier.Calls), tier.CompileSeconds * 1e6,
+                tier.CodeBytes, TierDecision::getOutcomeName(tier.Result));
+      }
+    }
+  }
+
+  /// The phases and counters as one JSON object.
+  std::string toJSON(const ASTContext &Ctx) const {
+    std::lock_guard<std::mutex> lock(Mutex);
+    double wall = std::chrono::duration<double>(Clock::now() - Epoch).count();
+    char number[32];
+    snprintf(number, sizeof(number), "%.6f", wall);
+    std::string out = "{\n  \"wall_seconds\": ";
+    out += number;
+    out += ",\n  \"phases\": {";
+    const char *separator = "";
+    for (int p = 0; p < NumPhases; ++p) {
+      if (!Spans[p]) { continue; }
+      snprintf(number, sizeof(number), "%.6f", Seconds[p]);
+      out += separator;
+      out += "\n    \"";
+      out += getPhaseName(p);
+      out += "\": {\"seconds\": ";
+      out += number;
+      out += ", \"spans\": " + std::to_string(Spans[p]) + "}";
+      separator = ",";
+    }
+    out += "\n  },\n  \"tokens\": {";
+    separator = "";
+    for (int slot = 0; slot < FrontEndCounts::NumTokenSlots; ++slot) {
+      if (!Counts.Tokens[slot]) { continue; }
+      out += separator;
+      out += "\n    ";
+      appendJSONString(out, FrontEndCounts::getTokenSlotName(slot));
+      out += ": " + std::to_string(Counts.Tokens[slot]);
+      separator = ",";
+    }
+    out += "\n  },\n  \"nodes\": {";
+    for (int kind = 0; kind < FrontEndCounts::NumNodeKinds; ++kind) {
+      out += kind ? ",\n    \"" : "\n    \"";
+      out += FrontEndCounts::getNodeKindName(kind);
+      out += "\": " + std::to_string(Counts.Nodes[kind]);
+    }
+    out += "\n  },\n  \"node_bytes\": {";
+    for (int kind = 0; kind < FrontEndCounts::NumNodeKinds; ++kind) {
+      out += kind ? ",\n    \"" : "\n    \"";
+      out += FrontEndCounts::getNodeKindName(kind);
+      out += "\": " + std::to_string(Counts.NodeBytes[kind]);
+    }
+    out += "\n  },\n";
+    out += "  \"name_bytes\": " + std::to_string(Counts.NameBytes) + ",\n";
+    out += "  \"largest_item\": {\"bytes\": " + std::to_string(Counts.LargestItemBytes) +
+           ", \"line\": " + std::to_string(Counts.LargestItemLoc.Line) +
+           ", \"column\": " + std::to_string(Counts.LargestItemLoc.Column) + "},\n";
+    out += "  \"folded\": " + std::to_string(Counts.Folded) + ",\n";
+    out += "  \"shared\": " + std::to_string(Counts.Shared) + ",\n";
+    out += "  \"calls_inlined\": " + std::to_string(NumInlined) + ",\n";
+    out += "  \"functions_eliminated\": " + std::to_string(NumEliminated) + ",\n";
+    out += "  \"memo_hits\": " + std::to_string(MemoHits) + ",\n";
+    out += "  \"memo_misses\": " + std::to_string(MemoMisses) + ",\n";
+    out += "  \"memo_evictions\": " + std::to_string(MemoEvictions) + ",\n";
+    out += "  \"tiers\": [";
+    for (size_t i = 0; i < Tiers.size(); ++i) {
+      const TierDecision &tier = Tiers[i];
+      out += i ? ",\n    {\"function\": " : "\n    {\"function\": ";
+      appendJSONString(out, tier.Name);
+      snprintf(number, sizeof(number), "%.6f", tier.CompileSeconds);
+      out += ", \"calls\": " + std::to_string(tier.Calls) + ", \"compile_seconds\": " + number +
+             ", \"code_bytes\": " + std::to_string(tier.CodeBytes) + ", \"tier\": \"" +
+             TierDecision::getOutcomeName(tier.Result) + "\"}";
+    }
+    out += Tiers.empty() ? "],\n" : "\n  ],\n";
+    out += "  \"symbols\": " + std::to_string(Ctx.getNumSymbols()) + ",\n";
+    out += "  \"arena_bytes_allocated\": " + std::to_string(Ctx.getBytesAllocated()) + ",\n";
+    out += "  \"arena_bytes_reserved\": " + std::to_string(Ctx.getBytesReserved()) + ",\n";
+    out += "  \"arena_high_water_mark\": " + std::to_string(ASTContext::getPeakSlabBytes()) +
+           "\n}\n";
+    return out;
+  }
+
+  /// Every span recorded while tracing, in the Chrome trace event format.
+  std::string toChromeTrace() const {
+    std::lock_guard<std::mutex> lock(Mutex);
+    std::string out = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (size_t i = 0; i < Events.size(); ++i) {
+      const Event &event = Events[i];
+      out += i ? ",\n" : "\n";
+      out += "{\"name\": \"";
+      out += getPhaseName(event.P);
+      out += "\", \"cat\": \"phase\", \"ph\": \"X\", \"pid\": 1, \"tid\": ";
+      out += std::to_string(event.Thread);
+      out += ", \"ts\": ";
+      appendNumber(out, event.Start);
+      out += ", \"dur\": ";
+      appendNumber(out, event.Duration);
+      if (!event.Detail.empty()) {
+        out += ", \"args\": {\"detail\": ";
+        appendJSONString(out, event.Detail);
+        out += '}';
+      }
+      out += '}';
+    }
+    out += "\n]}\n";
+    return out;
+  }
+};
+
+// Times the scope it lives in as a span of one phase, if there are stats to record it in.
+class PhaseTimer {
+  RunStats *Stats;
+  RunStats::Phase P;
+  std::string_view Detail;
+  RunStats::Clock::time_point Start;
+
+public:
+  PhaseTimer(RunStats *Stats, RunStats::Phase P, std::string_view Detail = std::string_view())
+    : Stats(Stats), P(P), Detail(Detail) {
+    if (Stats) { Start = RunStats::Clock::now(); }
+  }
+  ~PhaseTimer() {
+    if (Stats) { Stats->record(P, Start, RunStats::Clock::now(), Detail); }
+  }
+
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+};
+
+/// Call Fn, timing the call as a span of phase P if there are stats to record it in.
+template <typename FnT>
+auto timePhase(RunStats *Stats, RunStats::Phase P, FnT &&Fn) {
+  PhaseTimer timer(Stats, P);
+  return Fn();
+}
+
+#endif // KALEIDOSCOPE_STATS_H
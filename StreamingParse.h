@@ -0,0 +1,258 @@
+#ifndef KALEIDOSCOPE_STREAMINGPARSE_H
+#define KALEIDOSCOPE_STREAMINGPARSE_H
+
+#include "Diagnostics.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Stats.h"
+#include "TopLevelItems.h"
+
+#include <cctype>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//=========================
+// Streaming Parsing
+//=========================
+
+// Parses input that arrives in pieces, e.g. packets from a socket. Each feed() appends to the
+// unparsed tail of the input and hands back every top-level item that is now complete. An item is
+// complete once the token after it has arrived, since nothing that follows can change it then;
+// the incomplete item at the end of the input is parsed again when more of it arrives. Items are
+// the same, with the same errors in the same order, as a serial parse of the whole input. Once
+// parsing goes over its memory limit, the item it stopped in is the last one returned, and the
+// rest of the input is dropped.
+class StreamingParser {
+  ASTContext &Ctx;
+  bool Simplify;
+  std::string Pending;             // Input that is not yet part of a returned item
+  SourceLocation PendingLoc{1, 1}; // Where Pending starts in the input
+  // Once the item at the end was cut short, the size worth trying again at.
+  size_t RetryAt = 0;
+  // How far what arrived after that item has been scanned for where it ends, and whether the
+  // scan stopped in a comment, or in a word or number (which starts at TokenAt) that may go on.
+  enum ScanMode { Scan_Code, Scan_Comment, Scan_Word, Scan_Number };
+  size_t ScannedTo = 0;
+  ScanMode Mode = Scan_Code;
+  size_t TokenAt = 0;
+  // Where the item ran into the end of the input without an error, until a token that may
+  // continue it arrives, or npos.
+  size_t CleanEnd = std::string::npos;
+  size_t NumParses = 0;
+  RunStats *Stats = nullptr;
+  unsigned MaxExpressionDepth = DefaultMaxExpressionDepth;
+  size_t MaxArenaBytes = 0;
+  size_t ArenaBytesUsed = 0; // By the items returned, towards MaxArenaBytes
+  bool FlatBodies = false;
+  bool Stopped = false;
+
+  // Whether the word or number that was scanned at [Begin, End) ends the item at the start of
+  // Pending: a keyword after its first token does, and so does a name or number right after the
+  // clean end of an expression, which cannot continue it. One that started before that end
+  // extends its last token instead.
+  bool endsItem(size_t Begin, size_t End) const {
+    std::string_view text = std::string_view(Pending).substr(Begin, End - Begin);
+    if (Begin > 0 && (text == "def" || text == "extern")) { return true; }
+    return Begin >= CleanEnd;
+  }
+
+  // Scan what arrived since the last scan, as the lexer would read it, for a token before which
+  // the item at the start of Pending must end. Each byte is scanned once.
+  bool scanForItemEnd() {
+    size_t i = ScannedTo;
+    bool ends = false;
+    while (i < Pending.size() && !ends) {
+      unsigned char c = static_cast<unsigned char>(Pending[i]);
+      if (Mode == Scan_Comment) {
+        if (c == '\n' || c == '\r') { Mode = Scan_Code; }
+        ++i;
+      } else if (Mode == Scan_Word && isalnum(c)) {
+        ++i;
+      } else if (Mode == Scan_Number && (isdigit(c) || c == '.')) {
+        ++i;
+      } else if (Mode != Scan_Code) {
+        ends = endsItem(TokenAt, i);
+        Mode = Scan_Code;
+      } else {
+        if (isalpha(c) || isdigit(c) || c == '.') {
+          Mode = isalpha(c) ? Scan_Word : Scan_Number;
+          TokenAt = i;
+        } else if (c == '#') {
+          Mode = Scan_Comment;
+        } else if (c == ';') {
+          ends = i > 0;
+        } else if (!isspace(c) && i >= CleanEnd) {
+          // An operator or parenthesis may continue the expression; only parsing can tell.
+          CleanEnd = std::string::npos;
+        }
+        ++i;
+      }
+    }
+    ScannedTo = i;
+    return ends;
+  }
+
+  void parsePending(bool AtEnd, std::vector<TopLevelItem> &Items) {
+    PhaseTimer timer(Stats, RunStats::Phase_Parse);
+    ++NumParses;
+    auto source = SourceBuffer::getMemory(Pending);
+    auto context = std::make_unique<ASTContext>(Ctx);
+    Lexer lexer(*source, PendingLoc);
+    Parser parser(lexer, *context);
+    ExprSimplifier simplifier(*context);
+    if (Simplify) { parser.setSimplifier(&simplifier); }
+    FlatExprBuilder flat;
+    if (FlatBodies) { parser.setFlatExprBuilder(&flat); }
+    parser.setMaxExpressionDepth(MaxExpressionDepth);
+    parser.setMaxArenaBytes(MaxArenaBytes, ArenaBytesUsed);
+    DiagnosticCapture capture;
+
+    // The tail that is parsed again next time is only counted then: counts are taken as of the end
+    // of the last item returned, without the token after it.
+    FrontEndCounts counts, returned_counts;
+    if (Stats) { parser.setCounts(&counts); }
+
+    const char *input_end = source->end();
+    size_t consumed = 0, consumed_bytes = ArenaBytesUsed;
+    bool cut_short = false, clean = false;
+    parser.getNextToken();
+    while (parser.getCurrToken() != token_eof) {
+      TopLevelItem item;
+      const char *item_start = lexer.getTokenStart();
+      switch (parser.getCurrToken()) {
+      case ';':
+        item.Kind = TopLevelItem::Item_Semicolon;
+        break;
+      case token_def:
+        item.Kind = TopLevelItem::Item_Definition;
+        item.Function = parser.ParseDefinition();
+        break;
+      case token_extern:
+        item.Kind = TopLevelItem::Item_Extern;
+        item.Prototype = parser.ParseExtern();
+        break;
+      default:
+        item.Kind = TopLevelItem::Item_Expression;
+        item.Function = parser.ParseTopLevelExpr();
+        break;
+      }
+
+      if (item.Kind == TopLevelItem::Item_Semicolon) {
+        parser.getNextToken();
+      } else if (!item.Function && !item.Prototype) {
+        item.Kind = TopLevelItem::Item_Error;
+        parser.skipToNextItem();
+      }
+      // No more of the input is read once parsing stops.
+      Stopped = parser.exceededMaxArenaBytes();
+
+      // A failed item runs up to the next def or extern, unless more input turns that into the
+      // start of a longer identifier.
+      int next_token = parser.getCurrToken();
+      bool keyword_may_continue =
+          item.Kind == TopLevelItem::Item_Error && !AtEnd &&
+          (next_token == token_def || next_token == token_extern) &&
+          lexer.getIdentifierStr().data() + lexer.getIdentifierStr().size() == input_end;
+
+      // Where the next step starts, unless more input could still change this one.
+      const char *resume;
+      if (next_token != token_eof && !keyword_may_continue) {
+        resume = lexer.getTokenStart();
+      } else if (AtEnd || Stopped) {
+        resume = input_end;
+      } else if (item.Kind == TopLevelItem::Item_Semicolon) {
+        resume = item_start + 1; // Nothing can continue a ';'
+      } else {
+        // An item that failed, and was skipped to the end of the input, needs more of itself to
+        // find where it ends; any other only needs the next token, or the rest of it.
+        cut_short = true;
+        clean = item.Kind != TopLevelItem::Item_Error;
+        break;
+      }
+
+      item.Diagnostics = context->copyString(capture.take());
+      Items.push_back(item);
+      consumed = resume - source->begin();
+      consumed_bytes = parser.getArenaBytesUsed();
+      if (Stats) {
+        returned_counts = counts;
+        if (parser.getCurrToken() != token_eof) {
+          --returned_counts.Tokens[FrontEndCounts::getTokenSlot(parser.getCurrToken())];
+        }
+        returned_counts.Folded = simplifier.getNumFolded();
+        returned_counts.Shared = simplifier.getNumShared();
+      }
+    }
+
+    if (consumed > 0) {
+      Ctx.adopt(*context);
+      PendingLoc = getLocationAfter(PendingLoc, std::string_view(Pending).substr(0, consumed));
+      Pending.erase(0, consumed);
+      ArenaBytesUsed = consumed_bytes;
+      if (Stats) { Stats->addCounts(returned_counts); }
+    }
+    if (AtEnd || Stopped) { Pending.clear(); }
+
+    // Parsing a long item again on every piece of it would take quadratic time, whether or not
+    // it has failed so far. Wait until the input has doubled, or a token arrives that the scan of
+    // what was left of the item (seen as the lexer would) shows must end it.
+    RetryAt = cut_short ? 2 * Pending.size() : 0;
+    ScannedTo = 0;
+    Mode = Scan_Code;
+    CleanEnd = std::string::npos;
+    if (cut_short) {
+      while (ScannedTo < Pending.size()) { scanForItemEnd(); }
+      if (clean) { CleanEnd = Pending.size(); }
+    }
+  }
+
+public:
+  /// Parse into children of Ctx, which adopts everything returned. With Simplify, expressions
+  /// are folded and shared as they are parsed.
+  explicit StreamingParser(ASTContext &Ctx, bool Simplify = true)
+    : Ctx(Ctx), Simplify(Simplify) {}
+
+  /// Reject expressions nested deeper than Depth, or 0 for no limit.
+  void setMaxExpressionDepth(unsigned Depth) { MaxExpressionDepth = Depth; }
+
+  /// Stop parsing once the items of the stream take more than Bytes of arena, or never for 0;
+  /// see Parser::setMaxArenaBytes(). Only the items returned, and the one being parsed, count:
+  /// not the tails parsed again, nor anything else Ctx holds.
+  void setMaxArenaBytes(size_t Bytes) { MaxArenaBytes = Bytes; }
+
+  /// Whether parsing stopped at that limit, after which anything fed is ignored.
+  bool exceededMaxArenaBytes() const { return Stopped; }
+
+  /// Also encode every function body as a FlatExpr; see Parser::setFlatExprBuilder().
+  void setFlatBodies(bool Enable) { FlatBodies = Enable; }
+
+  /// Time each parse of the pending input as a span of the parse phase in Stats, and count what
+  /// the items returned consumed and built.
+  void setStats(RunStats *Recorder) { Stats = Recorder; }
+
+  /// Append Bytes to the input, and append every top-level item that is now complete to Items, in
+  /// source order, with the errors each reported in its Diagnostics.
+  void feed(std::string_view Bytes, std::vector<TopLevelItem> &Items) {
+    if (Stopped) { return; }
+    Pending.append(Bytes);
+    if (Pending.size() < RetryAt && !scanForItemEnd()) { return; }
+    parsePending(/*AtEnd=*/false, Items);
+  }
+
+  /// Mark the end of the input, and append whatever items are left to Items.
+  void finish(std::vector<TopLevelItem> &Items) {
+    if (!Stopped) { parsePending(/*AtEnd=*/true, Items); }
+  }
+
+  /// How much of the input fed so far is still waiting for an item to complete.
+  size_t getNumPendingBytes() const { return Pending.size(); }
+
+  /// How many times the pending input has been parsed, counting each time an item at its end that
+  /// was not complete yet was parsed again.
+  size_t getNumParses() const { return NumParses; }
+};
+
+#endif // KALEIDOSCOPE_STREAMINGPARSE_H
@@ -0,0 +1,114 @@
+#ifndef KALEIDOSCOPE_STRUCTURALHASH_H
+#define KALEIDOSCOPE_STRUCTURALHASH_H
+
+#include "AST.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+//=========================
+// Structural Hashing
+//=========================
+
+// A canonical byte encoding of a function, independent of the ASTContext it was parsed into. Two
+// functions encode the same exactly when they compile to the same code: the function's own name
+// and its callees' names are spelled out because compiled code refers to them, while parameters
+// are encoded by position, so renaming them does not change the encoding.
+class StructuralEncoder {
+  const ASTContext &Ctx;
+  std::string &Out;
+
+  void writeByte(char C) { Out.push_back(C); }
+
+  void writeU32(uint32_t V) {
+    char bytes[4];
+    memcpy(bytes, &V, 4);
+    Out.append(bytes, 4);
+  }
+
+  void writeDouble(double V) {
+    char bytes[8];
+    memcpy(bytes, &V, 8);
+    Out.append(bytes, 8);
+  }
+
+  void writeName(Symbol S) {
+    std::string_view spelling = Ctx.getSpelling(S);
+    writeU32(static_cast<uint32_t>(spelling.size()));
+    Out.append(spelling.data(), spelling.size());
+  }
+
+  void encode(const ExprAST *E, const PrototypeAST *Proto) {
+    switch (E->getKind()) {
+    case ExprAST::Expr_Number:
+      writeByte('N');
+      writeDouble(static_cast<const NumberExprAST *>(E)->getVal());
+      return;
+    case ExprAST::Expr_Variable: {
+      Symbol name = static_cast<const VariableExprAST *>(E)->getName();
+      auto Args = Proto->getArgs();
+      // Later parameters shadow earlier ones with the same name.
+      for (size_t i = Args.size(); i-- > 0;) {
+        if (Args[i] == name) {
+          writeByte('V');
+          writeU32(static_cast<uint32_t>(i));
+          return;
+        }
+      }
+      // Not a parameter; such a function never compiles, but keep it distinct anyway.
+      writeByte('U');
+      writeName(name);
+      return;
+    }
+    case ExprAST::Expr_Binary: {
+      auto B = static_cast<const BinaryExprAST *>(E);
+      writeByte('B');
+      writeByte(B->getOp());
+      encode(B->getLHS(), Proto);
+      encode(B->getRHS(), Proto);
+      return;
+    }
+    case ExprAST::Expr_Call: {
+      auto C = static_cast<const CallExprAST *>(E);
+      writeByte('C');
+      writeName(C->getCallee());
+      writeU32(static_cast<uint32_t>(C->getArgs().size()));
+      for (const ExprAST *Arg : C->getArgs()) { encode(Arg, Proto); }
+      return;
+    }
+    }
+  }
+
+public:
+  StructuralEncoder(const ASTContext &Ctx, std::string &Out) : Ctx(Ctx), Out(Out) {}
+
+  /// Append the encoding of F to the output string.
+  void encodeFunction(const FunctionAST *F) {
+    const PrototypeAST *Proto = F->getPrototype();
+    writeByte('F');
+    writeName(Proto->getName());
+    writeU32(static_cast<uint32_t>(Proto->getArgs().size()));
+    encode(F->getBody(), Proto);
+  }
+};
+
+/// 64-bit FNV-1a over Bytes.
+inline uint64_t hashBytes(std::string_view Bytes, uint64_t Seed = 0xcbf29ce484222325ULL) {
+  uint64_t hash = Seed;
+  for (unsigned char c : Bytes) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+/// Structural hash of F; see StructuralEncoder for what counts as equal.
+inline uint64_t hashFunction(const ASTContext &Ctx, const FunctionAST *F) {
+  std::string encoding;
+  StructuralEncoder(Ctx, encoding).encodeFunction(F);
+  return hashBytes(encoding);
+}
+
+#endif // KALEIDOSCOPE_STRUCTURALHASH_H
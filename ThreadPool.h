@@ -0,0 +1,134 @@
+#ifndef KALEIDOSCOPE_THREADPOOL_H
+#define KALEIDOSCOPE_THREADPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//=========================
+// Thread Pool
+//=========================
+
+// A fixed set of worker threads with a task queue each. A worker runs its own queue newest
+// first, and when it runs dry steals the oldest task from another worker's queue, so uneven
+// tasks (one huge file among many small ones) still keep every thread busy. Tasks submitted from
+// a worker go onto that worker's queue; others are spread round-robin.
+class ThreadPool {
+  struct Queue {
+    std::mutex Lock;
+    std::deque<std::function<void()>> Tasks;
+  };
+
+  std::vector<std::unique_ptr<Queue>> Queues;
+  std::vector<std::thread> Workers;
+
+  // Guards Pending, Stopping and the sleeping workers.
+  std::mutex StateLock;
+  std::condition_variable WorkAvailable;
+  std::condition_variable AllDone;
+  size_t Pending = 0; // Submitted but not yet finished
+  size_t Queued = 0;  // Submitted but not yet started
+  bool Stopping = false;
+  size_t NextQueue = 0;
+
+  static size_t &getWorkerIndex() {
+    static thread_local size_t Index = ~size_t(0);
+    return Index;
+  }
+
+  bool pop(size_t Worker, std::function<void()> &Task) {
+    {
+      Queue &own = *Queues[Worker];
+      std::lock_guard<std::mutex> lock(own.Lock);
+      if (!own.Tasks.empty()) {
+        Task = std::move(own.Tasks.back());
+        own.Tasks.pop_back();
+        return true;
+      }
+    }
+    for (size_t i = 1; i < Queues.size(); ++i) {
+      Queue &victim = *Queues[(Worker + i) % Queues.size()];
+      std::lock_guard<std::mutex> lock(victim.Lock);
+      if (!victim.Tasks.empty()) {
+        Task = std::move(victim.Tasks.front());
+        victim.Tasks.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void work(size_t Worker) {
+    getWorkerIndex() = Worker;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(StateLock);
+        WorkAvailable.wait(lock, [&] { return Stopping || Queued > 0; });
+        if (Stopping && Queued == 0) { return; }
+        --Queued;
+      }
+
+      // A task is queued somewhere, and it is ours: Queued was decremented for it.
+      std::function<void()> task;
+      while (!pop(Worker, task)) { std::this_thread::yield(); }
+      task();
+
+      std::lock_guard<std::mutex> lock(StateLock);
+      if (--Pending == 0) { AllDone.notify_all(); }
+    }
+  }
+
+public:
+  /// Start NumThreads workers, or one per hardware thread if NumThreads is 0.
+  explicit ThreadPool(unsigned NumThreads = 0) {
+    if (NumThreads == 0) { NumThreads = std::max(1u, std::thread::hardware_concurrency()); }
+    for (unsigned i = 0; i < NumThreads; ++i) { Queues.push_back(std::make_unique<Queue>()); }
+    for (unsigned i = 0; i < NumThreads; ++i) { Workers.emplace_back([this, i] { work(i); }); }
+  }
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /// Finish every submitted task, then stop the workers.
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(StateLock);
+      Stopping = true;
+    }
+    WorkAvailable.notify_all();
+    for (auto &worker : Workers) { worker.join(); }
+  }
+
+  size_t getNumThreads() const { return Workers.size(); }
+
+  void submit(std::function<void()> Task) {
+    size_t index = getWorkerIndex();
+    {
+      std::lock_guard<std::mutex> lock(StateLock);
+      if (index >= Queues.size()) { index = NextQueue++ % Queues.size(); }
+      ++Pending;
+      ++Queued;
+    }
+    {
+      Queue &queue = *Queues[index];
+      std::lock_guard<std::mutex> lock(queue.Lock);
+      queue.Tasks.push_back(std::move(Task));
+    }
+    WorkAvailable.notify_one();
+  }
+
+  /// Block until every task submitted so far, and every task those submit, has finished. Must not
+  /// be called from a worker.
+  void wait() {
+    std::unique_lock<std::mutex> lock(StateLock);
+    AllDone.wait(lock, [&] { return Pending == 0; });
+  }
+};
+
+#endif // KALEIDOSCOPE_THREADPOOL_H
@@ -0,0 +1,96 @@
+#ifndef KALEIDOSCOPE_TIERING_H
+#define KALEIDOSCOPE_TIERING_H
+
+#include "Stats.h"
+#include "ThreadPool.h"
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+class ASTContext;
+class FunctionAST;
+class NativeCode;
+
+//=========================
+// Tier-Up Compiler
+//=========================
+
+/// Calls that run a function's bytecode before it is compiled to native code, for a compiler
+/// that is not given a threshold. Nothing is compiled unless a driver sets up a compiler.
+constexpr uint32_t DefaultTierUpThreshold = 1000;
+
+// Compiles hot functions in the background. Interpreters count the calls that run each
+// function's bytecode, and queue the function here once the count reaches the threshold; a thread
+// of the compiler's own compiles it and swaps the result into the function table, while calls
+// carry on in bytecode until then. Interpreters on any number of threads may share a compiler.
+//
+// Functions are compiled from their bytecode by NativeCode, unless a backend is set, e.g. one
+// that compiles them with LLVM.
+class TierCompiler {
+public:
+  /// Compile one function and swap it in, setting CodeBytes, and return what became of it.
+  using CompileFn = std::function<TierDecision::Outcome(size_t &CodeBytes)>;
+
+  /// Compile one function on the compiler's thread, or return null to leave it in bytecode.
+  using CodeFn = std::function<std::shared_ptr<const NativeCode>()>;
+
+  /// Prepare Definition, whose names are in Ctx, on the thread of the interpreter tiering it up,
+  /// and return the CodeFn that compiles it; or an empty one to leave it in bytecode.
+  using BackendFn = std::function<CodeFn(ASTContext &Ctx, FunctionAST *Definition)>;
+
+private:
+  uint32_t Threshold;
+  BackendFn Backend;
+  RunStats *Stats = nullptr;
+  std::mutex Lock;
+  std::unique_ptr<ThreadPool> Pool; // Started by the first function queued
+
+public:
+  /// Compile functions once Threshold calls (at least one) have run their bytecode.
+  explicit TierCompiler(uint32_t Threshold = DefaultTierUpThreshold)
+    : Threshold(Threshold ? Threshold : 1) {}
+
+  uint32_t getThreshold() const { return Threshold; }
+
+  /// Compile functions through Compile instead of from their bytecode, or from their bytecode
+  /// again with nullptr. A backend only gets functions that make no calls, whose code then needs
+  /// nothing from the interpreter; the others stay in bytecode. It must be set before any
+  /// function is queued.
+  void setBackend(BackendFn Compile) { Backend = std::move(Compile); }
+  const BackendFn &getBackend() const { return Backend; }
+
+  /// Time each compile as a span of the JIT phase in Stats, and record what became of it.
+  void setStats(RunStats *Recorder) { Stats = Recorder; }
+
+  /// Queue the function Name, which Calls calls have run so far, to be compiled by Compile.
+  void submit(std::string Name, uint64_t Calls, CompileFn Compile) {
+    std::lock_guard<std::mutex> lock(Lock);
+    if (!Pool) { Pool = std::make_unique<ThreadPool>(1); }
+    Pool->submit([this, Name = std::move(Name), Calls, Compile = std::move(Compile)] {
+      TierDecision decision;
+      auto start = RunStats::Clock::now();
+      decision.Result = Compile(decision.CodeBytes);
+      auto end = RunStats::Clock::now();
+      if (!Stats) { return; }
+      decision.Name = Name;
+      decision.Calls = Calls;
+      decision.CompileSeconds = std::chrono::duration<double>(end - start).count();
+      Stats->record(RunStats::Phase_JIT, start, end, Name);
+      Stats->addTierDecision(std::move(decision));
+    });
+  }
+
+  /// Wait until every function queued so far has been compiled, and swapped in if it still can
+  /// be.
+  void wait() {
+    std::lock_guard<std::mutex> lock(Lock);
+    if (Pool) { Pool->wait(); }
+  }
+};
+
+#endif // KALEIDOSCOPE_TIERING_H
@@ -0,0 +1,75 @@
+#ifndef KALEIDOSCOPE_TOPLEVELITEMS_H
+#define KALEIDOSCOPE_TOPLEVELITEMS_H
+
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Lexer.h"
+#include "Parser.h"
+
+#include <string_view>
+#include <vector>
+
+//=========================
+// Top-Level Items
+//=========================
+
+// One step of the top-level loop over a file, in source order: a def, extern or top-level
+// expression, a stray semicolon, or an item that failed to parse and was skipped.
+struct TopLevelItem {
+  enum ItemKind { Item_Definition, Item_Extern, Item_Expression, Item_Semicolon, Item_Error };
+  ItemKind Kind;
+  FunctionAST *Function = nullptr;   // For definitions and expressions
+  PrototypeAST *Prototype = nullptr; // For externs
+  std::string_view Diagnostics;      // Errors reported while parsing it, if they were captured
+};
+
+/// Take one step of the top-level loop: parse the item at the parser's current token (which must
+/// already be primed) into Item, skipping to the next item as the loop does if it fails. Returns
+/// false instead at the end of the input.
+inline bool parseTopLevelItem(Parser &P, TopLevelItem &Item) {
+  switch (P.getCurrToken()) {
+  case token_eof:
+    return false;
+  case ';':
+    Item.Kind = TopLevelItem::Item_Semicolon;
+    P.getNextToken();
+    return true;
+  case token_def:
+    Item.Kind = TopLevelItem::Item_Definition;
+    Item.Function = P.ParseDefinition();
+    break;
+  case token_extern:
+    Item.Kind = TopLevelItem::Item_Extern;
+    Item.Prototype = P.ParseExtern();
+    break;
+  default:
+    Item.Kind = TopLevelItem::Item_Expression;
+    Item.Function = P.ParseTopLevelExpr();
+    break;
+  }
+
+  if (!Item.Function && !Item.Prototype) {
+    Item.Kind = TopLevelItem::Item_Error;
+    P.skipToNextItem();
+  }
+  return true;
+}
+
+/// Parse every top-level item the parser has left and append them to Items. The parser's current
+/// token must already be primed. Returns the number of items that failed to parse. If Capture is
+/// given, the errors reported while parsing each item are taken from it and kept, in the parser's
+/// context, as that item's Diagnostics; otherwise they have already been reported.
+inline unsigned parseTopLevelItems(Parser &P, std::vector<TopLevelItem> &Items,
+                                   DiagnosticCapture *Capture = nullptr) {
+  unsigned num_errors = 0;
+  TopLevelItem item;
+  while (parseTopLevelItem(P, item)) {
+    if (item.Kind == TopLevelItem::Item_Error) { ++num_errors; }
+    if (Capture) { item.Diagnostics = P.getContext().copyString(Capture->take()); }
+    Items.push_back(item);
+    item = TopLevelItem();
+  }
+  return num_errors;
+}
+
+#endif // KALEIDOSCOPE_TOPLEVELITEMS_H
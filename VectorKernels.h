@@ -0,0 +1,314 @@
+#ifndef KALEIDOSCOPE_VECTORKERNELS_H
+#define KALEIDOSCOPE_VECTORKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__AVX512F__) || defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+//=========================
+// Vector Kernels
+//=========================
+
+// Elementwise operations over columns of doubles, used to evaluate one expression over many rows
+// at once. Each is written once against VectorD, a thin wrapper over the widest double vector the
+// compiler is targeting (AVX-512, AVX, SSE2 or NEON, chosen at compile time), with a scalar loop
+// for the remainder. Build with e.g. -march=native to get the wider instruction sets.
+//
+// The same operations also run over columns of floats, through VectorF, which fits twice as many
+// lanes in a register, and over columns of int64_t, through VectorI64. Vector instructions for
+// 64-bit integers only arrived with AVX2 (which still has to build a multiply out of 32-bit ones)
+// and AVX-512DQ, so elsewhere VectorI64 is one scalar lane.
+//
+// Dst may be the same column as either operand, but must not partially overlap one.
+
+#if defined(__AVX512F__)
+struct VectorD {
+  static constexpr size_t Width = 8;
+  __m512d V;
+  static VectorD load(const double *P) { return {_mm512_loadu_pd(P)}; }
+  static VectorD splat(double X) { return {_mm512_set1_pd(X)}; }
+  void store(double *P) const { _mm512_storeu_pd(P, V); }
+  friend VectorD operator+(VectorD A, VectorD B) { return {_mm512_add_pd(A.V, B.V)}; }
+  friend VectorD operator-(VectorD A, VectorD B) { return {_mm512_sub_pd(A.V, B.V)}; }
+  friend VectorD operator*(VectorD A, VectorD B) { return {_mm512_mul_pd(A.V, B.V)}; }
+  static VectorD less(VectorD A, VectorD B) {
+    __mmask8 mask = _mm512_cmp_pd_mask(A.V, B.V, _CMP_LT_OQ);
+    return {_mm512_maskz_mov_pd(mask, _mm512_set1_pd(1.0))};
+  }
+};
+
+struct VectorF {
+  static constexpr size_t Width = 16;
+  __m512 V;
+  static VectorF load(const float *P) { return {_mm512_loadu_ps(P)}; }
+  static VectorF splat(float X) { return {_mm512_set1_ps(X)}; }
+  void store(float *P) const { _mm512_storeu_ps(P, V); }
+  friend VectorF operator+(VectorF A, VectorF B) { return {_mm512_add_ps(A.V, B.V)}; }
+  friend VectorF operator-(VectorF A, VectorF B) { return {_mm512_sub_ps(A.V, B.V)}; }
+  friend VectorF operator*(VectorF A, VectorF B) { return {_mm512_mul_ps(A.V, B.V)}; }
+  static VectorF less(VectorF A, VectorF B) {
+    __mmask16 mask = _mm512_cmp_ps_mask(A.V, B.V, _CMP_LT_OQ);
+    return {_mm512_maskz_mov_ps(mask, _mm512_set1_ps(1.0f))};
+  }
+};
+#elif defined(__AVX__)
+struct VectorD {
+  static constexpr size_t Width = 4;
+  __m256d V;
+  static VectorD load(const double *P) { return {_mm256_loadu_pd(P)}; }
+  static VectorD splat(double X) { return {_mm256_set1_pd(X)}; }
+  void store(double *P) const { _mm256_storeu_pd(P, V); }
+  friend VectorD operator+(VectorD A, VectorD B) { return {_mm256_add_pd(A.V, B.V)}; }
+  friend VectorD operator-(VectorD A, VectorD B) { return {_mm256_sub_pd(A.V, B.V)}; }
+  friend VectorD operator*(VectorD A, VectorD B) { return {_mm256_mul_pd(A.V, B.V)}; }
+  static VectorD less(VectorD A, VectorD B) {
+    return {_mm256_and_pd(_mm256_cmp_pd(A.V, B.V, _CMP_LT_OQ), _mm256_set1_pd(1.0))};
+  }
+};
+
+struct VectorF {
+  static constexpr size_t Width = 8;
+  __m256 V;
+  static VectorF load(const float *P) { return {_mm256_loadu_ps(P)}; }
+  static VectorF splat(float X) { return {_mm256_set1_ps(X)}; }
+  void store(float *P) const { _mm256_storeu_ps(P, V); }
+  friend VectorF operator+(VectorF A, VectorF B) { return {_mm256_add_ps(A.V, B.V)}; }
+  friend VectorF operator-(VectorF A, VectorF B) { return {_mm256_sub_ps(A.V, B.V)}; }
+  friend VectorF operator*(VectorF A, VectorF B) { return {_mm256_mul_ps(A.V, B.V)}; }
+  static VectorF less(VectorF A, VectorF B) {
+    return {_mm256_and_ps(_mm256_cmp_ps(A.V, B.V, _CMP_LT_OQ), _mm256_set1_ps(1.0f))};
+  }
+};
+#elif defined(__SSE2__) || defined(_M_X64)
+struct VectorD {
+  static constexpr size_t Width = 2;
+  __m128d V;
+  static VectorD load(const double *P) { return {_mm_loadu_pd(P)}; }
+  static VectorD splat(double X) { return {_mm_set1_pd(X)}; }
+  void store(double *P) const { _mm_storeu_pd(P, V); }
+  friend VectorD operator+(VectorD A, VectorD B) { return {_mm_add_pd(A.V, B.V)}; }
+  friend VectorD operator-(VectorD A, VectorD B) { return {_mm_sub_pd(A.V, B.V)}; }
+  friend VectorD operator*(VectorD A, VectorD B) { return {_mm_mul_pd(A.V, B.V)}; }
+  static VectorD less(VectorD A, VectorD B) {
+    return {_mm_and_pd(_mm_cmplt_pd(A.V, B.V), _mm_set1_pd(1.0))};
+  }
+};
+
+struct VectorF {
+  static constexpr size_t Width = 4;
+  __m128 V;
+  static VectorF load(const float *P) { return {_mm_loadu_ps(P)}; }
+  static VectorF splat(float X) { return {_mm_set1_ps(X)}; }
+  void store(float *P) const { _mm_storeu_ps(P, V); }
+  friend VectorF operator+(VectorF A, VectorF B) { return {_mm_add_ps(A.V, B.V)}; }
+  friend VectorF operator-(VectorF A, VectorF B) { return {_mm_sub_ps(A.V, B.V)}; }
+  friend VectorF operator*(VectorF A, VectorF B) { return {_mm_mul_ps(A.V, B.V)}; }
+  static VectorF less(VectorF A, VectorF B) {
+    return {_mm_and_ps(_mm_cmplt_ps(A.V, B.V), _mm_set1_ps(1.0f))};
+  }
+};
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+struct VectorD {
+  static constexpr size_t Width = 2;
+  float64x2_t V;
+  static VectorD load(const double *P) { return {vld1q_f64(P)}; }
+  static VectorD splat(double X) { return {vdupq_n_f64(X)}; }
+  void store(double *P) const { vst1q_f64(P, V); }
+  friend VectorD operator+(VectorD A, VectorD B) { return {vaddq_f64(A.V, B.V)}; }
+  friend VectorD operator-(VectorD A, VectorD B) { return {vsubq_f64(A.V, B.V)}; }
+  friend VectorD operator*(VectorD A, VectorD B) { return {vmulq_f64(A.V, B.V)}; }
+  static VectorD less(VectorD A, VectorD B) {
+    uint64x2_t one = vreinterpretq_u64_f64(vdupq_n_f64(1.0));
+    return {vreinterpretq_f64_u64(vandq_u64(vcltq_f64(A.V, B.V), one))};
+  }
+};
+
+struct VectorF {
+  static constexpr size_t Width = 4;
+  float32x4_t V;
+  static VectorF load(const float *P) { return {vld1q_f32(P)}; }
+  static VectorF splat(float X) { return {vdupq_n_f32(X)}; }
+  void store(float *P) const { vst1q_f32(P, V); }
+  friend VectorF operator+(VectorF A, VectorF B) { return {vaddq_f32(A.V, B.V)}; }
+  friend VectorF operator-(VectorF A, VectorF B) { return {vsubq_f32(A.V, B.V)}; }
+  friend VectorF operator*(VectorF A, VectorF B) { return {vmulq_f32(A.V, B.V)}; }
+  static VectorF less(VectorF A, VectorF B) {
+    uint32x4_t one = vreinterpretq_u32_f32(vdupq_n_f32(1.0f));
+    return {vreinterpretq_f32_u32(vandq_u32(vcltq_f32(A.V, B.V), one))};
+  }
+};
+#else
+struct VectorD {
+  static constexpr size_t Width = 1;
+  double V;
+  static VectorD load(const double *P) { return {*P}; }
+  static VectorD splat(double X) { return {X}; }
+  void store(double *P) const { *P = V; }
+  friend VectorD operator+(VectorD A, VectorD B) { return {A.V + B.V}; }
+  friend VectorD operator-(VectorD A, VectorD B) { return {A.V - B.V}; }
+  friend VectorD operator*(VectorD A, VectorD B) { return {A.V * B.V}; }
+  static VectorD less(VectorD A, VectorD B) { return {A.V < B.V ? 1.0 : 0.0}; }
+};
+
+struct VectorF {
+  static constexpr size_t Width = 1;
+  float V;
+  static VectorF load(const float *P) { return {*P}; }
+  static VectorF splat(float X) { return {X}; }
+  void store(float *P) const { *P = V; }
+  friend VectorF operator+(VectorF A, VectorF B) { return {A.V + B.V}; }
+  friend VectorF operator-(VectorF A, VectorF B) { return {A.V - B.V}; }
+  friend VectorF operator*(VectorF A, VectorF B) { return {A.V * B.V}; }
+  static VectorF less(VectorF A, VectorF B) { return {A.V < B.V ? 1.0f : 0.0f}; }
+};
+#endif
+
+/// A Op B, where Op is one of Kaleidoscope's + - * <, and comparisons give 1 or 0. Integers wrap
+/// around on overflow.
+template <char Op, typename T> inline T applyOp(T A, T B) {
+  static_assert(Op == '+' || Op == '-' || Op == '*' || Op == '<', "unsupported operator");
+  if constexpr (Op == '<') {
+    return A < B ? T(1) : T(0);
+  } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+    using U = std::make_unsigned_t<T>;
+    return static_cast<T>(applyOp<Op>(static_cast<U>(A), static_cast<U>(B)));
+  } else if constexpr (Op == '+') {
+    return A + B;
+  } else if constexpr (Op == '-') {
+    return A - B;
+  } else {
+    return A * B;
+  }
+}
+
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+struct VectorI64 {
+  static constexpr size_t Width = 8;
+  __m512i V;
+  static VectorI64 load(const int64_t *P) { return {_mm512_loadu_si512(P)}; }
+  static VectorI64 splat(int64_t X) { return {_mm512_set1_epi64(X)}; }
+  void store(int64_t *P) const { _mm512_storeu_si512(P, V); }
+  friend VectorI64 operator+(VectorI64 A, VectorI64 B) { return {_mm512_add_epi64(A.V, B.V)}; }
+  friend VectorI64 operator-(VectorI64 A, VectorI64 B) { return {_mm512_sub_epi64(A.V, B.V)}; }
+  friend VectorI64 operator*(VectorI64 A, VectorI64 B) { return {_mm512_mullo_epi64(A.V, B.V)}; }
+  static VectorI64 less(VectorI64 A, VectorI64 B) {
+    __mmask8 mask = _mm512_cmplt_epi64_mask(A.V, B.V);
+    return {_mm512_maskz_mov_epi64(mask, _mm512_set1_epi64(1))};
+  }
+};
+#elif defined(__AVX2__)
+struct VectorI64 {
+  static constexpr size_t Width = 4;
+  __m256i V;
+  static VectorI64 load(const int64_t *P) {
+    return {_mm256_loadu_si256(reinterpret_cast<const __m256i *>(P))};
+  }
+  static VectorI64 splat(int64_t X) { return {_mm256_set1_epi64x(X)}; }
+  void store(int64_t *P) const { _mm256_storeu_si256(reinterpret_cast<__m256i *>(P), V); }
+  friend VectorI64 operator+(VectorI64 A, VectorI64 B) { return {_mm256_add_epi64(A.V, B.V)}; }
+  friend VectorI64 operator-(VectorI64 A, VectorI64 B) { return {_mm256_sub_epi64(A.V, B.V)}; }
+  // The low 64 bits of the product, from the three 32x32-bit products that reach them.
+  friend VectorI64 operator*(VectorI64 A, VectorI64 B) {
+    __m256i low = _mm256_mul_epu32(A.V, B.V);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(A.V, 32), B.V),
+                                     _mm256_mul_epu32(A.V, _mm256_srli_epi64(B.V, 32)));
+    return {_mm256_add_epi64(low, _mm256_slli_epi64(cross, 32))};
+  }
+  static VectorI64 less(VectorI64 A, VectorI64 B) {
+    return {_mm256_and_si256(_mm256_cmpgt_epi64(B.V, A.V), _mm256_set1_epi64x(1))};
+  }
+};
+#else
+struct VectorI64 {
+  static constexpr size_t Width = 1;
+  int64_t V;
+  static VectorI64 load(const int64_t *P) { return {*P}; }
+  static VectorI64 splat(int64_t X) { return {X}; }
+  void store(int64_t *P) const { *P = V; }
+  friend VectorI64 operator+(VectorI64 A, VectorI64 B) { return {applyOp<'+'>(A.V, B.V)}; }
+  friend VectorI64 operator-(VectorI64 A, VectorI64 B) { return {applyOp<'-'>(A.V, B.V)}; }
+  friend VectorI64 operator*(VectorI64 A, VectorI64 B) { return {applyOp<'*'>(A.V, B.V)}; }
+  static VectorI64 less(VectorI64 A, VectorI64 B) { return {A.V < B.V ? 1 : 0}; }
+};
+#endif
+
+// The vector wrapper for columns of T.
+template <typename T> struct VectorFor {};
+template <> struct VectorFor<double> { using Type = VectorD; };
+template <> struct VectorFor<float> { using Type = VectorF; };
+template <> struct VectorFor<int64_t> { using Type = VectorI64; };
+
+/// Dst[i] = A[i] Op B[i] for i < N, for columns of double, float or int64_t.
+template <char Op, typename T>
+inline void applyColumns(T *Dst, const T *A, const T *B, size_t N) {
+  using VectorT = typename VectorFor<T>::Type;
+  size_t i = 0;
+  for (; i + VectorT::Width <= N; i += VectorT::Width) {
+    VectorT lhs = VectorT::load(A + i), rhs = VectorT::load(B + i), result;
+    if constexpr (Op == '+') {
+      result = lhs + rhs;
+    } else if constexpr (Op == '-') {
+      result = lhs - rhs;
+    } else if constexpr (Op == '*') {
+      result = lhs * rhs;
+    } else {
+      result = VectorT::less(lhs, rhs);
+    }
+    result.store(Dst + i);
+  }
+  for (; i < N; ++i) { Dst[i] = applyOp<Op>(A[i], B[i]); }
+}
+
+/// Dst[i] = X for i < N.
+template <typename T> inline void fillColumn(T *Dst, T X, size_t N) {
+  using VectorT = typename VectorFor<T>::Type;
+  size_t i = 0;
+  VectorT value = VectorT::splat(X);
+  for (; i + VectorT::Width <= N; i += VectorT::Width) { value.store(Dst + i); }
+  for (; i < N; ++i) { Dst[i] = X; }
+}
+
+// The sum of the first N elements of A, or with B, of their products with B's. The additions run
+// in four independent vector accumulators, so that each waits on none of the three before it;
+// the order they happen in depends only on N and the vector width.
+template <bool Products>
+inline double sumColumnsImpl(const double *A, const double *B, size_t N) {
+  constexpr size_t Width = VectorD::Width;
+  VectorD acc[4] = {VectorD::splat(0.0), VectorD::splat(0.0), VectorD::splat(0.0),
+                    VectorD::splat(0.0)};
+  auto element = [&](size_t i) {
+    if constexpr (Products) {
+      return VectorD::load(A + i) * VectorD::load(B + i);
+    } else {
+      return VectorD::load(A + i);
+    }
+  };
+  size_t i = 0;
+  for (; i + 4 * Width <= N; i += 4 * Width) {
+    for (size_t k = 0; k < 4; ++k) { acc[k] = acc[k] + element(i + k * Width); }
+  }
+  for (; i + Width <= N; i += Width) { acc[0] = acc[0] + element(i); }
+
+  double lanes[Width];
+  ((acc[0] + acc[1]) + (acc[2] + acc[3])).store(lanes);
+  double sum = 0.0;
+  for (size_t k = 0; k < Width; ++k) { sum += lanes[k]; }
+  for (; i < N; ++i) { sum += Products ? A[i] * B[i] : A[i]; }
+  return sum;
+}
+
+/// A[0] + ... + A[N-1].
+inline double sumColumn(const double *A, size_t N) { return sumColumnsImpl<false>(A, nullptr, N); }
+
+/// A[0]*B[0] + ... + A[N-1]*B[N-1].
+inline double dotColumns(const double *A, const double *B, size_t N) {
+  return sumColumnsImpl<true>(A, B, N);
+}
+
+#endif // KALEIDOSCOPE_VECTORKERNELS_H
@@ -0,0 +1,197 @@
+#include "Inliner.h"
+#include "Interpreter.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "Tiering.h"
+#include "TopLevelItems.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+//=========================
+// Interpreter Throughput
+//=========================
+
+// A small module in the shape our tooling sends: a handful of helpers that call each other, and
+// an entry point that is called over and over. tally is the same kind of entry point over integer
+// counters, so it also runs over int64_t columns.
+static const char *Prelude = R"(
+def square(x) x*x;
+def lerp(a b t) a + (b-a)*t;
+def clamp01(x) x * (0 < x) * (x < 1) + (1 < x);
+def score(a b c) clamp01(lerp(square(a), square(b), c) * 0.5) + (a < b) - c*0.25;
+def tally(a b c) square(c - a) * (a < c) + b - 3*c;
+)";
+
+typedef bool (Interpreter::*CallFn)(Symbol, const double *, size_t, double &);
+
+// Call Entry Iterations times and print the achieved call rate. Every call of the entry point
+// makes four nested calls, which are counted too, even once they have been inlined away or are
+// answered from a memo table.
+static void measure(const char *Label, Interpreter &Interp, CallFn Call, Symbol Entry,
+                    long Iterations) {
+  double args[3] = {0.25, 0.75, 0.5};
+  double checksum = 0.0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (long i = 0; i < Iterations; ++i) {
+    double result;
+    args[2] = (i & 1023) * (1.0 / 1024);
+    if (!(Interp.*Call)(Entry, args, 3, result)) { exit(1); }
+    checksum += result;
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  double calls = 5.0 * Iterations;
+  printf("%-9s %10.3f s  %12.0f calls/s  (checksum %g)\n", Label, elapsed.count(),
+         calls / elapsed.count(), checksum);
+}
+
+// Evaluate Entry, which makes CallsPerRow calls in all, over Iterations rows of T with one batch
+// call. Rows take the same arguments measure() uses, or with Counting, count through the same
+// cycle in integers without scaling it down.
+template <typename T>
+static void measureBatch(const char *Label, Interpreter &Interp, Symbol Entry, double CallsPerRow,
+                         bool Counting, long Iterations) {
+  std::vector<T> a(Iterations), b(Iterations), c(Iterations), out(Iterations);
+  for (long i = 0; i < Iterations; ++i) {
+    if (Counting) {
+      a[i] = 256;
+      b[i] = 768;
+      c[i] = i & 1023;
+    } else {
+      a[i] = T(0.25);
+      b[i] = T(0.75);
+      c[i] = T((i & 1023) * (1.0 / 1024));
+    }
+  }
+  const T *args[3] = {a.data(), b.data(), c.data()};
+
+  auto start = std::chrono::steady_clock::now();
+  if (!Interp.callBatch(Entry, args, 3, Iterations, out.data())) { exit(1); }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  double checksum = 0.0;
+  for (T result : out) { checksum += static_cast<double>(result); }
+  double calls = CallsPerRow * Iterations;
+  printf("%-9s %10.3f s  %12.0f calls/s  (checksum %g)\n", Label, elapsed.count(),
+         calls / elapsed.count(), checksum);
+}
+
+// Call Entry Iterations times on each of NumThreads threads, with interpreters that share Interp's
+// function table, while another thread keeps publishing Redefinition again. Lookups never wait
+// for the writer, so the readers' call rate should hold up however often it publishes.
+static void measureShared(ASTContext &Ctx, Interpreter &Interp, Symbol Entry,
+                          FunctionAST *Redefinition, unsigned NumThreads, long Iterations) {
+  std::atomic<bool> done{false};
+  std::atomic<unsigned long> updates{0};
+  std::thread writer([&] {
+    ASTContext context(Ctx);
+    Interpreter interp(context, Interp.getRegistry());
+    while (!done.load(std::memory_order_relaxed)) {
+      if (!interp.addFunction(Redefinition)) { exit(1); }
+      updates.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  std::vector<double> checksums(NumThreads);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> readers;
+  for (unsigned t = 0; t < NumThreads; ++t) {
+    readers.emplace_back([&, t] {
+      ASTContext context(Ctx);
+      Interpreter interp(context, Interp.getRegistry());
+      double args[3] = {0.25, 0.75, 0.5};
+      for (long i = 0; i < Iterations; ++i) {
+        double result;
+        args[2] = (i & 1023) * (1.0 / 1024);
+        if (!interp.call(Entry, args, 3, result)) { exit(1); }
+        checksums[t] += result;
+      }
+    });
+  }
+  for (std::thread &reader : readers) { reader.join(); }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  done = true;
+  writer.join();
+
+  double checksum = 0.0;
+  for (double sum : checksums) { checksum += sum; }
+  double calls = 5.0 * Iterations * NumThreads;
+  printf("%-9s %10.3f s  %12.0f calls/s  (checksum %g, %u threads, %lu redefinitions)\n",
+         "shared", elapsed.count(), calls / elapsed.count(), checksum, NumThreads,
+         updates.load());
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 2000000;
+
+  auto source = SourceBuffer::getMemory(Prelude);
+  ASTContext context;
+  Lexer lexer(*source);
+  Parser parser(lexer, context);
+  Interpreter interpreter(context);
+
+  // Load the prelude, once as written and once with the helpers inlined into their callers.
+  std::vector<TopLevelItem> items;
+  parser.getNextToken();
+  if (parseTopLevelItems(parser, items)) { return 1; }
+  for (const TopLevelItem &item : items) {
+    if (item.Kind == TopLevelItem::Item_Definition && !interpreter.addFunction(item.Function)) {
+      return 1;
+    }
+  }
+  ModuleInliner inliner(context, /*Simplify=*/true);
+  inliner.run(items);
+  Interpreter inlined(context);
+  for (const TopLevelItem &item : items) {
+    if (item.Kind == TopLevelItem::Item_Definition && !inlined.addFunction(item.Function)) {
+      return 1;
+    }
+  }
+
+  // And once more with every function compiled to native code before the clock starts.
+  Interpreter native(context);
+  TierCompiler tiers(1);
+  native.setTierCompiler(&tiers);
+  for (const TopLevelItem &item : items) {
+    if (item.Kind == TopLevelItem::Item_Definition && !native.addFunction(item.Function)) {
+      return 1;
+    }
+  }
+
+  Symbol entry = context.intern("score");
+  measure("tree", interpreter, &Interpreter::callTree, entry, iterations);
+  measure("bytecode", interpreter, &Interpreter::call, entry, iterations);
+  measure("inlined", inlined, &Interpreter::call, entry, iterations);
+  double warmup_args[3] = {0.25, 0.75, 0.5}, warmup_result;
+  if (!native.call(entry, warmup_args, 3, warmup_result)) { return 1; }
+  tiers.wait();
+  measure("native", native, &Interpreter::call, entry, iterations);
+  measureBatch<double>("batch", interpreter, entry, 5, false, iterations);
+  measureBatch<float>("batch f32", interpreter, entry, 5, false, iterations);
+  Symbol tally = context.intern("tally");
+  measureBatch<double>("tally f64", interpreter, tally, 2, true, iterations);
+  measureBatch<int64_t>("tally i64", interpreter, tally, 2, true, iterations);
+
+  // The entry point only ever sees 1024 distinct arguments, so every result fits in its table.
+  interpreter.setMemoCapacity(1024);
+  measure("memoized", interpreter, &Interpreter::call, entry, iterations);
+
+  FunctionAST *square = nullptr;
+  for (const TopLevelItem &item : items) {
+    if (item.Kind == TopLevelItem::Item_Definition &&
+        item.Function->getPrototype()->getName() == context.intern("square")) {
+      square = item.Function;
+    }
+  }
+  unsigned num_threads = std::max(2u, std::thread::hardware_concurrency());
+  measureShared(context, interpreter, entry, square, num_threads, iterations / num_threads);
+  return 0;
+}
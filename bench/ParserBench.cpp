@@ -0,0 +1,233 @@
+#include "AST.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "TopLevelItems.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+//=========================
+// Corpora
+//=========================
+
+// Each shape stresses one part of the front end, and takes one knob: how long its chains, argument
+// lists, comment blocks or identifiers are.
+enum Shape { Shape_Chain, Shape_Calls, Shape_Comments, Shape_Identifiers };
+
+struct ShapeInfo {
+  const char *Name;
+  long DefaultKnob;
+  const char *Knob;
+};
+
+static const ShapeInfo Shapes[] = {
+  {"chain", 256, "terms per expression"},
+  {"calls", 64, "arguments per call"},
+  {"comments", 16, "comment lines per definition"},
+  {"identifiers", 64, "characters per identifier"},
+};
+
+static const char Operators[] = {'+', '*', '-', '<'};
+
+// An identifier of Length characters that differs for each (Index, Which).
+static void appendIdentifier(std::string &Out, long Index, long Which, long Length) {
+  size_t start = Out.size();
+  Out += 'v';
+  Out += std::to_string(Which);
+  Out += 'x';
+  Out += std::to_string(Index);
+  while (static_cast<long>(Out.size() - start) < Length) { Out += 'q'; }
+}
+
+// Append one top-level item of the given shape, numbered Index.
+static void appendItem(std::string &Out, Shape S, long Knob, long Index) {
+  switch (S) {
+  case Shape_Chain:
+    // A long run of mixed-precedence operators, which builds one deep tree of BinaryExprASTs.
+    Out += "def chain" + std::to_string(Index) + "(a b)\n  a";
+    for (long i = 1; i < Knob; ++i) {
+      Out += ' ';
+      Out += Operators[(Index + i) % 4];
+      Out += (i & 1) ? " b" : " 1.5";
+      if (i % 16 == 0) { Out += "\n "; }
+    }
+    Out += ";\n";
+    break;
+  case Shape_Calls:
+    // A call with a wide argument list, each argument a small expression.
+    Out += "def calls" + std::to_string(Index) + "(a b) f" + std::to_string(Index % 97) + "(";
+    for (long i = 0; i < Knob; ++i) {
+      if (i) { Out += i % 8 ? ", " : ",\n    "; }
+      Out += (i & 1) ? "a*" : "b+";
+      Out += std::to_string(i);
+    }
+    Out += ");\n";
+    break;
+  case Shape_Comments:
+    // A block of comments before a small definition, which the lexer skips character by character.
+    for (long i = 0; i < Knob; ++i) {
+      Out += "# Comment line " + std::to_string(i) + " about definition " + std::to_string(Index) +
+             ", padded out to the width of an ordinary comment in real code.\n";
+    }
+    Out += "def commented" + std::to_string(Index) + "(x) x*x + 1;\n";
+    break;
+  case Shape_Identifiers:
+    // Long parameter and variable names, which the lexer scans and the context interns.
+    Out += "def ";
+    appendIdentifier(Out, Index, 0, Knob);
+    Out += '(';
+    for (long i = 1; i <= 3; ++i) {
+      if (i > 1) { Out += ' '; }
+      appendIdentifier(Out, Index, i, Knob);
+    }
+    Out += ")\n  ";
+    for (long i = 1; i <= 6; ++i) {
+      if (i > 1) { Out += " + "; }
+      appendIdentifier(Out, Index, (i - 1) % 3 + 1, Knob);
+    }
+    Out += ";\n";
+    break;
+  }
+}
+
+// At least Bytes of source of the given shape, made of whole items.
+static std::string generateCorpus(Shape S, long Knob, size_t Bytes) {
+  std::string corpus;
+  corpus.reserve(Bytes + 4096);
+  for (long i = 0; corpus.size() < Bytes; ++i) { appendItem(corpus, S, Knob, i); }
+  return corpus;
+}
+
+
+//=========================
+// Measurements
+//=========================
+
+static const int Repetitions = 3;
+
+static double seconds(std::chrono::steady_clock::time_point Start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+}
+
+// The process's peak resident set size so far, in MiB (Linux reports it in KiB).
+static double peakRSS() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;
+}
+
+static size_t countNodes(const std::vector<TopLevelItem> &Items) {
+  size_t count = 0;
+  std::vector<const ExprAST *> worklist;
+  for (const TopLevelItem &item : Items) {
+    if (item.Function) { worklist.push_back(item.Function->getBody()); }
+    while (!worklist.empty()) {
+      const ExprAST *E = worklist.back();
+      worklist.pop_back();
+      ++count;
+      if (E->getKind() == ExprAST::Expr_Binary) {
+        auto B = static_cast<const BinaryExprAST *>(E);
+        worklist.push_back(B->getLHS());
+        worklist.push_back(B->getRHS());
+      } else if (E->getKind() == ExprAST::Expr_Call) {
+        for (ExprAST *Arg : static_cast<const CallExprAST *>(E)->getArgs()) {
+          worklist.push_back(Arg);
+        }
+      }
+    }
+  }
+  return count;
+}
+
+// Lex the whole corpus with gettok() and print the best token and byte rates of a few runs.
+static void measureLexer(const char *Label, std::string_view Corpus) {
+  auto source = SourceBuffer::getMemory(Corpus);
+  double best = 1e30;
+  size_t tokens = 0;
+  for (int run = 0; run < Repetitions; ++run) {
+    auto start = std::chrono::steady_clock::now();
+    Lexer lexer(*source);
+    tokens = 0;
+    while (lexer.gettok() != token_eof) { ++tokens; }
+    best = std::min(best, seconds(start));
+  }
+  printf("%-11s lex    %8.3f s  %8.2f Mtok/s   %8.1f MB/s\n", Label, best, tokens / best / 1e6,
+         Corpus.size() / best / 1e6);
+}
+
+// Parse the whole corpus into a fresh context, as the top-level loop does, and print the best node
+// and byte rates of a few runs with the arena size and peak RSS.
+static void measureParser(const char *Label, std::string_view Corpus) {
+  auto source = SourceBuffer::getMemory(Corpus);
+  double best = 1e30;
+  size_t nodes = 0, arena = 0;
+  for (int run = 0; run < Repetitions; ++run) {
+    ASTContext context;
+    std::vector<TopLevelItem> items;
+    auto start = std::chrono::steady_clock::now();
+    Lexer lexer(*source);
+    Parser parser(lexer, context);
+    parser.getNextToken();
+    if (parseTopLevelItems(parser, items)) { exit(1); }
+    best = std::min(best, seconds(start));
+    nodes = countNodes(items);
+    arena = context.getBytesAllocated();
+  }
+  printf("%-11s parse  %8.3f s  %8.2f Mnode/s  %8.1f MB/s  arena %7.1f MB  peak RSS %7.1f MB\n",
+         Label, best, nodes / best / 1e6, Corpus.size() / best / 1e6, arena / 1e6, peakRSS());
+}
+
+static void printUsage(const char *Argv0) {
+  fprintf(stderr, "usage: %s [MiB] [shape[=knob]...]\n", Argv0);
+  fprintf(stderr, "Generates a corpus of about MiB (default 8) of each shape, all by default, and\n"
+                  "measures lexing and parsing it. Shapes, and what their knob sets:\n");
+  for (const ShapeInfo &info : Shapes) {
+    fprintf(stderr, "  %-11s %s (default %ld)\n", info.Name, info.Knob, info.DefaultKnob);
+  }
+}
+
+int main(int argc, char **argv) {
+  int arg = 1;
+  double mib = 8;
+  if (arg < argc && isdigit(static_cast<unsigned char>(argv[arg][0]))) { mib = atof(argv[arg++]); }
+
+  struct Selected {
+    Shape S;
+    long Knob;
+  };
+  std::vector<Selected> selected;
+  for (; arg < argc; ++arg) {
+    const char *eq = strchr(argv[arg], '=');
+    size_t name_length = eq ? eq - argv[arg] : strlen(argv[arg]);
+    auto it = std::find_if(std::begin(Shapes), std::end(Shapes), [&](const ShapeInfo &info) {
+      return std::string_view(info.Name) == std::string_view(argv[arg], name_length);
+    });
+    long knob = eq ? atol(eq + 1) : 0;
+    if (it == std::end(Shapes) || (eq && knob < 1)) {
+      printUsage(argv[0]);
+      return 1;
+    }
+    selected.push_back({static_cast<Shape>(it - std::begin(Shapes)), eq ? knob : it->DefaultKnob});
+  }
+  if (selected.empty()) {
+    for (size_t i = 0; i < std::size(Shapes); ++i) {
+      selected.push_back({static_cast<Shape>(i), Shapes[i].DefaultKnob});
+    }
+  }
+
+  for (const Selected &sel : selected) {
+    std::string corpus = generateCorpus(sel.S, sel.Knob, static_cast<size_t>(mib * 1048576));
+    measureLexer(Shapes[sel.S].Name, corpus);
+    measureParser(Shapes[sel.S].Name, corpus);
+  }
+  return 0;
+}
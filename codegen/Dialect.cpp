@@ -0,0 +1,41 @@
+#include "Dialect.h"
+
+using namespace mlir;
+using namespace kaleidoscope;
+
+#include "KaleidoscopeDialect.cpp.inc"
+
+//=========================
+// Kaleidoscope Dialect
+//=========================
+
+void KaleidoscopeDialect::initialize() {
+  addOperations<
+#define GET_OP_LIST
+#include "KaleidoscopeOps.cpp.inc"
+      >();
+}
+
+/// Folding only ever produces f64 constants, which become kal.constant.
+Operation *KaleidoscopeDialect::materializeConstant(OpBuilder &builder, Attribute value,
+                                                    Type type, Location loc) {
+  auto constant = llvm::dyn_cast<FloatAttr>(value);
+  if (!constant) { return nullptr; }
+  return builder.create<ConstantOp>(loc, type, constant);
+}
+
+
+//=========================
+// Operations
+//=========================
+
+OpFoldResult ConstantOp::fold(FoldAdaptor) { return getValueAttr(); }
+
+LogicalResult BinOp::verify() {
+  llvm::StringRef kind = getKind();
+  if (kind == "+" || kind == "-" || kind == "*" || kind == "<") { return success(); }
+  return emitOpError("unknown binary operator '") << kind << "'";
+}
+
+#define GET_OP_CLASSES
+#include "KaleidoscopeOps.cpp.inc"
@@ -0,0 +1,19 @@
+#ifndef KALEIDOSCOPE_CODEGEN_DIALECT_H
+#define KALEIDOSCOPE_CODEGEN_DIALECT_H
+
+#include "mlir/Bytecode/BytecodeOpInterface.h"
+#include "mlir/IR/Builders.h"
+#include "mlir/IR/BuiltinOps.h"
+#include "mlir/IR/BuiltinTypes.h"
+#include "mlir/IR/Dialect.h"
+#include "mlir/IR/OpDefinition.h"
+#include "mlir/IR/SymbolTable.h"
+#include "mlir/Interfaces/SideEffectInterfaces.h"
+
+// The dialect and op classes are generated from KaleidoscopeOps.td.
+#include "KaleidoscopeDialect.h.inc"
+
+#define GET_OP_CLASSES
+#include "KaleidoscopeOps.h.inc"
+
+#endif // KALEIDOSCOPE_CODEGEN_DIALECT_H
@@ -0,0 +1,120 @@
+#include "FunctionCache.h"
+
+#include "StructuralHash.h"
+
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cstring>
+
+using namespace kaleidoscope;
+
+// Bump whenever code generation changes in a way that makes old entries wrong.
+static constexpr const char *CacheFormatVersion = "kaleidoscope-fc-1";
+
+// Entry layout: magic, encoding length (8 bytes), encoding, zero padding to a 16-byte boundary,
+// then the object file, which runs to the end of the file.
+static constexpr char EntryMagic[8] = {'K', 'A', 'L', 'F', 'C', '0', '0', '1'};
+static constexpr uint64_t ObjectAlignment = 16;
+
+static uint64_t getObjectOffset(uint64_t EncodingSize) {
+  uint64_t end = sizeof(EntryMagic) + sizeof(uint64_t) + EncodingSize;
+  return (end + ObjectAlignment - 1) / ObjectAlignment * ObjectAlignment;
+}
+
+std::string FunctionCache::getDefaultDirectory() {
+  llvm::SmallString<128> path;
+  if (auto xdg = llvm::sys::Process::GetEnv("XDG_CACHE_HOME"); xdg && !xdg->empty()) {
+    path = *xdg;
+  } else if (auto local = llvm::sys::Process::GetEnv("LOCALAPPDATA"); local && !local->empty()) {
+    path = *local;
+  } else if (auto home = llvm::sys::Process::GetEnv("HOME"); home && !home->empty()) {
+    path = *home;
+    llvm::sys::path::append(path, ".cache");
+  } else {
+    return std::string();
+  }
+  llvm::sys::path::append(path, "mlir-project");
+  return std::string(path);
+}
+
+FunctionCache::FunctionCache(std::string Directory, llvm::StringRef Target)
+  : Directory(std::move(Directory)) {
+  Salt = CacheFormatVersion;
+  Salt += '\0';
+  Salt += LLVM_VERSION_STRING;
+  Salt += '\0';
+  Salt += Target.str();
+  Salt += '\0';
+}
+
+FunctionCacheKey FunctionCache::getKey(const ASTContext &Ctx, const FunctionAST *F) const {
+  FunctionCacheKey key;
+  StructuralEncoder(Ctx, key.Encoding).encodeFunction(F);
+  key.Hash = hashBytes(key.Encoding, hashBytes(Salt));
+  return key;
+}
+
+std::string FunctionCache::getPath(const FunctionCacheKey &Key) const {
+  llvm::SmallString<128> path(Directory);
+  std::string name;
+  llvm::raw_string_ostream(name) << llvm::format_hex_no_prefix(Key.Hash, 16) << ".o";
+  llvm::sys::path::append(path, name);
+  return std::string(path);
+}
+
+std::unique_ptr<llvm::MemoryBuffer> FunctionCache::lookup(const FunctionCacheKey &Key) const {
+  std::string path = getPath(Key);
+  uint64_t offset = getObjectOffset(Key.Encoding.size());
+
+  // Check the header against the key before mapping the object itself.
+  auto header = llvm::MemoryBuffer::getFileSlice(path, offset, 0);
+  if (!header) { return nullptr; }
+  const char *data = (*header)->getBufferStart();
+  uint64_t encoding_size;
+  memcpy(&encoding_size, data + sizeof(EntryMagic), sizeof(encoding_size));
+  if (memcmp(data, EntryMagic, sizeof(EntryMagic)) || encoding_size != Key.Encoding.size() ||
+      memcmp(data + sizeof(EntryMagic) + sizeof(encoding_size), Key.Encoding.data(),
+             Key.Encoding.size())) {
+    return nullptr;
+  }
+
+  uint64_t file_size;
+  if (llvm::sys::fs::file_size(path, file_size) || file_size <= offset) { return nullptr; }
+  auto object = llvm::MemoryBuffer::getFileSlice(path, file_size - offset, offset);
+  if (!object) { return nullptr; }
+  return std::move(*object);
+}
+
+void FunctionCache::store(const FunctionCacheKey &Key, llvm::MemoryBufferRef Object) const {
+  if (llvm::sys::fs::create_directories(Directory)) { return; }
+
+  llvm::SmallString<128> model(Directory);
+  llvm::sys::path::append(model, "tmp-%%%%%%%%.o");
+  int fd;
+  llvm::SmallString<128> temp_path;
+  if (llvm::sys::fs::createUniqueFile(model, fd, temp_path)) { return; }
+
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    uint64_t encoding_size = Key.Encoding.size();
+    os.write(EntryMagic, sizeof(EntryMagic));
+    os.write(reinterpret_cast<const char *>(&encoding_size), sizeof(encoding_size));
+    os << Key.Encoding;
+    os.write_zeros(getObjectOffset(encoding_size) - sizeof(EntryMagic) - sizeof(encoding_size) -
+                   encoding_size);
+    os << Object.getBuffer();
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      llvm::sys::fs::remove(temp_path);
+      return;
+    }
+  }
+
+  if (llvm::sys::fs::rename(temp_path, getPath(Key))) { llvm::sys::fs::remove(temp_path); }
+}
@@ -0,0 +1,56 @@
+#ifndef KALEIDOSCOPE_CODEGEN_FUNCTIONCACHE_H
+#define KALEIDOSCOPE_CODEGEN_FUNCTIONCACHE_H
+
+#include "AST.h"
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace kaleidoscope {
+
+// Identifies the compiled code of one definition: its structural encoding (see StructuralHash.h)
+// and a hash of that encoding salted with everything else the code depends on.
+struct FunctionCacheKey {
+  uint64_t Hash = 0;
+  std::string Encoding;
+};
+
+// Object files of compiled definitions, kept on disk so that later runs can map them in instead
+// of generating code again. Entries are salted with the compiler version, target triple and host
+// CPU, so a cache directory can be shared between builds and machines. Each file also records the
+// full encoding it was compiled from, which is compared on lookup, so a hash collision can only
+// cost a recompile.
+//
+// Writes go to a temporary file that is renamed into place, so concurrent runs sharing a
+// directory never see partial entries. Failures to read or write the cache are not errors; the
+// definition is simply compiled as if the cache were absent.
+class FunctionCache {
+  std::string Directory;
+  std::string Salt;
+
+  std::string getPath(const FunctionCacheKey &Key) const;
+
+public:
+  /// $XDG_CACHE_HOME/mlir-project, falling back to ~/.cache/mlir-project (or
+  /// %LOCALAPPDATA%\mlir-project on Windows). Empty if none of these are set.
+  static std::string getDefaultDirectory();
+
+  /// Use Directory, which is created on first store. Target describes the code generator,
+  /// e.g. its triple and CPU.
+  FunctionCache(std::string Directory, llvm::StringRef Target);
+
+  FunctionCacheKey getKey(const ASTContext &Ctx, const FunctionAST *F) const;
+
+  /// The object file stored for Key, mapped from disk, or nullptr if there is none.
+  std::unique_ptr<llvm::MemoryBuffer> lookup(const FunctionCacheKey &Key) const;
+
+  void store(const FunctionCacheKey &Key, llvm::MemoryBufferRef Object) const;
+};
+
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_CODEGEN_FUNCTIONCACHE_H
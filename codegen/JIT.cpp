@@ -0,0 +1,251 @@
+#include "JIT.h"
+
+#include "Dialect.h"
+#include "Passes.h"
+
+#include "mlir/Pass/PassManager.h"
+#include "mlir/Target/LLVMIR/Export.h"
+#include "llvm/ExecutionEngine/Orc/CompileUtils.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TargetSelect.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace kaleidoscope {
+
+// The code of the definitions in one module, produced the first time one of them is called:
+// either an object file mapped from the cache, or LLVM IR that is compiled (and cached) then.
+class FunctionMaterializationUnit : public llvm::orc::MaterializationUnit {
+  KaleidoscopeJIT &Parent;
+  std::unique_ptr<llvm::MemoryBuffer> Object;
+  llvm::orc::ThreadSafeModule Module;
+  std::unique_ptr<FunctionCacheKey> Key;
+
+public:
+  FunctionMaterializationUnit(KaleidoscopeJIT &Parent, llvm::orc::SymbolFlagsMap Symbols,
+                              std::unique_ptr<llvm::MemoryBuffer> Object)
+    : MaterializationUnit(Interface(std::move(Symbols), nullptr)), Parent(Parent),
+      Object(std::move(Object)) {}
+
+  FunctionMaterializationUnit(KaleidoscopeJIT &Parent, llvm::orc::SymbolFlagsMap Symbols,
+                              llvm::orc::ThreadSafeModule Module,
+                              std::unique_ptr<FunctionCacheKey> Key)
+    : MaterializationUnit(Interface(std::move(Symbols), nullptr)), Parent(Parent),
+      Module(std::move(Module)), Key(std::move(Key)) {}
+
+  llvm::StringRef getName() const override { return "KaleidoscopeFunction"; }
+
+  void materialize(std::unique_ptr<llvm::orc::MaterializationResponsibility> R) override {
+    if (!Object) {
+      auto compiled = Parent.compile(std::move(Module), Key.get());
+      if (!compiled) {
+        Parent.JIT->getExecutionSession().reportError(compiled.takeError());
+        R->failMaterialization();
+        return;
+      }
+      Object = std::move(*compiled);
+    }
+    Parent.JIT->getObjLinkingLayer().emit(std::move(R), std::move(Object));
+  }
+
+private:
+  // Definitions are never replaced, so nothing can be overridden.
+  void discard(const llvm::orc::JITDylib &, const llvm::orc::SymbolStringPtr &) override {}
+};
+
+} // namespace kaleidoscope
+
+using namespace kaleidoscope;
+
+// Called from a stub whose function failed to compile; the error has already been reported.
+static void HandleLazyCompileFailure() {
+  fprintf(stderr, "Error: could not compile a function on its first call\n");
+  exit(1);
+}
+
+llvm::Expected<std::unique_ptr<KaleidoscopeJIT>> KaleidoscopeJIT::Create(mlir::MLIRContext &Context) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+
+  auto target_builder = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!target_builder) { return target_builder.takeError(); }
+  std::unique_ptr<KaleidoscopeJIT> result(new KaleidoscopeJIT(Context, *target_builder));
+
+  auto target = result->TargetBuilder.createTargetMachine();
+  if (!target) { return target.takeError(); }
+  result->Target = std::move(*target);
+
+  auto jit = llvm::orc::LLJITBuilder().setJITTargetMachineBuilder(result->TargetBuilder).create();
+  if (!jit) { return jit.takeError(); }
+  result->JIT = std::move(*jit);
+  llvm::orc::LLJIT &J = *result->JIT;
+
+  const llvm::Triple &triple = result->TargetBuilder.getTargetTriple();
+  auto call_through = llvm::orc::createLocalLazyCallThroughManager(
+      triple, J.getExecutionSession(), llvm::orc::ExecutorAddr::fromPtr(&HandleLazyCompileFailure));
+  if (!call_through) { return call_through.takeError(); }
+  result->CallThrough = std::move(*call_through);
+  result->Stubs = llvm::orc::createLocalIndirectStubsManagerBuilder(triple)();
+
+  auto process_symbols = llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+      J.getDataLayout().getGlobalPrefix());
+  if (!process_symbols) { return process_symbols.takeError(); }
+  J.getMainJITDylib().addGenerator(std::move(*process_symbols));
+
+  // Bodies resolve their calls through the main dylib and never against each other directly, so
+  // linking one body does not pull in the bodies of everything it calls.
+  auto bodies = J.createJITDylib("kaleidoscope.bodies");
+  if (!bodies) { return bodies.takeError(); }
+  result->Bodies = &*bodies;
+  J.getMainJITDylib().withLinkOrderDo([&](const llvm::orc::JITDylibSearchOrder &Order) {
+    result->Bodies->setLinkOrder(Order, /*LinkAgainstThisJITDylibFirst=*/false);
+  });
+
+  return result;
+}
+
+void KaleidoscopeJIT::enableCache(std::string Directory) {
+  std::string target = TargetBuilder.getTargetTriple().str();
+  target += '\0';
+  target += TargetBuilder.getCPU();
+  target += '\0';
+  target += TargetBuilder.getFeatures().getString();
+  Cache = std::make_unique<FunctionCache>(std::move(Directory), target);
+}
+
+llvm::Error KaleidoscopeJIT::checkRedefinition(llvm::StringRef Name) {
+  if (Defined.contains(Name)) {
+    return llvm::make_error<llvm::StringError>(
+        "redefinition of '" + Name.str() + "' is not supported by the JIT",
+        llvm::inconvertibleErrorCode());
+  }
+  return llvm::Error::success();
+}
+
+llvm::Error KaleidoscopeJIT::checkRedefinitions(mlir::ModuleOp Module) {
+  for (auto func : Module.getOps<FuncOp>()) {
+    if (func.isExternal()) { continue; }
+    if (auto err = checkRedefinition(func.getSymName())) { return err; }
+  }
+  return llvm::Error::success();
+}
+
+// Lower a Kaleidoscope-dialect module to LLVM IR in a context of its own.
+llvm::Expected<llvm::orc::ThreadSafeModule> KaleidoscopeJIT::translate(mlir::ModuleOp Module) {
+  mlir::PassManager pm(&Context);
+  buildLoweringPipeline(pm, LoweringLevel::LLVM);
+  if (mlir::failed(pm.run(Module))) {
+    return llvm::make_error<llvm::StringError>("failed to lower module to the LLVM dialect",
+                                               llvm::inconvertibleErrorCode());
+  }
+
+  auto llvm_context = std::make_unique<llvm::LLVMContext>();
+  auto llvm_module = mlir::translateModuleToLLVMIR(Module, *llvm_context);
+  if (!llvm_module) {
+    return llvm::make_error<llvm::StringError>("failed to translate module to LLVM IR",
+                                               llvm::inconvertibleErrorCode());
+  }
+  llvm_module->setDataLayout(JIT->getDataLayout());
+  return llvm::orc::ThreadSafeModule(std::move(llvm_module), std::move(llvm_context));
+}
+
+llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>
+KaleidoscopeJIT::compile(llvm::orc::ThreadSafeModule Module, const FunctionCacheKey *Key) {
+  llvm::orc::SimpleCompiler compiler(*Target);
+  auto object = Module.withModuleDo([&](llvm::Module &M) { return compiler(M); });
+  if (!object) { return object.takeError(); }
+  if (Cache && Key) { Cache->store(*Key, (*object)->getMemBufferRef()); }
+  return object;
+}
+
+// Define Unit's symbols in the bodies dylib, with a lazy stub for each in the main dylib.
+llvm::Error KaleidoscopeJIT::addBody(std::unique_ptr<FunctionMaterializationUnit> Unit) {
+  llvm::orc::SymbolAliasMap aliases;
+  for (auto &[name, flags] : Unit->getSymbols()) { aliases[name] = {name, flags}; }
+  if (auto err = Bodies->define(std::move(Unit))) { return err; }
+  return JIT->getMainJITDylib().define(
+      llvm::orc::lazyReexports(*CallThrough, *Stubs, *Bodies, std::move(aliases)));
+}
+
+llvm::Expected<bool> KaleidoscopeJIT::addCached(llvm::StringRef Name, const FunctionCacheKey &Key) {
+  if (!Cache) { return false; }
+  if (auto err = checkRedefinition(Name)) { return std::move(err); }
+
+  auto object = Cache->lookup(Key);
+  if (!object) { return false; }
+
+  llvm::orc::SymbolFlagsMap symbols;
+  symbols[JIT->mangleAndIntern(Name)] =
+      llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+  if (auto err = addBody(
+          std::make_unique<FunctionMaterializationUnit>(*this, std::move(symbols), std::move(object)))) {
+    return std::move(err);
+  }
+  Defined.insert(Name);
+  return true;
+}
+
+llvm::Error KaleidoscopeJIT::addLazy(mlir::ModuleOp Module, const FunctionCacheKey *Key) {
+  if (auto err = checkRedefinitions(Module)) { return err; }
+
+  // Remember the names before lowering rewrites the module.
+  llvm::SmallVector<std::string, 4> names;
+  llvm::orc::SymbolFlagsMap symbols;
+  for (auto func : Module.getOps<FuncOp>()) {
+    if (func.isExternal()) { continue; }
+    names.push_back(func.getSymName().str());
+    symbols[JIT->mangleAndIntern(names.back())] =
+        llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable;
+  }
+
+  auto tsm = translate(Module);
+  if (!tsm) { return tsm.takeError(); }
+  auto key = Key ? std::make_unique<FunctionCacheKey>(*Key) : nullptr;
+  if (auto err = addBody(std::make_unique<FunctionMaterializationUnit>(
+          *this, std::move(symbols), std::move(*tsm), std::move(key)))) {
+    return err;
+  }
+
+  for (auto &name : names) { Defined.insert(name); }
+  return llvm::Error::success();
+}
+
+llvm::Expected<double> KaleidoscopeJIT::runOnce(mlir::ModuleOp Module, llvm::StringRef Name) {
+  if (auto err = checkRedefinitions(Module)) { return std::move(err); }
+
+  auto tsm = translate(Module);
+  if (!tsm) { return tsm.takeError(); }
+
+  // Track the expression's code separately so that it can be freed once it has run.
+  auto tracker = JIT->getMainJITDylib().createResourceTracker();
+  if (auto err = JIT->addIRModule(tracker, std::move(*tsm))) { return std::move(err); }
+
+  auto symbol = JIT->lookup(Name);
+  if (!symbol) {
+    llvm::consumeError(tracker->remove());
+    return symbol.takeError();
+  }
+
+  double result = symbol->toPtr<double (*)()>()();
+  if (auto err = tracker->remove()) { return std::move(err); }
+  return result;
+}
+
+llvm::Expected<KaleidoscopeJIT::DetachedFunction>
+KaleidoscopeJIT::compileDetached(mlir::ModuleOp Module, llvm::StringRef Name) {
+  auto tsm = translate(Module);
+  if (!tsm) { return tsm.takeError(); }
+
+  auto tracker = JIT->getMainJITDylib().createResourceTracker();
+  if (auto err = JIT->addIRModule(tracker, std::move(*tsm))) { return std::move(err); }
+
+  auto symbol = JIT->lookup(Name);
+  if (!symbol) {
+    llvm::consumeError(tracker->remove());
+    return symbol.takeError();
+  }
+  return DetachedFunction{symbol->toPtr<void *>(), std::move(tracker)};
+}
@@ -0,0 +1,95 @@
+#ifndef KALEIDOSCOPE_CODEGEN_JIT_H
+#define KALEIDOSCOPE_CODEGEN_JIT_H
+
+#include "FunctionCache.h"
+
+#include "mlir/IR/BuiltinOps.h"
+#include "mlir/IR/MLIRContext.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/LazyReexports.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <memory>
+
+namespace kaleidoscope {
+
+class FunctionMaterializationUnit;
+
+// Runs Kaleidoscope-dialect modules with LLVM ORC. Definitions are registered lazily: each one
+// sits behind a call-through stub and is only compiled to machine code the first time something
+// calls it. One-off top-level expressions are compiled straight away and their code is freed as
+// soon as they have run.
+//
+// With a FunctionCache, the object code of each definition is stored when it is compiled, and a
+// definition found in the cache is mapped in from disk without generating any code for it.
+class KaleidoscopeJIT {
+  friend class FunctionMaterializationUnit;
+
+  mlir::MLIRContext &Context;
+  llvm::orc::JITTargetMachineBuilder TargetBuilder;
+  std::unique_ptr<llvm::TargetMachine> Target;
+  std::unique_ptr<llvm::orc::LLJIT> JIT;
+  std::unique_ptr<llvm::orc::LazyCallThroughManager> CallThrough;
+  std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs;
+
+  // Where the bodies of definitions live. The main dylib holds a stub for each, which is what
+  // every caller (including other bodies) links against.
+  llvm::orc::JITDylib *Bodies = nullptr;
+
+  std::unique_ptr<FunctionCache> Cache;
+
+  // Names with a registered definition. Code already compiled may be calling them through their
+  // stubs, so they cannot be replaced.
+  llvm::StringSet<> Defined;
+
+  KaleidoscopeJIT(mlir::MLIRContext &Context, llvm::orc::JITTargetMachineBuilder TargetBuilder)
+    : Context(Context), TargetBuilder(std::move(TargetBuilder)) {}
+
+  llvm::Error checkRedefinition(llvm::StringRef Name);
+  llvm::Error checkRedefinitions(mlir::ModuleOp Module);
+  llvm::Expected<llvm::orc::ThreadSafeModule> translate(mlir::ModuleOp Module);
+  llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>
+  compile(llvm::orc::ThreadSafeModule Module, const FunctionCacheKey *Key);
+  llvm::Error addBody(std::unique_ptr<FunctionMaterializationUnit> Unit);
+
+public:
+  /// Set up a JIT for the host. Externs resolve against the symbols of the running process.
+  static llvm::Expected<std::unique_ptr<KaleidoscopeJIT>> Create(mlir::MLIRContext &Context);
+
+  /// Keep compiled definitions in Directory, and use the ones already there.
+  void enableCache(std::string Directory);
+
+  /// The cache in use, or nullptr if caching is off.
+  FunctionCache *getCache() { return Cache.get(); }
+
+  /// Register the definition Name from the cache entry for Key, if there is one. Returns false
+  /// if the cache has no such entry, in which case nothing is registered.
+  llvm::Expected<bool> addCached(llvm::StringRef Name, const FunctionCacheKey &Key);
+
+  /// Register the functions defined in Module without compiling any of them. If Key is given,
+  /// the code is stored in the cache under it once compiled.
+  llvm::Error addLazy(mlir::ModuleOp Module, const FunctionCacheKey *Key = nullptr);
+
+  /// Compile Module, call its zero-argument function Name, and release the code again.
+  llvm::Expected<double> runOnce(mlir::ModuleOp Module, llvm::StringRef Name);
+
+  /// The code of a module compiled on its own, and what frees it.
+  struct DetachedFunction {
+    void *Entry;
+    llvm::orc::ResourceTrackerSP Tracker;
+  };
+
+  /// Compile Module straight away and return the address of its function Name, without
+  /// registering its definitions: nothing else links against them, so their names only have to
+  /// be unique. The code stays until Tracker is removed.
+  llvm::Expected<DetachedFunction> compileDetached(mlir::ModuleOp Module, llvm::StringRef Name);
+};
+
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_CODEGEN_JIT_H
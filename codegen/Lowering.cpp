@@ -0,0 +1,156 @@
+#include "Dialect.h"
+#include "Passes.h"
+
+#include "mlir/Conversion/ArithToLLVM/ArithToLLVM.h"
+#include "mlir/Conversion/FuncToLLVM/ConvertFuncToLLVMPass.h"
+#include "mlir/Conversion/ReconcileUnrealizedCasts/ReconcileUnrealizedCasts.h"
+#include "mlir/Dialect/Arith/IR/Arith.h"
+#include "mlir/Dialect/Func/Extensions/InlinerExtension.h"
+#include "mlir/Dialect/Func/IR/FuncOps.h"
+#include "mlir/Dialect/LLVMIR/LLVMDialect.h"
+#include "mlir/Target/LLVMIR/Dialect/Builtin/BuiltinToLLVMIRTranslation.h"
+#include "mlir/Target/LLVMIR/Dialect/LLVMIR/LLVMToLLVMIRTranslation.h"
+#include "mlir/Transforms/DialectConversion.h"
+#include "mlir/Transforms/Passes.h"
+
+using namespace mlir;
+using namespace kaleidoscope;
+
+//=========================
+// Kaleidoscope -> Standard
+//=========================
+
+namespace {
+
+struct FuncOpLowering : public OpConversionPattern<FuncOp> {
+  using OpConversionPattern<FuncOp>::OpConversionPattern;
+
+  LogicalResult matchAndRewrite(FuncOp op, OpAdaptor adaptor,
+                                ConversionPatternRewriter &rewriter) const override {
+    auto func = rewriter.create<func::FuncOp>(op.getLoc(), op.getSymName(), op.getFunctionType());
+    // Externs become external declarations, which must not be public.
+    if (op.isExternal()) {
+      func.setPrivate();
+    } else if (auto visibility = op.getSymVisibilityAttr()) {
+      func.setSymVisibilityAttr(visibility);
+    }
+    rewriter.inlineRegionBefore(op.getBody(), func.getBody(), func.end());
+    rewriter.eraseOp(op);
+    return success();
+  }
+};
+
+struct ReturnOpLowering : public OpConversionPattern<ReturnOp> {
+  using OpConversionPattern<ReturnOp>::OpConversionPattern;
+
+  LogicalResult matchAndRewrite(ReturnOp op, OpAdaptor adaptor,
+                                ConversionPatternRewriter &rewriter) const override {
+    rewriter.replaceOpWithNewOp<func::ReturnOp>(op, adaptor.getInput());
+    return success();
+  }
+};
+
+struct CallOpLowering : public OpConversionPattern<CallOp> {
+  using OpConversionPattern<CallOp>::OpConversionPattern;
+
+  LogicalResult matchAndRewrite(CallOp op, OpAdaptor adaptor,
+                                ConversionPatternRewriter &rewriter) const override {
+    rewriter.replaceOpWithNewOp<func::CallOp>(op, op.getCalleeAttr(), op->getResultTypes(),
+                                              adaptor.getInputs());
+    return success();
+  }
+};
+
+struct ConstantOpLowering : public OpConversionPattern<ConstantOp> {
+  using OpConversionPattern<ConstantOp>::OpConversionPattern;
+
+  LogicalResult matchAndRewrite(ConstantOp op, OpAdaptor adaptor,
+                                ConversionPatternRewriter &rewriter) const override {
+    rewriter.replaceOpWithNewOp<arith::ConstantOp>(op, op.getValueAttr());
+    return success();
+  }
+};
+
+struct BinOpLowering : public OpConversionPattern<BinOp> {
+  using OpConversionPattern<BinOp>::OpConversionPattern;
+
+  LogicalResult matchAndRewrite(BinOp op, OpAdaptor adaptor,
+                                ConversionPatternRewriter &rewriter) const override {
+    Value lhs = adaptor.getLhs(), rhs = adaptor.getRhs();
+    llvm::StringRef kind = op.getKind();
+    if (kind == "+") {
+      rewriter.replaceOpWithNewOp<arith::AddFOp>(op, lhs, rhs);
+    } else if (kind == "-") {
+      rewriter.replaceOpWithNewOp<arith::SubFOp>(op, lhs, rhs);
+    } else if (kind == "*") {
+      rewriter.replaceOpWithNewOp<arith::MulFOp>(op, lhs, rhs);
+    } else if (kind == "<") {
+      // Comparisons produce 0.0 or 1.0, like every other Kaleidoscope value. A NaN compares
+      // false, as it does in the interpreter and when folding constants.
+      Value less = rewriter.create<arith::CmpFOp>(op.getLoc(), arith::CmpFPredicate::OLT, lhs, rhs);
+      rewriter.replaceOpWithNewOp<arith::UIToFPOp>(op, rewriter.getF64Type(), less);
+    } else {
+      return rewriter.notifyMatchFailure(op, "unknown binary operator");
+    }
+    return success();
+  }
+};
+
+struct LowerToStandardPass
+    : public PassWrapper<LowerToStandardPass, OperationPass<ModuleOp>> {
+  MLIR_DEFINE_EXPLICIT_INTERNAL_INLINE_TYPE_ID(LowerToStandardPass)
+
+  llvm::StringRef getArgument() const override { return "kal-to-std"; }
+
+  void getDependentDialects(DialectRegistry &registry) const override {
+    registry.insert<arith::ArithDialect, func::FuncDialect>();
+  }
+
+  void runOnOperation() override {
+    ConversionTarget target(getContext());
+    target.addLegalDialect<arith::ArithDialect, func::FuncDialect>();
+    target.addIllegalDialect<KaleidoscopeDialect>();
+
+    RewritePatternSet patterns(&getContext());
+    patterns.add<FuncOpLowering, ReturnOpLowering, CallOpLowering, ConstantOpLowering,
+                 BinOpLowering>(&getContext());
+
+    if (failed(applyPartialConversion(getOperation(), target, std::move(patterns)))) {
+      signalPassFailure();
+    }
+  }
+};
+
+} // namespace
+
+std::unique_ptr<Pass> kaleidoscope::createLowerToStandardPass() {
+  return std::make_unique<LowerToStandardPass>();
+}
+
+
+//=========================
+// Pipeline
+//=========================
+
+void kaleidoscope::buildLoweringPipeline(OpPassManager &PM, LoweringLevel Level) {
+  PM.addPass(createLowerToStandardPass());
+
+  // Kaleidoscope functions are small and pure, so inlining and then cleaning up is where most of
+  // the win is.
+  PM.addPass(createInlinerPass());
+  PM.addPass(createCanonicalizerPass());
+  PM.addPass(createCSEPass());
+  if (Level == LoweringLevel::Standard) { return; }
+
+  PM.addPass(createArithToLLVMConversionPass());
+  PM.addPass(createConvertFuncToLLVMPass());
+  PM.addPass(createReconcileUnrealizedCastsPass());
+}
+
+void kaleidoscope::registerCodegenDialects(DialectRegistry &Registry) {
+  Registry.insert<KaleidoscopeDialect, arith::ArithDialect, func::FuncDialect,
+                  LLVM::LLVMDialect>();
+  func::registerInlinerExtension(Registry);
+  registerBuiltinDialectTranslation(Registry);
+  registerLLVMDialectTranslation(Registry);
+}
@@ -0,0 +1,190 @@
+#include "MLIRGen.h"
+
+#include "Dialect.h"
+
+#include "mlir/IR/Diagnostics.h"
+#include "llvm/ADT/SmallVector.h"
+
+using namespace kaleidoscope;
+
+MLIRGen::MLIRGen(mlir::MLIRContext &Context, ASTContext &Ctx) : Ctx(Ctx), Builder(&Context) {
+  Context.getOrLoadDialect<KaleidoscopeDialect>();
+  Module = mlir::ModuleOp::create(Builder.getUnknownLoc());
+}
+
+// Create an empty kal.func for Proto at the end of the module. The caller is responsible for
+// removing any earlier function of the same name.
+mlir::Operation *MLIRGen::declare(PrototypeAST *Proto, llvm::StringRef Name) {
+  Arity[Proto->getName()] = Proto->getArgs().size();
+
+  llvm::SmallVector<mlir::Type, 4> arg_types(Proto->getArgs().size(), Builder.getF64Type());
+  auto type = Builder.getFunctionType(arg_types, Builder.getF64Type());
+
+  Builder.setInsertionPointToEnd(Module->getBody());
+  return Builder.create<FuncOp>(Builder.getUnknownLoc(), Builder.getStringAttr(Name),
+                                mlir::TypeAttr::get(type), mlir::StringAttr());
+}
+
+// Add a private declaration of Name to the top of the module.
+void MLIRGen::declareExternal(llvm::StringRef Name, size_t NumArgs) {
+  mlir::OpBuilder builder(Builder.getContext());
+  builder.setInsertionPointToStart(Module->getBody());
+
+  llvm::SmallVector<mlir::Type, 4> arg_types(NumArgs, builder.getF64Type());
+  auto type = builder.getFunctionType(arg_types, builder.getF64Type());
+  builder.create<FuncOp>(builder.getUnknownLoc(), builder.getStringAttr(Name),
+                         mlir::TypeAttr::get(type), builder.getStringAttr("private"));
+}
+
+mlir::Value MLIRGen::mlirGen(ExprAST *E, PrototypeAST *Proto, mlir::Block &Entry) {
+  auto loc = Builder.getUnknownLoc();
+  switch (E->getKind()) {
+  case ExprAST::Expr_Number:
+    return Builder.create<ConstantOp>(loc, Builder.getF64Type(),
+                                      Builder.getF64FloatAttr(static_cast<NumberExprAST *>(E)->getVal()));
+  case ExprAST::Expr_Variable: {
+    Symbol name = static_cast<VariableExprAST *>(E)->getName();
+    auto Args = Proto->getArgs();
+    // Later parameters shadow earlier ones with the same name.
+    for (size_t i = Args.size(); i-- > 0;) {
+      if (Args[i] == name) { return Entry.getArgument(i); }
+    }
+    mlir::emitError(loc) << "Unknown variable name '" << Ctx.getSpelling(name) << "'";
+    return nullptr;
+  }
+  case ExprAST::Expr_Binary: {
+    auto B = static_cast<BinaryExprAST *>(E);
+    mlir::Value lhs = mlirGen(B->getLHS(), Proto, Entry);
+    if (!lhs) { return nullptr; }
+    mlir::Value rhs = mlirGen(B->getRHS(), Proto, Entry);
+    if (!rhs) { return nullptr; }
+
+    char op = B->getOp();
+    return Builder.create<BinOp>(loc, Builder.getF64Type(),
+                                 Builder.getStringAttr(llvm::StringRef(&op, 1)), lhs, rhs);
+  }
+  case ExprAST::Expr_Call: {
+    auto C = static_cast<CallExprAST *>(E);
+    llvm::StringRef callee = Ctx.getSpelling(C->getCallee());
+    auto it = Arity.find(C->getCallee());
+    if (it == Arity.end()) {
+      mlir::emitError(loc) << "Unknown function referenced '" << callee << "'";
+      return nullptr;
+    }
+    if (it->second != C->getArgs().size()) {
+      mlir::emitError(loc) << "Incorrect # arguments passed to '" << callee << "'";
+      return nullptr;
+    }
+
+    // The callee may have been emitted into a module that has since been taken.
+    if (!Module->lookupSymbol(callee)) { declareExternal(callee, it->second); }
+
+    llvm::SmallVector<mlir::Value, 4> operands;
+    for (ExprAST *Arg : C->getArgs()) {
+      mlir::Value value = mlirGen(Arg, Proto, Entry);
+      if (!value) { return nullptr; }
+      operands.push_back(value);
+    }
+    return Builder.create<CallOp>(loc, Builder.getF64Type(),
+                                  mlir::SymbolRefAttr::get(Builder.getContext(), callee), operands);
+  }
+  }
+  return nullptr;
+}
+
+bool MLIRGen::check(ExprAST *E, PrototypeAST *Proto) {
+  auto loc = Builder.getUnknownLoc();
+  switch (E->getKind()) {
+  case ExprAST::Expr_Number:
+    return true;
+  case ExprAST::Expr_Variable: {
+    Symbol name = static_cast<VariableExprAST *>(E)->getName();
+    for (Symbol Arg : Proto->getArgs()) {
+      if (Arg == name) { return true; }
+    }
+    mlir::emitError(loc) << "Unknown variable name '" << Ctx.getSpelling(name) << "'";
+    return false;
+  }
+  case ExprAST::Expr_Binary: {
+    auto B = static_cast<BinaryExprAST *>(E);
+    return check(B->getLHS(), Proto) && check(B->getRHS(), Proto);
+  }
+  case ExprAST::Expr_Call: {
+    auto C = static_cast<CallExprAST *>(E);
+    size_t arity;
+    if (C->getCallee() == Proto->getName()) {
+      arity = Proto->getArgs().size();
+    } else if (auto it = Arity.find(C->getCallee()); it != Arity.end()) {
+      arity = it->second;
+    } else {
+      mlir::emitError(loc) << "Unknown function referenced '" << Ctx.getSpelling(C->getCallee())
+                           << "'";
+      return false;
+    }
+    if (arity != C->getArgs().size()) {
+      mlir::emitError(loc) << "Incorrect # arguments passed to '"
+                           << Ctx.getSpelling(C->getCallee()) << "'";
+      return false;
+    }
+    for (ExprAST *Arg : C->getArgs()) {
+      if (!check(Arg, Proto)) { return false; }
+    }
+    return true;
+  }
+  }
+  return false;
+}
+
+bool MLIRGen::checkFunction(FunctionAST *F) { return check(F->getBody(), F->getPrototype()); }
+
+std::string MLIRGen::addFunction(FunctionAST *F) {
+  PrototypeAST *Proto = F->getPrototype();
+  std::string name = Proto->getName() == EmptySymbol
+                         ? "__anon_expr" + std::to_string(NumAnonymous++)
+                         : std::string(Ctx.getSpelling(Proto->getName()));
+
+  // Keep the previous function of this name until the new body is known to be valid.
+  mlir::Operation *previous_op = Module->lookupSymbol(name);
+  auto previous_arity = Arity.find(Proto->getName());
+  bool had_previous = previous_arity != Arity.end();
+  size_t previous = had_previous ? previous_arity->second : 0;
+
+  // Declare the function first so that the body can call it.
+  auto func = llvm::cast<FuncOp>(declare(Proto, name));
+  mlir::Block &entry = func.getBody().emplaceBlock();
+  for (size_t i = 0, e = Proto->getArgs().size(); i != e; ++i) {
+    entry.addArgument(Builder.getF64Type(), func.getLoc());
+  }
+
+  Builder.setInsertionPointToStart(&entry);
+  mlir::Value result = mlirGen(F->getBody(), Proto, entry);
+  if (!result) {
+    func.erase();
+    if (had_previous) {
+      Arity[Proto->getName()] = previous;
+    } else {
+      Arity.erase(Proto->getName());
+    }
+    return std::string();
+  }
+  Builder.create<ReturnOp>(func.getLoc(), result);
+
+  if (previous_op) { previous_op->erase(); }
+  return name;
+}
+
+void MLIRGen::addExtern(PrototypeAST *Proto) {
+  llvm::StringRef name = Ctx.getSpelling(Proto->getName());
+  if (auto existing = Module->lookupSymbol<FuncOp>(name)) {
+    if (!existing.isExternal()) { return; }
+    existing.erase();
+  }
+  auto func = llvm::cast<FuncOp>(declare(Proto, name));
+  func.setSymVisibilityAttr(Builder.getStringAttr("private"));
+}
+
+mlir::OwningOpRef<mlir::ModuleOp> MLIRGen::takeModule() {
+  mlir::OwningOpRef<mlir::ModuleOp> taken = std::move(Module);
+  Module = mlir::ModuleOp::create(Builder.getUnknownLoc());
+  return taken;
+}
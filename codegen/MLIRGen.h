@@ -0,0 +1,64 @@
+#ifndef KALEIDOSCOPE_CODEGEN_MLIRGEN_H
+#define KALEIDOSCOPE_CODEGEN_MLIRGEN_H
+
+#include "AST.h"
+
+#include "mlir/IR/Builders.h"
+#include "mlir/IR/BuiltinOps.h"
+#include "mlir/IR/MLIRContext.h"
+#include "mlir/IR/OwningOpRef.h"
+#include "llvm/ADT/DenseMap.h"
+
+#include <string>
+
+namespace kaleidoscope {
+
+// Emits a module in the Kaleidoscope dialect from functions and externs as the parser produces
+// them. Later definitions of a name replace earlier ones, as they do in the interpreter.
+//
+// The module can also be taken away after each function (e.g. to hand every definition to the
+// JIT separately); calls to functions emitted into earlier modules are then declared as externs.
+class MLIRGen {
+  ASTContext &Ctx;
+  mlir::OpBuilder Builder;
+  mlir::OwningOpRef<mlir::ModuleOp> Module;
+
+  // Arity of every function defined or declared so far, to check calls against.
+  llvm::DenseMap<Symbol, size_t> Arity;
+
+  // Anonymous top-level expressions are numbered in the order they arrive.
+  unsigned NumAnonymous = 0;
+
+  mlir::Value mlirGen(ExprAST *E, PrototypeAST *Proto, mlir::Block &Entry);
+  bool check(ExprAST *E, PrototypeAST *Proto);
+  mlir::Operation *declare(PrototypeAST *Proto, llvm::StringRef Name);
+  void declareExternal(llvm::StringRef Name, size_t NumArgs);
+
+public:
+  MLIRGen(mlir::MLIRContext &Context, ASTContext &Ctx);
+
+  /// Emit a definition. Top-level expressions are given the name __anon_expr<N>. Returns the
+  /// name of the emitted function, or an empty string if the body could not be emitted.
+  std::string addFunction(FunctionAST *F);
+
+  /// Check F's body for the errors addFunction would report, without emitting anything.
+  bool checkFunction(FunctionAST *F);
+
+  /// Record that Proto has been defined without going through this MLIRGen, e.g. by loading its
+  /// code from a cache, so that later functions can call it.
+  void addExternalDefinition(PrototypeAST *Proto) {
+    Arity[Proto->getName()] = Proto->getArgs().size();
+  }
+
+  /// Declare an extern, unless a definition of the same name already exists.
+  void addExtern(PrototypeAST *Proto);
+
+  mlir::ModuleOp getModule() { return *Module; }
+
+  /// Hand over everything emitted so far and start a new, empty module.
+  mlir::OwningOpRef<mlir::ModuleOp> takeModule();
+};
+
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_CODEGEN_MLIRGEN_H
@@ -0,0 +1,82 @@
+#include "ORCTier.h"
+
+#include "JIT.h"
+#include "MLIRGen.h"
+#include "NativeCode.h"
+#include "Passes.h"
+
+#include "mlir/IR/DialectRegistry.h"
+#include "mlir/IR/MLIRContext.h"
+#include "mlir/IR/OwningOpRef.h"
+#include "mlir/IR/SymbolTable.h"
+
+#include <atomic>
+#include <string>
+#include <utility>
+
+namespace kaleidoscope {
+
+struct ORCTier::State {
+  mlir::MLIRContext Context;
+  std::unique_ptr<KaleidoscopeJIT> JIT;
+  std::atomic<unsigned> NumPrepared{0};
+
+  explicit State(const mlir::DialectRegistry &Registry) : Context(Registry) {
+    // Functions are emitted on interpreter threads while others are compiled, and no dialect may
+    // be loaded while the context is in use on several threads.
+    Context.loadAllAvailableDialects();
+  }
+};
+
+// One function's code, which is removed from the JIT once the last copy of it is dropped.
+struct ORCTier::Code {
+  std::shared_ptr<State> Shared;
+  llvm::orc::ResourceTrackerSP Tracker;
+
+  ~Code() { llvm::consumeError(Tracker->remove()); }
+};
+
+ORCTier::ORCTier(std::shared_ptr<State> Shared) : Shared(std::move(Shared)) {}
+
+ORCTier::~ORCTier() = default;
+
+llvm::Expected<std::unique_ptr<ORCTier>> ORCTier::Create() {
+  mlir::DialectRegistry registry;
+  registerCodegenDialects(registry);
+  auto shared = std::make_shared<State>(registry);
+  auto jit = KaleidoscopeJIT::Create(shared->Context);
+  if (!jit) { return jit.takeError(); }
+  shared->JIT = std::move(*jit);
+  return std::unique_ptr<ORCTier>(new ORCTier(std::move(shared)));
+}
+
+TierCompiler::CodeFn ORCTier::prepare(ASTContext &Ctx, FunctionAST *Definition) {
+  auto num_args = static_cast<unsigned>(Definition->getPrototype()->getArgs().size());
+  if (num_args > NativeCode::MaxForeignArgs) { return nullptr; }
+
+  MLIRGen codegen(Shared->Context, Ctx);
+  std::string name = codegen.addFunction(Definition);
+  if (name.empty()) { return nullptr; }
+  auto module = std::make_shared<mlir::OwningOpRef<mlir::ModuleOp>>(codegen.takeModule());
+
+  // A function may be tiered up again once it has been redefined, so every one compiled gets a
+  // name of its own.
+  std::string entry = "__tier" + std::to_string(Shared->NumPrepared++) + "_" + name;
+  mlir::SymbolTable::setSymbolName((*module)->lookupSymbol(name), entry);
+
+  std::shared_ptr<State> shared = Shared;
+  return [shared, module, entry, num_args]() -> std::shared_ptr<const NativeCode> {
+    auto compiled = shared->JIT->compileDetached(**module, entry);
+    if (!compiled) {
+      // The function stays in bytecode, which computes the same.
+      llvm::consumeError(compiled.takeError());
+      return nullptr;
+    }
+    auto code = std::make_shared<Code>();
+    code->Shared = shared;
+    code->Tracker = std::move(compiled->Tracker);
+    return NativeCode::wrap(compiled->Entry, num_args, std::move(code));
+  };
+}
+
+} // namespace kaleidoscope
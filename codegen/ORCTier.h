@@ -0,0 +1,40 @@
+#ifndef KALEIDOSCOPE_CODEGEN_ORCTIER_H
+#define KALEIDOSCOPE_CODEGEN_ORCTIER_H
+
+#include "AST.h"
+#include "Tiering.h"
+
+#include "llvm/Support/Error.h"
+
+#include <memory>
+
+namespace kaleidoscope {
+
+// Compiles hot functions for a TierCompiler with LLVM ORC, in place of the built-in x86-64 code
+// generator (see TierCompiler::setBackend). A function is emitted in the Kaleidoscope dialect on
+// the thread that tiers it up, then lowered and compiled on the compiler's thread, in an MLIR
+// context and a JIT of the tier's own. Its code is freed once nothing that could run it is left.
+//
+// Only functions that make no calls are handed over, so the code is a plain function of the
+// arguments, and computes what the bytecode does: the same IEEE operations, on the same values.
+class ORCTier {
+  struct State;
+  struct Code;
+  std::shared_ptr<State> Shared;
+
+  explicit ORCTier(std::shared_ptr<State> Shared);
+
+public:
+  /// Set up a JIT for the host.
+  static llvm::Expected<std::unique_ptr<ORCTier>> Create();
+  ~ORCTier();
+
+  /// Emit Definition, whose names are in Ctx, and return what compiles it; see
+  /// TierCompiler::BackendFn. Functions with more parameters than code compiled elsewhere may take
+  /// stay in bytecode.
+  TierCompiler::CodeFn prepare(ASTContext &Ctx, FunctionAST *Definition);
+};
+
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_CODEGEN_ORCTIER_H
@@ -0,0 +1,29 @@
+#ifndef KALEIDOSCOPE_CODEGEN_PASSES_H
+#define KALEIDOSCOPE_CODEGEN_PASSES_H
+
+#include "mlir/IR/DialectRegistry.h"
+#include "mlir/Pass/Pass.h"
+#include "mlir/Pass/PassManager.h"
+
+#include <memory>
+
+namespace kaleidoscope {
+
+/// Rewrite the Kaleidoscope dialect into the func and arith dialects.
+std::unique_ptr<mlir::Pass> createLowerToStandardPass();
+
+/// How far buildLoweringPipeline takes a module.
+enum class LoweringLevel {
+  Standard, // func + arith, after inlining, canonicalization and CSE
+  LLVM,     // The LLVM dialect, ready for translation to LLVM IR
+};
+
+/// Add the passes that take a Kaleidoscope-dialect module down to Level.
+void buildLoweringPipeline(mlir::OpPassManager &PM, LoweringLevel Level);
+
+/// Register the dialects and extensions the pipeline needs, including translation to LLVM IR.
+void registerCodegenDialects(mlir::DialectRegistry &Registry);
+
+} // namespace kaleidoscope
+
+#endif // KALEIDOSCOPE_CODEGEN_PASSES_H
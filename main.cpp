@@ -1,400 +1,787 @@
-#include <cctype>
+#include "ArrayRuntime.h"
+#include "Diagnostics.h"
+#include "Driver.h"
+#include "Inliner.h"
+#include "Interpreter.h"
+#include "Lexer.h"
+#include "ParallelParse.h"
+#include "Parser.h"
+#include "SerializedAST.h"
+#include "StreamingParse.h"
+#include "Stats.h"
+#include "Tiering.h"
+
+#ifndef _WIN32
+#include "Server.h"
+#endif
+
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <optional>
 #include <string>
-#include <utility>
+#include <string_view>
 #include <vector>
-#include <unordered_map>
+
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+#include "codegen/JIT.h"
+#include "codegen/MLIRGen.h"
+#include "codegen/ORCTier.h"
+#include "codegen/Passes.h"
+
+#include "mlir/IR/MLIRContext.h"
+#include "mlir/Pass/PassManager.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+#endif
 
 //=========================
-// Lexer
+// Top-Level Parsing
 //=========================
 
-// The lexer returns tokens [0-255] if it is an unknown character, otherwise one
-// of these for known things.
-enum Token {
-  token_eof = -1,        // End of file
-  token_def = -2,        // Define
-  token_extern = -3,     // External function
-  token_identifier = -4, // Keyword
-  token_number = -5,     // Numeric data
+// Everything a parsed top-level item is handed to.
+struct Session {
+  ASTContext &Ctx;
+  Parser &P;
+  Interpreter &Interp;
+  RunStats *Stats = nullptr; // Set when timing the run
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  kaleidoscope::MLIRGen *Codegen = nullptr;      // Set when emitting MLIR or JIT-compiling
+  kaleidoscope::KaleidoscopeJIT *JIT = nullptr; // Set when JIT-compiling instead of interpreting
+#endif
 };
 
-static std::string identifier_str; // Filled in if token_identifier
-static double num_val;             // Filled in if token_number
-
-/// gettok - Return the next token from standard input.
-static int gettok() {
-  static char last_char = ' ';
-
-  // Skip any whitespace.
-  while (isspace(last_char)) {
-    last_char = getchar();
-  }
-
-  if (isalpha(last_char)) { // Regular expression: [a-zA-Z][a-zA-Z0-9]*
-    identifier_str = last_char;
-    while (isalnum((last_char = getchar())))
-      identifier_str += last_char;
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+static void LogJITError(llvm::Error Err) {
+  llvm::logAllUnhandledErrors(std::move(Err), llvm::errs(), "Error: ");
+}
+#endif
+
+static void DefineFunction(Session &S, FunctionAST *F) {
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  if (S.JIT) {
+    // A definition compiled by an earlier run is mapped in from the cache without emitting it.
+    std::optional<kaleidoscope::FunctionCacheKey> key;
+    if (auto cache = S.JIT->getCache()) {
+      if (!S.Codegen->checkFunction(F)) { return; }
+      key = cache->getKey(S.Ctx, F);
+      auto name = S.Ctx.getSpelling(F->getPrototype()->getName());
+      auto cached = timePhase(S.Stats, RunStats::Phase_JIT, [&] {
+        return S.JIT->addCached(llvm::StringRef(name.data(), name.size()), *key);
+      });
+      if (!cached) {
+        LogJITError(cached.takeError());
+        return;
+      }
+      if (*cached) {
+        S.Codegen->addExternalDefinition(F->getPrototype());
+        fprintf(stderr, "Parsed a function definition.\n");
+        return;
+      }
+    }
 
-    if (identifier_str == "def") {
-      return token_def;
-    } else if (identifier_str == "extern") {
-      return token_extern;
+    // Register the definition now; it is compiled the first time it is called.
+    if (timePhase(S.Stats, RunStats::Phase_Codegen, [&] { return S.Codegen->addFunction(F); })
+            .empty()) {
+      return;
     }
-    // If the identifier is not a keyword, it is a generic identifier.
-    return token_identifier;
-  } else if (isdigit(last_char) || last_char == '.') {   // Regular expression: [0-9.]+
-    std::string num_str;
-    do {
-      num_str += last_char;
-      last_char = getchar();
-    } while (isdigit(last_char) || last_char == '.');
-
-    num_val = strtod(num_str.c_str(), 0);
-    return token_number;
-  } else if (last_char == '#') {
-    // Comment until end of line.
-    do {
-      last_char = getchar();
-    } while (last_char != EOF && last_char != '\n' && last_char != '\r');
-
-    if (last_char != EOF) {
-      return gettok();
+    auto module = S.Codegen->takeModule();
+    if (auto err = timePhase(S.Stats, RunStats::Phase_JIT,
+                             [&] { return S.JIT->addLazy(*module, key ? &*key : nullptr); })) {
+      LogJITError(std::move(err));
+      return;
     }
-  } else if (last_char == EOF) {
-    // Check for end of file.  Don't eat the EOF.
-    return token_eof;
+    fprintf(stderr, "Parsed a function definition.\n");
+    return;
   }
-
-  // Otherwise, just return the character as its ASCII value.
-  int this_char = last_char;
-  last_char = getchar();
-  return this_char;
+#endif
+  if (timePhase(S.Stats, RunStats::Phase_Lower, [&] { return S.Interp.addFunction(F); })) {
+    fprintf(stderr, "Parsed a function definition.\n");
+  }
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  if (S.Codegen) {
+    timePhase(S.Stats, RunStats::Phase_Codegen, [&] { return S.Codegen->addFunction(F); });
+  }
+#endif
 }
 
+static void DeclareExtern(Session &S, PrototypeAST *Prototype) {
+  S.Interp.addExtern(Prototype);
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  if (S.Codegen) { S.Codegen->addExtern(Prototype); }
+#endif
+  fprintf(stderr, "Parsed an extern\n");
+}
 
-//=========================
-// Abstract Syntax Tree
-//=========================
-
-// Base class for all expression nodes.
-class ExprAST {
-public:
-  virtual ~ExprAST() = default;
-};
-
-// Expression class for numeric literals like "1.0".
-class NumberExprAST : public ExprAST {
-  double Val;
-
-public:
-  NumberExprAST(double Val) : Val(Val) {}
-};
-
-// Expression class for referencing a variable, like "a".
-class VariableExprAST : public ExprAST {
-  std::string Name;
-
-public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
-};
-
-// Expression class for a binary operator.
-class BinaryExprAST : public ExprAST {
-  char Op; // A character representing the operator, e.g. '+'.
-  std::unique_ptr<ExprAST> LHS, RHS;
-
-public:
-  BinaryExprAST(char Op, std::unique_ptr<ExprAST> LHS,
-                std::unique_ptr<ExprAST> RHS)
-    : Op(Op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
-};
-
-// Expression class for function calls.
-class CallExprAST : public ExprAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExprAST>> Args;
-
-public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExprAST>> Args)
-    : Callee(Callee), Args(std::move(Args)) {}
-};
-
-// This class represents the "prototype" for a function, which captures its name,
-// and its argument names (thus implicitly the number of arguments the function takes).
-class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
-
-public:
-  PrototypeAST(const std::string &Name, std::vector<std::string> Args)
-    : Name(Name), Args(std::move(Args)) {}
-
-  const std::string &getName() const { return Name; }
-};
-
-/// This class represents a function definition itself.
-class FunctionAST {
-  std::unique_ptr<PrototypeAST> Prototype;
-  std::unique_ptr<ExprAST> Body;
-
-public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Prototype,
-              std::unique_ptr<ExprAST> Body)
-    : Prototype(std::move(Prototype)), Body(std::move(Body)) {}
-};
+// Evaluate a top-level expression, parsed into an anonymous function.
+static void EvaluateTopLevel(Session &S, FunctionAST *F) {
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  if (S.JIT) {
+    std::string name =
+        timePhase(S.Stats, RunStats::Phase_Codegen, [&] { return S.Codegen->addFunction(F); });
+    if (name.empty()) { return; }
+    auto module = S.Codegen->takeModule();
+    auto result =
+        timePhase(S.Stats, RunStats::Phase_JIT, [&] { return S.JIT->runOnce(*module, name); });
+    if (!result) {
+      LogJITError(result.takeError());
+      return;
+    }
+    fprintf(stderr, "Evaluated to %f\n", *result);
+    return;
+  }
+#endif
+  double result;
+  if (timePhase(S.Stats, RunStats::Phase_Evaluate, [&] { return S.Interp.evaluate(F, result); })) {
+    fprintf(stderr, "Evaluated to %f\n", result);
+  }
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  if (S.Codegen) {
+    timePhase(S.Stats, RunStats::Phase_Codegen, [&] { return S.Codegen->addFunction(F); });
+  }
+#endif
+}
 
+// Parse one item with Parse, skipping to the next item if it fails. Its errors are collected
+// while it is parsed and printed together afterwards.
+template <typename ParseFn> static auto ParseItem(Session &S, ParseFn Parse) {
+  DiagnosticCapture capture;
+  auto result = timePhase(S.Stats, RunStats::Phase_Parse, [&] {
+    auto parsed = Parse();
+    if (!parsed) { S.P.skipToNextItem(); }
+    return parsed;
+  });
+  capture.print(stderr);
+  return result;
+}
 
-//=========================
-// Logger
-//=========================
+static void HandleDefinition(Session &S) {
+  if (auto F = ParseItem(S, [&] { return S.P.ParseDefinition(); })) { DefineFunction(S, F); }
+}
 
-std::unique_ptr<ExprAST> LogError(const char *Str) {
-  fprintf(stderr, "Error: %s\n", Str);
-  return nullptr;
+static void HandleExtern(Session &S) {
+  if (auto Prototype = ParseItem(S, [&] { return S.P.ParseExtern(); })) {
+    DeclareExtern(S, Prototype);
+  }
 }
 
-std::unique_ptr<PrototypeAST> LogErrorP(const char *Str) {
-  LogError(Str);
-  return nullptr;
+static void HandleTopLevelExpression(Session &S) {
+  if (auto F = ParseItem(S, [&] { return S.P.ParseTopLevelExpr(); })) { EvaluateTopLevel(S, F); }
 }
 
 
 //=========================
-// Parser
+// Driver
 //=========================
 
-static int curr_token;
-static int getNextToken() { return curr_token = gettok(); }
-
-static std::unique_ptr<ExprAST> ParseNumberExpr() {
-  auto result = std::make_unique<NumberExprAST>(num_val);
-  getNextToken(); // Eat the number
-  return std::move(result);
-}
-
-static std::unique_ptr<ExprAST> ParseExpression();
-
-// Parses an expression starting with an open bracket '('.
-static std::unique_ptr<ExprAST> ParseParenExpr() {
-  getNextToken(); // Eat '('
-  auto V = ParseExpression();
-  if (!V) { return nullptr; }
-
-  if (curr_token != ')') { return LogError("expected ')'"); };
-  getNextToken(); // Eat ')'
-  return V;
-}
-
-static std::unique_ptr<ExprAST> ParseIdentifierExpr() {
-  std::string id_name = identifier_str;
-
-  getNextToken();  // Eat identifier
-  if (curr_token != '(') { return std::make_unique<VariableExprAST>(id_name); }
-  
-  getNextToken();  // Eat '('
-  std::vector<std::unique_ptr<ExprAST>> Args;
-  // If the function has arguments, parse the arguments.
-  if (curr_token != ')') {
-    while (true) {
-      if (auto Arg = ParseExpression()) {
-        Args.push_back(std::move(Arg));
-      } else { return nullptr; }
-
-      if (curr_token == ')')
-        break;
-
-      if (curr_token != ',') { return LogError("Expected ')' or ',' in argument list"); }
-      getNextToken();
+static void MainLoop(Session &S) {
+  while (true) {
+    fprintf(stderr, "ready> ");
+    switch (S.P.getCurrToken()) {
+    case token_eof:
+      return;
+    case ';': // Ignore top-level semicolons
+      S.P.getNextToken();
+      break;
+    case token_def:
+      HandleDefinition(S);
+      break;
+    case token_extern:
+      HandleExtern(S);
+      break;
+    default:
+      HandleTopLevelExpression(S);
+      break;
     }
   }
-
-  // Eat the ')'.
-  getNextToken();
-
-  return std::make_unique<CallExprAST>(id_name, std::move(Args));
 }
 
-static std::unique_ptr<ExprAST> ParsePrimary() {
-  switch (curr_token) {
-  default:
-    return LogError("Unknown token when expecting an expression");
-  case token_identifier:
-    return ParseIdentifierExpr();
-  case token_number:
-    return ParseNumberExpr();
-  case '(':
-    return ParseParenExpr();
+// Handle an item parsed ahead of time as MainLoop would have handled it while parsing, printing
+// the errors it reported at the point they would have been reported.
+static void HandleItem(Session &S, const TopLevelItem &Item) {
+  fwrite(Item.Diagnostics.data(), 1, Item.Diagnostics.size(), stderr);
+  switch (Item.Kind) {
+  case TopLevelItem::Item_Definition:
+    DefineFunction(S, Item.Function);
+    break;
+  case TopLevelItem::Item_Extern:
+    DeclareExtern(S, Item.Prototype);
+    break;
+  case TopLevelItem::Item_Expression:
+    EvaluateTopLevel(S, Item.Function);
+    break;
+  case TopLevelItem::Item_Semicolon:
+  case TopLevelItem::Item_Error:
+    break;
   }
 }
 
-// An unordered map that determines the precedence of binary operators (i.e. like BEDMAS) - higher 
-// precendence means that operator will be processed first.
-static std::unordered_map<char, int> BinopPrecedence;
-
-/// Get the precedence of the pending binary operator token.
-static int GetTokenPrecedence() {
-  if (!isascii(curr_token)) { return -1; }
-
-  // Make sure it's a declared binop.
-  int token_precedence = BinopPrecedence[curr_token];
-  if (token_precedence <= 0) {
-    return -1;
-  } else {
-    return token_precedence;
+static void ReplayItems(Session &S, const std::vector<TopLevelItem> &Items) {
+  for (const TopLevelItem &item : Items) {
+    fprintf(stderr, "ready> ");
+    HandleItem(S, item);
   }
+  fprintf(stderr, "ready> ");
 }
 
-static std::unique_ptr<ExprAST> ParseBinOpRHS(int expression_precedence, std::unique_ptr<ExprAST> LHS) {
-  // If this is a binary operator, find its precedence.
-  while (true) {
-    int token_precedence = GetTokenPrecedence();
-
-    // If this is a binop that binds at least as tightly as the current binop,
-    // consume it, otherwise we are done.
-    if (token_precedence < expression_precedence) { return LHS; }
+// Parse the whole of Source up front, on NumThreads threads if it is a file, and print the errors
+// found. Returns how many items failed to parse. With FlatBodies, every function body is also
+// encoded as a FlatExpr while it is parsed.
+static unsigned ParseInput(ASTContext &Ctx, SourceBuffer &Source, unsigned NumThreads,
+                           bool Simplify, unsigned MaxDepth, size_t MaxArenaBytes,
+                           RunStats *Stats, std::vector<TopLevelItem> &Items,
+                           bool FlatBodies = false) {
+  if (Source.holdsWholeInput()) {
+    ParallelParser parallel(Ctx, NumThreads, Simplify);
+    parallel.setMaxExpressionDepth(MaxDepth);
+    parallel.setMaxArenaBytes(MaxArenaBytes);
+    parallel.setFlatBodies(FlatBodies);
+    parallel.setStats(Stats);
+    parallel.parse(Source, Items);
+  } else {
+    StreamingParser stream(Ctx, Simplify);
+    stream.setMaxExpressionDepth(MaxDepth);
+    stream.setMaxArenaBytes(MaxArenaBytes);
+    stream.setFlatBodies(FlatBodies);
+    stream.setStats(Stats);
+    const char *keep = Source.end(), *cursor = keep;
+    while (!stream.exceededMaxArenaBytes() && Source.refill(keep, cursor)) {
+      stream.feed(std::string_view(Source.begin(), Source.end() - Source.begin()), Items);
+      keep = cursor = Source.end();
+    }
+    stream.finish(Items);
+  }
 
-    int binary_operator = curr_token;
-    getNextToken();  // Eat binary operator
+  unsigned num_errors = 0;
+  for (const TopLevelItem &item : Items) {
+    fwrite(item.Diagnostics.data(), 1, item.Diagnostics.size(), stderr);
+    if (item.Kind == TopLevelItem::Item_Error) { ++num_errors; }
+  }
+  return num_errors;
+}
 
-    // Parse the primary expression after the binary operator.
-    auto RHS = ParsePrimary();
-    if (!RHS) { return nullptr; }
+// Inline calls to small functions throughout Items, which hold the whole input, and drop the
+// definitions nothing calls if StripDead is set.
+static void OptimizeItems(ASTContext &Ctx, std::vector<TopLevelItem> &Items, bool Simplify,
+                          unsigned Threshold, bool StripDead, RunStats *Stats) {
+  PhaseTimer timer(Stats, RunStats::Phase_Inline);
+  ModuleInliner inliner(Ctx, Simplify);
+  inliner.setThreshold(Threshold);
+  inliner.setEliminateDead(StripDead);
+  inliner.run(Items);
+  if (Stats) { Stats->addInlined(inliner.getNumInlined(), inliner.getNumEliminated()); }
+}
 
-    int next_precedence = GetTokenPrecedence();
-    if (token_precedence < next_precedence) {
-      RHS = ParseBinOpRHS(token_precedence + 1, std::move(RHS));
-      if (!RHS) { return nullptr; }
+// Make the array runtime for Ctx when there are arrays to hand scripts: the numbers in each of
+// Paths, separated by whitespace, so that the first file's is array 0, the next's 1, and so on.
+// Returns false, having said why, if one cannot be read.
+static bool LoadArrays(ASTContext &Ctx, unsigned NumThreads, const std::vector<const char *> &Paths,
+                       std::unique_ptr<ArrayRuntime> &Runtime) {
+  if (Paths.empty()) { return true; }
+  Runtime = std::make_unique<ArrayRuntime>(Ctx, NumThreads);
+  for (const char *path : Paths) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+      fprintf(stderr, "Error: could not open '%s'\n", path);
+      return false;
+    }
+    std::vector<double> values;
+    double value;
+    while (fscanf(file, "%lf", &value) == 1) { values.push_back(value); }
+    bool complete = feof(file);
+    fclose(file);
+    if (!complete) {
+      fprintf(stderr, "Error: '%s' holds something other than numbers\n", path);
+      return false;
     }
-    
-    // Merge LHS/RHS.
-    LHS = std::make_unique<BinaryExprAST>(binary_operator, std::move(LHS), std::move(RHS));
+    Runtime->addArray(std::move(values));
   }
+  return true;
 }
 
-// Parse function header.
-static std::unique_ptr<PrototypeAST> ParsePrototype() {
-  if (curr_token != token_identifier) { return LogErrorP("Expected function name in prototype"); }
-
-  std::string func_name = identifier_str;
-  getNextToken();
-
-  if (curr_token != '(') { return LogErrorP("Expected '(' in prototype"); }
-
-  // Read the list of argument names.
-  std::vector<std::string> ArgNames;
-  while (getNextToken() == token_identifier) { ArgNames.push_back(identifier_str); }
-  if (curr_token != ')') { return LogErrorP("Expected ')' in prototype"); }
-
-  getNextToken();  // Eat ')'
+// Parse a stream as it arrives, handling each item as soon as it is complete. The prompt for the
+// next item is printed straight after each one, as MainLoop prints it before blocking. Returns
+// false if parsing stopped at its memory limit.
+static bool StreamLoop(Session &S, SourceBuffer &Source, bool Simplify, unsigned MaxDepth,
+                       size_t MaxArenaBytes) {
+  StreamingParser stream(S.Ctx, Simplify);
+  stream.setMaxExpressionDepth(MaxDepth);
+  stream.setMaxArenaBytes(MaxArenaBytes);
+  stream.setStats(S.Stats);
+  std::vector<TopLevelItem> items;
+  auto handle = [&] {
+    for (const TopLevelItem &item : items) {
+      HandleItem(S, item);
+      fprintf(stderr, "ready> ");
+    }
+    items.clear();
+  };
 
-  return std::make_unique<PrototypeAST>(func_name, std::move(ArgNames));
+  fprintf(stderr, "ready> ");
+  const char *keep = Source.end(), *cursor = keep;
+  while (!stream.exceededMaxArenaBytes() && Source.refill(keep, cursor)) {
+    stream.feed(std::string_view(Source.begin(), Source.end() - Source.begin()), items);
+    handle();
+    keep = cursor = Source.end();
+  }
+  stream.finish(items);
+  handle();
+  return !stream.exceededMaxArenaBytes();
 }
 
-static std::unique_ptr<ExprAST> ParseExpression() {
-  auto LHS = ParsePrimary();
-  if (!LHS)
-    return nullptr;
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+// What -emit= asks for, if anything.
+enum EmitAction {
+  emit_none,
+  emit_mlir,     // The Kaleidoscope dialect, as generated
+  emit_mlir_std, // After lowering to func/arith and optimizing
+  emit_mlir_llvm // After lowering to the LLVM dialect
+};
 
-  return ParseBinOpRHS(0, std::move(LHS));
+// Lower the module as far as Action asks and print it to stdout.
+static int EmitModule(mlir::MLIRContext &Context, kaleidoscope::MLIRGen &Codegen,
+                      EmitAction Action) {
+  mlir::ModuleOp module = Codegen.getModule();
+  if (Action != emit_mlir) {
+    mlir::PassManager pm(&Context);
+    kaleidoscope::buildLoweringPipeline(pm, Action == emit_mlir_std
+                                                ? kaleidoscope::LoweringLevel::Standard
+                                                : kaleidoscope::LoweringLevel::LLVM);
+    if (mlir::failed(pm.run(module))) { return 1; }
+  }
+  module.print(llvm::outs());
+  llvm::outs() << "\n";
+  return 0;
 }
-
-// Parse function definition.
-static std::unique_ptr<FunctionAST> ParseDefinition() {
-  getNextToken();  // Eat 'def'
-  auto Prototype = ParsePrototype();
-  if (!Prototype) { return nullptr; }
-
-  if (auto E = ParseExpression())
-    return std::make_unique<FunctionAST>(std::move(Prototype), std::move(E));
-  return nullptr;
+#endif
+
+// A count of bytes, optionally followed by K, M or G for that many KiB, MiB or GiB.
+static size_t ParseByteCount(const char *Str) {
+  char *end;
+  size_t count = static_cast<size_t>(strtoull(Str, &end, 10));
+  switch (*end) {
+  case 'k':
+  case 'K':
+    return count << 10;
+  case 'm':
+  case 'M':
+    return count << 20;
+  case 'g':
+  case 'G':
+    return count << 30;
+  }
+  return count;
 }
 
-static std::unique_ptr<PrototypeAST> ParseExtern() {
-  getNextToken();  // Eat 'extern'
-  return ParsePrototype();
+static void PrintUsage(const char *Program) {
+  fprintf(stderr, "usage: %s [options] [file...]\n", Program);
+  fprintf(stderr, "Given several files, or @manifest naming one file per line, compiles them in\n"
+                  "parallel and links their externs against each other's definitions.\n");
+  fprintf(stderr, "  -j=<n>           threads for parsing a file or compiling several\n"
+                  "                   (default: one per CPU)\n");
+  fprintf(stderr, "  -no-simplify     keep expressions exactly as written, without folding\n");
+  fprintf(stderr, "  -max-expr-depth=<n>\n"
+                  "                   reject expressions nested more than n deep, or whose\n"
+                  "                   trees are more than n high (default %u, 0 for no limit)\n",
+          DefaultMaxExpressionDepth);
+  fprintf(stderr, "  -max-ast-memory=<n>\n"
+                  "                   stop parsing, with an error, once the ASTs of an input\n"
+                  "                   take more than n bytes (or nK, nM, nG); each file, and each\n"
+                  "                   client of -serve, has a limit of its own; by default there\n"
+                  "                   is no limit\n");
+  fprintf(stderr, "  -no-inline       keep every call; otherwise, when the whole input is parsed\n"
+                  "                   before it runs, small functions are inlined into callers\n");
+  fprintf(stderr, "  -inline-threshold=<n>\n"
+                  "                   inline functions of at most n nodes (default %u)\n",
+          DefaultInlineThreshold);
+  fprintf(stderr, "  -strip-dead      drop the definitions nothing calls, when the whole input is\n"
+                  "                   parsed first; they are no longer reported as parsed\n");
+  fprintf(stderr, "  -memoize=<n>     remember up to n results of each function, and answer\n"
+                  "                   calls with the same arguments from them (default 0)\n");
+  fprintf(stderr, "  -tier-up=<n>     compile a function to native code in the background once\n"
+                  "                   n calls have run its bytecode, e.g. %u (0, the default,\n"
+                  "                   keeps every function in bytecode); code is generated\n",
+          DefaultTierUpThreshold);
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  fprintf(stderr, "                   by LLVM, for the functions that make no calls\n");
+#else
+  fprintf(stderr, "                   by a built-in code generator, on x86-64 only\n");
+#endif
+  fprintf(stderr, "  -array=<file>    hand scripts the numbers in <file> as an array, for the\n"
+                  "                   built-ins len, at, sum, dot, map and reduce; arrays are\n"
+                  "                   numbered 0, 1, ... in the order given\n");
+#ifndef _WIN32
+  fprintf(stderr, "  -serve=<address> keep running, and evaluate what clients send to <address>,\n"
+                  "                   either unix:<path> or [<host>:]<port>; definitions are\n"
+                  "                   shared by every connection until SIGINT or SIGTERM\n");
+#endif
+  fprintf(stderr, "  -emit-ast=<file> write the parsed input to <file> as a serialized AST\n"
+                  "                   instead of running it; such files can be given as input\n");
+  fprintf(stderr, "  -time-report     print the time spent in each phase, and what was parsed\n");
+  fprintf(stderr, "  -stats=<file>    write the same as JSON to <file>\n");
+  fprintf(stderr, "  -trace=<file>    write every timed span to <file> as Chrome trace events\n");
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  fprintf(stderr, "  -emit=mlir       print the Kaleidoscope dialect at end of input\n");
+  fprintf(stderr, "  -emit=mlir-std   print it lowered to func/arith and optimized\n");
+  fprintf(stderr, "  -emit=mlir-llvm  print it lowered to the LLVM dialect\n");
+  fprintf(stderr, "  -jit             compile with ORC instead of interpreting\n");
+  fprintf(stderr, "  -cache           with -jit, reuse code compiled by earlier runs\n");
+  fprintf(stderr, "  -cache-dir=<dir> where -cache keeps it (default ~/.cache/mlir-project)\n");
+#endif
 }
 
-static std::unique_ptr<FunctionAST> ParseTopLevelExpr() {
-  if (auto E = ParseExpression()) {
-    // Make an anonymous prototype.
-    auto Prototype = std::make_unique<PrototypeAST>("", std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(Prototype), std::move(E));
+int main(int argc, char **argv) {
+  std::vector<const char *> input_paths;
+  std::vector<const char *> manifests;
+  unsigned num_threads = 0;
+  bool simplify = true;
+  unsigned max_depth = DefaultMaxExpressionDepth;
+  size_t max_arena_bytes = 0;
+  bool inline_calls = true;
+  unsigned inline_threshold = DefaultInlineThreshold;
+  bool strip_dead = false;
+  uint32_t memo_capacity = 0;
+  uint32_t tier_up_threshold = 0;
+  std::vector<const char *> array_paths;
+  const char *serve_address = nullptr;
+  const char *emit_ast_path = nullptr;
+  bool time_report = false;
+  const char *stats_path = nullptr;
+  const char *trace_path = nullptr;
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  EmitAction emit_action = emit_none;
+  bool use_jit = false;
+  bool use_cache = false;
+  std::string cache_dir;
+#endif
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    if (!strcmp(arg, "-no-simplify")) {
+      simplify = false;
+      continue;
+    } else if (!strncmp(arg, "-j=", 3)) {
+      num_threads = static_cast<unsigned>(atoi(arg + 3));
+      continue;
+    } else if (!strncmp(arg, "-max-expr-depth=", 16)) {
+      max_depth = static_cast<unsigned>(atoi(arg + 16));
+      continue;
+    } else if (!strncmp(arg, "-max-ast-memory=", 16)) {
+      max_arena_bytes = ParseByteCount(arg + 16);
+      continue;
+    } else if (!strcmp(arg, "-no-inline")) {
+      inline_calls = false;
+      continue;
+    } else if (!strncmp(arg, "-inline-threshold=", 18)) {
+      inline_threshold = static_cast<unsigned>(atoi(arg + 18));
+      continue;
+    } else if (!strcmp(arg, "-strip-dead")) {
+      strip_dead = true;
+      continue;
+    } else if (!strncmp(arg, "-memoize=", 9)) {
+      memo_capacity = static_cast<uint32_t>(atoi(arg + 9));
+      continue;
+    } else if (!strncmp(arg, "-tier-up=", 9)) {
+      tier_up_threshold = static_cast<uint32_t>(atoi(arg + 9));
+      continue;
+    } else if (!strncmp(arg, "-array=", 7)) {
+      array_paths.push_back(arg + 7);
+      continue;
+    } else if (!strncmp(arg, "-serve=", 7)) {
+      serve_address = arg + 7;
+      continue;
+    } else if (!strncmp(arg, "-emit-ast=", 10)) {
+      emit_ast_path = arg + 10;
+      continue;
+    } else if (!strcmp(arg, "-time-report")) {
+      time_report = true;
+      continue;
+    } else if (!strncmp(arg, "-stats=", 7)) {
+      stats_path = arg + 7;
+      continue;
+    } else if (!strncmp(arg, "-trace=", 7)) {
+      trace_path = arg + 7;
+      continue;
+    }
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+    if (!strcmp(arg, "-emit=mlir")) {
+      emit_action = emit_mlir;
+      continue;
+    } else if (!strcmp(arg, "-emit=mlir-std")) {
+      emit_action = emit_mlir_std;
+      continue;
+    } else if (!strcmp(arg, "-emit=mlir-llvm")) {
+      emit_action = emit_mlir_llvm;
+      continue;
+    } else if (!strcmp(arg, "-jit")) {
+      use_jit = true;
+      continue;
+    } else if (!strcmp(arg, "-cache")) {
+      use_cache = true;
+      continue;
+    } else if (!strncmp(arg, "-cache-dir=", 11)) {
+      use_cache = true;
+      cache_dir = arg + 11;
+      continue;
+    }
+#endif
+    if (arg[0] == '-') {
+      PrintUsage(argv[0]);
+      return 1;
+    }
+    if (arg[0] == '@') {
+      manifests.push_back(arg + 1);
+    } else {
+      input_paths.push_back(arg);
+    }
   }
-  return nullptr;
-}
 
-static void HandleDefinition() {
-  if (ParseDefinition()) {
-    fprintf(stderr, "Parsed a function definition.\n");
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+  // Several inputs are compiled as a batch rather than read as one interactive session.
+  bool multi_file = input_paths.size() > 1 || !manifests.empty();
+  if (multi_file && (emit_ast_path || strip_dead)) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  // A server reads its input from its clients, and runs until it is stopped.
+  if (serve_address && (!input_paths.empty() || multi_file || emit_ast_path)) {
+    PrintUsage(argv[0]);
+    return 1;
   }
-}
 
-static void HandleExtern() {
-  if (ParseExtern()) {
-    fprintf(stderr, "Parsed an extern\n");
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  // The JIT takes each function's module as soon as it is emitted, leaving nothing to print.
+  if ((use_jit && emit_action != emit_none) || (use_cache && !use_jit) ||
+      (multi_file && (use_jit || emit_action != emit_none))) {
+    PrintUsage(argv[0]);
+    return 1;
   }
-}
+#endif
 
-static void HandleTopLevelExpression() {
-  // Evaluate a top-level expression into an anonymous function.
-  if (ParseTopLevelExpr()) {
-    fprintf(stderr, "Parsed a top-level expr\n");
-  } else {
-    // Skip token for error recovery.
-    getNextToken();
+  std::unique_ptr<RunStats> stats;
+  if (time_report || stats_path || trace_path) {
+    stats = std::make_unique<RunStats>(/*Tracing=*/trace_path != nullptr);
+  }
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  std::unique_ptr<kaleidoscope::ORCTier> orc_tier; // Outlives the compiler that uses it
+#endif
+  std::unique_ptr<TierCompiler> tiers;
+  if (tier_up_threshold) {
+    tiers = std::make_unique<TierCompiler>(tier_up_threshold);
+    tiers->setStats(stats.get());
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+    auto created = kaleidoscope::ORCTier::Create();
+    if (!created) {
+      LogJITError(created.takeError());
+      return 1;
+    }
+    orc_tier = std::move(*created);
+    tiers->setBackend([tier = orc_tier.get()](ASTContext &Ctx, FunctionAST *Definition) {
+      return tier->prepare(Ctx, Definition);
+    });
+#endif
+  }
+  // Report on the run, once it is over, as the options asked. A report that cannot be written
+  // turns a successful run into a failed one.
+  auto finish = [&](const ASTContext &Ctx, int Status) {
+    if (!stats) { return Status; }
+    if (tiers) { tiers->wait(); }
+    if (time_report) {
+      fputc('\n', stderr); // After the last prompt
+      stats->printReport(stderr, Ctx);
+    }
+    if (stats_path && !writeFile(stats_path, stats->toJSON(Ctx))) { return 1; }
+    if (trace_path && !writeFile(trace_path, stats->toChromeTrace())) { return 1; }
+    return Status;
+  };
+
+  if (multi_file) {
+    ASTContext context;
+    MultiFileDriver driver(context, num_threads, simplify);
+    driver.setMaxExpressionDepth(max_depth);
+    driver.setMaxArenaBytes(max_arena_bytes);
+    driver.setStats(stats.get());
+    driver.setInlineThreshold(inline_calls ? inline_threshold : 0);
+    driver.setMemoCapacity(memo_capacity);
+    driver.setTierCompiler(tiers.get());
+    std::unique_ptr<ArrayRuntime> arrays;
+    if (!LoadArrays(context, num_threads, array_paths, arrays)) { return 1; }
+    driver.setArrayRuntime(arrays.get());
+    for (const char *path : manifests) {
+      if (!driver.addManifest(path)) {
+        fprintf(stderr, "Error: could not open manifest '%s'\n", path);
+        return 1;
+      }
+    }
+    for (const char *path : input_paths) { driver.addFile(path); }
+    return finish(context, driver.run() ? 1 : 0);
   }
-}
 
+#ifndef _WIN32
+  if (serve_address) {
+    ASTContext context;
+    std::unique_ptr<ArrayRuntime> arrays;
+    if (!LoadArrays(context, num_threads, array_paths, arrays)) { return 1; }
+    EvaluationServer server(context, num_threads, simplify);
+    server.setMaxExpressionDepth(max_depth);
+    server.setMaxArenaBytes(max_arena_bytes);
+    server.setMemoCapacity(memo_capacity);
+    server.setTierCompiler(tiers.get());
+    server.setStats(stats.get());
+    server.setArrayRuntime(arrays.get());
+    if (arrays) {
+      Interpreter installer(context, server.getRegistry());
+      arrays->install(installer);
+    }
+    if (!server.listen(serve_address)) { return 1; }
+    std::signal(SIGINT, [](int) { EvaluationServer::requestStop(); });
+    std::signal(SIGTERM, [](int) { EvaluationServer::requestStop(); });
+    fprintf(stderr, "Serving on %s\n", serve_address);
+    server.serve();
+    fprintf(stderr, "Served %zu items from %zu connections\n", server.getNumItems(),
+            server.getNumConnections());
+    if (stats) {
+      MemoCounts memo = server.getMemoCounts();
+      stats->addMemo(memo.Hits, memo.Misses, memo.Evictions);
+    }
+    return finish(context, 0);
+  }
+#endif
+
+  // Lex the file named on the command line if there is one, otherwise standard input.
+  const char *input_path = input_paths.empty() ? nullptr : input_paths[0];
+  std::unique_ptr<SourceBuffer> source;
+  if (input_path) {
+    source = SourceBuffer::getFile(input_path);
+    if (!source) {
+      fprintf(stderr, "Error: could not open '%s'\n", input_path);
+      return 1;
+    }
+  } else {
+    source = SourceBuffer::getStream(0);
+  }
 
-//=========================
-// Driver
-//=========================
+  // Every node parsed in this session lives in one context and is released together at exit.
+  ASTContext context;
+
+  // A serialized AST is loaded rather than parsed, and its items handled as if just parsed.
+  std::vector<TopLevelItem> items;
+  bool preparsed = false;
+  if (source->holdsWholeInput() && SerializedAST::isSerialized(*source)) {
+    PhaseTimer timer(stats.get(), RunStats::Phase_Load);
+    auto module = SerializedAST::load(std::move(source));
+    if (!module) { return 1; }
+    module->importInto(context, items);
+    source = SourceBuffer::getMemory(std::string_view());
+    preparsed = true;
+  }
 
-static void MainLoop() {
-  while (true) {
-    fprintf(stderr, "ready> ");
-    switch (curr_token) {
-    case token_eof:
-      return;
-    case ';': // Ignore top-level semicolons
-      getNextToken();
-      break;
-    case token_def:
-      HandleDefinition();
-      break;
-    case token_extern:
-      HandleExtern();
-      break;
-    default:
-      HandleTopLevelExpression();
-      break;
+  if (!inline_calls) { inline_threshold = 0; }
+  auto optimize = [&] {
+    if (inline_threshold || strip_dead) {
+      OptimizeItems(context, items, simplify, inline_threshold, strip_dead, stats.get());
+    }
+  };
+
+  if (emit_ast_path) {
+    // Bodies are encoded flat as they are parsed, which is the form they are written in; those
+    // the inliner rewrites are encoded again from their trees.
+    if (!preparsed &&
+        ParseInput(context, *source, num_threads, simplify, max_depth, max_arena_bytes, stats.get(),
+                   items, /*FlatBodies=*/true)) {
+      return finish(context, 1);
     }
+    optimize();
+    std::string bytes;
+    serializeAST(context, items, bytes);
+    return finish(context, writeFile(emit_ast_path, bytes) ? 0 : 1);
   }
-}
 
-int main() {
-  // Set standard binary operators.
-  BinopPrecedence['<'] = 100;
-  BinopPrecedence['+'] = 200;
-  BinopPrecedence['-'] = 200;
-  BinopPrecedence['*'] = 300;
+  Lexer lexer(*source);
+  Parser parser(lexer, context);
+  ExprSimplifier simplifier(context);
+  if (simplify) { parser.setSimplifier(&simplifier); }
+  parser.setMaxExpressionDepth(max_depth);
+  parser.setMaxArenaBytes(max_arena_bytes);
+  std::unique_ptr<ArrayRuntime> arrays;
+  if (!LoadArrays(context, num_threads, array_paths, arrays)) { return finish(context, 1); }
+  Interpreter interpreter(context);
+  interpreter.setMemoCapacity(memo_capacity);
+  interpreter.setTierCompiler(tiers.get());
+  if (arrays) { arrays->install(interpreter); }
+  Session session{context, parser, interpreter, stats.get()};
+  FrontEndCounts counts;
+  if (stats) { parser.setCounts(&counts); }
+
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  mlir::DialectRegistry registry;
+  kaleidoscope::registerCodegenDialects(registry);
+  mlir::MLIRContext mlir_context(registry);
+  std::unique_ptr<kaleidoscope::MLIRGen> codegen;
+  std::unique_ptr<kaleidoscope::KaleidoscopeJIT> jit;
+  if (emit_action != emit_none || use_jit) {
+    codegen = std::make_unique<kaleidoscope::MLIRGen>(mlir_context, context);
+    session.Codegen = codegen.get();
+  }
+  if (use_jit) {
+    auto created = kaleidoscope::KaleidoscopeJIT::Create(mlir_context);
+    if (!created) {
+      LogJITError(created.takeError());
+      return 1;
+    }
+    jit = std::move(*created);
+    session.JIT = jit.get();
+    if (use_cache) {
+      if (cache_dir.empty()) { cache_dir = kaleidoscope::FunctionCache::getDefaultDirectory(); }
+      if (cache_dir.empty()) {
+        fprintf(stderr, "Error: no cache directory; set XDG_CACHE_HOME or use -cache-dir=\n");
+        return 1;
+      }
+      jit->enableCache(cache_dir);
+    }
+  }
+#endif
 
-  // Prime the first token.
   fprintf(stderr, "ready> ");
-  getNextToken();
+  bool stopped = false; // At the memory limit, which fails the run
+  if (preparsed) {
+    optimize();
+    ReplayItems(session, items);
+  } else if (!source->holdsWholeInput()) {
+    // Standard input or a pipe is parsed as it arrives.
+    stopped = !StreamLoop(session, *source, simplify, max_depth, max_arena_bytes);
+  } else if (num_threads != 1) {
+    // A whole file can be parsed up front, in chunks on several threads.
+    ParallelParser parallel(context, num_threads, simplify);
+    parallel.setMaxExpressionDepth(max_depth);
+    parallel.setMaxArenaBytes(max_arena_bytes);
+    parallel.setStats(stats.get());
+    parallel.parse(*source, items);
+    stopped = parallel.exceededMaxArenaBytes();
+    optimize();
+    ReplayItems(session, items);
+  } else {
+    // Prime the first token.
+    parser.getNextToken();
+
+    // Run the main "interpreter loop" now.
+    MainLoop(session);
+    stopped = parser.exceededMaxArenaBytes();
+    counts.Folded = simplifier.getNumFolded();
+    counts.Shared = simplifier.getNumShared();
+    if (stats) { stats->addCounts(counts); }
+  }
+  if (stats) {
+    MemoCounts memo = interpreter.getMemoCounts();
+    stats->addMemo(memo.Hits, memo.Misses, memo.Evictions);
+  }
 
-  // Run the main "interpreter loop" now.
-  MainLoop();
+#ifdef KALEIDOSCOPE_ENABLE_MLIR
+  if (emit_action != emit_none) {
+    return finish(context, EmitModule(mlir_context, *codegen, emit_action));
+  }
+#endif
 
-  return 0;
-}
\ No newline at end of file
+  return finish(context, stopped ? 1 : 0);
+}
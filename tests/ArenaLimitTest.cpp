@@ -0,0 +1,108 @@
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Lexer.h"
+#include "ParallelParse.h"
+#include "Parser.h"
+#include "StreamingParse.h"
+#include "TopLevelItems.h"
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Checks that the memory limit on parsing is charged to the input alone: what a context already
+// holds does not count, and parsing stops in the same item however the input is parsed.
+
+static int NumFailures = 0;
+
+static void check(bool Condition, const char *What) {
+  if (!Condition) {
+    fprintf(stderr, "FAILED: %s\n", What);
+    ++NumFailures;
+  }
+}
+
+static const size_t Limit = 16 << 10;
+
+// Many definitions, each with names of its own, of which those past Limit are not parsed.
+static std::string makeProgram() {
+  std::string source;
+  for (int i = 0; i < 2000; ++i) {
+    std::string n = std::to_string(i);
+    source += "def f" + n + "(x" + n + " y) x" + n + " * y + f" + n + "(y, 1) - 2\n";
+  }
+  return source;
+}
+
+static bool sameItems(const std::vector<TopLevelItem> &A, const std::vector<TopLevelItem> &B) {
+  if (A.size() != B.size()) { return false; }
+  for (size_t i = 0; i < A.size(); ++i) {
+    if (A[i].Kind != B[i].Kind || A[i].Diagnostics != B[i].Diagnostics) { return false; }
+  }
+  return true;
+}
+
+// Parse Source serially into Items, in Ctx, which may hold other things already.
+static bool parseSerially(ASTContext &Ctx, const std::string &Source,
+                          std::vector<TopLevelItem> &Items) {
+  auto buffer = SourceBuffer::getMemory(Source);
+  Lexer lexer(*buffer);
+  Parser parser(lexer, Ctx);
+  parser.setMaxArenaBytes(Limit);
+  DiagnosticCapture capture;
+  parser.getNextToken();
+  parseTopLevelItems(parser, Items, &capture);
+  return parser.exceededMaxArenaBytes();
+}
+
+// A context that already holds more than the limit, as a server's does once its clients have
+// defined enough, parses a new input up to the limit all the same.
+static void testOnlyTheInputCounts(const std::string &Source) {
+  ASTContext context;
+  std::vector<TopLevelItem> before, items;
+  check(parseSerially(context, Source, before), "an input over the limit stops");
+  check(parseSerially(context, Source, items), "an input over the limit stops again");
+  check(sameItems(before, items), "bytes parsed earlier do not count against a new input");
+  check(items.size() > 10 && items.size() < 2000 &&
+            items.back().Kind == TopLevelItem::Item_Error,
+        "the input stops in an item, which fails");
+}
+
+// Streams cut into pieces, and chunks parsed on threads, stop where a serial parse does.
+static void testEveryParseStopsInTheSameItem(const std::string &Source) {
+  ASTContext context;
+  std::vector<TopLevelItem> serial;
+  parseSerially(context, Source, serial);
+
+  for (size_t size : {size_t(7), size_t(100), size_t(4096)}) {
+    std::vector<TopLevelItem> items;
+    StreamingParser stream(context, /*Simplify=*/false);
+    stream.setMaxArenaBytes(Limit);
+    for (size_t i = 0; i < Source.size() && !stream.exceededMaxArenaBytes(); i += size) {
+      stream.feed(std::string_view(Source).substr(i, size), items);
+    }
+    stream.finish(items);
+    check(stream.exceededMaxArenaBytes() && sameItems(items, serial),
+          "a stream stops in the item a serial parse does");
+  }
+
+  auto buffer = SourceBuffer::getMemory(Source);
+  for (int run = 0; run < 8; ++run) {
+    std::vector<TopLevelItem> items;
+    ParallelParser parallel(context, 4, /*Simplify=*/false, /*MinChunkBytes=*/1024);
+    parallel.setMaxArenaBytes(Limit);
+    parallel.parse(*buffer, items);
+    check(parallel.exceededMaxArenaBytes() && sameItems(items, serial),
+          "chunks parsed on threads stop in the item a serial parse does");
+  }
+}
+
+int main() {
+  std::string source = makeProgram();
+  testOnlyTheInputCounts(source);
+  testEveryParseStopsInTheSameItem(source);
+  if (NumFailures) { return 1; }
+  printf("All arena limit tests passed.\n");
+  return 0;
+}
@@ -0,0 +1,143 @@
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Inliner.h"
+#include "Interpreter.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "TopLevelItems.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Checks that the passes over expressions handle trees far deeper than the thread's stack could
+// hold a frame per node for: a left-associative chain of a million terms is a tree a million
+// nodes high.
+
+static const long ChainLength = 1000000;
+
+static int NumFailures = 0;
+
+static void check(bool Condition, const char *What) {
+  if (!Condition) {
+    fprintf(stderr, "FAILED: %s\n", What);
+    ++NumFailures;
+  }
+}
+
+// First, then " + Term" until there are Length terms.
+static std::string makeChain(const std::string &First, const std::string &Term, long Length) {
+  std::string chain = First;
+  for (long i = 1; i < Length; ++i) { chain += " + " + Term; }
+  return chain;
+}
+
+// Parse Source in full into Items, letting expressions nest MaxDepth deep (0 for no limit).
+// Returns the number of items that failed to parse.
+static unsigned parseAll(ASTContext &Ctx, const std::string &Source,
+                         std::vector<TopLevelItem> &Items, unsigned MaxDepth = 0) {
+  auto buffer = SourceBuffer::getMemory(Source);
+  Lexer lexer(*buffer);
+  Parser parser(lexer, Ctx);
+  parser.setMaxExpressionDepth(MaxDepth);
+  parser.getNextToken();
+  return parseTopLevelItems(parser, Items);
+}
+
+// The number of nodes in E as a tree, and how many of them are calls.
+static void countNodes(const ExprAST *E, size_t &Nodes, size_t &Calls) {
+  std::vector<const ExprAST *> worklist{E};
+  while (!worklist.empty()) {
+    const ExprAST *node = worklist.back();
+    worklist.pop_back();
+    ++Nodes;
+    if (node->getKind() == ExprAST::Expr_Binary) {
+      auto B = static_cast<const BinaryExprAST *>(node);
+      worklist.push_back(B->getLHS());
+      worklist.push_back(B->getRHS());
+    } else if (node->getKind() == ExprAST::Expr_Call) {
+      ++Calls;
+      for (const ExprAST *Arg : static_cast<const CallExprAST *>(node)->getArgs()) {
+        worklist.push_back(Arg);
+      }
+    }
+  }
+}
+
+// A chain is as deep as it is long, even though it takes no brackets: the parser's limit applies
+// to it.
+static void testParserLimit() {
+  ASTContext context;
+  std::vector<TopLevelItem> items;
+  DiagnosticCapture capture;
+  unsigned limit = DefaultMaxExpressionDepth;
+  std::string at_limit = "def f(x) " + makeChain("x", "x", limit + 1);
+  check(parseAll(context, at_limit, items, limit) == 0, "a chain as high as the limit parses");
+  check(parseAll(context, at_limit + " + x", items, limit) == 1,
+        "a chain higher than the limit fails to parse");
+  check(capture.take().find("expression is nested too deeply") != std::string::npos,
+        "the chain is reported as nested too deeply");
+  check(parseAll(context, at_limit + " + x * x", items, limit) == 1,
+        "a chain that ends in a tighter operator counts it too");
+  capture.take();
+}
+
+// Inline a small function into every term of a deep chain, and the deep chain itself into a
+// caller.
+static void testInliner() {
+  ASTContext context;
+  std::vector<TopLevelItem> items;
+  std::string source = "def twice(x) x * 2\n"
+                       "def calls(x) " + makeChain("twice(x)", "twice(x)", ChainLength) + "\n"
+                       "def chain(x) " + makeChain("x", "1", ChainLength) + "\n"
+                       "def caller(y) chain(y)\n";
+  check(parseAll(context, source, items) == 0, "the inliner's input parses");
+  check(items.size() == 4, "the inliner's input is four definitions");
+  if (NumFailures) { return; }
+
+  ModuleInliner inliner(context, false);
+  inliner.setThreshold(2 * ChainLength);
+  inliner.run(items);
+  check(inliner.getNumInlined() == ChainLength + 1, "every call is inlined");
+
+  size_t nodes = 0, calls = 0;
+  countNodes(items[1].Function->getBody(), nodes, calls);
+  check(nodes == 4 * ChainLength - 1 && calls == 0, "the calls are replaced by their bodies");
+  nodes = calls = 0;
+  countNodes(items[3].Function->getBody(), nodes, calls);
+  check(nodes == 2 * ChainLength - 1 && calls == 0, "the chain is inlined into its caller");
+}
+
+// Lower a deep chain to bytecode and run it, walk its tree, and evaluate one as a top-level
+// expression.
+static void testInterpreter() {
+  ASTContext context;
+  std::vector<TopLevelItem> items;
+  std::string source = "def chain(x) " + makeChain("x", "x", ChainLength) + "\n" +
+                       makeChain("chain(1)", "1", ChainLength) + "\n";
+  check(parseAll(context, source, items) == 0, "the interpreter's input parses");
+  check(items.size() == 2, "the interpreter's input is a definition and an expression");
+  if (NumFailures) { return; }
+
+  Interpreter interpreter(context);
+  check(interpreter.addFunction(items[0].Function), "the chain lowers");
+  Symbol chain = items[0].Function->getPrototype()->getName();
+  double arg = 0.5, result = 0;
+  check(interpreter.call(chain, &arg, 1, result) && result == 0.5 * ChainLength,
+        "the chain runs as bytecode");
+  result = 0;
+  check(interpreter.callTree(chain, &arg, 1, result) && result == 0.5 * ChainLength,
+        "the chain runs from its tree");
+  result = 0;
+  check(interpreter.evaluate(items[1].Function, result) && result == 2.0 * ChainLength - 1,
+        "a chain evaluates as a top-level expression");
+}
+
+int main() {
+  testParserLimit();
+  testInliner();
+  testInterpreter();
+  if (NumFailures) { return 1; }
+  printf("All deep expression tests passed.\n");
+  return 0;
+}
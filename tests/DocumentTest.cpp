@@ -0,0 +1,124 @@
+#include "AST.h"
+#include "Document.h"
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks that editing a Document leaves it as parsing its new text from scratch would, and that
+// the errors of the items an edit keeps move with them.
+
+static int NumFailures = 0;
+
+static void check(bool Condition, const std::string &What) {
+  if (!Condition) {
+    fprintf(stderr, "FAILED: %s\n", What.c_str());
+    ++NumFailures;
+  }
+}
+
+// Whether Doc's items are those of a document parsed from its text in one go.
+static bool matchesFreshParse(ASTContext &Ctx, const Document &Doc) {
+  Document fresh(Ctx);
+  fresh.setText(Doc.getText());
+  const std::vector<Document::Item> &items = Doc.getItems();
+  const std::vector<Document::Item> &expected = fresh.getItems();
+  if (items.size() != expected.size()) { return false; }
+  for (size_t i = 0; i < items.size(); ++i) {
+    const Document::Item &item = items[i];
+    const Document::Item &want = expected[i];
+    if (item.Begin != want.Begin || item.End != want.End ||
+        item.Start.Line != want.Start.Line || item.Start.Column != want.Start.Column ||
+        item.Parsed.Kind != want.Parsed.Kind ||
+        Document::getDiagnostics(item) != Document::getDiagnostics(want)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// An edit before an item that is kept moves its errors with it, down and along.
+static void testKeptErrorsMove() {
+  ASTContext context;
+  Document doc(context);
+  doc.setText("def f(x) x\n\n\ndef g(x) x +;\n");
+  check(doc.getItems().size() == 3, "the text parses to two definitions and a semicolon");
+  if (NumFailures) { return; }
+  const std::string error = "Error: 4:13: Unknown token when expecting an expression\n";
+  check(Document::getDiagnostics(doc.getItems()[1]) == error, "the error is where it was made");
+
+  Document::EditResult result = doc.edit(0, 0, "\n\n");
+  check(result.First == 0 && result.NumRemoved == 1 && result.NumAdded == 1,
+        "inserting lines before the first item parses only that item again");
+  check(Document::getDiagnostics(doc.getItems()[1]) ==
+            "Error: 6:13: Unknown token when expecting an expression\n",
+        "the kept item's error moves down with it");
+  check(matchesFreshParse(context, doc), "the document matches a fresh parse after the lines");
+
+  doc.setText("def f(x) x def g(x) x +;");
+  doc.edit(9, 0, "1 + ");
+  check(doc.getItems().size() == 3, "the joined definitions are still two and a semicolon");
+  check(Document::getDiagnostics(doc.getItems()[1]) ==
+            "Error: 1:28: Unknown token when expecting an expression\n",
+        "the kept item's error moves along the line with it");
+  check(matchesFreshParse(context, doc), "the document matches a fresh parse after the insert");
+}
+
+// Edits that fix an error and make another parse those items again.
+static void testReparse() {
+  ASTContext context;
+  Document doc(context);
+  doc.setText("def f(x) x +;\ndef g(y) y * 2;\n");
+  check(!Document::getDiagnostics(doc.getItems()[0]).empty(), "the first definition fails");
+
+  size_t plus = doc.getText().find('+');
+  doc.edit(plus + 1, 0, " 1");
+  check(doc.getItems()[0].Parsed.Kind == TopLevelItem::Item_Definition &&
+            Document::getDiagnostics(doc.getItems()[0]).empty(),
+        "completing the expression fixes the definition");
+  check(matchesFreshParse(context, doc), "the document matches a fresh parse after the fix");
+
+  size_t star = doc.getText().find('*');
+  doc.edit(star, 1, "(");
+  check(Document::getDiagnostics(doc.getItems()[2]) ==
+            "Error: 2:15: Expected ')' or ',' in argument list\n",
+        "breaking the second definition reports it");
+  check(matchesFreshParse(context, doc), "the document matches a fresh parse after the break");
+}
+
+// Random edits, each checked against parsing the whole text again.
+static void testRandomEdits() {
+  static const char *const Snippets[] = {
+      "def ", "extern ", "f", "g(x)", "(", ")", "x", " + ", "*", "<", ";", "\n", "\n\n", " ",
+      "1", "2.5", "h(1, 2)", ",", "# note\n", "def h(a b) a - b;\n",
+  };
+  const size_t num_snippets = sizeof(Snippets) / sizeof(Snippets[0]);
+  ASTContext context;
+  Document doc(context);
+  doc.setText("def f(x) x + 1;\n\ndef g(x y) f(x) * y;\nextern h(a b);\n"
+              "g(1, 2);\n# a comment\ndef k(z)\n  h(z, z) < 3;\nk(4);\n");
+
+  std::mt19937 random(2024);
+  for (int step = 0; step < 2000 && !NumFailures; ++step) {
+    const std::string &text = doc.getText();
+    size_t offset = random() % (text.size() + 1);
+    size_t length = random() % 3 == 0 ? random() % 6 : 0;
+    std::string replacement;
+    for (unsigned n = random() % 3; n > 0; --n) {
+      replacement += Snippets[random() % num_snippets];
+    }
+    doc.edit(offset, length, replacement);
+    check(matchesFreshParse(context, doc),
+          "the document matches a fresh parse after edit " + std::to_string(step));
+  }
+}
+
+int main() {
+  testKeptErrorsMove();
+  testReparse();
+  testRandomEdits();
+  if (NumFailures) { return 1; }
+  printf("All document tests passed.\n");
+  return 0;
+}
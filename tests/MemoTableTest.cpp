@@ -0,0 +1,80 @@
+#include "MemoTable.h"
+
+#include <cstdio>
+
+// Checks that a memo table holds at most one result per arguments: a result that was found but
+// went too deep to be used is replaced where it is, wherever the calls made meanwhile have left
+// it.
+
+static int NumFailures = 0;
+
+static void check(bool Condition, const char *What) {
+  if (!Condition) {
+    fprintf(stderr, "FAILED: %s\n", What);
+    ++NumFailures;
+  }
+}
+
+// A result too deep for the caller is found, and computing it again replaces it.
+static void testTooDeepIsReplaced() {
+  MemoTable table(1, 4);
+  double a = 1.0, result = 0;
+  uint32_t depth = 0;
+  table.insert(&a, 10.0, 10);
+
+  MemoTable::Slot found = MemoTable::NoSlot;
+  check(!table.lookup(&a, 5, result, depth, found), "a result that went too deep is not used");
+  check(found != MemoTable::NoSlot, "a result that went too deep is still found");
+  table.insert(&a, 20.0, 3, found);
+  check(table.size() == 1, "computing it again replaces it rather than adding another");
+  check(table.lookup(&a, 5, result, depth, found) && result == 20.0 && depth == 3,
+        "the replacement answers the next call");
+
+  double b = 2.0;
+  check(!table.lookup(&b, 5, result, depth, found) && found == MemoTable::NoSlot,
+        "arguments the table does not hold are not found");
+  check(table.getCounts().Hits == 1 && table.getCounts().Misses == 2,
+        "a result that went too deep counts as a miss");
+}
+
+// The slot a lookup found may hold other arguments by the time the call is done, and the
+// arguments may have moved to another.
+static void testStaleSlot() {
+  MemoTable table(1, 2);
+  double a = 1.0, b = 2.0, c = 3.0, result = 0;
+  uint32_t depth = 0;
+  table.insert(&a, 10.0, 10);
+  MemoTable::Slot found = MemoTable::NoSlot;
+  table.lookup(&a, 5, result, depth, found);
+
+  // Calls made meanwhile evict a, and its slot goes to c.
+  table.insert(&b, 20.0, 0);
+  table.insert(&c, 30.0, 0);
+  table.insert(&a, 11.0, 2, found);
+  check(table.size() == 2, "the table stays within its capacity");
+  check(table.lookup(&c, 5, result, depth, found) && result == 30.0,
+        "a slot that was reused keeps its new arguments' result");
+  check(table.lookup(&a, 5, result, depth, found) && result == 11.0,
+        "a result for arguments that were evicted is added again");
+
+  // Calls made meanwhile put a back in another slot than the one found.
+  MemoTable moved(1, 2);
+  moved.insert(&a, 10.0, 10);
+  moved.lookup(&a, 5, result, depth, found);
+  moved.insert(&b, 20.0, 0);
+  moved.insert(&c, 30.0, 0);
+  moved.insert(&a, 11.0, 2);
+  moved.insert(&a, 12.0, 1, found);
+  check(moved.size() == 2 && moved.lookup(&c, 5, result, depth, found) && result == 30.0,
+        "arguments put back elsewhere are not added twice");
+  check(moved.lookup(&a, 5, result, depth, found) && result == 12.0 && depth == 1,
+        "arguments put back elsewhere are replaced there");
+}
+
+int main() {
+  testTooDeepIsReplaced();
+  testStaleSlot();
+  if (NumFailures) { return 1; }
+  printf("All memo table tests passed.\n");
+  return 0;
+}
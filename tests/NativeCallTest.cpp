@@ -0,0 +1,79 @@
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Interpreter.h"
+#include "Lexer.h"
+#include "NativeCode.h"
+#include "Parser.h"
+#include "Tiering.h"
+#include "TopLevelItems.h"
+
+#include <cstdio>
+#include <new>
+#include <string>
+#include <vector>
+
+// Checks that a call from compiled code that throws fails with an error, as any failed call
+// does, rather than unwinding through the compiled frames.
+
+static int NumFailures = 0;
+
+static void check(bool Condition, const char *What) {
+  if (!Condition) {
+    fprintf(stderr, "FAILED: %s\n", What);
+    ++NumFailures;
+  }
+}
+
+// A built-in that runs out of memory, as growing the stack for a callee can, is called from a
+// function once it has been compiled.
+static void testThrowingCallee() {
+  ASTContext context;
+  std::vector<TopLevelItem> items;
+  auto buffer = SourceBuffer::getMemory("extern grow(x)\ndef f(x) grow(x) + 1\n");
+  Lexer lexer(*buffer);
+  Parser parser(lexer, context);
+  parser.getNextToken();
+  check(parseTopLevelItems(parser, items) == 0 && items.size() == 2, "the input parses");
+  if (NumFailures) { return; }
+
+  TierCompiler tiers(1);
+  Interpreter interpreter(context);
+  interpreter.setTierCompiler(&tiers);
+  bool fail = false;
+  interpreter.addNative(items[0].Prototype,
+                        [&fail](Interpreter &, const double *Args, double &Result) {
+                          if (fail) { throw std::bad_alloc(); }
+                          Result = Args[0];
+                          return true;
+                        });
+  check(interpreter.addFunction(items[1].Function), "the function lowers");
+
+  Symbol f = items[1].Function->getPrototype()->getName();
+  double arg = 2, result = 0;
+  check(interpreter.call(f, &arg, 1, result) && result == 3, "the bytecode calls the built-in");
+  tiers.wait();
+  check(interpreter.call(f, &arg, 1, result) && result == 3, "the compiled code calls it too");
+
+  fail = true;
+  DiagnosticCapture capture;
+  check(!interpreter.call(f, &arg, 1, result), "a call that throws fails");
+  std::string errors = capture.take();
+#ifdef KALEIDOSCOPE_NATIVE_TIER
+  check(errors.find("Out of memory in call to 'grow'") != std::string::npos,
+        "running out of memory under compiled code is reported");
+#endif
+}
+
+int main() {
+  try {
+    testThrowingCallee();
+  } catch (const std::bad_alloc &) {
+    // Only bytecode callers, which are C++ frames, may let it through.
+#ifdef KALEIDOSCOPE_NATIVE_TIER
+    check(false, "running out of memory under compiled code does not unwind through it");
+#endif
+  }
+  if (NumFailures) { return 1; }
+  printf("All native call tests passed.\n");
+  return 0;
+}
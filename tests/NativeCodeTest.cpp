@@ -0,0 +1,219 @@
+#include "AST.h"
+#include "Diagnostics.h"
+#include "Interpreter.h"
+#include "Lexer.h"
+#include "NativeCode.h"
+#include "Parser.h"
+#include "Simplify.h"
+#include "Tiering.h"
+#include "TopLevelItems.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Checks that compiled functions compute what their bytecode does, bit for bit, for every opcode
+// and for the awkward values: zeros of either sign, NaNs, infinities, extremes and subnormals.
+// Calls made from compiled code fail as they fail from bytecode, with the same errors. A backend
+// only gets the functions that make no calls.
+
+static int NumFailures = 0;
+
+static void check(bool Condition, const char *What) {
+  if (!Condition) {
+    fprintf(stderr, "FAILED: %s\n", What);
+    ++NumFailures;
+  }
+}
+
+// One function per opcode or mix of them, some of which make calls that fail.
+static const char *const Program =
+    "def add(x y) x + y\n"
+    "def sub(x y) x - y\n"
+    "def mul(x y) x * y\n"
+    "def less(x y) x < y\n"
+    "def constant(x y) 2.5 * 4 - 0.5\n"
+    "def negativezero(x y) 0 * (0 - 1)\n"
+    "def first(x y) x\n"
+    "def second(x y) y\n"
+    "def poly(x y) (x + 1) * (y - 2) < x * y - (y < x)\n"
+    "def swap(x y) sub(y, x)\n"
+    "def nested(x y) add(mul(x, y), swap(y, add(x, 1))) * less(y, x)\n"
+    "extern missing(x)\n"
+    "def callsmissing(x y) x + missing(y)\n"
+    "def forever(x y) forever(y, x) + 1\n";
+
+static const char *const Names[] = {"add",    "sub",          "mul",   "less",
+                                    "constant", "negativezero", "first", "second",
+                                    "poly",   "swap",         "nested", "callsmissing",
+                                    "forever"};
+
+static std::vector<double> getValues() {
+  double inf = std::numeric_limits<double>::infinity();
+  double nan = std::numeric_limits<double>::quiet_NaN();
+  return {0.0,  -0.0, 1.0,     -2.5,    1e308, -1e308,
+          5e-324, inf, -inf, nan, -nan, 3.0};
+}
+
+static bool sameBits(double A, double B) { return memcmp(&A, &B, sizeof(double)) == 0; }
+
+static bool parseProgram(ASTContext &Ctx, bool Simplify, std::vector<TopLevelItem> &Items) {
+  auto buffer = SourceBuffer::getMemory(Program);
+  Lexer lexer(*buffer);
+  Parser parser(lexer, Ctx);
+  ExprSimplifier simplifier(Ctx);
+  if (Simplify) { parser.setSimplifier(&simplifier); }
+  parser.getNextToken();
+  return parseTopLevelItems(parser, Items) == 0;
+}
+
+static void addItems(Interpreter &Interp, const std::vector<TopLevelItem> &Items) {
+  for (const TopLevelItem &item : Items) {
+    if (item.Kind == TopLevelItem::Item_Definition) {
+      check(Interp.addFunction(item.Function), "a definition lowers");
+    } else if (item.Kind == TopLevelItem::Item_Extern) {
+      Interp.addExtern(item.Prototype);
+    }
+  }
+}
+
+// Name called with X and Y, in bytecode and compiled, succeeds or fails alike, with the same
+// errors and the same bits.
+static bool sameCall(Interpreter &Bytecode, Interpreter &Compiled, Symbol Name, double X,
+                     double Y) {
+  double args[] = {X, Y};
+  double expected = 0, result = 0;
+  DiagnosticCapture capture;
+  bool expected_ok = Bytecode.call(Name, args, 2, expected);
+  std::string expected_errors = capture.take();
+  bool ok = Compiled.call(Name, args, 2, result);
+  std::string errors = capture.take();
+  return ok == expected_ok && errors == expected_errors && (!ok || sameBits(result, expected));
+}
+
+// Every function compiled by the built-in code generator, where there is one, against bytecode.
+static void testCompiledMatchesBytecode() {
+  for (bool simplify : {false, true}) {
+    ASTContext context;
+    std::vector<TopLevelItem> items;
+    check(parseProgram(context, simplify, items), "the program parses");
+    if (NumFailures) { return; }
+
+    Interpreter bytecode(context);
+    TierCompiler tiers(1);
+    Interpreter compiled(context);
+    compiled.setTierCompiler(&tiers);
+    addItems(bytecode, items);
+    addItems(compiled, items);
+
+    // The first call of each queues it.
+    for (const char *name : Names) {
+      double args[] = {1, 2}, result = 0;
+      DiagnosticCapture capture;
+      compiled.call(context.intern(name), args, 2, result);
+    }
+    tiers.wait();
+
+    std::vector<double> values = getValues();
+    for (const char *name : Names) {
+      Symbol symbol = context.intern(name);
+#ifdef KALEIDOSCOPE_NATIVE_TIER
+      check(compiled.isCompiled(symbol), "each function is compiled");
+#endif
+      for (double x : values) {
+        for (double y : values) {
+          check(sameCall(bytecode, compiled, symbol, x, y),
+                "compiled code computes what its bytecode does");
+        }
+      }
+    }
+
+    // A callee redefined with other parameters fails calls from compiled code as it does from
+    // bytecode.
+    std::vector<TopLevelItem> redefined;
+    auto buffer = SourceBuffer::getMemory("def sub(x) x\n");
+    Lexer lexer(*buffer);
+    Parser parser(lexer, context);
+    parser.getNextToken();
+    parseTopLevelItems(parser, redefined);
+    addItems(bytecode, redefined);
+    addItems(compiled, redefined);
+    double args[] = {1, 2}, result = 0;
+    DiagnosticCapture capture;
+    check(!compiled.call(context.intern("swap"), args, 2, result) &&
+              !compiled.call(context.intern("callsmissing"), args, 2, result) &&
+              !compiled.call(context.intern("forever"), args, 2, result),
+          "calls from compiled code fail");
+    check(sameCall(bytecode, compiled, context.intern("swap"), 1, 2) &&
+              sameCall(bytecode, compiled, context.intern("nested"), -0.0, 2),
+          "a call with the wrong number of arguments fails from compiled code too");
+  }
+}
+
+static double addTwo(double X, double Y) { return X + Y; }
+
+// A backend is handed the functions that make no calls, and what it wraps runs in their place.
+static void testBackend() {
+  ASTContext context;
+  std::vector<TopLevelItem> items;
+  check(parseProgram(context, /*Simplify=*/false, items), "the program parses");
+  if (NumFailures) { return; }
+
+  std::vector<std::string> handed;
+  TierCompiler tiers(1);
+  tiers.setBackend([&handed](ASTContext &Ctx, FunctionAST *Definition) -> TierCompiler::CodeFn {
+    std::string name(Ctx.getSpelling(Definition->getPrototype()->getName()));
+    handed.push_back(name);
+    if (name != "add") { return nullptr; }
+    return [] {
+      return std::shared_ptr<const NativeCode>(
+          NativeCode::wrap(reinterpret_cast<void *>(&addTwo), 2, nullptr));
+    };
+  });
+  Interpreter bytecode(context);
+  Interpreter compiled(context);
+  compiled.setTierCompiler(&tiers);
+  addItems(bytecode, items);
+  addItems(compiled, items);
+  for (const char *name : Names) {
+    double args[] = {1, 2}, result = 0;
+    DiagnosticCapture capture;
+    compiled.call(context.intern(name), args, 2, result);
+  }
+  tiers.wait();
+
+  check(handed.size() == 9, "the backend gets every function that makes no calls");
+  for (const std::string &name : handed) {
+    check(name != "swap" && name != "nested" && name != "callsmissing" && name != "forever",
+          "the backend gets no function that makes calls");
+  }
+  check(compiled.isCompiled(context.intern("add")), "what the backend compiles is swapped in");
+  check(!compiled.isCompiled(context.intern("sub")) && !compiled.isCompiled(context.intern("swap")),
+        "what the backend leaves stays in bytecode");
+
+  std::vector<double> values = getValues();
+  for (const char *name : {"add", "nested"}) {
+    for (double x : values) {
+      for (double y : values) {
+        check(sameCall(bytecode, compiled, context.intern(name), x, y),
+              "code from a backend computes what the bytecode does");
+      }
+    }
+  }
+  check(!NativeCode::wrap(reinterpret_cast<void *>(&addTwo), NativeCode::MaxForeignArgs + 1,
+                          nullptr),
+        "code taking too many arguments is not wrapped");
+}
+
+int main() {
+  testCompiledMatchesBytecode();
+  testBackend();
+  if (NumFailures) { return 1; }
+  printf("All native code tests passed.\n");
+  return 0;
+}
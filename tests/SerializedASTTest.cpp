@@ -0,0 +1,139 @@
+#include "AST.h"
+#include "Diagnostics.h"
+#include "FlatExpr.h"
+#include "Lexer.h"
+#include "Parser.h"
+#include "SerializedAST.h"
+#include "Simplify.h"
+#include "TopLevelItems.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Checks that the flat bodies the parser builds are those of the trees it builds, and that a
+// module written from them loads back into the same items, however deep its expressions are.
+
+static int NumFailures = 0;
+
+static void check(bool Condition, const char *What) {
+  if (!Condition) {
+    fprintf(stderr, "FAILED: %s\n", What);
+    ++NumFailures;
+  }
+}
+
+// Parse Source in full into Items, with no limit on nesting, encoding every body flat as well
+// if Flat is set, and folding as it goes if Simplify is.
+static void parseAll(ASTContext &Ctx, const std::string &Source, std::vector<TopLevelItem> &Items,
+                     bool Flat, bool Simplify) {
+  auto buffer = SourceBuffer::getMemory(Source);
+  Lexer lexer(*buffer);
+  Parser parser(lexer, Ctx);
+  ExprSimplifier simplifier(Ctx);
+  if (Simplify) { parser.setSimplifier(&simplifier); }
+  FlatExprBuilder builder;
+  if (Flat) { parser.setFlatExprBuilder(&builder); }
+  parser.setMaxExpressionDepth(0);
+  parser.getNextToken();
+  DiagnosticCapture capture;
+  parseTopLevelItems(parser, Items);
+}
+
+template <typename T> static bool sameArray(ArenaArray<T> A, ArenaArray<T> B) {
+  if (A.size() != B.size()) { return false; }
+  for (size_t i = 0; i < A.size(); ++i) {
+    if (!(A[i] == B[i])) { return false; }
+  }
+  return true;
+}
+
+static bool sameFlat(const FlatExpr &A, const FlatExpr &B) {
+  return sameArray(A.Opcodes, B.Opcodes) && sameArray(A.Operand0, B.Operand0) &&
+         sameArray(A.Operand1, B.Operand1) && sameArray(A.Literals, B.Literals) &&
+         sameArray(A.CallArgs, B.CallArgs);
+}
+
+// Whether every body among Items has a flat form, and it is the one encoding its tree gives.
+static bool flatBodiesMatchTrees(ASTContext &Ctx, const std::vector<TopLevelItem> &Items) {
+  FlatExprBuilder builder;
+  for (const TopLevelItem &item : Items) {
+    if (!item.Function) { continue; }
+    const FlatExpr *flat = item.Function->getFlatBody();
+    builder.addTree(item.Function->getBody());
+    if (!flat || !sameFlat(*flat, *builder.finish(Ctx))) { return false; }
+  }
+  return true;
+}
+
+// Serialize Items, load them back into Ctx, and serialize those again, into First and Second.
+static bool roundTrip(ASTContext &Ctx, const std::vector<TopLevelItem> &Items, std::string &First,
+                      std::string &Second) {
+  serializeAST(Ctx, Items, First);
+  auto module = SerializedAST::load(SourceBuffer::getMemory(First));
+  if (!module) { return false; }
+  std::vector<TopLevelItem> loaded;
+  module->importInto(Ctx, loaded);
+  serializeAST(Ctx, loaded, Second);
+  return true;
+}
+
+static const char *const Program =
+    "def add(a b) a + b;\n"
+    "extern sin(x);\n"
+    "def poly(x) 3 * x * x + 2 * (x - 1) < add(x, sin(x * 2)) * 0.5;\n"
+    "def bad(x) x + ;\n"
+    "def nested(x y) add(add(x, y), add(y * (x + 1), poly(add(1, 2 + 3))));\n"
+    "def call(x) (bad(x));\n"
+    "1 + 2 * 3 + add(4, 5);\n";
+
+// The parser's flat bodies match its trees, whether or not it folds, and items written from
+// them are written the same as from their trees.
+static void testParserBuildsFlatBodies() {
+  for (bool simplify : {false, true}) {
+    ASTContext context;
+    std::vector<TopLevelItem> flat_items, tree_items;
+    parseAll(context, Program, flat_items, /*Flat=*/true, simplify);
+    parseAll(context, Program, tree_items, /*Flat=*/false, simplify);
+    check(flatBodiesMatchTrees(context, flat_items), "the flat bodies encode the trees");
+
+    std::string from_flat, from_trees;
+    serializeAST(context, flat_items, from_flat);
+    serializeAST(context, tree_items, from_trees);
+    check(from_flat == from_trees, "flat bodies are written as their trees would be");
+
+    std::string reloaded;
+    check(roundTrip(context, flat_items, from_flat, reloaded) && reloaded == from_flat,
+          "a written module loads back into the same items");
+  }
+}
+
+// A chain of a million terms is a million nodes high, which neither encoding it, nor loading it
+// back, may need a stack frame per node for.
+static void testDeepChain() {
+  std::string source = "def chain(x) x";
+  for (int i = 1; i < 1000000; ++i) { source += " + x"; }
+  source += "\n";
+
+  for (bool simplify : {false, true}) {
+    ASTContext context;
+    std::vector<TopLevelItem> items;
+    parseAll(context, source, items, /*Flat=*/true, simplify);
+    check(items.size() == 1 && items[0].Function, "the chain parses");
+    if (NumFailures) { return; }
+    check(items[0].Function->getFlatBody()->size() == 1999999,
+          "the chain's flat body holds every node");
+    check(flatBodiesMatchTrees(context, items), "the chain's flat body encodes its tree");
+    std::string first, second;
+    check(roundTrip(context, items, first, second) && first == second,
+          "the chain loads back as it was written");
+  }
+}
+
+int main() {
+  testParserBuildsFlatBodies();
+  testDeepChain();
+  if (NumFailures) { return 1; }
+  printf("All serialized AST tests passed.\n");
+  return 0;
+}
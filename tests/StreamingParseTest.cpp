@@ -0,0 +1,123 @@
+#include "AST.h"
+#include "StreamingParse.h"
+#include "TopLevelItems.h"
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Checks that a stream returns the items a serial parse of its input would, however it is cut
+// into pieces, that one long item fed in small pieces is only parsed a logarithmic number of
+// times, and that an item is still returned as soon as the token after it arrives.
+
+static int NumFailures = 0;
+
+static void check(bool Condition, const char *What) {
+  if (!Condition) {
+    fprintf(stderr, "FAILED: %s\n", What);
+    ++NumFailures;
+  }
+}
+
+// Feed Source to Stream in pieces of Size bytes, then finish it, into Items.
+static void feedInPieces(StreamingParser &Stream, std::string_view Source, size_t Size,
+                         std::vector<TopLevelItem> &Items) {
+  for (size_t i = 0; i < Source.size(); i += Size) { Stream.feed(Source.substr(i, Size), Items); }
+  Stream.finish(Items);
+}
+
+static bool sameItems(const std::vector<TopLevelItem> &A, const std::vector<TopLevelItem> &B) {
+  if (A.size() != B.size()) { return false; }
+  for (size_t i = 0; i < A.size(); ++i) {
+    if (A[i].Kind != B[i].Kind || A[i].Diagnostics != B[i].Diagnostics) { return false; }
+  }
+  return true;
+}
+
+static const char *const Program =
+    "def add(a b) a + b\n"
+    "extern sin(x);\n"
+    "def poly(x) 3 * x * x # a comment with def and ; in it\n"
+    "  + 2 * (x - 1) < add(x, sin(x * 2)) * 0.5\n"
+    "def bad(x) x + ;\n"
+    "1.5 + add(4, 5) poly(2) bad\n"
+    "def undefined(x) x 12.5.6 extern deft(y) y\n"
+    "add(1";
+
+// Items are those of a serial parse, errors included, whatever size the pieces are.
+static void testPiecesMatchSerialParse() {
+  ASTContext context;
+  std::vector<TopLevelItem> whole;
+  StreamingParser serial(context);
+  feedInPieces(serial, Program, std::string_view(Program).size(), whole);
+  check(whole.size() == 14, "the program parses into its items");
+  for (size_t size = 1; size <= 16; ++size) {
+    std::vector<TopLevelItem> items;
+    StreamingParser stream(context);
+    feedInPieces(stream, Program, size, items);
+    check(sameItems(items, whole), "items fed in pieces are those of a serial parse");
+  }
+}
+
+// One long item is parsed again only when the input has doubled, whether it has failed so far
+// or not, and wherever the pieces cut it.
+static void testLongItemIsParsedLogarithmically() {
+  const char *const terms[] = {"+abcd", "+\nabcd", "+ # comment\nabcd", "+ + abcd"};
+  for (const char *term : terms) {
+    std::string source = "def f(abcd) abcd";
+    while (source.size() < 200000) { source += term; }
+    source += "\n";
+
+    ASTContext context;
+    std::vector<TopLevelItem> items;
+    StreamingParser stream(context);
+    stream.setMaxExpressionDepth(0);
+    feedInPieces(stream, source, 7, items);
+    check(items.size() == 1, "a long item is returned once");
+    check(stream.getNumParses() < 40, "a long item fed in small pieces is parsed a few times");
+  }
+}
+
+// The token after an item is all it takes to return it, however much longer the item is than
+// what arrives after it.
+static void testItemIsReturnedOnTheNextToken() {
+  std::string long_item = "def f(x) x";
+  while (long_item.size() < 10000) { long_item += " + x"; }
+  const char *const followers[] = {"\nf(1)\n", " 2\n", "\n# a comment\nf\n", ";", "\ndef "};
+  for (const char *follower : followers) {
+    ASTContext context;
+    std::vector<TopLevelItem> items;
+    StreamingParser stream(context);
+    stream.feed(long_item, items);
+    check(items.empty(), "an item is not returned before the token after it");
+    stream.feed("\n", items);
+    stream.feed(follower, items);
+    check(!items.empty() && items[0].Kind == TopLevelItem::Item_Definition,
+          "an item is returned once the token after it arrives");
+  }
+
+  // A token that may continue the item needs a parse to tell. Once the item is found to go on,
+  // it is not parsed again on each piece.
+  ASTContext context;
+  std::vector<TopLevelItem> items;
+  StreamingParser stream(context);
+  stream.feed(long_item, items);
+  size_t parses = stream.getNumParses();
+  stream.feed("\n+ x", items);
+  stream.feed(" + x", items);
+  stream.feed(" + x\n", items);
+  check(items.empty() && stream.getNumParses() == parses,
+        "an item that may go on waits for more of it");
+  stream.feed("f(1);", items);
+  check(items.size() == 3, "a ';' ends the items before it");
+}
+
+int main() {
+  testPiecesMatchSerialParse();
+  testLongItemIsParsedLogarithmically();
+  testItemIsReturnedOnTheNextToken();
+  if (NumFailures) { return 1; }
+  printf("All streaming parse tests passed.\n");
+  return 0;
+}